@@ -8,26 +8,9 @@ TEMPLATE = app
 
 CONFIG(release, debug|release):DEFINES += QT_NO_DEBUG_OUTPUT
 
+include(core.pri)
+
 SOURCES += main.cpp \
-    global.cpp \
-    qtorrent.cpp \
-    core/bencodeparser.cpp \
-    core/bencodevalue.cpp \
-    core/torrentinfo.cpp \
-    core/trackerclient.cpp \
-    core/torrent.cpp \
-    core/peer.cpp \
-    core/piece.cpp \
-    core/block.cpp \
-    core/torrentmessage.cpp \
-    core/torrentserver.cpp \
-    core/resumeinfo.cpp \
-    core/torrentmanager.cpp \
-    core/torrentsettings.cpp \
-    core/remote.cpp \
-    core/filecontroller.cpp \
-    core/localservicediscoveryclient.cpp \
-    core/trafficmonitor.cpp \
     ui/mainwindow.cpp \
     ui/panel.cpp \
     ui/torrentslist.cpp \
@@ -38,25 +21,6 @@ SOURCES += main.cpp \
     ui/settingswindow.cpp
 
 HEADERS += \
-    qtorrent.h \
-    global.h \
-    core/bencodeparser.h \
-    core/bencodevalue.h \
-    core/torrentinfo.h \
-    core/trackerclient.h \
-    core/torrent.h \
-    core/peer.h \
-    core/piece.h \
-    core/block.h \
-    core/torrentmessage.h \
-    core/torrentserver.h \
-    core/resumeinfo.h \
-    core/torrentmanager.h \
-    core/torrentsettings.h \
-    core/remote.h \
-    core/filecontroller.h \
-    core/localservicediscoveryclient.h \
-    core/trafficmonitor.h \
     ui/mainwindow.h \
     ui/panel.h \
     ui/torrentslist.h \
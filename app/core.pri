@@ -0,0 +1,86 @@
+# The core of qTorrent - everything except the user interface.
+# Shared by the GUI application (app.pro) and the daemon (qtorrentd)
+
+QT += concurrent
+
+INCLUDEPATH += $$PWD
+
+SOURCES += \
+    $$PWD/global.cpp \
+    $$PWD/qtorrent.cpp \
+    $$PWD/core/bencodeparser.cpp \
+    $$PWD/core/bencodevalue.cpp \
+    $$PWD/core/bencodereader.cpp \
+    $$PWD/core/torrentinfo.cpp \
+    $$PWD/core/trackerclient.cpp \
+    $$PWD/core/torrent.cpp \
+    $$PWD/core/peer.cpp \
+    $$PWD/core/piece.cpp \
+    $$PWD/core/block.cpp \
+    $$PWD/core/torrentmessage.cpp \
+    $$PWD/core/torrentserver.cpp \
+    $$PWD/core/resumeinfo.cpp \
+    $$PWD/core/torrentmanager.cpp \
+    $$PWD/core/torrentsettings.cpp \
+    $$PWD/core/remote.cpp \
+    $$PWD/core/filecontroller.cpp \
+    $$PWD/core/localservicediscoveryclient.cpp \
+    $$PWD/core/trafficmonitor.cpp \
+    $$PWD/core/metadatadownloader.cpp \
+    $$PWD/core/timerwheel.cpp \
+    $$PWD/core/networkengine.cpp \
+    $$PWD/core/peersocket.cpp \
+    $$PWD/core/torrentstream.cpp \
+    $$PWD/core/streamserver.cpp \
+    $$PWD/core/readcache.cpp \
+    $$PWD/core/storage.cpp \
+    $$PWD/core/diskmanager.cpp \
+    $$PWD/core/diskio.cpp \
+    $$PWD/core/torrentcreator.cpp \
+    $$PWD/core/merkletree.cpp
+
+HEADERS += \
+    $$PWD/qtorrent.h \
+    $$PWD/global.h \
+    $$PWD/core/bencodeparser.h \
+    $$PWD/core/bencodevalue.h \
+    $$PWD/core/bencodereader.h \
+    $$PWD/core/torrentinfo.h \
+    $$PWD/core/trackerclient.h \
+    $$PWD/core/torrent.h \
+    $$PWD/core/peer.h \
+    $$PWD/core/piece.h \
+    $$PWD/core/block.h \
+    $$PWD/core/torrentmessage.h \
+    $$PWD/core/torrentserver.h \
+    $$PWD/core/resumeinfo.h \
+    $$PWD/core/torrentmanager.h \
+    $$PWD/core/torrentsettings.h \
+    $$PWD/core/remote.h \
+    $$PWD/core/filecontroller.h \
+    $$PWD/core/localservicediscoveryclient.h \
+    $$PWD/core/trafficmonitor.h \
+    $$PWD/core/metadatadownloader.h \
+    $$PWD/core/timerwheel.h \
+    $$PWD/core/spscqueue.h \
+    $$PWD/core/networkengine.h \
+    $$PWD/core/peersocket.h \
+    $$PWD/core/torrentstream.h \
+    $$PWD/core/streamserver.h \
+    $$PWD/core/readcache.h \
+    $$PWD/core/storage.h \
+    $$PWD/core/diskmanager.h \
+    $$PWD/core/diskio.h \
+    $$PWD/core/torrentcreator.h \
+    $$PWD/core/merkletree.h
+
+# The io_uring storage backend, used if the StorageBackend setting is "io_uring"
+linux {
+    CONFIG += link_pkgconfig
+    packagesExist(liburing) {
+        PKGCONFIG += liburing
+        DEFINES += QTORRENT_IO_URING
+        SOURCES += $$PWD/core/uringstorage.cpp
+        HEADERS += $$PWD/core/uringstorage.h
+    }
+}
@@ -0,0 +1,435 @@
+/* qTorrent - An open-source, cross-platform BitTorrent client
+ * Copyright (C) 2017 Petko Georgiev
+ *
+ * bencodereader.cpp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "bencodereader.h"
+#include <QFile>
+#include <cstring>
+
+// Deeper nesting is rejected, so validation never needs to allocate
+const int MAX_NESTING_DEPTH = 256;
+
+// Returns a pointer past the end of the value starting at position.
+// The data must have been validated
+static const char *skipValue(const char *position)
+{
+	const char *p = position;
+	int depth = 0;
+	do {
+		char c = *p;
+		if (c == 'i') {
+			while (*p != 'e') {
+				p++;
+			}
+			p++;
+		} else if (c == 'l' || c == 'd') {
+			depth++;
+			p++;
+		} else if (c == 'e') {
+			depth--;
+			p++;
+		} else {
+			qint64 length = 0;
+			while (*p != ':') {
+				length = length * 10 + (*p++ - '0');
+			}
+			p += 1 + length;
+		}
+	} while (depth > 0);
+	return p;
+}
+
+
+BencodeView::Iterator::Iterator(const BencodeView &container)
+	: m_position(nullptr)
+	, m_end(nullptr)
+	, m_isDictionary(container.isDictionary())
+{
+	if (container.isList() || container.isDictionary()) {
+		// Skip the leading 'l' or 'd' and the trailing 'e'
+		m_position = container.m_begin + 1;
+		m_end = container.m_end - 1;
+	}
+}
+
+bool BencodeView::Iterator::hasNext() const
+{
+	return m_position < m_end;
+}
+
+BencodeView BencodeView::Iterator::next()
+{
+	if (!hasNext()) {
+		return BencodeView();
+	}
+	if (m_isDictionary) {
+		m_key = fromValidData(m_position);
+		m_position = m_key.m_end;
+	}
+	BencodeView value = fromValidData(m_position);
+	m_position = value.m_end;
+	return value;
+}
+
+const BencodeView &BencodeView::Iterator::key() const
+{
+	return m_key;
+}
+
+
+BencodeView::BencodeView()
+	: m_type(Type::Invalid)
+	, m_begin(nullptr)
+	, m_end(nullptr)
+{
+}
+
+BencodeView::BencodeView(Type type, const char *begin, const char *end)
+	: m_type(type)
+	, m_begin(begin)
+	, m_end(end)
+{
+}
+
+BencodeView BencodeView::fromValidData(const char *begin)
+{
+	Type type;
+	switch (*begin) {
+	case 'i':
+		type = Type::Integer;
+		break;
+	case 'l':
+		type = Type::List;
+		break;
+	case 'd':
+		type = Type::Dictionary;
+		break;
+	default:
+		type = Type::String;
+	}
+	return BencodeView(type, begin, skipValue(begin));
+}
+
+
+BencodeView::Type BencodeView::type() const
+{
+	return m_type;
+}
+
+bool BencodeView::isValid() const
+{
+	return m_type != Type::Invalid;
+}
+
+bool BencodeView::isInteger() const
+{
+	return m_type == Type::Integer;
+}
+
+bool BencodeView::isString() const
+{
+	return m_type == Type::String;
+}
+
+bool BencodeView::isList() const
+{
+	return m_type == Type::List;
+}
+
+bool BencodeView::isDictionary() const
+{
+	return m_type == Type::Dictionary;
+}
+
+
+qint64 BencodeView::toInt(qint64 defaultValue) const
+{
+	if (!isInteger()) {
+		return defaultValue;
+	}
+	const char *p = m_begin + 1;
+	bool negative = (*p == '-');
+	if (negative) {
+		p++;
+	}
+	qint64 value = 0;
+	while (*p != 'e') {
+		value = value * 10 + (*p++ - '0');
+	}
+	return negative ? -value : value;
+}
+
+const char *BencodeView::stringData() const
+{
+	if (!isString()) {
+		return nullptr;
+	}
+	return static_cast<const char *>(memchr(m_begin, ':', m_end - m_begin)) + 1;
+}
+
+int BencodeView::stringLength() const
+{
+	if (!isString()) {
+		return 0;
+	}
+	return m_end - stringData();
+}
+
+bool BencodeView::equals(const char *string) const
+{
+	int length = strlen(string);
+	return stringLength() == length && memcmp(stringData(), string, length) == 0;
+}
+
+QByteArray BencodeView::toByteArray() const
+{
+	if (!isString()) {
+		return QByteArray();
+	}
+	return QByteArray(stringData(), stringLength());
+}
+
+
+int BencodeView::count() const
+{
+	int count = 0;
+	for (Iterator it(*this); it.hasNext(); it.next()) {
+		count++;
+	}
+	return count;
+}
+
+BencodeView BencodeView::at(int index) const
+{
+	if (!isList() || index < 0) {
+		return BencodeView();
+	}
+	Iterator it(*this);
+	while (it.hasNext()) {
+		BencodeView value = it.next();
+		if (index-- == 0) {
+			return value;
+		}
+	}
+	return BencodeView();
+}
+
+BencodeView BencodeView::value(const char *key) const
+{
+	if (!isDictionary()) {
+		return BencodeView();
+	}
+	Iterator it(*this);
+	while (it.hasNext()) {
+		BencodeView value = it.next();
+		if (it.key().equals(key)) {
+			return value;
+		}
+	}
+	return BencodeView();
+}
+
+bool BencodeView::keyExists(const char *key) const
+{
+	return value(key).isValid();
+}
+
+
+const char *BencodeView::data() const
+{
+	return m_begin;
+}
+
+int BencodeView::size() const
+{
+	return m_end - m_begin;
+}
+
+QByteArray BencodeView::getRawBencodeData() const
+{
+	return QByteArray(m_begin, size());
+}
+
+
+
+void BencodeReader::setError(const QString &errorString)
+{
+	m_errorString = errorString;
+}
+
+void BencodeReader::clearError()
+{
+	m_errorString.clear();
+}
+
+
+BencodeReader::BencodeReader()
+{
+}
+
+
+QString BencodeReader::errorString() const
+{
+	return m_errorString;
+}
+
+
+bool BencodeReader::readFile(const QString &fileName)
+{
+	clearError();
+
+	QFile file(fileName);
+	if (!file.open(QIODevice::ReadOnly)) {
+		setError(file.errorString());
+		return false;
+	}
+	m_bencodeData = file.readAll();
+	m_root = BencodeView();
+	file.close();
+	return true;
+}
+
+bool BencodeReader::parse(const QByteArray &data, bool allowTrailingData)
+{
+	m_bencodeData = data;
+	return parse(allowTrailingData);
+}
+
+bool BencodeReader::parse(bool allowTrailingData)
+{
+	clearError();
+	m_root = BencodeView();
+
+	const char *begin = m_bencodeData.constData();
+	const char *end = begin + m_bencodeData.size();
+	QString errorString;
+	const char *valueEnd = validate(begin, end, &errorString);
+	if (valueEnd == nullptr) {
+		setError(errorString);
+		return false;
+	}
+	if (!allowTrailingData && valueEnd != end) {
+		setError(QString("Unexpected data after the bencoded value at position %1").arg(valueEnd - begin));
+		return false;
+	}
+
+	m_root = BencodeView::fromValidData(begin);
+	return true;
+}
+
+
+const QByteArray &BencodeReader::rawBencodeData() const
+{
+	return m_bencodeData;
+}
+
+BencodeView BencodeReader::root() const
+{
+	return m_root;
+}
+
+
+const char *BencodeReader::validate(const char *begin, const char *end, QString *errorString)
+{
+	enum State : char
+	{
+		InList, ExpectingKey, ExpectingValue
+	};
+	State states[MAX_NESTING_DEPTH];
+	int depth = 0;
+
+	auto fail = [&](const char *position, const QString &error) -> const char * {
+		if (errorString != nullptr) {
+			*errorString = QString("%1 at position %2").arg(error).arg(position - begin);
+		}
+		return nullptr;
+	};
+
+	const char *p = begin;
+	for (;;) {
+		if (p >= end) {
+			return fail(p, "Unexpectedly reached end of the data stream");
+		}
+
+		char c = *p;
+		if (c == 'e' && depth > 0) {
+			if (states[depth - 1] == ExpectingValue) {
+				return fail(p, "Dictionary key without a value");
+			}
+			depth--;
+			p++;
+		} else {
+			bool isKey = depth > 0 && states[depth - 1] == ExpectingKey;
+			if (isKey && (c < '0' || c > '9')) {
+				return fail(p, "Dictionary keys must be strings");
+			}
+
+			if (c == 'l' || c == 'd') {
+				if (depth == MAX_NESTING_DEPTH) {
+					return fail(p, "Values nested too deeply");
+				}
+				states[depth++] = (c == 'l') ? InList : ExpectingKey;
+				p++;
+				continue;
+			} else if (c == 'i') {
+				const char *digits = ++p;
+				if (p < end && *p == '-') {
+					p++;
+				}
+				qint64 value = 0;
+				while (p < end && *p >= '0' && *p <= '9') {
+					if (value > (Q_INT64_C(0x7FFFFFFFFFFFFFFF) - (*p - '0')) / 10) {
+						return fail(digits, "Integer out of range");
+					}
+					value = value * 10 + (*p++ - '0');
+				}
+				if (p >= end || *p != 'e' || p == digits || (p == digits + 1 && *digits == '-')) {
+					return fail(digits, "Value not an integer");
+				}
+				p++;
+			} else if (c >= '0' && c <= '9') {
+				qint64 length = 0;
+				while (p < end && *p >= '0' && *p <= '9') {
+					length = length * 10 + (*p++ - '0');
+					if (length > end - begin) {
+						return fail(p, "String length out of range");
+					}
+				}
+				if (p >= end || *p != ':') {
+					return fail(p, "Expected ':' after string length");
+				}
+				p++;
+				if (length > end - p) {
+					return fail(p, "String is longer than the data stream");
+				}
+				p += length;
+			} else {
+				return fail(p, QString("Invalid begining character for bencode value: '%1'").arg(c));
+			}
+		}
+
+		// A whole value was read
+		if (depth == 0) {
+			return p;
+		}
+		if (states[depth - 1] == ExpectingKey) {
+			states[depth - 1] = ExpectingValue;
+		} else if (states[depth - 1] == ExpectingValue) {
+			states[depth - 1] = ExpectingKey;
+		}
+	}
+}
@@ -0,0 +1,154 @@
+/* qTorrent - An open-source, cross-platform BitTorrent client
+ * Copyright (C) 2017 Petko Georgiev
+ *
+ * bencodereader.h
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef BENCODEREADER_H
+#define BENCODEREADER_H
+
+#include <QByteArray>
+#include <QString>
+
+/* A lightweight view of one bencoded value inside a buffer.
+ * Views never copy or allocate - they are only valid while the buffer
+ * they point into is alive and unmodified.
+ * Lists and dictionaries are decoded lazily: looking up a key only walks
+ * the dictionary that contains it and skips over everything else */
+class BencodeView
+{
+public:
+	enum class Type
+	{
+		Invalid, Integer, String, List, Dictionary
+	};
+
+	/* Pull-style iterator over the elements of a list
+	 * or the key/value pairs of a dictionary */
+	class Iterator;
+
+private:
+	Type m_type;
+
+	// The whole bencoded value, including 'i', 'l', 'd', 'e' and string lengths
+	const char *m_begin;
+	const char *m_end;
+
+	BencodeView(Type type, const char *begin, const char *end);
+
+	// Creates a view of the (already validated) value starting at begin
+	static BencodeView fromValidData(const char *begin);
+
+	friend class BencodeReader;
+
+public:
+	BencodeView();
+
+	Type type() const;
+	bool isValid() const;
+	bool isInteger() const;
+	bool isString() const;
+	bool isList() const;
+	bool isDictionary() const;
+
+	// Integer value. Returns defaultValue if this isn't an integer
+	qint64 toInt(qint64 defaultValue = 0) const;
+
+	// String contents. Nothing is copied
+	const char *stringData() const;
+	int stringLength() const;
+	bool equals(const char *string) const;
+
+	// String contents. Makes a deep copy. Empty if this isn't a string
+	QByteArray toByteArray() const;
+
+	// Number of list elements or dictionary entries. Walks the container
+	int count() const;
+
+	// The list element at index. Invalid view if there isn't one
+	BencodeView at(int index) const;
+
+	// The dictionary value for key. Invalid view if there isn't one
+	BencodeView value(const char *key) const;
+	bool keyExists(const char *key) const;
+
+	// The raw bencoded value
+	const char *data() const;
+	int size() const;
+
+	// Deep copy of the raw bencoded value (used for calculating torrents info_hash)
+	QByteArray getRawBencodeData() const;
+};
+
+class BencodeView::Iterator
+{
+	const char *m_position;
+	const char *m_end;
+	bool m_isDictionary;
+	BencodeView m_key;
+
+public:
+	Iterator(const BencodeView &container);
+
+	bool hasNext() const;
+
+	// Returns the next list element or dictionary value
+	BencodeView next();
+
+	// The key of the last dictionary value returned by next()
+	const BencodeView &key() const;
+};
+
+/* Validates bencoded data in a single allocation-free pass
+ * and gives access to it through BencodeView */
+class BencodeReader
+{
+	// Error handling
+	QString m_errorString;
+	void setError(const QString &errorString);
+	void clearError();
+
+	// The data is shared with the caller, not copied
+	QByteArray m_bencodeData;
+
+	BencodeView m_root;
+
+public:
+	BencodeReader();
+
+	// Returns m_errorString
+	QString errorString() const;
+
+	// Stores the data from fileName. Returns false on error and sets m_errorString
+	bool readFile(const QString &fileName);
+
+	// Validates data. The data must hold exactly one bencoded value
+	// unless allowTrailingData is true. Returns false on error
+	bool parse(const QByteArray &data, bool allowTrailingData = false);
+
+	// Validates the data read with readFile()
+	bool parse(bool allowTrailingData = false);
+
+	const QByteArray &rawBencodeData() const;
+
+	// The parsed value. The view is valid as long as this reader is
+	BencodeView root() const;
+
+	// Validates one bencoded value starting at begin.
+	// Returns a pointer past its end, or nullptr on error and sets errorString
+	static const char *validate(const char *begin, const char *end, QString *errorString = nullptr);
+};
+
+#endif // BENCODEREADER_H
@@ -26,6 +26,7 @@ Block::Block(Piece *piece, int begin, int size)
 	, m_begin(begin)
 	, m_size(size)
 	, m_isDownloaded(false)
+	, m_isSaved(false)
 {
 	connect(this, &Block::downloaded, m_piece, &Piece::updateState);
 }
@@ -54,6 +55,11 @@ bool Block::isDownloaded()
 	return m_isDownloaded;
 }
 
+bool Block::isSaved() const
+{
+	return m_isSaved;
+}
+
 QList<Peer *> &Block::assignees()
 {
 	return m_assignees;
@@ -72,6 +78,11 @@ void Block::setDownloaded(bool isDownloaded)
 	}
 }
 
+void Block::setSaved(bool isSaved)
+{
+	m_isSaved = isSaved;
+}
+
 void Block::setData(const Peer *peer, const char *data)
 {
 	if (isDownloaded()) {
@@ -36,6 +36,8 @@ private:
 	int m_begin;
 	int m_size;
 	bool m_isDownloaded;
+	// The data was written to the files before the piece was complete
+	bool m_isSaved;
 
 	/* The peers to which this Block is
 	 * assigned to be downloaded from. */
@@ -48,6 +50,7 @@ public:
 	int begin() const;
 	int size() const;
 	bool isDownloaded();
+	bool isSaved() const;
 	QList<Peer *> &assignees();
 	bool hasAssignees() const;
 
@@ -56,6 +59,7 @@ signals:
 
 public slots:
 	void setDownloaded(bool isDownloaded);
+	void setSaved(bool isSaved);
 	void setData(const Peer *peer, const char *data);
 	void addAssignee(Peer *peer);
 	void removeAssignee(Peer *peer);
@@ -0,0 +1,203 @@
+/* qTorrent - An open-source, cross-platform BitTorrent client
+ * Copyright (C) 2017 Petko Georgiev
+ *
+ * diskio.cpp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "diskio.h"
+#include "diskmanager.h"
+#include <QMutexLocker>
+#include <QMetaObject>
+#include <QDir>
+#include <QFile>
+#include <QDebug>
+
+DiskIoWorker::DiskIoWorker()
+{
+}
+
+void DiskIoWorker::queue(DiskIoJob *job)
+{
+	QMutexLocker locker(&m_mutex);
+	m_jobs.append(job);
+	if (m_jobs.size() == 1) {
+		QMetaObject::invokeMethod(this, "runJobs", Qt::QueuedConnection);
+	}
+}
+
+void DiskIoWorker::runJobs()
+{
+	// The storage of this thread. Its asynchronous batches are
+	// called back from this thread's event loop
+	Storage *storage = Storage::instance();
+	forever {
+		DiskIoJob *job;
+		{
+			QMutexLocker locker(&m_mutex);
+			if (m_jobs.isEmpty()) {
+				return;
+			}
+			job = m_jobs.takeFirst();
+		}
+
+		switch (job->type) {
+		case DiskIoJob::Write:
+			for (const DiskIo::FileSetup &setup : job->setups) {
+				QFile file(setup.fileName);
+				bool exists = file.exists();
+				if (!exists) {
+					QDir().mkpath(setup.directory);
+				}
+				// Fully allocated files already have their size, unless allocating failed
+				if (setup.size != -1 && (!exists || file.size() != setup.size)) {
+					file.resize(setup.size);
+				}
+			}
+			storage->writeAsync(job->writes, [this, job](bool ok) {
+				finishJob(job, ok);
+			});
+			break;
+		case DiskIoJob::Read:
+			storage->readAsync(job->reads, [this, job](bool ok) {
+				finishJob(job, ok);
+			});
+			break;
+		case DiskIoJob::Sync:
+			// Everything that was queued before is written first
+			storage->waitForAll();
+			finishJob(job, storage->sync(job->fileNames));
+			break;
+		}
+	}
+}
+
+void DiskIoWorker::finishJob(DiskIoJob *job, bool ok)
+{
+	job->ok = ok;
+	job->owner->jobDone(job);
+}
+
+
+DiskIo::DiskIo(Disk *disk)
+	: m_disk(disk)
+	, m_pending(0)
+{
+}
+
+DiskIo::~DiskIo()
+{
+	// The worker must not call back a deleted object
+	waitForJobs();
+}
+
+Disk *DiskIo::disk() const
+{
+	return m_disk;
+}
+
+void DiskIo::setDisk(Disk *disk)
+{
+	if (disk == m_disk) {
+		return;
+	}
+	waitForJobs();
+	m_disk = disk;
+}
+
+void DiskIo::write(const QVector<Storage::Write> &writes, const QVector<FileSetup> &setups,
+				   const QList<QByteArray> &buffers, const Callback &done)
+{
+	DiskIoJob *job = new DiskIoJob;
+	job->type = DiskIoJob::Write;
+	job->writes = writes;
+	job->setups = setups;
+	job->buffers = buffers;
+	job->done = done;
+	queue(job);
+}
+
+void DiskIo::read(const QVector<Storage::Read> &reads, const QByteArray &data, const ReadCallback &done)
+{
+	DiskIoJob *job = new DiskIoJob;
+	job->type = DiskIoJob::Read;
+	job->reads = reads;
+	job->data = data;
+	job->readDone = done;
+	queue(job);
+}
+
+void DiskIo::sync(const QStringList &fileNames, const Callback &done)
+{
+	DiskIoJob *job = new DiskIoJob;
+	job->type = DiskIoJob::Sync;
+	job->fileNames = fileNames;
+	job->done = done;
+	queue(job);
+}
+
+void DiskIo::queue(DiskIoJob *job)
+{
+	job->owner = this;
+	job->ok = false;
+	m_pending++;
+	m_disk->jobQueued();
+	m_disk->io()->queue(job);
+}
+
+void DiskIo::jobDone(DiskIoJob *job)
+{
+	// Locked until the event is posted, so waitForJobs() can't return
+	// and let this be deleted before that
+	QMutexLocker locker(&m_mutex);
+	m_completed.append(job);
+	m_jobDone.wakeAll();
+	if (m_completed.size() == 1) {
+		QMetaObject::invokeMethod(this, "processCompletions", Qt::QueuedConnection);
+	}
+}
+
+void DiskIo::processCompletions()
+{
+	QList<DiskIoJob *> jobs;
+	{
+		QMutexLocker locker(&m_mutex);
+		jobs.swap(m_completed);
+	}
+	// The callbacks may queue new jobs
+	for (DiskIoJob *job : jobs) {
+		m_pending--;
+		m_disk->jobFinished();
+		if (job->type == DiskIoJob::Read) {
+			job->readDone(job->ok, job->data);
+		} else {
+			job->done(job->ok);
+		}
+		delete job;
+	}
+}
+
+void DiskIo::waitForJobs()
+{
+	while (m_pending > 0) {
+		{
+			QMutexLocker locker(&m_mutex);
+			while (m_completed.isEmpty()) {
+				m_jobDone.wait(&m_mutex);
+			}
+		}
+		processCompletions();
+	}
+}
@@ -0,0 +1,145 @@
+/* qTorrent - An open-source, cross-platform BitTorrent client
+ * Copyright (C) 2017 Petko Georgiev
+ *
+ * diskio.h
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DISKIO_H
+#define DISKIO_H
+
+#include "storage.h"
+#include <QObject>
+#include <QString>
+#include <QStringList>
+#include <QVector>
+#include <QList>
+#include <QByteArray>
+#include <QMutex>
+#include <QWaitCondition>
+#include <functional>
+
+class Disk;
+class DiskIo;
+struct DiskIoJob;
+
+/*
+ * Runs the block reads, writes and syncs of the torrents on one disk.
+ * Lives on the disk's I/O thread, which is separate from the worker
+ * thread, so a long check or copy doesn't hold up the downloads.
+ * Jobs start in the order they are queued
+ */
+class DiskIoWorker : public QObject
+{
+	Q_OBJECT
+
+public:
+	DiskIoWorker();
+
+	// Thread-safe
+	void queue(DiskIoJob *job);
+
+private slots:
+	void runJobs();
+
+private:
+	QMutex m_mutex;
+	QList<DiskIoJob *> m_jobs;
+
+	void finishJob(DiskIoJob *job, bool ok);
+};
+
+/*
+ * The block I/O of a torrent, through the I/O thread of its disk.
+ * The callbacks are called on the thread that queued the jobs, from its
+ * event loop or from waitForJobs(). The data to write is shared with
+ * the job, so it must not be modified until the job is done
+ */
+class DiskIo : public QObject
+{
+	Q_OBJECT
+
+public:
+	typedef std::function<void(bool ok)> Callback;
+	typedef std::function<void(bool ok, const QByteArray &data)> ReadCallback;
+
+	/* What is done to a file before it's written to */
+	struct FileSetup {
+		QString fileName;
+		// Created if the file doesn't exist
+		QString directory;
+		// The file is resized to it, unless it's -1
+		qint64 size;
+	};
+
+	DiskIo(Disk *disk);
+	// Waits for the queued jobs
+	~DiskIo();
+
+	Disk *disk() const;
+	/* Waits for the queued jobs, then queues the next ones on the new disk */
+	void setDisk(Disk *disk);
+
+	/* The segments of the writes point into the buffers */
+	void write(const QVector<Storage::Write> &writes, const QVector<FileSetup> &setups,
+			   const QList<QByteArray> &buffers, const Callback &done);
+	/* The reads point into data, which is passed to done */
+	void read(const QVector<Storage::Read> &reads, const QByteArray &data, const ReadCallback &done);
+	/* Syncs the files after the jobs queued before are done */
+	void sync(const QStringList &fileNames, const Callback &done);
+
+	/* Blocks until all queued jobs are done and called back */
+	void waitForJobs();
+
+	// Called by the worker. Thread-safe
+	void jobDone(DiskIoJob *job);
+
+private slots:
+	void processCompletions();
+
+private:
+	Disk *m_disk;
+	// Queued and not called back yet
+	int m_pending;
+
+	QMutex m_mutex;
+	QWaitCondition m_jobDone;
+	QList<DiskIoJob *> m_completed;
+
+	void queue(DiskIoJob *job);
+};
+
+struct DiskIoJob
+{
+	enum Type {
+		Read,
+		Write,
+		Sync
+	};
+
+	Type type;
+	DiskIo *owner;
+	QVector<Storage::Write> writes;
+	QVector<DiskIo::FileSetup> setups;
+	QList<QByteArray> buffers;
+	QVector<Storage::Read> reads;
+	QByteArray data;
+	QStringList fileNames;
+	bool ok;
+	DiskIo::Callback done;
+	DiskIo::ReadCallback readDone;
+};
+
+#endif // DISKIO_H
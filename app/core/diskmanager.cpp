@@ -0,0 +1,200 @@
+/* qTorrent - An open-source, cross-platform BitTorrent client
+ * Copyright (C) 2017 Petko Georgiev
+ *
+ * diskmanager.cpp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "diskmanager.h"
+#include "diskio.h"
+#include <QThread>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QStorageInfo>
+#include <QDebug>
+#ifdef Q_OS_LINUX
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#endif
+
+#define MONITOR_INTERVAL 1000
+
+// The device that holds an existing path
+static QString deviceName(const QString &path)
+{
+#ifdef Q_OS_LINUX
+	// The block device in sysfs. A partition's directory is inside its disk's one
+	struct stat st;
+	if (stat(QFile::encodeName(path).constData(), &st) == 0) {
+		QString device = QFileInfo(QString("/sys/dev/block/%1:%2")
+								   .arg(major(st.st_dev)).arg(minor(st.st_dev))).canonicalFilePath();
+		if (!device.isEmpty()) {
+			if (QFile::exists(device + "/partition")) {
+				device = QFileInfo(device).path();
+			}
+			return QFileInfo(device).fileName();
+		}
+	}
+#endif
+	// Network and virtual file systems have no block device
+	QStorageInfo storage(path);
+	QString device = QString::fromLocal8Bit(storage.device());
+	return device.isEmpty() ? storage.rootPath() : device;
+}
+
+
+Disk::Disk(const QString &name, const QString &rootPath)
+	: m_name(name)
+	, m_rootPath(rootPath)
+	, m_workerThread(new QThread)
+	, m_ioThread(new QThread)
+	, m_io(new DiskIoWorker)
+	, m_bytesRead(0)
+	, m_bytesWritten(0)
+	, m_queueDepth(0)
+	, m_lastBytesRead(0)
+	, m_lastBytesWritten(0)
+	, m_readSpeed(0)
+	, m_writeSpeed(0)
+{
+	m_workerThread->setObjectName("Disk " + name);
+	m_workerThread->start();
+	m_ioThread->setObjectName("Disk I/O " + name);
+	m_io->moveToThread(m_ioThread);
+	m_ioThread->start();
+}
+
+Disk::~Disk()
+{
+	m_workerThread->quit();
+	m_workerThread->wait();
+	delete m_workerThread;
+	// The torrents are gone, so there are no jobs left
+	m_ioThread->quit();
+	m_ioThread->wait();
+	delete m_io;
+	delete m_ioThread;
+}
+
+const QString &Disk::name() const
+{
+	return m_name;
+}
+
+const QString &Disk::rootPath() const
+{
+	return m_rootPath;
+}
+
+QThread *Disk::workerThread() const
+{
+	return m_workerThread;
+}
+
+DiskIoWorker *Disk::io() const
+{
+	return m_io;
+}
+
+void Disk::addBytesRead(qint64 bytes)
+{
+	m_bytesRead.fetchAndAddRelaxed(bytes);
+}
+
+void Disk::addBytesWritten(qint64 bytes)
+{
+	m_bytesWritten.fetchAndAddRelaxed(bytes);
+}
+
+void Disk::jobQueued()
+{
+	m_queueDepth.ref();
+}
+
+void Disk::jobFinished()
+{
+	m_queueDepth.deref();
+}
+
+int Disk::queueDepth() const
+{
+	return m_queueDepth.loadAcquire();
+}
+
+qint64 Disk::readSpeed() const
+{
+	return m_readSpeed;
+}
+
+qint64 Disk::writeSpeed() const
+{
+	return m_writeSpeed;
+}
+
+void Disk::update()
+{
+	qint64 bytesRead = m_bytesRead.loadAcquire();
+	qint64 bytesWritten = m_bytesWritten.loadAcquire();
+	m_readSpeed = (bytesRead - m_lastBytesRead) / (MONITOR_INTERVAL / 1000.0);
+	m_writeSpeed = (bytesWritten - m_lastBytesWritten) / (MONITOR_INTERVAL / 1000.0);
+	m_lastBytesRead = bytesRead;
+	m_lastBytesWritten = bytesWritten;
+}
+
+
+DiskManager::DiskManager()
+{
+	m_timer.start(MONITOR_INTERVAL);
+	connect(&m_timer, &QTimer::timeout, this, &DiskManager::update);
+}
+
+DiskManager::~DiskManager()
+{
+	// Waits for the worker threads to finish
+	qDeleteAll(m_disks);
+}
+
+Disk *DiskManager::diskOf(const QString &path)
+{
+	QString existingPath = QDir(path).absolutePath();
+	while (!QFileInfo::exists(existingPath)) {
+		QString parent = QFileInfo(existingPath).path();
+		if (parent == existingPath) {
+			break;
+		}
+		existingPath = parent;
+	}
+
+	QString name = deviceName(existingPath);
+	Disk *&disk = m_disks[name];
+	if (!disk) {
+		disk = new Disk(name, QStorageInfo(existingPath).rootPath());
+		qDebug() << "Found disk" << name << "mounted on" << disk->rootPath();
+	}
+	return disk;
+}
+
+QList<Disk *> DiskManager::disks() const
+{
+	return m_disks.values();
+}
+
+void DiskManager::update()
+{
+	for (Disk *disk : m_disks) {
+		disk->update();
+	}
+	emit updated();
+}
@@ -0,0 +1,113 @@
+/* qTorrent - An open-source, cross-platform BitTorrent client
+ * Copyright (C) 2017 Petko Georgiev
+ *
+ * diskmanager.h
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef DISKMANAGER_H
+#define DISKMANAGER_H
+
+#include <QObject>
+#include <QString>
+#include <QList>
+#include <QMap>
+#include <QTimer>
+#include <QAtomicInt>
+#include <QAtomicInteger>
+
+class QThread;
+class DiskIoWorker;
+
+/*
+ * A storage device. Each one has its own worker thread, where the file
+ * controllers of the torrents on it check, allocate and copy files.
+ * Jobs on one disk run one after another, so they don't make it seek
+ * between torrents, and a slow disk doesn't hold up the others.
+ * The block reads and writes of the torrents run on another thread of
+ * the disk, see DiskIo.
+ * The counters can be updated from any thread
+ */
+class Disk
+{
+public:
+	Disk(const QString &name, const QString &rootPath);
+	~Disk();
+
+	/* The device, like "sda" or "nvme0n1". Partitions of a device share a disk */
+	const QString &name() const;
+	/* The mount point it was first found through */
+	const QString &rootPath() const;
+	QThread *workerThread() const;
+	DiskIoWorker *io() const;
+
+	void addBytesRead(qint64 bytes);
+	void addBytesWritten(qint64 bytes);
+	void jobQueued();
+	void jobFinished();
+
+	/* Jobs queued or running on the worker and I/O threads */
+	int queueDepth() const;
+	/* In bytes per second, over the last second */
+	qint64 readSpeed() const;
+	qint64 writeSpeed() const;
+
+	void update();
+
+private:
+	QString m_name;
+	QString m_rootPath;
+	QThread *m_workerThread;
+	QThread *m_ioThread;
+	DiskIoWorker *m_io;
+
+	QAtomicInteger<qint64> m_bytesRead;
+	QAtomicInteger<qint64> m_bytesWritten;
+	QAtomicInt m_queueDepth;
+
+	qint64 m_lastBytesRead;
+	qint64 m_lastBytesWritten;
+	qint64 m_readSpeed;
+	qint64 m_writeSpeed;
+
+	Q_DISABLE_COPY(Disk)
+};
+
+class DiskManager : public QObject
+{
+	Q_OBJECT
+
+public:
+	DiskManager();
+	~DiskManager();
+
+	/* The disk that holds the path, created on first use. A path that
+	 * doesn't exist yet is looked up by its closest existing parent */
+	Disk *diskOf(const QString &path);
+	QList<Disk *> disks() const;
+
+signals:
+	/* The speeds are updated */
+	void updated();
+
+private slots:
+	void update();
+
+private:
+	// By device name
+	QMap<QString, Disk *> m_disks;
+	QTimer m_timer;
+};
+
+#endif // DISKMANAGER_H
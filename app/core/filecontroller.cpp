@@ -20,57 +20,343 @@
 #include "filecontroller.h"
 #include "torrent.h"
 #include "torrentinfo.h"
-#include "piece.h"
+#include "diskmanager.h"
+#include "storage.h"
+#include "merkletree.h"
 #include <QCryptographicHash>
 #include <QThread>
+#include <QMutexLocker>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QSettings>
+#include <QDebug>
+#include <algorithm>
+#ifdef Q_OS_UNIX
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#endif
 
-FileController::FileController(Torrent *torrent)
+// Progress is reported after each chunk
+const qint64 ALLOCATION_CHUNK_SIZE = 64 * 1024 * 1024;
+// Copies are throttled and can be aborted after each chunk
+const qint64 COPY_CHUNK_SIZE = 1024 * 1024;
+
+// Reserves disk space without writing anything. Falls back to just
+// setting the file size where that's not supported
+static bool preallocate(QFile &file, qint64 offset, qint64 size)
+{
+#if defined(Q_OS_LINUX)
+	// Unlike posix_fallocate(), this never falls back to writing zeros,
+	// which could overwrite the pieces being written at the same time
+	if (fallocate(file.handle(), 0, offset, size) == 0) {
+		return true;
+	}
+	if (errno != EOPNOTSUPP) {
+		qDebug() << "Failed to allocate" << file.fileName() << ":" << strerror(errno);
+		return false;
+	}
+#elif defined(Q_OS_UNIX) && !defined(Q_OS_MACOS)
+	int error = posix_fallocate(file.handle(), offset, size);
+	if (error == 0) {
+		return true;
+	}
+	if (error != EINVAL && error != EOPNOTSUPP) {
+		qDebug() << "Failed to allocate" << file.fileName() << ":" << strerror(error);
+		return false;
+	}
+#endif
+	if (file.size() < offset + size) {
+		return file.resize(offset + size);
+	}
+	return true;
+}
+
+FileController::FileController(Torrent *torrent, Disk *disk)
 	: m_torrent(torrent)
-	, m_workerThread(new QThread)
+	, m_disk(disk)
+	, m_worker(new FileControllerWorker(disk))
 {
-	FileControllerWorker *worker = new FileControllerWorker(torrent);
-	worker->moveToThread(m_workerThread);
-	connect(m_workerThread, &QThread::finished, worker, &FileControllerWorker::deleteLater);
+	qRegisterMetaType<CheckLayout>();
+	FileControllerWorker *worker = m_worker;
+	worker->moveToThread(disk->workerThread());
 
-	m_workerThread->start();
+	// The disk's queue depth counts the jobs from here until the worker is done
+	// with them. Connected first, so they're counted before they can start
+	auto jobQueued = [disk]() { disk->jobQueued(); };
+	connect(this, &FileController::checkTorrent, this, jobQueued);
+	connect(this, &FileController::checkPieces, this, jobQueued);
+	connect(this, &FileController::allocateFiles, this, jobQueued);
+	connect(this, &FileController::copyFile, this, jobQueued);
 
 	// For torrent-checking
 	connect(this, &FileController::checkTorrent, worker, &FileControllerWorker::checkTorrent);
+	connect(this, &FileController::checkPieces, worker, &FileControllerWorker::checkPieces);
 	connect(worker, &FileControllerWorker::torrentChecked, this, &FileController::torrentChecked);
+
+	// For allocating. Runs before any check that is queued after it
+	connect(this, &FileController::allocateFiles, worker, &FileControllerWorker::allocateFiles);
+	connect(worker, &FileControllerWorker::allocationProgress, this, &FileController::allocationProgress);
+	connect(worker, &FileControllerWorker::filesAllocated, this, &FileController::filesAllocated);
 	connect(worker, &FileControllerWorker::pieceAvailable, m_torrent, &Torrent::setPieceAvailable);
+
+	// For moving the torrent's files
+	connect(this, &FileController::copyFile, worker, &FileControllerWorker::copyFile);
+	connect(worker, &FileControllerWorker::fileCopied, this, &FileController::fileCopied);
 }
 
 FileController::~FileController()
 {
-	m_workerThread->quit();
-	m_workerThread->wait();
-	delete m_workerThread;
+	// The thread is the disk's. Stop the running job without waiting for
+	// a whole check or copy, and delete the worker after its queued jobs
+	m_worker->abort();
+	m_worker->waitForJob();
+	m_worker->deleteLater();
 }
 
+Disk *FileController::disk() const
+{
+	return m_disk;
+}
 
-FileControllerWorker::FileControllerWorker(Torrent *torrent)
-	: m_torrent(torrent)
+
+FileControllerWorker::FileControllerWorker(Disk *disk)
+	: m_disk(disk)
+	, m_aborted(0)
+{
+}
+
+void FileControllerWorker::checkTorrent(const CheckLayout &layout)
+{
+	check(layout, QVector<int>(), true);
+}
+
+void FileControllerWorker::checkPieces(const CheckLayout &layout, const QVector<int> &pieceNumbers)
 {
+	check(layout, pieceNumbers, false);
 }
 
-void FileControllerWorker::checkTorrent()
+void FileControllerWorker::check(const CheckLayout &layout, QVector<int> pieceNumbers, bool allPieces)
 {
-	TorrentInfo *info = m_torrent->torrentInfo();
-	QList<Piece *> &pieces = m_torrent->pieces();
-	for (Piece *piece : pieces) {
-		emit pieceAvailable(piece, false);
-	}
-	for (Piece *piece : pieces) {
-		QByteArray pieceData, pieceHash;
-		if (!piece->getPieceData(pieceData)) {
+	QMutexLocker locker(&m_jobMutex);
+	if (isAborted()) {
+		m_disk->jobFinished();
+		return;
+	}
+	if (allPieces) {
+		for (int i = 0; i < layout.numberOfPieces; i++) {
+			pieceNumbers.push_back(i);
+		}
+	}
+
+	// Checking reads everything once. Keep it from evicting
+	// the data that is being uploaded from the page cache
+	QSettings settings;
+	bool uncached = settings.value("UncachedChecking", true).toBool();
+	settings.setValue("UncachedChecking", uncached);
+
+	for (int pieceNumber : pieceNumbers) {
+		emit pieceAvailable(pieceNumber, false);
+	}
+	for (int pieceNumber : pieceNumbers) {
+		if (isAborted()) {
+			break;
+		}
+		if (pieceNumber < 0 || pieceNumber >= layout.numberOfPieces) {
 			continue;
 		}
-		pieceHash = QCryptographicHash::hash(pieceData, QCryptographicHash::Sha1);
-		bool pieceIsValid = (pieceHash == info->piece(piece->pieceNumber()));
+		qint64 pieceBegin = layout.pieceLength * pieceNumber;
+		qint64 pieceSize = qMin(layout.pieceLength, layout.totalSize - pieceBegin);
+		// The pieces of v2 torrents end with their file
+		auto file = firstFileAt(layout, pieceBegin);
+		if (layout.isV2Only) {
+			if (file == layout.files.constEnd() || file->isPadFile) {
+				continue;
+			}
+			pieceSize = qMin(pieceSize, file->begin + file->size - pieceBegin);
+		}
+		QByteArray pieceData;
+		if (!readPiece(layout, pieceBegin, pieceSize, uncached, pieceData)) {
+			continue;
+		}
+		bool pieceIsValid;
+		if (layout.isV2Only) {
+			QByteArray pieceRoot = MerkleTree::pieceRoot(pieceData.constData(), pieceSize, file->size, layout.pieceLength);
+			pieceIsValid = pieceRoot == layout.pieceHashes.mid(pieceNumber * MerkleTree::HASH_SIZE, MerkleTree::HASH_SIZE);
+		} else {
+			QByteArray pieceHash = QCryptographicHash::hash(pieceData, QCryptographicHash::Sha1);
+			pieceIsValid = pieceHash == layout.pieceHashes.mid(pieceNumber * PIECE_HASH_SIZE, PIECE_HASH_SIZE);
+		}
 		if (pieceIsValid) {
-			emit pieceAvailable(piece, true);
+			emit pieceAvailable(pieceNumber, true);
 		}
 		// TODO report some kind of percentage
 	}
+	m_disk->jobFinished();
 	emit torrentChecked();
 }
+
+QVector<CheckedFile>::const_iterator FileControllerWorker::firstFileAt(const CheckLayout &layout, qint64 offset)
+{
+	// The files are sorted by their end too
+	return std::upper_bound(layout.files.constBegin(), layout.files.constEnd(), offset,
+							[](qint64 value, const CheckedFile &file) {
+		return value < file.begin + file.size;
+	});
+}
+
+bool FileControllerWorker::readPiece(const CheckLayout &layout, qint64 pieceBegin, qint64 pieceSize,
+									 bool uncached, QByteArray &pieceData)
+{
+	qint64 pieceEnd = pieceBegin + pieceSize;
+	pieceData.resize(pieceSize);
+
+	// The reads from all files are done together
+	QVector<Storage::Read> reads;
+	for (auto file = firstFileAt(layout, pieceBegin); file != layout.files.constEnd() && file->begin < pieceEnd; ++file) {
+		qint64 fileEnd = file->begin + file->size;
+		if (fileEnd == file->begin) {
+			continue;
+		}
+		Storage::Read read;
+		read.fileName = file->fileName;
+		read.offset = file->offset + qMax(pieceBegin, file->begin) - file->begin;
+		read.data = pieceData.data() + (qMax(pieceBegin, file->begin) - pieceBegin);
+		read.size = qMin(pieceEnd, fileEnd) - qMax(pieceBegin, file->begin);
+		if (file->isPadFile) {
+			memset(read.data, 0, read.size);
+			continue;
+		}
+		reads.push_back(read);
+	}
+	m_disk->addBytesRead(pieceData.size());
+	Storage *storage = Storage::instance();
+	return uncached ? storage->readUncached(reads) : storage->read(reads);
+}
+
+void FileControllerWorker::allocateFiles(const QStringList &filePaths, const QVector<qint64> &fileSizes)
+{
+	QMutexLocker locker(&m_jobMutex);
+	if (isAborted()) {
+		m_disk->jobFinished();
+		return;
+	}
+	qint64 totalSize = 0;
+	for (qint64 size : fileSizes) {
+		totalSize += size;
+	}
+
+	// Own QFile objects, the torrent's ones belong to its thread
+	bool ok = true;
+	qint64 allocated = 0;
+	int lastPercent = -1;
+	for (int i = 0; i < filePaths.size(); i++) {
+		QFile file(filePaths[i]);
+		QDir dir;
+		dir.mkpath(QFileInfo(file).absolutePath());
+		if (!file.open(QIODevice::ReadWrite)) {
+			qDebug() << "Failed to open file" << file.fileName() << ":" << file.errorString();
+			ok = false;
+			allocated += fileSizes[i];
+			continue;
+		}
+		for (qint64 offset = 0; offset < fileSizes[i]; offset += ALLOCATION_CHUNK_SIZE) {
+			if (isAborted()) {
+				ok = false;
+				break;
+			}
+			qint64 size = qMin(ALLOCATION_CHUNK_SIZE, fileSizes[i] - offset);
+			if (!preallocate(file, offset, size)) {
+				ok = false;
+				break;
+			}
+			allocated += size;
+			int percent = totalSize ? allocated * 100 / totalSize : 100;
+			if (percent != lastPercent) {
+				lastPercent = percent;
+				emit allocationProgress(percent);
+			}
+		}
+		file.close();
+	}
+	m_disk->jobFinished();
+	emit filesAllocated(ok);
+}
+
+void FileControllerWorker::copyFile(const QString &source, const QString &destination, qint64 bytesPerSecond)
+{
+	QMutexLocker locker(&m_jobMutex);
+	QFile sourceFile(source);
+	QFile destinationFile(destination);
+	if (isAborted()) {
+		m_disk->jobFinished();
+		emit fileCopied(false);
+		return;
+	}
+	if (!sourceFile.open(QIODevice::ReadOnly)) {
+		qDebug() << "Failed to open file" << source << ":" << sourceFile.errorString();
+		m_disk->jobFinished();
+		emit fileCopied(false);
+		return;
+	}
+	if (!destinationFile.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+		qDebug() << "Failed to open file" << destination << ":" << destinationFile.errorString();
+		m_disk->jobFinished();
+		emit fileCopied(false);
+		return;
+	}
+
+	QElapsedTimer timer;
+	timer.start();
+	qint64 copied = 0;
+	bool ok = true;
+	while (!sourceFile.atEnd()) {
+		if (m_aborted.loadAcquire()) {
+			ok = false;
+			break;
+		}
+		QByteArray data = sourceFile.read(COPY_CHUNK_SIZE);
+		if (data.isEmpty() || destinationFile.write(data) != data.size()) {
+			qDebug() << "Failed to copy" << source << "to" << destination << ":" << destinationFile.errorString();
+			ok = false;
+			break;
+		}
+		copied += data.size();
+		// Counted as the source disk's, though the destination may be another one
+		m_disk->addBytesRead(data.size());
+		m_disk->addBytesWritten(data.size());
+
+		// Sleep until the average rate drops to the limit
+		if (bytesPerSecond > 0) {
+			qint64 due = copied * 1000 / bytesPerSecond;
+			if (due > timer.elapsed()) {
+				QThread::msleep(due - timer.elapsed());
+			}
+		}
+	}
+	destinationFile.close();
+	// The source is removed once the copy takes its place
+	if (ok && !Storage::instance()->sync(QStringList() << destination)) {
+		qDebug() << "Failed to sync" << destination;
+		ok = false;
+	}
+	m_disk->jobFinished();
+	emit fileCopied(ok);
+}
+
+void FileControllerWorker::abort()
+{
+	m_aborted.storeRelease(1);
+}
+
+void FileControllerWorker::waitForJob()
+{
+	QMutexLocker locker(&m_jobMutex);
+}
+
+bool FileControllerWorker::isAborted() const
+{
+	return m_aborted.loadAcquire();
+}
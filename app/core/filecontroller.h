@@ -21,27 +21,86 @@
 #define FILECONTROLLER_H
 
 #include <QObject>
+#include <QVector>
+#include <QStringList>
+#include <QAtomicInt>
+#include <QMutex>
+#include <QMetaType>
 
-class QThread;
 class Torrent;
-class Piece;
+class Disk;
+
+/* A file of a torrent, as its data is stored */
+struct CheckedFile
+{
+	// The file with the data. The part file for skipped files that don't exist
+	QString fileName;
+	// Where the file's data begins in the torrent and in fileName
+	qint64 begin;
+	qint64 offset;
+	qint64 size;
+	// Pad files are zeros and aren't stored
+	bool isPadFile;
+};
+
+/* What checking needs to know about a torrent. It's taken on the
+ * torrent's thread when the check starts, the worker doesn't look at
+ * the Torrent, whose files and priorities change meanwhile */
+struct CheckLayout
+{
+	QVector<CheckedFile> files;
+	qint64 pieceLength;
+	// The end of the last file, including the pad files
+	qint64 totalSize;
+	int numberOfPieces;
+	// The pieces of v2 torrents end with their file and are checked by
+	// their merkle roots
+	bool isV2Only;
+	// SHA-1 hashes of the pieces, PIECE_HASH_SIZE bytes each, or the
+	// merkle roots, MerkleTree::HASH_SIZE bytes each
+	QByteArray pieceHashes;
+};
+Q_DECLARE_METATYPE(CheckLayout)
 
 class FileControllerWorker : public QObject
 {
 	Q_OBJECT
 
 public:
-	FileControllerWorker(Torrent *torrent);
+	FileControllerWorker(Disk *disk);
+
+	// Makes the running job stop as soon as possible and the queued
+	// ones do nothing. Thread-safe
+	void abort();
+	// Blocks until the running job, if any, is finished
+	void waitForJob();
 
 public slots:
-	void checkTorrent();
+	void checkTorrent(const CheckLayout &layout);
+	void checkPieces(const CheckLayout &layout, const QVector<int> &pieceNumbers);
+	void allocateFiles(const QStringList &filePaths, const QVector<qint64> &fileSizes);
+	// Copies at most bytesPerSecond (0 for no limit)
+	void copyFile(const QString &source, const QString &destination, qint64 bytesPerSecond);
 
 signals:
 	void torrentChecked();
-	void pieceAvailable(Piece* piece, bool available);
+	void pieceAvailable(int pieceNumber, bool available);
+	void allocationProgress(int percent);
+	void filesAllocated(bool ok);
+	void fileCopied(bool ok);
 
 private:
-	Torrent *m_torrent;
+	Disk *m_disk;
+	QAtomicInt m_aborted;
+	// Held while running a job
+	QMutex m_jobMutex;
+
+	bool isAborted() const;
+	void check(const CheckLayout &layout, QVector<int> pieceNumbers, bool allPieces);
+	// The first file that ends after offset
+	static QVector<CheckedFile>::const_iterator firstFileAt(const CheckLayout &layout, qint64 offset);
+	bool readPiece(const CheckLayout &layout, qint64 pieceBegin, qint64 pieceSize,
+				   bool uncached, QByteArray &pieceData);
 };
 
 class FileController : public QObject
@@ -49,16 +108,27 @@ class FileController : public QObject
 	Q_OBJECT
 
 public:
-	FileController(Torrent *torrent);
+	/* The jobs run on the disk's thread, after the ones of the other
+	 * torrents on the same disk */
+	FileController(Torrent *torrent, Disk *disk);
 	~FileController();
 
+	Disk *disk() const;
+
 signals:
-	void checkTorrent();
+	void checkTorrent(const CheckLayout &layout);
+	void checkPieces(const CheckLayout &layout, const QVector<int> &pieceNumbers);
 	void torrentChecked();
+	void allocateFiles(const QStringList &filePaths, const QVector<qint64> &fileSizes);
+	void allocationProgress(int percent);
+	void filesAllocated(bool ok);
+	void copyFile(const QString &source, const QString &destination, qint64 bytesPerSecond);
+	void fileCopied(bool ok);
 
 private:
 	Torrent *m_torrent;
-	QThread *m_workerThread;
+	Disk *m_disk;
+	FileControllerWorker *m_worker;
 };
 
 #endif // FILECONTROLLER_H
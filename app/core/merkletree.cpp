@@ -0,0 +1,141 @@
+/* qTorrent - An open-source, cross-platform BitTorrent client
+ * Copyright (C) 2017 Petko Georgiev
+ *
+ * merkletree.cpp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "merkletree.h"
+#include <QCryptographicHash>
+
+// The parent of two nodes, written to result
+static void hashPair(QCryptographicHash &hash, const char *left, const char *right, char *result)
+{
+	hash.reset();
+	hash.addData(left, MerkleTree::HASH_SIZE);
+	hash.addData(right, MerkleTree::HASH_SIZE);
+	memcpy(result, hash.result().constData(), MerkleTree::HASH_SIZE);
+}
+
+QByteArray MerkleTree::blockHashes(const char *data, qint64 size)
+{
+	// One hash object for all blocks, the results go straight to their place
+	qint64 numberOfBlocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	QByteArray hashes(numberOfBlocks * HASH_SIZE, Qt::Uninitialized);
+	QCryptographicHash hash(QCryptographicHash::Sha256);
+	for (qint64 i = 0; i < numberOfBlocks; i++) {
+		hash.reset();
+		hash.addData(data + i * BLOCK_SIZE, qMin<qint64>(BLOCK_SIZE, size - i * BLOCK_SIZE));
+		memcpy(hashes.data() + i * HASH_SIZE, hash.result().constData(), HASH_SIZE);
+	}
+	return hashes;
+}
+
+QByteArray MerkleTree::root(const QByteArray &hashes, qint64 count, const QByteArray &padHash)
+{
+	qint64 numberOfHashes = hashes.size() / HASH_SIZE;
+	if (count < numberOfHashes || numberOfHashes == 0) {
+		return QByteArray();
+	}
+
+	// Each layer is hashed in place into the first half of the buffer.
+	// Pad hashes are only added where they pair with real ones, the
+	// subtrees of only padding are the pad hash of their layer
+	QByteArray layer = hashes;
+	QByteArray pad = padHash;
+	QCryptographicHash hash(QCryptographicHash::Sha256);
+	while (count > 1) {
+		if (numberOfHashes % 2 != 0) {
+			layer.append(pad);
+			numberOfHashes++;
+		}
+		for (qint64 i = 0; i < numberOfHashes / 2; i++) {
+			const char *pair = layer.constData() + 2 * i * HASH_SIZE;
+			hashPair(hash, pair, pair + HASH_SIZE, layer.data() + i * HASH_SIZE);
+		}
+		numberOfHashes /= 2;
+		layer.truncate(numberOfHashes * HASH_SIZE);
+		QByteArray parentPad(HASH_SIZE, Qt::Uninitialized);
+		hashPair(hash, pad.constData(), pad.constData(), parentPad.data());
+		pad = parentPad;
+		count /= 2;
+	}
+	return layer;
+}
+
+QByteArray MerkleTree::padHash(qint64 leaves)
+{
+	QByteArray pad(HASH_SIZE, '\0');
+	QCryptographicHash hash(QCryptographicHash::Sha256);
+	for (; leaves > 1; leaves /= 2) {
+		hashPair(hash, pad.constData(), pad.constData(), pad.data());
+	}
+	return pad;
+}
+
+QByteArray MerkleTree::rootFromProof(const QByteArray &subtreeRoot, qint64 position, const QByteArray &uncles)
+{
+	QByteArray node = subtreeRoot;
+	QCryptographicHash hash(QCryptographicHash::Sha256);
+	for (int i = 0; i + HASH_SIZE <= uncles.size(); i += HASH_SIZE) {
+		const char *uncle = uncles.constData() + i;
+		if (position % 2 == 0) {
+			hashPair(hash, node.constData(), uncle, node.data());
+		} else {
+			hashPair(hash, uncle, node.constData(), node.data());
+		}
+		position /= 2;
+	}
+	return node;
+}
+
+QByteArray MerkleTree::pieceRoot(const char *data, qint64 size, qint64 fileLength, qint64 pieceLength)
+{
+	// Pieces of larger files are padded to a whole piece of leaves
+	qint64 leaves;
+	if (fileLength > pieceLength) {
+		leaves = pieceLength / BLOCK_SIZE;
+	} else {
+		leaves = nextPowerOfTwo((fileLength + BLOCK_SIZE - 1) / BLOCK_SIZE);
+	}
+	return root(blockHashes(data, size), leaves, QByteArray(HASH_SIZE, '\0'));
+}
+
+qint64 MerkleTree::nextPowerOfTwo(qint64 n)
+{
+	qint64 power = 1;
+	while (power < n) {
+		power *= 2;
+	}
+	return power;
+}
+
+int MerkleTree::log2(qint64 n)
+{
+	int log = 0;
+	while (n > 1) {
+		n /= 2;
+		log++;
+	}
+	return log;
+}
+
+bool MerkleTree::equal(const char *a, const char *b)
+{
+	unsigned char difference = 0;
+	for (int i = 0; i < HASH_SIZE; i++) {
+		difference |= a[i] ^ b[i];
+	}
+	return difference == 0;
+}
@@ -0,0 +1,60 @@
+/* qTorrent - An open-source, cross-platform BitTorrent client
+ * Copyright (C) 2017 Petko Georgiev
+ *
+ * merkletree.h
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef MERKLETREE_H
+#define MERKLETREE_H
+
+#include <QByteArray>
+
+/*
+ * The SHA-256 merkle trees of BitTorrent v2 (BEP 52). Each file has a
+ * tree whose leaves are the hashes of its 16 KiB blocks. Leaves past the
+ * end of the file are zeros, up to a power of two. Files larger than a
+ * piece are padded at the piece layer instead, with the root of a piece
+ * of zero leaves (padHash()).
+ * Hashes are HASH_SIZE bytes long and kept back to back in byte arrays
+ */
+class MerkleTree
+{
+public:
+	static const int BLOCK_SIZE = 16384;
+	static const int HASH_SIZE = 32;
+
+	/* The leaf hashes of the blocks of data. The last block may be shorter */
+	static QByteArray blockHashes(const char *data, qint64 size);
+	/* The root of a tree over the hashes, which are padded with padHash
+	 * to count hashes. count must be a power of two */
+	static QByteArray root(const QByteArray &hashes, qint64 count, const QByteArray &padHash);
+	/* The root of a tree of leaves zero leaves */
+	static QByteArray padHash(qint64 leaves);
+	/* The root of the tree that the subtree at position (counted in its
+	 * layer) is in, given the hashes of its uncles from the bottom up */
+	static QByteArray rootFromProof(const QByteArray &subtreeRoot, qint64 position, const QByteArray &uncles);
+	/* The hash of a piece of a file in the piece layer, or the pieces root
+	 * if the file is not larger than a piece */
+	static QByteArray pieceRoot(const char *data, qint64 size, qint64 fileLength, qint64 pieceLength);
+
+	static qint64 nextPowerOfTwo(qint64 n);
+	// n must be a power of two
+	static int log2(qint64 n);
+
+	/* Compares hashes in the same time no matter where they differ */
+	static bool equal(const char *a, const char *b);
+};
+
+#endif // MERKLETREE_H
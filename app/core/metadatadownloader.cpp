@@ -0,0 +1,201 @@
+/* qTorrent - An open-source, cross-platform BitTorrent client
+ * Copyright (C) 2017 Petko Georgiev
+ *
+ * metadatadownloader.cpp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "metadatadownloader.h"
+#include "torrent.h"
+#include "torrentinfo.h"
+#include <QDebug>
+
+// Info dictionaries larger than this are rejected
+const int MAX_METADATA_SIZE = 32 * 1024 * 1024;
+// A piece request that took longer than that is given to another peer
+const int METADATA_REQUEST_TIMEOUT_MSEC = 20000;
+
+MetadataDownloader::MetadataDownloader(Torrent *torrent)
+	: QObject(torrent)
+	, m_torrent(torrent)
+	, m_metadataSize(0)
+{
+	m_elapsedTimer.start();
+	m_timeoutTimer.setSingleShot(true);
+	m_timeoutTimer.setInterval(METADATA_REQUEST_TIMEOUT_MSEC + 1);
+	connect(&m_timeoutTimer, &QTimer::timeout, this, [this]() {
+		if (hasPendingRequests()) {
+			m_torrent->wakePeers();
+			m_timeoutTimer.start();
+		}
+	});
+}
+
+bool MetadataDownloader::hasMetadataSize() const
+{
+	return m_metadataSize > 0;
+}
+
+int MetadataDownloader::metadataSize() const
+{
+	return m_metadataSize;
+}
+
+int MetadataDownloader::numberOfPieces() const
+{
+	return m_received.size();
+}
+
+bool MetadataDownloader::setMetadataSize(int size)
+{
+	if (size <= 0 || size > MAX_METADATA_SIZE) {
+		return false;
+	}
+	if (hasMetadataSize()) {
+		return size == m_metadataSize;
+	}
+
+	m_metadataSize = size;
+	m_metadata.resize(size);
+	int pieces = (size + PIECE_SIZE - 1) / PIECE_SIZE;
+	m_received.fill(false, pieces);
+	m_requestedFrom.fill(nullptr, pieces);
+	m_requestTime.fill(0, pieces);
+	return true;
+}
+
+int MetadataDownloader::requestPiece(Peer *peer)
+{
+	qint64 now = m_elapsedTimer.elapsed();
+	if (!m_timeoutTimer.isActive()) {
+		m_timeoutTimer.start();
+	}
+
+	// Prefer pieces that nobody is downloading
+	for (int i = 0; i < m_received.size(); i++) {
+		if (!m_received[i] && m_requestedFrom[i] == nullptr) {
+			m_requestedFrom[i] = peer;
+			m_requestTime[i] = now;
+			return i;
+		}
+	}
+
+	// Then take over timed-out requests
+	for (int i = 0; i < m_received.size(); i++) {
+		if (!m_received[i] && m_requestedFrom[i] != peer
+				&& now - m_requestTime[i] > METADATA_REQUEST_TIMEOUT_MSEC) {
+			m_requestedFrom[i] = peer;
+			m_requestTime[i] = now;
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+int MetadataDownloader::requestsCount(Peer *peer) const
+{
+	int count = 0;
+	for (int i = 0; i < m_received.size(); i++) {
+		if (!m_received[i] && m_requestedFrom[i] == peer) {
+			count++;
+		}
+	}
+	return count;
+}
+
+void MetadataDownloader::releasePeer(Peer *peer)
+{
+	for (int i = 0; i < m_requestedFrom.size(); i++) {
+		if (m_requestedFrom[i] == peer) {
+			m_requestedFrom[i] = nullptr;
+			m_torrent->wakePeers();
+		}
+	}
+}
+
+void MetadataDownloader::reset()
+{
+	m_metadataSize = 0;
+	m_metadata.clear();
+	m_received.clear();
+	m_requestedFrom.clear();
+	m_requestTime.clear();
+	m_timeoutTimer.stop();
+	m_torrent->wakePeers();
+}
+
+void MetadataDownloader::pieceReceived(Peer *peer, int index, const QByteArray &data)
+{
+	if (index < 0 || index >= m_received.size() || data.size() != pieceSize(index)) {
+		qDebug() << "MetadataDownloader: Invalid metadata piece" << index << "of size" << data.size();
+		pieceRejected(peer, index);
+		return;
+	}
+	if (m_received[index]) {
+		return;
+	}
+
+	memcpy(m_metadata.data() + index * PIECE_SIZE, data.constData(), data.size());
+	m_received[index] = true;
+	m_requestedFrom[index] = nullptr;
+	checkIfComplete();
+}
+
+void MetadataDownloader::pieceRejected(Peer *peer, int index)
+{
+	if (index >= 0 && index < m_requestedFrom.size() && m_requestedFrom[index] == peer) {
+		m_requestedFrom[index] = nullptr;
+		m_torrent->wakePeers();
+	}
+}
+
+bool MetadataDownloader::hasPendingRequests() const
+{
+	for (int i = 0; i < m_received.size(); i++) {
+		if (!m_received[i] && m_requestedFrom[i] != nullptr) {
+			return true;
+		}
+	}
+	return false;
+}
+
+int MetadataDownloader::pieceSize(int index) const
+{
+	if (index == m_received.size() - 1) {
+		return m_metadataSize - index * PIECE_SIZE;
+	}
+	return PIECE_SIZE;
+}
+
+void MetadataDownloader::checkIfComplete()
+{
+	for (bool received : m_received) {
+		if (!received) {
+			return;
+		}
+	}
+
+	if (!m_torrent->torrentInfo()->matchesInfoDictionary(m_metadata)) {
+		// Someone sent us garbage, or a wrong metadata size. Start over
+		qDebug() << "MetadataDownloader: Metadata for" << m_torrent->torrentInfo()->infoHash().toHex()
+				 << "failed hash check";
+		reset();
+		return;
+	}
+
+	qDebug() << "MetadataDownloader: Downloaded metadata for" << m_torrent->torrentInfo()->infoHash().toHex();
+	emit metadataDownloaded(m_metadata);
+}
@@ -0,0 +1,99 @@
+/* qTorrent - An open-source, cross-platform BitTorrent client
+ * Copyright (C) 2017 Petko Georgiev
+ *
+ * metadatadownloader.h
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef METADATADOWNLOADER_H
+#define METADATADOWNLOADER_H
+
+#include <QObject>
+#include <QByteArray>
+#include <QVector>
+#include <QElapsedTimer>
+#include <QTimer>
+
+class Torrent;
+class Peer;
+
+/*
+ * Downloads the info dictionary of a torrent from its peers with the
+ * ut_metadata extension (BEP 9). Used for torrents added with magnet links.
+ * The metadata is split into 16 KiB pieces, which are requested from
+ * several peers in parallel. When all pieces are received, the result
+ * is verified against the info hash.
+ */
+class MetadataDownloader : public QObject
+{
+	Q_OBJECT
+
+public:
+	/* The size of a metadata piece */
+	static const int PIECE_SIZE = 16384;
+
+	MetadataDownloader(Torrent *torrent);
+
+	bool hasMetadataSize() const;
+	int metadataSize() const;
+	int numberOfPieces() const;
+
+	/* Sets the metadata size, as reported by a peer.
+	 * Returns false if the size is invalid or different from the current one */
+	bool setMetadataSize(int size);
+
+	/* Returns the index of a metadata piece that should be requested from
+	 * that peer, or -1 if there are none. The piece is assigned to the peer */
+	int requestPiece(Peer *peer);
+
+	/* Returns the number of pieces that are currently assigned to the peer */
+	int requestsCount(Peer *peer) const;
+
+	/* Drops all pieces assigned to the peer (e.g. on disconnect) */
+	void releasePeer(Peer *peer);
+
+	/* Discards everything and starts from the beginning */
+	void reset();
+
+signals:
+	/* Emitted when the whole info dictionary is downloaded and verified */
+	void metadataDownloaded(QByteArray infoDictionary);
+
+public slots:
+	void pieceReceived(Peer *peer, int index, const QByteArray &data);
+	void pieceRejected(Peer *peer, int index);
+
+private:
+	Torrent *m_torrent;
+	int m_metadataSize;
+	QByteArray m_metadata;
+
+	/* Per-piece state */
+	QVector<bool> m_received;
+	QVector<Peer *> m_requestedFrom;
+	QVector<qint64> m_requestTime;
+
+	/* Used for timing out requests */
+	QElapsedTimer m_elapsedTimer;
+	/* Wakes the peers up when a request may have timed out,
+	 * so that another peer takes the piece over */
+	QTimer m_timeoutTimer;
+
+	int pieceSize(int index) const;
+	void checkIfComplete();
+	bool hasPendingRequests() const;
+};
+
+#endif // METADATADOWNLOADER_H
@@ -0,0 +1,428 @@
+/* qTorrent - An open-source, cross-platform BitTorrent client
+ * Copyright (C) 2017 Petko Georgiev
+ *
+ * networkengine.cpp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "networkengine.h"
+#include "peersocket.h"
+#include <QTcpSocket>
+#include <QThread>
+#include <QSettings>
+#include <QFile>
+#include <QDebug>
+#ifdef Q_OS_LINUX
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#endif
+
+// Messages longer than that are forwarded as they are.
+// The peer will reject them anyway
+const int MAX_MESSAGE_LENGTH = 65536;
+// The BitTorrent handshake without the protocol string
+const int HANDSHAKE_LENGTH = 49;
+const int MAX_NETWORK_THREADS = 16;
+
+NetworkEngine *NetworkEngine::m_networkEngine = nullptr;
+
+
+NetworkShardWorker::NetworkShardWorker(NetworkEngine *engine, int index)
+	: m_engine(engine)
+	, m_index(index)
+	, m_commandsNotified(0)
+	, m_eventsNotified(0)
+{
+}
+
+void NetworkShardWorker::postCommand(const NetworkCommand &command)
+{
+	m_commands.push(command);
+	// Wake up the network thread, unless it's already going to check the queue
+	if (m_commandsNotified.testAndSetOrdered(0, 1)) {
+		QMetaObject::invokeMethod(this, "processCommands", Qt::QueuedConnection);
+	}
+}
+
+bool NetworkShardWorker::takeEvent(NetworkEvent &event)
+{
+	return m_events.pop(event);
+}
+
+void NetworkShardWorker::clearEventsNotification()
+{
+	m_eventsNotified.storeRelease(0);
+}
+
+void NetworkShardWorker::processCommands()
+{
+	// Clear the flag first, so that commands pushed while
+	// we're working will schedule another call
+	m_commandsNotified.storeRelease(0);
+
+	NetworkCommand command;
+	while (m_commands.pop(command)) {
+		switch (command.type) {
+		case NetworkCommand::Connect: {
+			QTcpSocket *socket = new QTcpSocket(this);
+			addConnection(command.connectionId, socket);
+			socket->connectToHost(command.address, command.port);
+			break;
+		}
+		case NetworkCommand::Adopt: {
+			QTcpSocket *socket = new QTcpSocket(this);
+			addConnection(command.connectionId, socket);
+			if (socket->setSocketDescriptor(command.socketDescriptor)) {
+				onConnected(command.connectionId);
+			} else {
+				onError(command.connectionId);
+			}
+			break;
+		}
+		case NetworkCommand::Write: {
+			Connection *connection = m_connections.value(command.connectionId);
+			if (connection) {
+				connection->socket->write(command.data);
+			}
+			break;
+		}
+		case NetworkCommand::SendFile: {
+			Connection *connection = m_connections.value(command.connectionId);
+			if (connection) {
+				sendFile(connection, command);
+			}
+			break;
+		}
+		case NetworkCommand::Close:
+			closeConnection(command.connectionId);
+			break;
+		}
+	}
+}
+
+void NetworkShardWorker::addConnection(quint32 connectionId, QTcpSocket *socket)
+{
+	Connection *connection = new Connection;
+	connection->socket = socket;
+	connection->handshakeReceived = false;
+	m_connections[connectionId] = connection;
+
+	connect(socket, &QTcpSocket::connected, this, [this, connectionId]() { onConnected(connectionId); });
+	connect(socket, &QTcpSocket::readyRead, this, [this, connectionId]() { onReadyRead(connectionId); });
+	connect(socket, &QTcpSocket::disconnected, this, [this, connectionId]() { onDisconnected(connectionId); });
+	connect(socket, static_cast<void (QAbstractSocket::*)(QAbstractSocket::SocketError)>(&QAbstractSocket::error),
+			this, [this, connectionId]() { onError(connectionId); });
+}
+
+void NetworkShardWorker::closeConnection(quint32 connectionId)
+{
+	Connection *connection = m_connections.take(connectionId);
+	if (connection == nullptr) {
+		return;
+	}
+	QTcpSocket *socket = connection->socket;
+	delete connection;
+
+	// Send whatever is left in the write buffer, then get rid of the socket
+	QObject::disconnect(socket, nullptr, this, nullptr);
+	connect(socket, &QTcpSocket::disconnected, socket, &QObject::deleteLater);
+	socket->disconnectFromHost();
+	if (socket->state() == QAbstractSocket::UnconnectedState) {
+		socket->deleteLater();
+	}
+}
+
+void NetworkShardWorker::sendFile(Connection *connection, const NetworkCommand &command)
+{
+	QTcpSocket *socket = connection->socket;
+	if (socket->state() != QAbstractSocket::ConnectedState) {
+		return;
+	}
+
+	// Writing to the descriptor is fine only if it doesn't
+	// overtake the data in the socket's write buffer
+	bool direct = false;
+	qint64 headerSent = 0;
+#ifdef Q_OS_LINUX
+	int fd = socket->socketDescriptor();
+	if (socket->bytesToWrite() == 0) {
+		// MSG_MORE keeps the header in the same packet as the file data
+		ssize_t sent = ::send(fd, command.data.constData(), command.data.size(), MSG_MORE | MSG_NOSIGNAL);
+		if (sent > 0) {
+			headerSent = sent;
+		}
+		direct = (headerSent == command.data.size());
+	}
+#endif
+	if (headerSent < command.data.size()) {
+		socket->write(command.data.constData() + headerSent, command.data.size() - headerSent);
+	}
+
+	for (const FileRegion &region : command.regions) {
+		QFile file(region.fileName);
+		if (!file.open(QIODevice::ReadOnly)) {
+			// The message is already started, so the connection is broken
+			qDebug() << "Failed to open file" << region.fileName << ":" << file.errorString();
+			socket->abort();
+			return;
+		}
+		qint64 offset = region.offset;
+		qint64 bytesLeft = region.length;
+#ifdef Q_OS_LINUX
+		while (direct && bytesLeft > 0) {
+			off_t fileOffset = offset;
+			ssize_t sent = ::sendfile(fd, file.handle(), &fileOffset, bytesLeft);
+			if (sent <= 0) {
+				// The socket's buffer is full, or the file can't be sent like that
+				direct = false;
+				break;
+			}
+			offset += sent;
+			bytesLeft -= sent;
+		}
+#endif
+		if (bytesLeft > 0) {
+			QByteArray data;
+			if (file.seek(offset)) {
+				data = file.read(bytesLeft);
+			}
+			if (data.size() != bytesLeft) {
+				qDebug() << "Failed to read" << bytesLeft << "bytes from" << region.fileName;
+				socket->abort();
+				return;
+			}
+			socket->write(data);
+			// Keep the order from now on
+			direct = false;
+		}
+	}
+}
+
+void NetworkShardWorker::postEvent(const NetworkEvent &event)
+{
+	m_events.push(event);
+	if (m_eventsNotified.testAndSetOrdered(0, 1)) {
+		QMetaObject::invokeMethod(m_engine, "processShardEvents", Qt::QueuedConnection, Q_ARG(int, m_index));
+	}
+}
+
+void NetworkShardWorker::onConnected(quint32 connectionId)
+{
+	Connection *connection = m_connections.value(connectionId);
+	if (connection == nullptr) {
+		return;
+	}
+	NetworkEvent event(NetworkEvent::Connected, connectionId);
+	event.peerAddress = connection->socket->peerAddress();
+	event.peerPort = connection->socket->peerPort();
+	postEvent(event);
+}
+
+void NetworkShardWorker::onReadyRead(quint32 connectionId)
+{
+	Connection *connection = m_connections.value(connectionId);
+	if (connection == nullptr) {
+		return;
+	}
+	connection->buffer.push_back(connection->socket->readAll());
+
+	// Hand over only whole messages
+	int length = completeMessagesLength(connection);
+	if (length == 0) {
+		return;
+	}
+	NetworkEvent event(NetworkEvent::Data, connectionId);
+	if (length == connection->buffer.size()) {
+		event.data = connection->buffer;
+		connection->buffer.clear();
+	} else {
+		event.data = connection->buffer.left(length);
+		connection->buffer.remove(0, length);
+	}
+	postEvent(event);
+}
+
+void NetworkShardWorker::onDisconnected(quint32 connectionId)
+{
+	if (!m_connections.contains(connectionId)) {
+		return;
+	}
+	postEvent(NetworkEvent(NetworkEvent::Disconnected, connectionId));
+}
+
+void NetworkShardWorker::onError(quint32 connectionId)
+{
+	Connection *connection = m_connections.value(connectionId);
+	if (connection == nullptr) {
+		return;
+	}
+	NetworkEvent event(NetworkEvent::Error, connectionId);
+	event.socketError = connection->socket->error();
+	event.errorString = connection->socket->errorString();
+	postEvent(event);
+}
+
+int NetworkShardWorker::completeMessagesLength(Connection *connection) const
+{
+	const QByteArray &buffer = connection->buffer;
+	int pos = 0;
+
+	// The first message is the handshake
+	if (!connection->handshakeReceived) {
+		if (buffer.isEmpty()) {
+			return 0;
+		}
+		int handshakeLength = HANDSHAKE_LENGTH + (unsigned char)buffer[0];
+		if (buffer.size() < handshakeLength) {
+			return 0;
+		}
+		connection->handshakeReceived = true;
+		pos = handshakeLength;
+	}
+
+	while (buffer.size() - pos >= 4) {
+		int length = 0;
+		for (int j = 0; j < 4; j++) {
+			length *= 256;
+			length += (unsigned char)buffer[pos + j];
+		}
+		if (length > MAX_MESSAGE_LENGTH || length < 0) {
+			// Let the peer deal with it
+			return buffer.size();
+		}
+		if (buffer.size() - pos < 4 + length) {
+			break;
+		}
+		pos += 4 + length;
+	}
+	return pos;
+}
+
+
+NetworkEngine::NetworkEngine()
+	: m_nextConnectionId(1)
+{
+	Q_ASSERT(m_networkEngine == nullptr);
+	m_networkEngine = this;
+
+	QSettings settings;
+	int threads = settings.value("NetworkThreads", QThread::idealThreadCount()).toInt();
+	settings.setValue("NetworkThreads", threads);
+	threads = qBound(1, threads, MAX_NETWORK_THREADS);
+
+	for (int i = 0; i < threads; i++) {
+		QThread *thread = new QThread;
+		NetworkShardWorker *worker = new NetworkShardWorker(this, i);
+		worker->moveToThread(thread);
+		connect(thread, &QThread::finished, worker, &NetworkShardWorker::deleteLater);
+		thread->start();
+		m_threads.push_back(thread);
+		m_workers.push_back(worker);
+	}
+	qDebug() << "Network engine started with" << threads << "threads";
+}
+
+NetworkEngine::~NetworkEngine()
+{
+	for (QThread *thread : m_threads) {
+		thread->quit();
+		thread->wait();
+		delete thread;
+	}
+	m_networkEngine = nullptr;
+}
+
+NetworkEngine *NetworkEngine::instance()
+{
+	Q_ASSERT(m_networkEngine != nullptr);
+	return m_networkEngine;
+}
+
+int NetworkEngine::numberOfShards() const
+{
+	return m_workers.size();
+}
+
+quint32 NetworkEngine::connectToHost(PeerSocket *socket, const QHostAddress &address, quint16 port)
+{
+	quint32 connectionId = addSocket(socket);
+	NetworkCommand command(NetworkCommand::Connect, connectionId);
+	command.address = address;
+	command.port = port;
+	shard(connectionId)->postCommand(command);
+	return connectionId;
+}
+
+quint32 NetworkEngine::adoptSocketDescriptor(PeerSocket *socket, qintptr socketDescriptor)
+{
+	quint32 connectionId = addSocket(socket);
+	NetworkCommand command(NetworkCommand::Adopt, connectionId);
+	command.socketDescriptor = socketDescriptor;
+	shard(connectionId)->postCommand(command);
+	return connectionId;
+}
+
+void NetworkEngine::write(quint32 connectionId, const QByteArray &data)
+{
+	NetworkCommand command(NetworkCommand::Write, connectionId);
+	command.data = data;
+	shard(connectionId)->postCommand(command);
+}
+
+void NetworkEngine::sendFile(quint32 connectionId, const QByteArray &data, const QVector<FileRegion> &regions)
+{
+	NetworkCommand command(NetworkCommand::SendFile, connectionId);
+	command.data = data;
+	command.regions = regions;
+	shard(connectionId)->postCommand(command);
+}
+
+void NetworkEngine::close(quint32 connectionId)
+{
+	if (m_sockets.remove(connectionId) == 0) {
+		return;
+	}
+	shard(connectionId)->postCommand(NetworkCommand(NetworkCommand::Close, connectionId));
+}
+
+void NetworkEngine::processShardEvents(int shard)
+{
+	NetworkShardWorker *worker = m_workers[shard];
+	worker->clearEventsNotification();
+
+	NetworkEvent event;
+	while (worker->takeEvent(event)) {
+		// The socket might have been closed in the meantime
+		PeerSocket *socket = m_sockets.value(event.connectionId);
+		if (socket) {
+			socket->handleEvent(event);
+		}
+	}
+}
+
+quint32 NetworkEngine::addSocket(PeerSocket *socket)
+{
+	quint32 connectionId = m_nextConnectionId++;
+	if (m_nextConnectionId == 0) {
+		m_nextConnectionId = 1;
+	}
+	m_sockets[connectionId] = socket;
+	return connectionId;
+}
+
+NetworkShardWorker *NetworkEngine::shard(quint32 connectionId)
+{
+	return m_workers[connectionId % m_workers.size()];
+}
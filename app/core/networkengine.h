@@ -0,0 +1,195 @@
+/* qTorrent - An open-source, cross-platform BitTorrent client
+ * Copyright (C) 2017 Petko Georgiev
+ *
+ * networkengine.h
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef NETWORKENGINE_H
+#define NETWORKENGINE_H
+
+#include "spscqueue.h"
+#include <QObject>
+#include <QHostAddress>
+#include <QAbstractSocket>
+#include <QByteArray>
+#include <QAtomicInt>
+#include <QHash>
+#include <QList>
+#include <QVector>
+#include <QString>
+
+class QThread;
+class QTcpSocket;
+class PeerSocket;
+class NetworkEngine;
+
+/* A part of a file, sent by a SendFile command */
+struct FileRegion
+{
+	QString fileName;
+	qint64 offset;
+	qint64 length;
+};
+
+/* A request from the main thread to a network thread */
+struct NetworkCommand
+{
+	enum Type {
+		Connect, /* Connect to address:port */
+		Adopt, /* Take over an accepted socket descriptor */
+		Write, /* Send data */
+		SendFile, /* Send data, followed by the contents of file regions */
+		Close /* Close the connection and forget about it */
+	};
+
+	Type type;
+	quint32 connectionId;
+	QHostAddress address;
+	quint16 port;
+	qintptr socketDescriptor;
+	QByteArray data;
+	QVector<FileRegion> regions;
+
+	NetworkCommand(Type type = Write, quint32 connectionId = 0)
+		: type(type), connectionId(connectionId), port(0), socketDescriptor(-1) {}
+};
+
+/* A notification from a network thread to the main thread */
+struct NetworkEvent
+{
+	enum Type {
+		Connected,
+		Data, /* One or more complete peer wire messages */
+		Disconnected,
+		Error
+	};
+
+	Type type;
+	quint32 connectionId;
+	QByteArray data;
+	QHostAddress peerAddress;
+	quint16 peerPort;
+	QAbstractSocket::SocketError socketError;
+	QString errorString;
+
+	NetworkEvent(Type type = Data, quint32 connectionId = 0)
+		: type(type), connectionId(connectionId), peerPort(0)
+		, socketError(QAbstractSocket::UnknownSocketError) {}
+};
+
+/*
+ * Lives in a network thread and owns the real sockets of a shard of
+ * connections. It does all the socket I/O and splits the incoming
+ * stream into whole messages, so a 16 KiB block is handed to the
+ * main thread once, after it was fully received.
+ * Commands and events are passed through lock-free queues. The other
+ * side is woken up with a queued call only when its queue was empty.
+ */
+class NetworkShardWorker : public QObject
+{
+	Q_OBJECT
+
+public:
+	NetworkShardWorker(NetworkEngine *engine, int index);
+
+	/* Called from the main thread */
+	void postCommand(const NetworkCommand &command);
+	bool takeEvent(NetworkEvent &event);
+	void clearEventsNotification();
+
+public slots:
+	void processCommands();
+
+private:
+	struct Connection
+	{
+		QTcpSocket *socket;
+		QByteArray buffer;
+		bool handshakeReceived;
+	};
+
+	NetworkEngine *m_engine;
+	int m_index;
+
+	SpscQueue<NetworkCommand> m_commands;
+	QAtomicInt m_commandsNotified;
+	SpscQueue<NetworkEvent> m_events;
+	QAtomicInt m_eventsNotified;
+
+	QHash<quint32, Connection *> m_connections;
+
+	void addConnection(quint32 connectionId, QTcpSocket *socket);
+	void closeConnection(quint32 connectionId);
+	/* Sends the file regions with sendfile() when nothing is waiting
+	 * in the socket's write buffer. What can't be sent directly is
+	 * read and appended to the write buffer */
+	void sendFile(Connection *connection, const NetworkCommand &command);
+	void postEvent(const NetworkEvent &event);
+
+	void onConnected(quint32 connectionId);
+	void onReadyRead(quint32 connectionId);
+	void onDisconnected(quint32 connectionId);
+	void onError(quint32 connectionId);
+
+	/* Returns the number of bytes at the beginning of the
+	 * buffer, which form complete messages */
+	int completeMessagesLength(Connection *connection) const;
+};
+
+/*
+ * Runs the network threads and routes data between the PeerSocket
+ * objects in the main thread and the real sockets in the shards.
+ * The number of threads is read from the "NetworkThreads" setting.
+ */
+class NetworkEngine : public QObject
+{
+	Q_OBJECT
+
+public:
+	NetworkEngine();
+	~NetworkEngine();
+
+	static NetworkEngine *instance();
+
+	int numberOfShards() const;
+
+	/* These return the id of the new connection */
+	quint32 connectToHost(PeerSocket *socket, const QHostAddress &address, quint16 port);
+	quint32 adoptSocketDescriptor(PeerSocket *socket, qintptr socketDescriptor);
+
+	void write(quint32 connectionId, const QByteArray &data);
+	/* Writes data and then the contents of the file regions */
+	void sendFile(quint32 connectionId, const QByteArray &data, const QVector<FileRegion> &regions);
+	/* Closes the connection. No more events are delivered for it */
+	void close(quint32 connectionId);
+
+private slots:
+	/* Delivers the events of a shard to the PeerSocket objects */
+	void processShardEvents(int shard);
+
+private:
+	QList<QThread *> m_threads;
+	QList<NetworkShardWorker *> m_workers;
+	QHash<quint32, PeerSocket *> m_sockets;
+	quint32 m_nextConnectionId;
+
+	static NetworkEngine *m_networkEngine;
+
+	quint32 addSocket(PeerSocket *socket);
+	NetworkShardWorker *shard(quint32 connectionId);
+};
+
+#endif // NETWORKENGINE_H
@@ -24,10 +24,15 @@
 #include "torrent.h"
 #include "torrentinfo.h"
 #include "torrentmessage.h"
-#include <QTcpSocket>
+#include "metadatadownloader.h"
+#include "bencodevalue.h"
+#include "peersocket.h"
+#include "networkengine.h"
 #include <QHostAddress>
-#include <QTimer>
+#include <QCryptographicHash>
+#include <QPointer>
 #include <QDebug>
+#include <cmath>
 
 const int BLOCK_REQUEST_SIZE = 16384;
 const int REPLY_TIMEOUT_MSEC = 10000;
@@ -35,21 +40,61 @@ const int HANDSHAKE_TIMEOUT_MSEC = 20000;
 const int BLOCKS_TO_REQUEST = 5;
 const int MAX_MESSAGE_LENGTH = 65536;
 const int RECONNECT_INTERVAL_MSEC = 30000;
-const int SEND_MESSAGES_INTERVAL = 1000;
-
-Peer::Peer(ConnectionInitiator connectionInitiator, QTcpSocket *socket)
+const int KEEP_ALIVE_INTERVAL_MSEC = 90000;
+const int ALLOWED_FAST_SET_SIZE = 10;
+const int METADATA_REQUESTS_PER_PEER = 2;
+// Time constant of the download rate average
+const double DOWNLOAD_RATE_TIME_CONSTANT_MSEC = 5000.0;
+
+/* Reserved handshake bits */
+const int FAST_EXTENSION_BYTE = 7;
+const char FAST_EXTENSION_BIT = 0x04;
+const int EXTENSION_PROTOCOL_BYTE = 5;
+const char EXTENSION_PROTOCOL_BIT = 0x10;
+const int V2_BYTE = 7;
+const char V2_BIT = 0x10;
+// A hash request, hashes or hash reject message without the hashes:
+// id, pieces root, base layer, index, length and proof layers
+const int HASH_MESSAGE_HEADER_LENGTH = 1 + 32 + 4 * 4;
+
+/* Extended message ids. These are the ids we advertise in
+ * the extended handshake, so the peer uses them to talk to us */
+const int EXTENDED_HANDSHAKE_ID = 0;
+const int UT_METADATA_ID = 1;
+
+/* ut_metadata message types */
+const int METADATA_REQUEST = 0;
+const int METADATA_DATA = 1;
+const int METADATA_REJECT = 2;
+
+Peer::Peer(ConnectionInitiator connectionInitiator, PeerSocket *socket)
 	: m_torrent(nullptr)
 	, m_bitfield(nullptr)
 	, m_state(Created)
 	, m_connectionInitiator(connectionInitiator)
 	, m_socket(socket)
+	, m_isStarved(false)
+	, m_connectionNumber(0)
+	, m_downloadRate(0)
+	, m_downloadRateUpdated(0)
+	, m_supportsFastExtension(false)
+	, m_supportsV2(false)
+	, m_supportsExtensionProtocol(false)
+	, m_utMetadataId(0)
+	, m_metadataSize(0)
+	, m_pendingHaveAll(false)
 	, m_isPaused(false)
 {
+	m_rateClock.start();
 	connectAll();
 }
 
 Peer::~Peer()
 {
+	if (m_torrent && m_bitfield) {
+		// Our pieces no longer count towards the torrent's availability
+		setAllPieces(false);
+	}
 	delete[] m_bitfield;
 	delete m_socket;
 }
@@ -67,10 +112,7 @@ void Peer::startConnection()
 		m_socket->close();
 	}
 
-	m_piecesDownloaded = 0;
-	for (int i = 0; i < m_torrent->torrentInfo()->bitfieldSize() * 8; i++) {
-		m_bitfield[i] = false;
-	}
+	setAllPieces(false);
 	m_protocol.clear();
 	m_reserved.clear();
 	m_infoHash.clear();
@@ -86,12 +128,23 @@ void Peer::startConnection()
 	m_replyTimeoutTimer.stop();
 	m_handshakeTimeoutTimer.stop();
 	m_reconnectTimer.stop();
+	m_keepAliveTimer.stop();
 
-	m_sendMessagesTimer.stop();
+	m_isStarved = false;
 
 	m_hasTimedOut = false;
 	m_blocksQueue.clear();
 
+	m_supportsFastExtension = false;
+	m_supportsV2 = false;
+	m_allowedFastSet.clear();
+	m_allowedFastSent.clear();
+
+	m_supportsExtensionProtocol = false;
+	m_utMetadataId = 0;
+	m_metadataSize = 0;
+	clearPendingPieces();
+
 	qDebug() << "Connecting to" << addressPort();
 	m_socket->connectToHost(m_address, m_port);
 }
@@ -122,10 +175,21 @@ void Peer::sendHandshake()
 	QByteArray dataToWrite;
 	dataToWrite.push_back(char(19));
 	dataToWrite.push_back("BitTorrent protocol");
-	for (int i = 0; i < 8; i++) {
-		dataToWrite.push_back(char(0));
+	QByteArray reserved(8, char(0));
+	reserved[FAST_EXTENSION_BYTE] = FAST_EXTENSION_BIT;
+	reserved[EXTENSION_PROTOCOL_BYTE] = EXTENSION_PROTOCOL_BIT;
+	// Also for v2 magnet links, whose metadata comes from v2 peers
+	if (!m_torrent->torrentInfo()->infoHashV2().isEmpty()) {
+		reserved[V2_BYTE] = reserved[V2_BYTE] | V2_BIT;
+	}
+	dataToWrite.push_back(reserved);
+	// Peers connecting to a v2 torrent may use either info hash,
+	// and expect the same one back
+	if (m_connectionInitiator == ConnectionInitiator::Peer && !m_infoHash.isEmpty()) {
+		dataToWrite.push_back(m_infoHash);
+	} else {
+		dataToWrite.push_back(m_torrent->torrentInfo()->infoHash());
 	}
-	dataToWrite.push_back(m_torrent->torrentInfo()->infoHash());
 	dataToWrite.push_back(QTorrent::instance()->peerId());
 	m_socket->write(dataToWrite);
 }
@@ -182,6 +246,53 @@ void Peer::sendBitfield()
 	TorrentMessage::bitfield(m_socket, m_torrent->bitfield());
 }
 
+void Peer::sendPieceAvailability()
+{
+	if (m_state != ConnectionEstablished) {
+		return;
+	}
+	if (!m_torrent->hasMetadata()) {
+		// We have nothing yet. The bitfield message is optional in that case
+		if (m_supportsFastExtension) {
+			TorrentMessage::haveNone(m_socket);
+		}
+		return;
+	}
+	if (m_supportsFastExtension) {
+		int downloadedPieces = m_torrent->downloadedPieces();
+		if (downloadedPieces == m_torrent->torrentInfo()->numberOfPieces()) {
+			TorrentMessage::haveAll(m_socket);
+			return;
+		} else if (downloadedPieces == 0) {
+			TorrentMessage::haveNone(m_socket);
+			return;
+		}
+	}
+	sendBitfield();
+}
+
+void Peer::sendAllowedFastSet()
+{
+	if (m_state != ConnectionEstablished || !m_supportsFastExtension || !m_torrent->hasMetadata()) {
+		return;
+	}
+	// Only pieces that we actually have are worth announcing
+	for (int index : generateAllowedFastSet(ALLOWED_FAST_SET_SIZE)) {
+		if (m_torrent->hasPiece(index)) {
+			sendAllowedFast(index);
+		}
+	}
+}
+
+void Peer::sendKeepAlive()
+{
+	if (m_state != ConnectionEstablished) {
+		return;
+	}
+	TorrentMessage::keepAlive(m_socket);
+	m_keepAliveTimer.start();
+}
+
 void Peer::sendRequest(Block* block)
 {
 	if (m_state != ConnectionEstablished) {
@@ -216,6 +327,23 @@ void Peer::sendPiece(int index, int begin, const QByteArray &blockData)
 	emit uploadedData(blockData.size());
 }
 
+bool Peer::sendPieceFromFiles(int index, int begin, int length)
+{
+	if (m_state != ConnectionEstablished) {
+		return false;
+	}
+	QVector<FileRegion> regions;
+	if (!m_torrent->fileRegions(index, begin, length, regions)) {
+		return false;
+	}
+	if (!m_socket->sendFile(TorrentMessage::pieceHeader(index, begin, length), regions)) {
+		return false;
+	}
+	m_torrent->onBlockUploaded(length);
+	emit uploadedData(length);
+	return true;
+}
+
 void Peer::sendCancel(Block* block)
 {
 	if (m_state != ConnectionEstablished) {
@@ -227,6 +355,107 @@ void Peer::sendCancel(Block* block)
 	TorrentMessage::cancel(m_socket, index, begin, length);
 }
 
+void Peer::sendRejectRequest(int index, int begin, int length)
+{
+	if (m_state != ConnectionEstablished || !m_supportsFastExtension) {
+		return;
+	}
+	qDebug() << "Rejecting request" << index << begin << length << "from" << addressPort();
+	TorrentMessage::rejectRequest(m_socket, index, begin, length);
+}
+
+void Peer::sendHashRequest(const QByteArray &piecesRoot, int baseLayer, int index, int length, int proofLayers)
+{
+	if (m_state != ConnectionEstablished || !supportsV2()) {
+		return;
+	}
+	qDebug() << "Requesting hashes" << index << length << "from" << addressPort();
+	TorrentMessage::hashRequest(m_socket, piecesRoot, baseLayer, index, length, proofLayers);
+}
+
+void Peer::sendHashes(const QByteArray &piecesRoot, int baseLayer, int index, int length, int proofLayers,
+					  const QByteArray &hashes)
+{
+	if (m_state != ConnectionEstablished || !supportsV2()) {
+		return;
+	}
+	qDebug() << "Sending hashes" << index << length << "to" << addressPort();
+	TorrentMessage::hashes(m_socket, piecesRoot, baseLayer, index, length, proofLayers, hashes);
+}
+
+void Peer::sendHashReject(const QByteArray &piecesRoot, int baseLayer, int index, int length, int proofLayers)
+{
+	if (m_state != ConnectionEstablished || !supportsV2()) {
+		return;
+	}
+	qDebug() << "Rejecting hash request" << index << length << "from" << addressPort();
+	TorrentMessage::hashReject(m_socket, piecesRoot, baseLayer, index, length, proofLayers);
+}
+
+void Peer::sendAllowedFast(int index)
+{
+	if (m_state != ConnectionEstablished || !m_supportsFastExtension) {
+		return;
+	}
+	m_allowedFastSent.insert(index);
+	TorrentMessage::allowedFast(m_socket, index);
+}
+
+void Peer::sendExtendedHandshake()
+{
+	if (m_state != ConnectionEstablished || !m_supportsExtensionProtocol) {
+		return;
+	}
+	BencodeDictionary handshake;
+	BencodeDictionary *messages = new BencodeDictionary;
+	messages->add("ut_metadata", new BencodeInteger(UT_METADATA_ID));
+	handshake.add("m", messages);
+	if (m_torrent->hasMetadata()) {
+		handshake.add("metadata_size", new BencodeInteger(m_torrent->torrentInfo()->infoDictionary().size()));
+	}
+	handshake.add("v", new BencodeString("qTorrent " VERSION));
+	TorrentMessage::extended(m_socket, EXTENDED_HANDSHAKE_ID, handshake.bencode());
+}
+
+void Peer::sendMetadataRequest(int piece)
+{
+	if (m_state != ConnectionEstablished || m_utMetadataId == 0) {
+		return;
+	}
+	qDebug() << "Requesting metadata piece" << piece << "from" << addressPort();
+	BencodeDictionary message;
+	message.add("msg_type", new BencodeInteger(METADATA_REQUEST));
+	message.add("piece", new BencodeInteger(piece));
+	TorrentMessage::extended(m_socket, m_utMetadataId, message.bencode());
+}
+
+void Peer::sendMetadataPiece(int piece)
+{
+	if (m_state != ConnectionEstablished || m_utMetadataId == 0) {
+		return;
+	}
+	const QByteArray &metadata = m_torrent->torrentInfo()->infoDictionary();
+	BencodeDictionary message;
+	message.add("msg_type", new BencodeInteger(METADATA_DATA));
+	message.add("piece", new BencodeInteger(piece));
+	message.add("total_size", new BencodeInteger(metadata.size()));
+	// The raw metadata piece follows the dictionary
+	QByteArray payload = message.bencode();
+	payload.push_back(metadata.mid(piece * MetadataDownloader::PIECE_SIZE, MetadataDownloader::PIECE_SIZE));
+	TorrentMessage::extended(m_socket, m_utMetadataId, payload);
+}
+
+void Peer::sendMetadataReject(int piece)
+{
+	if (m_state != ConnectionEstablished || m_utMetadataId == 0) {
+		return;
+	}
+	BencodeDictionary message;
+	message.add("msg_type", new BencodeInteger(METADATA_REJECT));
+	message.add("piece", new BencodeInteger(piece));
+	TorrentMessage::extended(m_socket, m_utMetadataId, message.bencode());
+}
+
 bool Peer::requestBlock()
 {
 	Block *block = m_torrent->requestBlock(this, BLOCK_REQUEST_SIZE);
@@ -255,7 +484,7 @@ void Peer::fatalError()
 	m_socket->close();
 }
 
-Peer *Peer::createClient(QTcpSocket *socket)
+Peer *Peer::createClient(PeerSocket *socket)
 {
 	Peer *peer = new Peer(ConnectionInitiator::Peer, socket);
 	peer->initClient();
@@ -264,14 +493,14 @@ Peer *Peer::createClient(QTcpSocket *socket)
 
 Peer *Peer::createServer(Torrent *torrent, QHostAddress address, int port)
 {
-	Peer *peer = new Peer(ConnectionInitiator::Client, new QTcpSocket);
+	Peer *peer = new Peer(ConnectionInitiator::Client, new PeerSocket);
 	peer->initServer(torrent, address, port);
 	return peer;
 }
 
 void Peer::sendMessages()
 {
-	m_sendMessagesTimer.stop();
+	m_isStarved = false;
 
 	// Can't do anything if not connected
 	if (m_state != ConnectionEstablished) {
@@ -284,7 +513,15 @@ void Peer::sendMessages()
 		return;
 	}
 
-	m_sendMessagesTimer.start(SEND_MESSAGES_INTERVAL);
+	if (!m_torrent->hasMetadata()) {
+		// There is nothing else to do until we have the metadata
+		if (!m_isPaused) {
+			requestMetadata();
+			// Pieces that other peers don't send come back through wakePeers()
+			m_isStarved = true;
+		}
+		return;
+	}
 
 	if (m_isPaused) {
 		/* Paused */
@@ -318,13 +555,21 @@ void Peer::sendMessages()
 			sendUnchoke();
 		}
 
-		// Request as many blocks as we can if we are interested and not choked
-		if (!m_peerChoking && m_amInterested) {
+		// Request as many blocks as we can if we are interested and not choked.
+		// While choked, we can still request pieces from the allowed fast set
+		if (m_amInterested && (!m_peerChoking || !m_allowedFastSet.isEmpty())) {
 			while (m_blocksQueue.size() < BLOCKS_TO_REQUEST) {
 				if (!requestBlock()) {
 					break;
 				}
 			}
+
+			// Nothing left to request right now. Blocks may become free when other
+			// peers time out or disconnect, the torrent lets us know then.
+			// Everything else is triggered by incoming messages
+			if (m_blocksQueue.size() < BLOCKS_TO_REQUEST) {
+				m_isStarved = true;
+			}
 		}
 
 	}
@@ -350,6 +595,9 @@ bool Peer::readHandshakeReply(bool *ok)
 	for (int j = 0; j < 8; j++) {
 		m_reserved.push_back(m_receivedDataBuffer[i++]);
 	}
+	m_supportsFastExtension = (m_reserved[FAST_EXTENSION_BYTE] & FAST_EXTENSION_BIT) != 0;
+	m_supportsExtensionProtocol = (m_reserved[EXTENSION_PROTOCOL_BYTE] & EXTENSION_PROTOCOL_BIT) != 0;
+	m_supportsV2 = (m_reserved[V2_BYTE] & V2_BIT) != 0;
 	for (int j = 0; j < 20; j++) {
 		m_infoHash.push_back(m_receivedDataBuffer[i++]);
 	}
@@ -360,7 +608,7 @@ bool Peer::readHandshakeReply(bool *ok)
 
 	if (m_connectionInitiator == ConnectionInitiator::Client) {
 		// Check if info hash matches expected one
-		if (m_infoHash != m_torrent->torrentInfo()->infoHash()) {
+		if (!m_torrent->torrentInfo()->matchesInfoHash(m_infoHash)) {
 			// Info hash does not match the expected one
 			qDebug() << "Info hash does not match expected one from peer" << addressPort();
 			*ok = false;
@@ -370,7 +618,7 @@ bool Peer::readHandshakeReply(bool *ok)
 		// Find torrent with correct info hash
 		m_torrent = nullptr;
 		for (auto torrent : QTorrent::instance()->torrents()) {
-			if (torrent->torrentInfo()->infoHash() == m_infoHash) {
+			if (torrent->torrentInfo()->matchesInfoHash(m_infoHash)) {
 				m_torrent = torrent;
 				break;
 			}
@@ -426,9 +674,13 @@ bool Peer::readPeerMessage(bool *ok)
 	case TorrentMessage::Choke: {
 		qDebug() << addressPort() << ": choke";
 		m_peerChoking = true;
-		releaseAllBlocks();
-		m_replyTimeoutTimer.stop();
-		m_hasTimedOut = false;
+		// With the fast extension, choke doesn't reject the pending requests.
+		// The peer will either send them or reject them explicitly
+		if (!m_supportsFastExtension) {
+			releaseAllBlocks();
+			m_replyTimeoutTimer.stop();
+			m_hasTimedOut = false;
+		}
 		break;
 	}
 	case TorrentMessage::Unchoke: {
@@ -452,38 +704,35 @@ bool Peer::readPeerMessage(bool *ok)
 			pieceNumber *= 256;
 			pieceNumber += (unsigned char)m_receivedDataBuffer[i++];
 		}
-		if (!m_bitfield[pieceNumber]) {
-			m_bitfield[pieceNumber] = true;
-			m_piecesDownloaded++;
+		if (!m_torrent->hasMetadata()) {
+			// Validated when the metadata arrives
+			m_pendingHaves.push_back(pieceNumber);
+			break;
+		}
+		if (pieceNumber < 0 || pieceNumber >= m_torrent->torrentInfo()->numberOfPieces()) {
+			qDebug() << "Error: Peer" << addressPort() << "sent have for invalid piece" << pieceNumber;
+			*ok = false;
+			return false;
 		}
+		setHasPiece(pieceNumber, true);
 		break;
 	}
 	case TorrentMessage::Bitfield: {
 		int bitfieldSize = length - 1;
+		QByteArray bitfield = m_receivedDataBuffer.mid(i, bitfieldSize);
+		if (!m_torrent->hasMetadata()) {
+			// Validated when the metadata arrives
+			clearPendingPieces();
+			m_pendingBitfield = bitfield;
+			break;
+		}
 		if (bitfieldSize != m_torrent->torrentInfo()->bitfieldSize()) {
 			qDebug() << "Error: Peer" << addressPort() << "sent bitfield of wrong size:" << bitfieldSize*8
 					 << "expected" << m_torrent->torrentInfo()->bitfieldSize();
 			*ok = false;
 			return false;
-		} else {
-			// Set the bitfield
-			for (int j = 0; j < bitfieldSize; j++) {
-				unsigned char byte = m_receivedDataBuffer[i++];
-				unsigned char pos = 0b10000000;
-				for (int q = 0; q < 8; q++) {
-					m_bitfield[j * 8 + q] = ((byte & pos) != 0);
-					pos = pos >> 1;
-				}
-			}
-
-			// Recount the pieces
-			m_piecesDownloaded = 0;
-			for (int j = 0; j < bitfieldSize * 8; j++) {
-				if (m_bitfield[j]) {
-					m_piecesDownloaded++;
-				}
-			}
 		}
+		loadBitfield(bitfield);
 		break;
 	}
 	case TorrentMessage::Request: {
@@ -504,10 +753,8 @@ bool Peer::readPeerMessage(bool *ok)
 			blockLength += (unsigned char)m_receivedDataBuffer[i++];
 		}
 
-		QList<Piece *> &pieces = m_torrent->pieces();
-
 		// Check for invalid ranges
-		if (index >= (unsigned)pieces.size() || blockLength > MAX_MESSAGE_LENGTH) {
+		if (index >= (unsigned)m_torrent->torrentInfo()->numberOfPieces() || blockLength > MAX_MESSAGE_LENGTH) {
 			qDebug() << "Invalid request (" << index << begin << blockLength << ")"
 					 << "from" << addressPort();
 			disconnect();
@@ -515,10 +762,10 @@ bool Peer::readPeerMessage(bool *ok)
 			return false;
 		}
 
-		Piece *piece = pieces[index];
+		unsigned int pieceSize = m_torrent->pieceSize(index);
 
 		// Check for invalid begin + blockLength combination
-		if (begin + blockLength > (unsigned)piece->size() || begin > (unsigned)piece->size()) {
+		if (begin + blockLength > pieceSize || begin > pieceSize) {
 			qDebug() << "Invalid request (" << index << begin << blockLength << ")"
 					 << "from" << addressPort();
 			disconnect();
@@ -526,18 +773,38 @@ bool Peer::readPeerMessage(bool *ok)
 			return false;
 		}
 
-		// Get the data
-		QByteArray blockData;
-		if (!piece->getBlockData(begin, blockLength, blockData)) {
-			qDebug() << "Failed to get block (" << index << begin << blockLength << ")"
-					 << "for" << addressPort();
-			disconnect();
-			*ok = false;
-			return false;
+		// Are we allowed to serve this request?
+		if (!acceptRequest(index, begin, blockLength)) {
+			break;
 		}
 
-		sendPiece(index, begin, blockData);
+		// Blocks of cached pieces are sent from memory. Otherwise the block
+		// is sent without copying it, if possible
+		QByteArray blockData;
+		if (m_torrent->readBlockFromMemory(index, begin, blockLength, blockData)) {
+			sendPiece(index, begin, blockData);
+			break;
+		}
+		if (sendPieceFromFiles(index, begin, blockLength)) {
+			break;
+		}
 
+		// Read the data on the disk's I/O thread, filling the read cache.
+		// The peer may be gone or reconnected by the time it's read
+		QPointer<Peer> peer(this);
+		int connection = m_connectionNumber;
+		m_torrent->readCachedBlock(index, begin, blockLength, [peer, connection, index, begin, blockLength](bool ok, const QByteArray &blockData) {
+			if (!peer || peer->m_connectionNumber != connection) {
+				return;
+			}
+			if (!ok || blockData.size() != blockLength) {
+				qDebug() << "Failed to get block (" << index << begin << blockLength << ")"
+						 << "for" << peer->addressPort();
+				peer->disconnect();
+				return;
+			}
+			peer->sendPiece(index, begin, blockData);
+		});
 		break;
 	}
 	case TorrentMessage::Piece: {
@@ -566,9 +833,9 @@ bool Peer::readPeerMessage(bool *ok)
 
 		// If we weren't waiting for this block, check if it exists
 		if (block == nullptr) {
-			QList<Piece *> pieces = m_torrent->pieces();
-			if (index >= 0 && index < pieces.size()) {
-				block = pieces[index]->getBlock(begin, blockLength);
+			Piece *piece = m_torrent->activePiece(index);
+			if (piece != nullptr) {
+				block = piece->getBlock(begin, blockLength);
 			}
 		}
 
@@ -581,6 +848,7 @@ bool Peer::readPeerMessage(bool *ok)
 			if (!block->isDownloaded()) {
 				block->setData(this, blockData);
 				releaseBlock(block);
+				updateDownloadRate(blockLength);
 				emit downloadedData(blockLength);
 			}
 			if (m_blocksQueue.isEmpty()) {
@@ -599,6 +867,158 @@ bool Peer::readPeerMessage(bool *ok)
 		// TODO
 		break;
 	}
+	case TorrentMessage::SuggestPiece: {
+		if (!m_supportsFastExtension || length != 5) {
+			qDebug() << "Error: Unexpected suggest piece message from" << addressPort();
+			*ok = false;
+			return false;
+		}
+		// Suggestions are ignored. Our piece picker decides what to request
+		break;
+	}
+	case TorrentMessage::HaveAll:
+	case TorrentMessage::HaveNone: {
+		if (!m_supportsFastExtension || length != 1) {
+			qDebug() << "Error: Unexpected have all/have none message from" << addressPort();
+			*ok = false;
+			return false;
+		}
+		bool haveAll = (messageId == TorrentMessage::HaveAll);
+		qDebug() << addressPort() << (haveAll ? ": have all" : ": have none");
+		if (!m_torrent->hasMetadata()) {
+			clearPendingPieces();
+			m_pendingHaveAll = haveAll;
+			break;
+		}
+		setAllPieces(haveAll);
+		break;
+	}
+	case TorrentMessage::RejectRequest: {
+		if (!m_supportsFastExtension || length != 13) {
+			qDebug() << "Error: Unexpected reject request message from" << addressPort();
+			*ok = false;
+			return false;
+		}
+		int index = 0;
+		int begin = 0;
+		int blockLength = 0;
+		for (int j = 0; j < 4; j++) {
+			index *= 256;
+			index += (unsigned char)m_receivedDataBuffer[i++];
+		}
+		for (int j = 0; j < 4; j++) {
+			begin *= 256;
+			begin += (unsigned char)m_receivedDataBuffer[i++];
+		}
+		for (int j = 0; j < 4; j++) {
+			blockLength *= 256;
+			blockLength += (unsigned char)m_receivedDataBuffer[i++];
+		}
+		qDebug() << addressPort() << ": reject request" << index << begin << blockLength;
+
+		// A choking peer that rejects a piece doesn't allow it anymore.
+		// Otherwise requestBlock() would hand the block straight back to it
+		if (m_peerChoking) {
+			m_allowedFastSet.remove(index);
+		}
+
+		// Drop the block from our queue, so that it can be requested from someone else
+		for (Block *block : m_blocksQueue) {
+			if (block->piece()->pieceNumber() == index
+				&& block->begin() == begin
+				&& block->size() == blockLength) {
+				releaseBlock(block);
+				// The block is free again, let the peers refill their queues
+				m_torrent->wakePeers();
+				break;
+			}
+		}
+		if (m_blocksQueue.isEmpty()) {
+			m_replyTimeoutTimer.stop();
+			m_hasTimedOut = false;
+		}
+		break;
+	}
+	case TorrentMessage::AllowedFast: {
+		if (!m_supportsFastExtension || length != 5) {
+			qDebug() << "Error: Unexpected allowed fast message from" << addressPort();
+			*ok = false;
+			return false;
+		}
+		int index = 0;
+		for (int j = 0; j < 4; j++) {
+			index *= 256;
+			index += (unsigned char)m_receivedDataBuffer[i++];
+		}
+		// Silently ignore invalid indexes
+		if (index >= 0 && index < m_torrent->torrentInfo()->numberOfPieces()) {
+			m_allowedFastSet.insert(index);
+		}
+		break;
+	}
+	case TorrentMessage::HashRequest:
+	case TorrentMessage::Hashes:
+	case TorrentMessage::HashReject: {
+		bool validLength = (messageId == TorrentMessage::Hashes)
+				? (length >= HASH_MESSAGE_HEADER_LENGTH && (length - HASH_MESSAGE_HEADER_LENGTH) % 32 == 0)
+				: length == HASH_MESSAGE_HEADER_LENGTH;
+		if (!supportsV2() || !validLength) {
+			qDebug() << "Error: Unexpected hash message from" << addressPort();
+			*ok = false;
+			return false;
+		}
+		QByteArray piecesRoot = m_receivedDataBuffer.mid(i, 32);
+		i += 32;
+		int fields[4] = {0, 0, 0, 0};
+		for (int k = 0; k < 4; k++) {
+			for (int j = 0; j < 4; j++) {
+				fields[k] *= 256;
+				fields[k] += (unsigned char)m_receivedDataBuffer[i++];
+			}
+		}
+		int baseLayer = fields[0];
+		int index = fields[1];
+		int hashesLength = fields[2];
+		int proofLayers = fields[3];
+		if (messageId == TorrentMessage::HashRequest) {
+			// Answered from the piece layers, and from the data of the piece
+			// below them. The peer may be gone or reconnected by then
+			qDebug() << addressPort() << ": hash request" << index << hashesLength;
+			QPointer<Peer> peer(this);
+			int connection = m_connectionNumber;
+			m_torrent->serveHashRequest(piecesRoot, baseLayer, index, hashesLength, proofLayers,
+										[peer, connection, piecesRoot, baseLayer, index, hashesLength, proofLayers](bool ok, const QByteArray &hashes) {
+				if (!peer || peer->m_connectionNumber != connection) {
+					return;
+				}
+				if (ok) {
+					peer->sendHashes(piecesRoot, baseLayer, index, hashesLength, proofLayers, hashes);
+				} else {
+					peer->sendHashReject(piecesRoot, baseLayer, index, hashesLength, proofLayers);
+				}
+			});
+		} else if (messageId == TorrentMessage::Hashes) {
+			qDebug() << addressPort() << ": hashes" << index << hashesLength;
+			QByteArray hashes = m_receivedDataBuffer.mid(i, length - HASH_MESSAGE_HEADER_LENGTH);
+			m_torrent->onHashesReceived(piecesRoot, baseLayer, index, hashesLength, proofLayers, hashes);
+		} else {
+			qDebug() << addressPort() << ": hash reject" << index << hashesLength;
+			m_torrent->onHashesRejected(piecesRoot, baseLayer, index, hashesLength);
+		}
+		break;
+	}
+	case TorrentMessage::Extended: {
+		if (!m_supportsExtensionProtocol || length < 2) {
+			qDebug() << "Error: Unexpected extended message from" << addressPort();
+			*ok = false;
+			return false;
+		}
+		if (!readExtendedMessage(m_receivedDataBuffer.mid(i, length - 1))) {
+			*ok = false;
+			return false;
+		}
+		break;
+	}
 	default:
 		qDebug() << "Error: Received unknown message with id =" << messageId
 				 << " and length =" << length << "from" << addressPort();
@@ -618,15 +1038,16 @@ void Peer::connectAll()
 	connect(m_socket, SIGNAL(error(QAbstractSocket::SocketError)), this, SLOT(error(QAbstractSocket::SocketError)));
 
 	// Timeout callbacks
-	connect(&m_replyTimeoutTimer, SIGNAL(timeout()), this, SLOT(replyTimeout()));
-	connect(&m_handshakeTimeoutTimer, SIGNAL(timeout()), this, SLOT(handshakeTimeout()));
-	connect(&m_reconnectTimer, SIGNAL(timeout()), this, SLOT(reconnect()));
-	connect(&m_sendMessagesTimer, SIGNAL(timeout()), this, SLOT(sendMessages()));
+	m_replyTimeoutTimer.setCallback([this]() { replyTimeout(); });
+	m_handshakeTimeoutTimer.setCallback([this]() { handshakeTimeout(); });
+	m_reconnectTimer.setCallback([this]() { reconnect(); });
+	m_keepAliveTimer.setCallback([this]() { sendKeepAlive(); });
 
 	// Timeout intervals
 	m_replyTimeoutTimer.setInterval(REPLY_TIMEOUT_MSEC);
 	m_handshakeTimeoutTimer.setInterval(HANDSHAKE_TIMEOUT_MSEC);
 	m_reconnectTimer.setInterval(RECONNECT_INTERVAL_MSEC);
+	m_keepAliveTimer.setInterval(KEEP_ALIVE_INTERVAL_MSEC);
 }
 
 void Peer::initBitfield()
@@ -661,11 +1082,22 @@ void Peer::initClient()
 	m_replyTimeoutTimer.stop();
 	m_handshakeTimeoutTimer.stop();
 	m_reconnectTimer.stop();
+	m_keepAliveTimer.stop();
 
-	m_sendMessagesTimer.stop();
+	m_isStarved = false;
 
 	m_hasTimedOut = false;
 	m_blocksQueue.clear();
+
+	m_supportsFastExtension = false;
+	m_supportsV2 = false;
+	m_allowedFastSet.clear();
+	m_allowedFastSent.clear();
+
+	m_supportsExtensionProtocol = false;
+	m_utMetadataId = 0;
+	m_metadataSize = 0;
+	clearPendingPieces();
 }
 
 void Peer::initServer(Torrent *torrent, QHostAddress address, int port)
@@ -678,6 +1110,256 @@ void Peer::initServer(Torrent *torrent, QHostAddress address, int port)
 	m_state = Created;
 }
 
+void Peer::loadBitfield(const QByteArray &bitfield)
+{
+	// Set the bitfield. Spare bits past the last piece are ignored
+	int numberOfPieces = m_torrent->torrentInfo()->numberOfPieces();
+	for (int j = 0; j < bitfield.size(); j++) {
+		unsigned char byte = bitfield[j];
+		unsigned char pos = 0b10000000;
+		for (int q = 0; q < 8 && j * 8 + q < numberOfPieces; q++) {
+			setHasPiece(j * 8 + q, (byte & pos) != 0);
+			pos = pos >> 1;
+		}
+	}
+}
+
+void Peer::setHasPiece(int index, bool hasPiece)
+{
+	if (m_bitfield[index] == hasPiece) {
+		return;
+	}
+	m_bitfield[index] = hasPiece;
+	m_piecesDownloaded += hasPiece ? 1 : -1;
+	m_torrent->changePieceAvailability(index, hasPiece ? 1 : -1);
+}
+
+void Peer::clearPendingPieces()
+{
+	m_pendingBitfield.clear();
+	m_pendingHaves.clear();
+	m_pendingHaveAll = false;
+}
+
+void Peer::onMetadataLoaded()
+{
+	// The number of pieces is now known
+	delete[] m_bitfield;
+	initBitfield();
+	m_piecesDownloaded = 0;
+
+	if (m_pendingHaveAll) {
+		setAllPieces(true);
+	} else if (!m_pendingBitfield.isEmpty()) {
+		if (m_pendingBitfield.size() != m_torrent->torrentInfo()->bitfieldSize()) {
+			qDebug() << "Error: Peer" << addressPort() << "sent bitfield of wrong size before the metadata";
+			clearPendingPieces();
+			disconnect();
+			return;
+		}
+		loadBitfield(m_pendingBitfield);
+	}
+
+	int numberOfPieces = m_torrent->torrentInfo()->numberOfPieces();
+	for (int index : m_pendingHaves) {
+		if (index < 0 || index >= numberOfPieces) {
+			qDebug() << "Error: Peer" << addressPort() << "sent have for invalid piece" << index;
+			clearPendingPieces();
+			disconnect();
+			return;
+		}
+		setHasPiece(index, true);
+	}
+	clearPendingPieces();
+}
+
+void Peer::onRequestsAvailable()
+{
+	if (m_isStarved) {
+		sendMessages();
+	}
+}
+
+bool Peer::readExtendedMessage(const QByteArray &message)
+{
+	int extendedId = (unsigned char)message[0];
+	QByteArray payload = message.mid(1);
+	switch (extendedId) {
+	case EXTENDED_HANDSHAKE_ID:
+		return readExtendedHandshake(payload);
+	case UT_METADATA_ID:
+		return readMetadataMessage(payload);
+	default:
+		// We never advertised this id
+		qDebug() << "Error: Received unknown extended message with id =" << extendedId
+				 << "from" << addressPort();
+		return false;
+	}
+}
+
+bool Peer::readExtendedHandshake(const QByteArray &payload)
+{
+	BencodeValue *value = nullptr;
+	try {
+		int position = 0;
+		value = BencodeValue::createFromByteArray(payload, position);
+		BencodeDictionary *handshake = value->toBencodeDictionary();
+		if (handshake->keyExists("m")) {
+			BencodeDictionary *messages = handshake->value("m")->toBencodeDictionary();
+			// An id of 0 means that the extension was disabled
+			m_utMetadataId = 0;
+			if (messages->keyExists("ut_metadata")) {
+				m_utMetadataId = messages->value("ut_metadata")->toInt();
+			}
+		}
+		if (handshake->keyExists("metadata_size")) {
+			m_metadataSize = handshake->value("metadata_size")->toInt();
+		}
+	} catch (BencodeException &ex) {
+		qDebug() << "Error: Invalid extended handshake from" << addressPort() << ":" << ex.what();
+		delete value;
+		return false;
+	}
+	delete value;
+
+	if (m_utMetadataId < 0 || m_utMetadataId > 255) {
+		qDebug() << "Error: Invalid ut_metadata id from" << addressPort();
+		return false;
+	}
+	qDebug() << addressPort() << ": extended handshake, ut_metadata =" << m_utMetadataId
+			 << "metadata_size =" << m_metadataSize;
+	return true;
+}
+
+bool Peer::readMetadataMessage(const QByteArray &payload)
+{
+	int msgType;
+	int piece;
+	int position = 0;
+	BencodeValue *value = nullptr;
+	try {
+		value = BencodeValue::createFromByteArray(payload, position);
+		BencodeDictionary *message = value->toBencodeDictionary();
+		msgType = message->value("msg_type")->toInt();
+		piece = message->value("piece")->toInt();
+	} catch (BencodeException &ex) {
+		qDebug() << "Error: Invalid ut_metadata message from" << addressPort() << ":" << ex.what();
+		delete value;
+		return false;
+	}
+	delete value;
+
+	MetadataDownloader *downloader = m_torrent->metadataDownloader();
+	switch (msgType) {
+	case METADATA_REQUEST: {
+		int metadataSize = m_torrent->torrentInfo()->infoDictionary().size();
+		if (!m_torrent->hasMetadata() || piece < 0
+				|| piece * (qint64)MetadataDownloader::PIECE_SIZE >= metadataSize) {
+			sendMetadataReject(piece);
+		} else {
+			sendMetadataPiece(piece);
+		}
+		break;
+	}
+	case METADATA_DATA:
+		if (downloader) {
+			// The piece data follows the dictionary
+			downloader->pieceReceived(this, piece, payload.mid(position));
+		}
+		break;
+	case METADATA_REJECT:
+		qDebug() << addressPort() << ": rejected metadata piece" << piece;
+		if (downloader) {
+			downloader->pieceRejected(this, piece);
+		}
+		break;
+	default:
+		// Unknown message types must be ignored
+		break;
+	}
+	return true;
+}
+
+void Peer::requestMetadata()
+{
+	MetadataDownloader *downloader = m_torrent->metadataDownloader();
+	if (downloader == nullptr || m_utMetadataId == 0) {
+		return;
+	}
+	if (!downloader->hasMetadataSize()) {
+		if (m_metadataSize <= 0 || !downloader->setMetadataSize(m_metadataSize)) {
+			return;
+		}
+	} else if (m_metadataSize != downloader->metadataSize()) {
+		// Don't ask peers that disagree about the size
+		return;
+	}
+
+	while (downloader->requestsCount(this) < METADATA_REQUESTS_PER_PEER) {
+		int piece = downloader->requestPiece(this);
+		if (piece < 0) {
+			break;
+		}
+		sendMetadataRequest(piece);
+	}
+}
+
+void Peer::setAllPieces(bool value)
+{
+	int numberOfPieces = m_torrent->torrentInfo()->numberOfPieces();
+	for (int i = 0; i < numberOfPieces; i++) {
+		setHasPiece(i, value);
+	}
+}
+
+QSet<int> Peer::generateAllowedFastSet(int size) const
+{
+	QSet<int> allowedFastSet;
+	int numberOfPieces = m_torrent->torrentInfo()->numberOfPieces();
+	size = qMin(size, numberOfPieces);
+
+	// The algorithm is only defined for IPv4 addresses
+	bool isIPv4;
+	quint32 ip = m_address.toIPv4Address(&isIPv4);
+	if (!isIPv4 || size <= 0) {
+		return allowedFastSet;
+	}
+
+	// x = (ip & 0xFFFFFF00) + info_hash
+	ip &= 0xFFFFFF00;
+	QByteArray x;
+	for (int j = 3; j >= 0; j--) {
+		x.push_back(char((ip >> (8 * j)) & 0xFF));
+	}
+	x.push_back(m_torrent->torrentInfo()->infoHash());
+
+	while (allowedFastSet.size() < size) {
+		x = QCryptographicHash::hash(x, QCryptographicHash::Sha1);
+		for (int j = 0; j < 5 && allowedFastSet.size() < size; j++) {
+			quint32 y = 0;
+			for (int q = 0; q < 4; q++) {
+				y = (y << 8) | (unsigned char)x[j * 4 + q];
+			}
+			allowedFastSet.insert(y % numberOfPieces);
+		}
+	}
+	return allowedFastSet;
+}
+
+bool Peer::acceptRequest(int index, int begin, int length)
+{
+	bool havePiece = m_torrent->hasPiece(index);
+	bool allowed = !m_amChoking || m_allowedFastSent.contains(index);
+	if (havePiece && allowed) {
+		return true;
+	}
+	qDebug() << "Not serving request (" << index << begin << length << ")"
+			 << "from" << addressPort()
+			 << (havePiece ? ": peer is choked" : ": we don't have the piece");
+	sendRejectRequest(index, begin, length);
+	return false;
+}
+
 void Peer::releaseBlock(Block *block)
 {
 	block->removeAssignee(this);
@@ -719,7 +1401,7 @@ void Peer::readyRead()
 		bool ok;
 		if (readHandshakeReply(&ok)) {
 			if (m_connectionInitiator == ConnectionInitiator::Peer) {
-				if(m_torrent->state() != Torrent::Started) {
+				if(m_torrent->state() != Torrent::Started && !m_torrent->isFetchingMetadata()) {
 					disconnect();
 					break;
 				}
@@ -743,8 +1425,13 @@ void Peer::readyRead()
 		m_handshakeTimeoutTimer.stop();
 		qDebug() << "Handshaking completed with peer" << addressPort();
 		m_state = ConnectionEstablished;
-		m_sendMessagesTimer.start(SEND_MESSAGES_INTERVAL);
-		sendBitfield();
+		m_keepAliveTimer.start();
+		sendExtendedHandshake();
+		sendPieceAvailability();
+		sendAllowedFastSet();
+		if (supportsV2() && m_torrent->hasMetadata()) {
+			m_torrent->requestPieceLayers();
+		}
 	// Fall down
 	case ConnectionEstablished: {
 		// Read messages
@@ -774,8 +1461,13 @@ void Peer::finished()
 {
 	m_handshakeTimeoutTimer.stop();
 	m_replyTimeoutTimer.stop();
-	m_sendMessagesTimer.stop();
+	m_keepAliveTimer.stop();
+	m_isStarved = false;
+	m_connectionNumber++;
 	releaseAllBlocks();
+	if (m_torrent && m_torrent->metadataDownloader()) {
+		m_torrent->metadataDownloader()->releasePeer(this);
+	}
 	if (m_state != Error) {
 		m_state = Disconnected;
 	}
@@ -801,6 +1493,8 @@ void Peer::replyTimeout()
 	qDebug() << "Peer" << addressPort() << "took too long to reply";
 	m_hasTimedOut = true;
 	m_replyTimeoutTimer.stop();
+	// Other peers may now request our blocks
+	m_torrent->wakePeers();
 }
 
 void Peer::handshakeTimeout()
@@ -813,7 +1507,7 @@ void Peer::reconnect()
 {
 	qDebug() << "Reconnecting to" << addressPort();
 	m_reconnectTimer.stop();
-	if (m_torrent->isStarted()) {
+	if (m_torrent->isStarted() || m_torrent->isFetchingMetadata()) {
 		startConnection();
 	}
 }
@@ -895,7 +1589,7 @@ bool Peer::peerInterested()
 	return m_peerInterested;
 }
 
-QTcpSocket *Peer::socket()
+PeerSocket *Peer::socket()
 {
 	return m_socket;
 }
@@ -922,12 +1616,15 @@ QString Peer::addressPort()
 
 bool Peer::isDownloaded()
 {
+	if (!m_torrent->hasMetadata()) {
+		return false;
+	}
 	return m_piecesDownloaded == m_torrent->torrentInfo()->numberOfPieces();
 }
 
-bool Peer::hasPiece(Piece *piece)
+bool Peer::hasPiece(int index)
 {
-	return m_bitfield[piece->pieceNumber()];
+	return m_bitfield[index];
 }
 
 bool Peer::isConnected()
@@ -935,6 +1632,50 @@ bool Peer::isConnected()
 	return m_socket->state() == QAbstractSocket::ConnectedState;
 }
 
+bool Peer::supportsFastExtension() const
+{
+	return m_supportsFastExtension;
+}
+
+bool Peer::supportsV2() const
+{
+	return m_supportsV2 && m_torrent != nullptr && m_torrent->hasMetadata()
+			&& m_torrent->torrentInfo()->isV2();
+}
+
+bool Peer::supportsExtensionProtocol() const
+{
+	return m_supportsExtensionProtocol;
+}
+
+bool Peer::supportsMetadataExchange() const
+{
+	return m_supportsExtensionProtocol && m_utMetadataId != 0;
+}
+
+bool Peer::canRequestPiece(int index)
+{
+	if (!hasPiece(index)) {
+		return false;
+	}
+	return !m_peerChoking || m_allowedFastSet.contains(index);
+}
+
+qint64 Peer::downloadRate() const
+{
+	qint64 elapsed = m_rateClock.elapsed() - m_downloadRateUpdated;
+	return m_downloadRate * exp(-elapsed / DOWNLOAD_RATE_TIME_CONSTANT_MSEC) * 1000;
+}
+
+void Peer::updateDownloadRate(int bytes)
+{
+	// Decay the old average and add the new bytes, spread over the time constant
+	qint64 now = m_rateClock.elapsed();
+	m_downloadRate *= exp(-(now - m_downloadRateUpdated) / DOWNLOAD_RATE_TIME_CONSTANT_MSEC);
+	m_downloadRate += bytes / DOWNLOAD_RATE_TIME_CONSTANT_MSEC;
+	m_downloadRateUpdated = now;
+}
+
 bool Peer::isInteresting()
 {
 	// No peer is interesting when the torrent is downloaded
@@ -942,8 +1683,10 @@ bool Peer::isInteresting()
 		return false;
 	}
 	// Check if peer has pieces that we don't
-	for (Piece* piece : m_torrent->pieces()) {
-		if (!piece->isDownloaded() && hasPiece(piece)) {
+	int numberOfPieces = m_torrent->torrentInfo()->numberOfPieces();
+	for (int i = 0; i < numberOfPieces; i++) {
+		if (m_bitfield[i] && !m_torrent->hasPiece(i)
+				&& m_torrent->piecePriority(i) != Torrent::DontDownload) {
 			return true;
 		}
 	}
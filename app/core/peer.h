@@ -22,14 +22,16 @@
 
 #include <QByteArray>
 #include <QHostAddress>
-#include <QTimer>
 #include <QObject>
 #include <QAbstractSocket>
+#include <QSet>
+#include <QElapsedTimer>
+#include "timerwheel.h"
 
 class Torrent;
 class Piece;
 class Block;
-class QTcpSocket;
+class PeerSocket;
 
 /*
  * This class is used to connect to a peer and communicate with him.
@@ -78,16 +80,37 @@ public:
 	bool peerChoking();
 	bool peerInterested();
 
-	QTcpSocket *socket();
+	PeerSocket *socket();
 	bool hasTimedOut();
 	QList<Block *> &blocksQueue();
 	bool isPaused() const;
 
 	QString addressPort();
 	bool isDownloaded();
-	bool hasPiece(Piece *piece);
+	bool hasPiece(int index);
 	bool isConnected();
 	bool isInteresting();
+	// Bytes per second we receive from the peer, averaged over a few seconds
+	qint64 downloadRate() const;
+
+	/* Fast extension (BEP 6) */
+	bool supportsFastExtension() const;
+	// True if we may request blocks of this piece from the peer right now:
+	// it has the piece and either isn't choking us or allowed it as 'fast'
+	bool canRequestPiece(int index);
+
+	/* Extension protocol (BEP 10) */
+	bool supportsExtensionProtocol() const;
+	// True if the peer can send us the torrent metadata (BEP 9)
+	bool supportsMetadataExchange() const;
+
+	/* BitTorrent v2 (BEP 52), for v2 and hybrid torrents */
+	bool supportsV2() const;
+
+	/* Called by the torrent when its metadata becomes available */
+	void onMetadataLoaded();
+	/* Called by the torrent when blocks or metadata pieces became free */
+	void onRequestsAvailable();
 
 private:
 	Torrent *m_torrent;
@@ -111,15 +134,23 @@ private:
 	bool m_peerInterested;
 
 	/* Networking */
-	QTcpSocket *m_socket;
+	PeerSocket *m_socket;
 	QByteArray m_receivedDataBuffer;
-	QTimer m_replyTimeoutTimer;
-	QTimer m_handshakeTimeoutTimer;
-	QTimer m_reconnectTimer;
-
-	/* Used to make sure that sendMessages() will ce called at
-	 * least every SEND_MESSAGES_INTERVAL milliseconds */
-	QTimer m_sendMessagesTimer;
+	/* All timeouts are driven by the thread's TimerWheel */
+	WheelTimer m_replyTimeoutTimer;
+	WheelTimer m_handshakeTimeoutTimer;
+	WheelTimer m_reconnectTimer;
+	WheelTimer m_keepAliveTimer;
+
+	/* sendMessages() is called whenever something changes (a message was
+	 * received, the torrent was paused, blocks became free...). This is set
+	 * while our request pipeline can't be filled, so that the torrent's
+	 * wakePeers() only reaches the peers that have something to gain */
+	bool m_isStarved;
+
+	/* Counts the closed connections, so that the blocks read for
+	 * an earlier connection aren't sent to the next one */
+	int m_connectionNumber;
 
 	/* This flag will be set when the peer hasn't
 	 * responded to a request in a certain amount of time */
@@ -128,6 +159,40 @@ private:
 	/* The blocks that we have requested */
 	QList<Block *> m_blocksQueue;
 
+	/* Exponential moving average of the download rate in bytes per
+	 * millisecond, as of m_downloadRateUpdated on m_rateClock */
+	double m_downloadRate;
+	qint64 m_downloadRateUpdated;
+	QElapsedTimer m_rateClock;
+	void updateDownloadRate(int bytes);
+
+	/* Set when both sides advertised the fast extension in the handshake */
+	bool m_supportsFastExtension;
+
+	/* Set when the peer advertised BitTorrent v2 in the handshake */
+	bool m_supportsV2;
+
+	/* Pieces that the peer allows us to request while choked */
+	QSet<int> m_allowedFastSet;
+
+	/* Pieces that we allow the peer to request while we're choking him */
+	QSet<int> m_allowedFastSent;
+
+	/* Set when both sides advertised the extension protocol in the handshake */
+	bool m_supportsExtensionProtocol;
+
+	/* The id of the peer's ut_metadata message, 0 if not supported */
+	int m_utMetadataId;
+
+	/* The size of the info dictionary, as advertised by the peer */
+	int m_metadataSize;
+
+	/* The piece availability messages received before we had the metadata.
+	 * Without it, we don't know the number of pieces, so they are applied later */
+	QByteArray m_pendingBitfield;
+	QList<int> m_pendingHaves;
+	bool m_pendingHaveAll;
+
 	/* Is downloading/uploading paused */
 	bool m_isPaused;
 
@@ -155,13 +220,40 @@ private:
 	/* Initializes variables for server peer (ConnectionInitiator::Client) */
 	void initServer(Torrent *torrent, QHostAddress address, int port);
 
+	/* Sets the whole bitfield to value (used by have_all/have_none) */
+	void setAllPieces(bool value);
+
+	/* Updates one bit of the bitfield and the torrent's availability count */
+	void setHasPiece(int index, bool hasPiece);
+
+	/* Loads the peer's bitfield from a bitfield message payload */
+	void loadBitfield(const QByteArray &bitfield);
+
+	/* Clears the piece availability received before the metadata */
+	void clearPendingPieces();
+
+	/* Handles an extension protocol message. Returns false on error */
+	bool readExtendedMessage(const QByteArray &message);
+	bool readExtendedHandshake(const QByteArray &payload);
+	bool readMetadataMessage(const QByteArray &payload);
+
+	/* Requests metadata pieces from the peer, if the torrent needs them */
+	void requestMetadata();
+
+	/* Generates the canonical allowed fast set for this peer, as described in BEP 6 */
+	QSet<int> generateAllowedFastSet(int size) const;
+
+	/* Checks whether the peer may be served the given request right now.
+	 * Rejects it (fast extension) or drops it otherwise */
+	bool acceptRequest(int index, int begin, int length);
+
 public:
 	/* Constructor and destructor */
-	Peer(ConnectionInitiator connectionInitiator, QTcpSocket *socket);
+	Peer(ConnectionInitiator connectionInitiator, PeerSocket *socket);
 	~Peer();
 
 	/* Returns a newly-created peer object with peerType = Client (He downloads from us) */
-	static Peer *createClient(QTcpSocket *socket);
+	static Peer *createClient(PeerSocket *socket);
 
 	/* Returns a newly-created peer object with peerType = Server (We download from him) */
 	static Peer* createServer(Torrent *torrent, QHostAddress address, int port);
@@ -189,7 +281,27 @@ public slots:
 	void sendBitfield();
 	void sendRequest(Block *block);
 	void sendPiece(int index, int begin, const QByteArray &blockData);
+	// Lets the network thread send the block straight from the files.
+	// Returns false if that isn't possible for this block
+	bool sendPieceFromFiles(int index, int begin, int length);
 	void sendCancel(Block *block);
+	void sendRejectRequest(int index, int begin, int length);
+	void sendAllowedFast(int index);
+	void sendKeepAlive();
+	void sendExtendedHandshake();
+	void sendMetadataRequest(int piece);
+	void sendMetadataPiece(int piece);
+	void sendMetadataReject(int piece);
+	void sendHashRequest(const QByteArray &piecesRoot, int baseLayer, int index, int length, int proofLayers);
+	void sendHashes(const QByteArray &piecesRoot, int baseLayer, int index, int length, int proofLayers,
+					const QByteArray &hashes);
+	void sendHashReject(const QByteArray &piecesRoot, int baseLayer, int index, int length, int proofLayers);
+
+	/* Sends our pieces right after the handshake: a bitfield, or
+	 * have_all/have_none when the fast extension is supported */
+	void sendPieceAvailability();
+	/* Sends the allowed fast set to the peer (fast extension only) */
+	void sendAllowedFastSet();
 
 	/* Attempt to request a block from the Torrent object
 	 * and send that request to the peer */
@@ -0,0 +1,178 @@
+/* qTorrent - An open-source, cross-platform BitTorrent client
+ * Copyright (C) 2017 Petko Georgiev
+ *
+ * peersocket.cpp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "peersocket.h"
+#include "networkengine.h"
+
+PeerSocket::PeerSocket(QObject *parent)
+	: QIODevice(parent)
+	, m_connectionId(0)
+	, m_state(QAbstractSocket::UnconnectedState)
+	, m_peerPort(0)
+	, m_flushScheduled(false)
+{
+}
+
+PeerSocket::~PeerSocket()
+{
+	reset();
+}
+
+void PeerSocket::connectToHost(const QHostAddress &address, quint16 port)
+{
+	if (m_state != QAbstractSocket::UnconnectedState) {
+		close();
+	}
+	m_peerAddress = address;
+	m_peerPort = port;
+	m_state = QAbstractSocket::ConnectingState;
+	setErrorString(QString());
+	open(QIODevice::ReadWrite | QIODevice::Unbuffered);
+	m_connectionId = NetworkEngine::instance()->connectToHost(this, address, port);
+}
+
+void PeerSocket::setSocketDescriptor(qintptr socketDescriptor)
+{
+	if (m_state != QAbstractSocket::UnconnectedState) {
+		close();
+	}
+	// Becomes ConnectedState when the network thread has the socket
+	m_state = QAbstractSocket::ConnectingState;
+	setErrorString(QString());
+	open(QIODevice::ReadWrite | QIODevice::Unbuffered);
+	m_connectionId = NetworkEngine::instance()->adoptSocketDescriptor(this, socketDescriptor);
+}
+
+QAbstractSocket::SocketState PeerSocket::state() const
+{
+	return m_state;
+}
+
+QHostAddress PeerSocket::peerAddress() const
+{
+	return m_peerAddress;
+}
+
+quint16 PeerSocket::peerPort() const
+{
+	return m_peerPort;
+}
+
+bool PeerSocket::isSequential() const
+{
+	return true;
+}
+
+qint64 PeerSocket::bytesAvailable() const
+{
+	return m_readBuffer.size() + QIODevice::bytesAvailable();
+}
+
+void PeerSocket::close()
+{
+	bool wasConnected = (m_state == QAbstractSocket::ConnectedState);
+	// Don't lose the last messages
+	flush();
+	reset();
+	QIODevice::close();
+	if (wasConnected) {
+		emit disconnected();
+	}
+}
+
+qint64 PeerSocket::readData(char *data, qint64 maxSize)
+{
+	int size = qMin<qint64>(maxSize, m_readBuffer.size());
+	memcpy(data, m_readBuffer.constData(), size);
+	m_readBuffer.remove(0, size);
+	return size;
+}
+
+qint64 PeerSocket::writeData(const char *data, qint64 maxSize)
+{
+	if (m_state != QAbstractSocket::ConnectedState) {
+		return -1;
+	}
+	m_writeBuffer.append(data, maxSize);
+	if (!m_flushScheduled) {
+		m_flushScheduled = true;
+		QMetaObject::invokeMethod(this, "flush", Qt::QueuedConnection);
+	}
+	return maxSize;
+}
+
+bool PeerSocket::sendFile(const QByteArray &data, const QVector<FileRegion> &regions)
+{
+	if (m_state != QAbstractSocket::ConnectedState) {
+		return false;
+	}
+	// The data written before must be sent first
+	flush();
+	NetworkEngine::instance()->sendFile(m_connectionId, data, regions);
+	return true;
+}
+
+void PeerSocket::handleEvent(const NetworkEvent &event)
+{
+	switch (event.type) {
+	case NetworkEvent::Connected:
+		m_state = QAbstractSocket::ConnectedState;
+		m_peerAddress = event.peerAddress;
+		m_peerPort = event.peerPort;
+		emit connected();
+		break;
+	case NetworkEvent::Data:
+		m_readBuffer.append(event.data);
+		emit readyRead();
+		break;
+	case NetworkEvent::Disconnected:
+		close();
+		break;
+	case NetworkEvent::Error:
+		setErrorString(event.errorString);
+		if (m_state != QAbstractSocket::ConnectedState) {
+			// Failed to connect
+			reset();
+			QIODevice::close();
+		}
+		emit error(event.socketError);
+		break;
+	}
+}
+
+void PeerSocket::reset()
+{
+	if (m_connectionId != 0) {
+		NetworkEngine::instance()->close(m_connectionId);
+		m_connectionId = 0;
+	}
+	m_state = QAbstractSocket::UnconnectedState;
+	m_readBuffer.clear();
+	m_writeBuffer.clear();
+}
+
+void PeerSocket::flush()
+{
+	m_flushScheduled = false;
+	if (m_writeBuffer.isEmpty() || m_connectionId == 0) {
+		return;
+	}
+	NetworkEngine::instance()->write(m_connectionId, m_writeBuffer);
+	m_writeBuffer.clear();
+}
@@ -0,0 +1,91 @@
+/* qTorrent - An open-source, cross-platform BitTorrent client
+ * Copyright (C) 2017 Petko Georgiev
+ *
+ * peersocket.h
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PEERSOCKET_H
+#define PEERSOCKET_H
+
+#include <QIODevice>
+#include <QAbstractSocket>
+#include <QHostAddress>
+#include <QByteArray>
+#include <QVector>
+
+struct NetworkEvent;
+struct FileRegion;
+
+/*
+ * The main thread side of a peer connection.
+ * Has the parts of the QTcpSocket interface used by Peer, but the
+ * real socket lives in one of the NetworkEngine threads.
+ * Written data is batched and sent to the network thread when
+ * control returns to the event loop.
+ */
+class PeerSocket : public QIODevice
+{
+	Q_OBJECT
+
+public:
+	PeerSocket(QObject *parent = nullptr);
+	~PeerSocket();
+
+	void connectToHost(const QHostAddress &address, quint16 port);
+	/* Takes over a connection accepted by a QTcpServer */
+	void setSocketDescriptor(qintptr socketDescriptor);
+
+	QAbstractSocket::SocketState state() const;
+	QHostAddress peerAddress() const;
+	quint16 peerPort() const;
+
+	/* Writes data and then the contents of the file regions. The files
+	 * are read by the network thread, with sendfile() where possible */
+	bool sendFile(const QByteArray &data, const QVector<FileRegion> &regions);
+
+	bool isSequential() const;
+	qint64 bytesAvailable() const;
+	void close();
+
+signals:
+	void connected();
+	void disconnected();
+	void error(QAbstractSocket::SocketError socketError);
+
+protected:
+	qint64 readData(char *data, qint64 maxSize);
+	qint64 writeData(const char *data, qint64 maxSize);
+
+private:
+	friend class NetworkEngine;
+
+	quint32 m_connectionId;
+	QAbstractSocket::SocketState m_state;
+	QHostAddress m_peerAddress;
+	quint16 m_peerPort;
+	QByteArray m_readBuffer;
+	QByteArray m_writeBuffer;
+	bool m_flushScheduled;
+
+	void handleEvent(const NetworkEvent &event);
+	/* Forgets about the connection, without emitting any signals */
+	void reset();
+
+private slots:
+	void flush();
+};
+
+#endif // PEERSOCKET_H
@@ -23,7 +23,8 @@
 #include "torrentinfo.h"
 #include "peer.h"
 #include "trackerclient.h"
-#include <QCryptographicHash>
+#include "merkletree.h"
+#include <QPointer>
 #include <QTcpSocket>
 #include <QFile>
 #include <QDebug>
@@ -34,6 +35,8 @@ Piece::Piece(Torrent *torrent, int pieceNumber, int size)
 	, m_size(size)
 	, m_isDownloaded(false)
 	, m_pieceData(nullptr)
+	, m_isLoadingBlocks(false)
+	, m_loadId(0)
 {
 }
 
@@ -89,8 +92,11 @@ void Piece::deleteBlock(Block *block)
 		}
 	}
 	if (blockNumber != -1) {
+		m_blocksOnDisk.removeOne(block);
 		m_blocks[blockNumber]->deleteLater();
 		m_blocks.removeAt(blockNumber);
+		// The block can be requested again
+		m_torrent->wakePeers();
 	}
 }
 
@@ -99,7 +105,6 @@ bool Piece::checkIfFullyDownloaded()
 	if (m_isDownloaded) { // If already marked as downloaded, don't do anything
 		return true;
 	}
-	Q_ASSERT_X(m_pieceData != nullptr, "Piece::checkIfFullyDownloaded()", "Piece not loaded");
 	int pos = 0;
 	for (auto b : m_blocks) {
 		if (b->begin() == pos && b->isDownloaded()) {
@@ -113,27 +118,39 @@ bool Piece::checkIfFullyDownloaded()
 
 void Piece::updateState()
 {
-	if (checkIfFullyDownloaded()) {
-		Q_ASSERT_X(m_pieceData != nullptr, "Piece::updateState()", "Piece not loaded");
-		QCryptographicHash hash(QCryptographicHash::Sha1);
-		hash.addData(m_pieceData, m_size);
-		QByteArray actualHash = hash.result();
-		if (actualHash != m_torrent->torrentInfo()->piece(m_pieceNumber)) {
-			for (auto b : m_blocks) {
-				b->deleteLater();
-			}
-			m_blocks.clear();
-			setDownloaded(false);
-			qDebug() << "Piece" << m_pieceNumber << "failed SHA1 validation";
-		} else {
-			m_torrent->savePiece(this);
-			setDownloaded(true);
-			unloadFromMemory();
-			m_torrent->onPieceDownloaded(this);
+	m_torrent->setResumeInfoDirty(true);
+	if (m_isLoadingBlocks || !checkIfFullyDownloaded()) {
+		return;
+	}
+	if (m_blocksOnDisk.isEmpty()) {
+		checkHash();
+	} else {
+		loadBlocksFromDisk();
+	}
+}
+
+void Piece::checkHash()
+{
+	// SHA-1, or the merkle root of the pieces of v2 torrents
+	if (!m_torrent->torrentInfo()->checkPiece(m_pieceNumber, m_pieceData, m_size)) {
+		qDebug() << "Piece" << m_pieceNumber << "failed hash validation";
+		// The blocks are kept until verifyBlocks() if the merkle tree can tell the corrupt ones
+		if (!m_torrent->requestBlockHashes(this)) {
+			discardBlocks();
 		}
+	} else {
+		finishDownload();
 	}
 }
 
+void Piece::finishDownload()
+{
+	m_torrent->savePiece(this);
+	setDownloaded(true);
+	unloadFromMemory();
+	m_torrent->onPieceDownloaded(this);
+}
+
 Block *Piece::requestBlock(int size)
 {
 	int tmp = 0;
@@ -177,96 +194,192 @@ Block *Piece::requestBlock(int size)
 	return block;
 }
 
-void Piece::unloadFromMemory()
+void Piece::loadBlocksFromDisk()
 {
-	Q_ASSERT_X(m_pieceData != nullptr, "Piece::unloadFromMemory()", "Piece is not loaded");
-	Q_ASSERT_X(checkIfFullyDownloaded(), "Piece::unloadFromMemory()", "Piece is not fully downloaded");
-	delete[] m_pieceData;
-	m_pieceData = nullptr;
+	QVector<QPair<int, int>> blocks;
+	for (Block *block : m_blocksOnDisk) {
+		blocks.push_back(qMakePair(block->begin(), block->size()));
+	}
+	m_isLoadingBlocks = true;
+	int loadId = ++m_loadId;
+	// The piece may be gone or discarded when the read is done
+	QPointer<Piece> piece(this);
+	m_torrent->readSavedBlocks(m_pieceNumber, blocks, [piece, loadId](bool ok, const QByteArray &data) {
+		if (piece && piece->m_loadId == loadId) {
+			piece->onBlocksLoaded(ok, data);
+		}
+	});
 }
 
-void Piece::setDownloaded(bool isDownloaded)
+void Piece::onBlocksLoaded(bool ok, const QByteArray &data)
 {
-	m_isDownloaded = isDownloaded;
-	for (Block* block : m_blocks) {
-		block->deleteLater();
+	m_isLoadingBlocks = false;
+	if (!checkIfFullyDownloaded()) {
+		// Some blocks are downloaded again, updateState() comes back
+		return;
 	}
-	m_blocks.clear();
-	emit availabilityChanged(this, m_isDownloaded);
+	if (!ok || data.size() != m_size) {
+		qDebug() << "Piece" << m_pieceNumber << ": failed to load the saved blocks";
+		discardBlocks();
+		return;
+	}
+	if (m_pieceData == nullptr) {
+		m_pieceData = new char[m_size];
+	}
+	for (Block *block : m_blocksOnDisk) {
+		memcpy(m_pieceData + block->begin(), data.constData() + block->begin(), block->size());
+	}
+	m_blocksOnDisk.clear();
+	checkHash();
 }
 
-bool Piece::getBlockData(int begin, int size, QByteArray &blockData)
+void Piece::discardBlocks()
 {
-	blockData.clear();
+	m_blocksOnDisk.clear();
+	m_isLoadingBlocks = false;
+	m_loadId++;
+	setDownloaded(false);
+	m_torrent->wakePeers();
+}
 
-	// Check if piece is loaded in memory (unlikely)
-	if (m_pieceData && m_isDownloaded) {
-		blockData.append(m_pieceData + begin, size);
-		return true;
+void Piece::saveDownloadedBlocks()
+{
+	Torrent *torrent = m_torrent;
+	int pieceNumber = m_pieceNumber;
+	for (Block *block : m_blocks) {
+		if (!block->isDownloaded() || block->isSaved()) {
+			continue;
+		}
+		int begin = block->begin();
+		int size = block->size();
+		// The piece is looked up again, it may be gone when the write is done
+		torrent->writeBlock(pieceNumber, begin, QByteArray(m_pieceData + begin, size), [torrent, pieceNumber, begin, size](bool ok) {
+			Piece *piece = torrent->activePiece(pieceNumber);
+			if (!ok) {
+				qDebug() << "Piece" << pieceNumber << ": failed to save block" << begin << size;
+			} else if (piece) {
+				piece->onBlockSaved(begin, size);
+			}
+		});
 	}
+}
 
-	const QList<FileInfo> &fileInfos = m_torrent->torrentInfo()->fileInfos();
-	QList<QFile *> &files = m_torrent->files();
-
-	// Find this block's absolute indexes
-	qint64 blockBegin = m_torrent->torrentInfo()->pieceLength();
-	blockBegin *= m_pieceNumber;
-	blockBegin += begin;
-	qint64 blockEnd = blockBegin + size;
-
-	// For each file
-	qint64 fileBegin = 0;
-	for (int i = 0; i < fileInfos.size(); i++) {
-		const FileInfo &fileInfo = fileInfos[i];
-		QFile *file = files[i];
+void Piece::onBlockSaved(int begin, int size)
+{
+	for (Block *block : m_blocks) {
+		if (block->begin() == begin && block->size() == size && block->isDownloaded()) {
+			block->setSaved(true);
+			return;
+		}
+	}
+}
 
-		qint64 fileEnd = fileBegin + fileInfo.length;
+QVector<QPair<int, int>> Piece::savedBlocks() const
+{
+	QVector<QPair<int, int>> blocks;
+	for (Block *block : m_blocks) {
+		if (block->isSaved()) {
+			blocks.push_back(qMakePair(block->begin(), block->size()));
+		}
+	}
+	return blocks;
+}
 
-		// Does this file have any of the needed data?
-		if (fileEnd > blockBegin && fileBegin < blockEnd) {
-			qint64 seek = 0;
-			if (blockBegin - fileBegin > 0) {
-				seek = blockBegin - fileBegin;
-			}
+bool Piece::restoreBlocks(const QVector<QPair<int, int>> &blocks)
+{
+	// The blocks must be sorted and must not overlap
+	int end = 0;
+	int totalSize = 0;
+	for (const QPair<int, int> &block : blocks) {
+		if (block.first < end || block.second <= 0 || block.second > m_size - block.first) {
+			return false;
+		}
+		end = block.first + block.second;
+		totalSize += block.second;
+	}
+	if (blocks.isEmpty() || totalSize == m_size) {
+		// A complete piece has to be checked instead
+		return false;
+	}
 
-			// Calculate the number of bytes we have to read from this file
-			qint64 bytesToRead = qMin(blockEnd, fileEnd) - qMax(blockBegin, fileBegin);
+	for (const QPair<int, int> &range : blocks) {
+		Block *block = new Block(this, range.first, range.second);
+		block->setSaved(true);
+		block->setDownloaded(true);
+		addBlock(block);
+		m_blocksOnDisk.push_back(block);
+	}
+	return true;
+}
 
-			// Open file
-			if (!file->open(QFile::ReadOnly)) {
-				qDebug() << "Failed to open file" << file->fileName() << ":" << file->errorString();
-				return false;
-			}
+void Piece::verifyBlocks(const QByteArray &blockHashes, int dataSize)
+{
+	// The piece may have been discarded or checked again meanwhile
+	if (m_isDownloaded || m_pieceData == nullptr || !checkIfFullyDownloaded()) {
+		return;
+	}
 
-			// Seek in the file if needed
-			if (seek) {
-				if (!file->seek(seek)) {
-					qDebug() << "Failed to seek" << seek << "bytes in file" << file->fileName() << ":" << file->errorString();
-					file->close();
-					return false;
-				}
+	// Byte ranges of the blocks whose hashes differ
+	QVector<QPair<int, int>> corruptRanges;
+	if (!blockHashes.isEmpty()) {
+		QByteArray actualHashes = MerkleTree::blockHashes(m_pieceData, dataSize);
+		for (int i = 0; i < actualHashes.size() && i < blockHashes.size(); i += MerkleTree::HASH_SIZE) {
+			if (!MerkleTree::equal(actualHashes.constData() + i, blockHashes.constData() + i)) {
+				int begin = i / MerkleTree::HASH_SIZE * MerkleTree::BLOCK_SIZE;
+				corruptRanges.push_back(qMakePair(begin, qMin(MerkleTree::BLOCK_SIZE, dataSize - begin)));
 			}
+		}
+	}
+	if (corruptRanges.isEmpty()) {
+		// The leaves lead to the pieces root of a v2 piece whose piece layer
+		// isn't known yet. In hybrid torrents, the padding after the data is wrong
+		if (!blockHashes.isEmpty() && m_torrent->torrentInfo()->isV2Only()) {
+			finishDownload();
+		} else {
+			discardBlocks();
+		}
+		return;
+	}
 
-			// Read bytesToRead bytes
-			blockData.append(file->read(bytesToRead));
-
-			// Close the file
-			file->close();
-
-			// Return if this is the last file
-			if (fileEnd >= blockEnd) {
-				return true;
+	// The blocks that overlap the corrupt ranges are requested again
+	for (Block *block : QList<Block *>(m_blocks)) {
+		for (const QPair<int, int> &range : corruptRanges) {
+			if (block->begin() < range.first + range.second && range.first < block->begin() + block->size()) {
+				deleteBlock(block);
+				break;
 			}
 		}
+	}
+	qDebug() << "Piece" << m_pieceNumber << ":" << corruptRanges.size() << "corrupt blocks will be downloaded again";
+	m_torrent->setResumeInfoDirty(true);
+}
 
-		fileBegin += fileInfo.length;
+Block *Piece::requestDuplicateBlock(Peer *peer)
+{
+	for (Block *block : m_blocks) {
+		if (!block->isDownloaded() && !block->assignees().contains(peer)) {
+			return block;
+		}
 	}
-	return true;
+	return nullptr;
+}
+
+void Piece::unloadFromMemory()
+{
+	Q_ASSERT_X(m_pieceData != nullptr, "Piece::unloadFromMemory()", "Piece is not loaded");
+	Q_ASSERT_X(checkIfFullyDownloaded(), "Piece::unloadFromMemory()", "Piece is not fully downloaded");
+	delete[] m_pieceData;
+	m_pieceData = nullptr;
 }
 
-bool Piece::getPieceData(QByteArray &pieceData)
+void Piece::setDownloaded(bool isDownloaded)
 {
-	return getBlockData(0, m_size, pieceData);
+	m_isDownloaded = isDownloaded;
+	for (Block* block : m_blocks) {
+		block->deleteLater();
+	}
+	m_blocks.clear();
+	emit availabilityChanged(this, m_isDownloaded);
 }
 
 Block *Piece::getBlock(int begin, int size) const
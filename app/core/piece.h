@@ -23,9 +23,12 @@
 #include <QObject>
 #include <QList>
 #include <QByteArray>
+#include <QVector>
+#include <QPair>
 
 class Torrent;
 class Block;
+class Peer;
 
 class Piece : public QObject
 {
@@ -38,9 +41,24 @@ private:
 	bool m_isDownloaded;
 	char *m_pieceData;
 	QList<Block *> m_blocks;
+	// Downloaded blocks restored from the resume data. Their data is
+	// only in the files and is loaded when the piece is complete
+	QList<Block *> m_blocksOnDisk;
+	// Set while the blocks on disk are read. Loads that finish after the
+	// blocks were discarded have an old id and are ignored
+	bool m_isLoadingBlocks;
+	int m_loadId;
 
 	void addBlock(Block *block);
 	bool checkIfFullyDownloaded();
+	// Reads the blocks on disk on the I/O thread, then checks the piece
+	void loadBlocksFromDisk();
+	void onBlocksLoaded(bool ok, const QByteArray &data);
+	// Checks the hash of the complete piece in memory
+	void checkHash();
+	// Saves the verified piece and lets the torrent know
+	void finishDownload();
+	void discardBlocks();
 
 public:
 	Piece(Torrent *torrent, int pieceNumber, int size);
@@ -53,13 +71,29 @@ public:
 	char *data() const;
 	int size() const;
 
-	// Gets data for a block. Reads from files if needed
-	bool getBlockData(int begin, int size, QByteArray &blockData);
-	bool getPieceData(QByteArray &pieceData);
 	// Returns a pointer to an existing block or nullptr if no such block exists
 	Block *getBlock(int begin, int size) const;
 	// Returns a block from this piece that hasn't been downloaded or requested
 	Block *requestBlock(int size);
+	// Returns a block that was requested from other peers, but not from this one
+	Block *requestDuplicateBlock(Peer *peer);
+
+	/* Partial piece persistence */
+	// Starts writing the downloaded blocks that aren't saved yet to the files
+	void saveDownloadedBlocks();
+	// Called when a block is written. The block may be gone by then
+	void onBlockSaved(int begin, int size);
+	// Begin and size of the blocks that are written to the files
+	QVector<QPair<int, int>> savedBlocks() const;
+	// Recreates blocks from the resume data. Returns false if they are invalid
+	bool restoreBlocks(const QVector<QPair<int, int>> &blocks);
+
+	/* v2 and hybrid torrents. Called with the verified merkle tree leaves of
+	 * a piece that failed its check, for the first dataSize bytes (the rest
+	 * is padding). Only the blocks whose hashes differ are downloaded again.
+	 * If blockHashes is empty, the whole piece is. If none differ, a v2
+	 * piece is complete, the hash of a hybrid piece is wrong */
+	void verifyBlocks(const QByteArray &blockHashes, int dataSize);
 
 signals:
 	void availabilityChanged(Piece *piece, bool isDownloaded);
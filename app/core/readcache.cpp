@@ -0,0 +1,188 @@
+/* qTorrent - An open-source, cross-platform BitTorrent client
+ * Copyright (C) 2017 Petko Georgiev
+ *
+ * readcache.cpp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "readcache.h"
+#include <QSettings>
+#include <QDebug>
+
+const int DEFAULT_READ_CACHE_SIZE_MIB = 32;
+
+ReadCache::ReadCache()
+	: m_head(nullptr)
+	, m_tail(nullptr)
+	, m_capacity(0)
+	, m_size(0)
+	, m_hits(0)
+	, m_misses(0)
+{
+	QSettings settings;
+	int cacheSize = settings.value("ReadCacheSize", DEFAULT_READ_CACHE_SIZE_MIB).toInt();
+	settings.setValue("ReadCacheSize", cacheSize);
+	m_capacity = qMax(cacheSize, 0) * qint64(1024 * 1024);
+}
+
+ReadCache::~ReadCache()
+{
+	if (m_hits + m_misses > 0) {
+		qDebug() << "Read cache:" << m_hits << "hits," << m_misses << "misses," << hitRate() << "% hit rate";
+	}
+	clear();
+}
+
+bool ReadCache::read(const Torrent *torrent, int pieceNumber, int begin, int size, QByteArray &blockData)
+{
+	Entry *entry = m_entries.value(Key(torrent, pieceNumber));
+	if (!entry || begin < 0 || begin + size > entry->data.size()) {
+		m_misses++;
+		return false;
+	}
+	m_hits++;
+	blockData = entry->data.mid(begin, size);
+
+	// Move to the front of the list
+	unlink(entry);
+	link(entry);
+	return true;
+}
+
+void ReadCache::insert(const Torrent *torrent, int pieceNumber, const QByteArray &pieceData)
+{
+	if (pieceData.size() > m_capacity) {
+		return;
+	}
+	Key key(torrent, pieceNumber);
+	Entry *entry = m_entries.value(key);
+	if (entry) {
+		unlink(entry);
+		m_size -= entry->data.size();
+	} else {
+		entry = new Entry;
+		entry->key = key;
+		m_entries.insert(key, entry);
+	}
+	entry->data = pieceData;
+	m_size += pieceData.size();
+	link(entry);
+	evict();
+}
+
+void ReadCache::remove(const Torrent *torrent, int pieceNumber)
+{
+	Entry *entry = m_entries.value(Key(torrent, pieceNumber));
+	if (entry) {
+		removeEntry(entry);
+	}
+}
+
+void ReadCache::removeTorrent(const Torrent *torrent)
+{
+	Entry *entry = m_head;
+	while (entry) {
+		Entry *next = entry->next;
+		if (entry->key.first == torrent) {
+			removeEntry(entry);
+		}
+		entry = next;
+	}
+}
+
+void ReadCache::clear()
+{
+	while (m_head) {
+		removeEntry(m_head);
+	}
+}
+
+qint64 ReadCache::capacity() const
+{
+	return m_capacity;
+}
+
+void ReadCache::setCapacity(qint64 capacity)
+{
+	m_capacity = qMax(capacity, qint64(0));
+	evict();
+}
+
+qint64 ReadCache::size() const
+{
+	return m_size;
+}
+
+qint64 ReadCache::hits() const
+{
+	return m_hits;
+}
+
+qint64 ReadCache::misses() const
+{
+	return m_misses;
+}
+
+float ReadCache::hitRate() const
+{
+	qint64 reads = m_hits + m_misses;
+	if (reads == 0) {
+		return 0;
+	}
+	return (m_hits * 100.0f) / reads;
+}
+
+void ReadCache::link(Entry *entry)
+{
+	entry->prev = nullptr;
+	entry->next = m_head;
+	if (m_head) {
+		m_head->prev = entry;
+	} else {
+		m_tail = entry;
+	}
+	m_head = entry;
+}
+
+void ReadCache::unlink(Entry *entry)
+{
+	if (entry->prev) {
+		entry->prev->next = entry->next;
+	} else {
+		m_head = entry->next;
+	}
+	if (entry->next) {
+		entry->next->prev = entry->prev;
+	} else {
+		m_tail = entry->prev;
+	}
+	entry->prev = nullptr;
+	entry->next = nullptr;
+}
+
+void ReadCache::removeEntry(Entry *entry)
+{
+	unlink(entry);
+	m_entries.remove(entry->key);
+	m_size -= entry->data.size();
+	delete entry;
+}
+
+void ReadCache::evict()
+{
+	while (m_size > m_capacity && m_tail) {
+		removeEntry(m_tail);
+	}
+}
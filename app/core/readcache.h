@@ -0,0 +1,89 @@
+/* qTorrent - An open-source, cross-platform BitTorrent client
+ * Copyright (C) 2017 Petko Georgiev
+ *
+ * readcache.h
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef READCACHE_H
+#define READCACHE_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QPair>
+
+class Torrent;
+
+/*
+ * A least recently used cache of whole pieces, for uploading.
+ * Peers usually request all blocks of a piece one after another,
+ * so the first request reads the whole piece from the files and
+ * the rest are served from memory.
+ * Shared by all torrents. The size is the ReadCacheSize setting, in MiB
+ */
+class ReadCache
+{
+public:
+	ReadCache();
+	~ReadCache();
+
+	/* Copies a part of the piece to blockData. Returns false if the piece isn't cached */
+	bool read(const Torrent *torrent, int pieceNumber, int begin, int size, QByteArray &blockData);
+	/* Adds a piece, evicting the least recently used ones if needed */
+	void insert(const Torrent *torrent, int pieceNumber, const QByteArray &pieceData);
+	/* Forgets a piece that is no longer available */
+	void remove(const Torrent *torrent, int pieceNumber);
+	/* Forgets all pieces of the torrent */
+	void removeTorrent(const Torrent *torrent);
+	void clear();
+
+	/* Maximum and current size in bytes */
+	qint64 capacity() const;
+	void setCapacity(qint64 capacity);
+	qint64 size() const;
+
+	/* Statistics, counted by read() */
+	qint64 hits() const;
+	qint64 misses() const;
+	// Percentage of the reads that were served from memory
+	float hitRate() const;
+
+private:
+	typedef QPair<const Torrent *, int> Key;
+	struct Entry {
+		Key key;
+		QByteArray data;
+		// The list of entries, most recently used first
+		Entry *prev;
+		Entry *next;
+	};
+
+	QHash<Key, Entry *> m_entries;
+	Entry *m_head;
+	Entry *m_tail;
+	qint64 m_capacity;
+	qint64 m_size;
+	qint64 m_hits;
+	qint64 m_misses;
+
+	void link(Entry *entry);
+	void unlink(Entry *entry);
+	void removeEntry(Entry *entry);
+	void evict();
+
+	Q_DISABLE_COPY(ReadCache)
+};
+
+#endif // READCACHE_H
@@ -18,8 +18,6 @@
  */
 
 #include "remote.h"
-#include "qtorrent.h"
-#include "ui/mainwindow.h"
 #include <QLocalSocket>
 #include <QLocalServer>
 
@@ -120,5 +118,5 @@ void Remote::sendShowWindow()
 
 void Remote::showWindow()
 {
-	QTorrent::instance()->mainWindow()->show();
+	emit showWindowRequested();
 }
@@ -44,6 +44,10 @@ public:
 	void sendShowWindow();
 	void showWindow();
 
+signals:
+	// Another instance was started. Nothing is shown by the daemon
+	void showWindowRequested();
+
 public slots:
 	void newConnection();
 	void disconnected();
@@ -18,10 +18,17 @@
  */
 
 #include "core/resumeinfo.h"
-#include "core/bencodevalue.h"
+#include "core/bencodereader.h"
 #include "core/torrentinfo.h"
+#include <QDataStream>
 #include <QDebug>
 
+// "QTRS" - qTorrent resume
+const quint32 RESUME_FILE_MAGIC = 0x51545253;
+// Version 2 adds the partially downloaded pieces, version 3 the file priorities,
+// version 4 the piece layers downloaded from peers
+const quint16 RESUME_FILE_VERSION = 4;
+
 ResumeInfo::ResumeInfo(TorrentInfo *torrentInfo)
 	: m_torrentInfo(torrentInfo)
 	, m_totalBytesDownloaded(0)
@@ -31,32 +38,140 @@ ResumeInfo::ResumeInfo(TorrentInfo *torrentInfo)
 }
 
 
-bool ResumeInfo::loadFromBencode(BencodeDictionary *dict)
+bool ResumeInfo::loadFromBencode(const BencodeView &dict)
 {
-	try {
-		m_downloadLocation = dict->value("downloadLocation")->toByteArray();
-		m_totalBytesDownloaded = dict->value("totalBytesDownloaded")->toInt();
-		m_totalBytesUploaded = dict->value("totalBytesUploaded")->toInt();
-		m_paused = dict->value("paused")->toInt() ? true : false;
-		m_aquiredPieces = toBitArray(dict->value("aquiredPieces")->toByteArray());
+	BencodeView downloadLocation = dict.value("downloadLocation");
+	BencodeView totalBytesDownloaded = dict.value("totalBytesDownloaded");
+	BencodeView totalBytesUploaded = dict.value("totalBytesUploaded");
+	BencodeView paused = dict.value("paused");
+	BencodeView aquiredPieces = dict.value("aquiredPieces");
+	if (!downloadLocation.isString() || !totalBytesDownloaded.isInteger() || !totalBytesUploaded.isInteger()
+			|| !paused.isInteger() || !aquiredPieces.isString()) {
+		qDebug() << "Failed to load resume info: missing or invalid values";
+		return false;
+	}
+
+	m_downloadLocation = downloadLocation.toByteArray();
+	m_totalBytesDownloaded = totalBytesDownloaded.toInt();
+	m_totalBytesUploaded = totalBytesUploaded.toInt();
+	m_paused = paused.toInt() ? true : false;
+	m_aquiredPieces = toBitArray(aquiredPieces.toByteArray());
+	BencodeView magnetLink = dict.value("magnetLink");
+	if (magnetLink.isString()) {
+		m_magnetLink = QString::fromUtf8(magnetLink.toByteArray());
+	}
+	return true;
+}
+
+bool ResumeInfo::loadFromByteArray(const QByteArray &data)
+{
+	QDataStream stream(data);
+	stream.setVersion(QDataStream::Qt_5_0);
+
+	quint32 magic;
+	quint16 version;
+	stream >> magic >> version;
+	if (magic != RESUME_FILE_MAGIC) {
+		qDebug() << "Failed to load resume info: not a resume file";
+		return false;
+	}
+	if (version > RESUME_FILE_VERSION) {
+		qDebug() << "Failed to load resume info: unsupported version" << version;
+		return false;
+	}
+
+	QString downloadLocation;
+	qint64 totalBytesDownloaded, totalBytesUploaded;
+	bool paused;
+	QByteArray aquiredPieces;
+	QString magnetLink;
+	quint32 numberOfFiles;
+	stream >> downloadLocation >> totalBytesDownloaded >> totalBytesUploaded
+		   >> paused >> aquiredPieces >> magnetLink >> numberOfFiles;
+	if (stream.status() != QDataStream::Ok) {
+		qDebug() << "Failed to load resume info: unexpected end of data";
+		return false;
+	}
 
-	} catch (BencodeException &ex) {
-		qDebug() << "Failed to load resume info:" << ex.what();
+	QVector<ResumeFileInfo> fileInfos;
+	for (quint32 i = 0; i < numberOfFiles && stream.status() == QDataStream::Ok; i++) {
+		ResumeFileInfo fileInfo;
+		stream >> fileInfo.size >> fileInfo.lastModified;
+		fileInfos.push_back(fileInfo);
+	}
+	QVector<ResumePartialPiece> partialPieces;
+	if (version >= 2) {
+		quint32 numberOfPartialPieces;
+		stream >> numberOfPartialPieces;
+		for (quint32 i = 0; i < numberOfPartialPieces && stream.status() == QDataStream::Ok; i++) {
+			ResumePartialPiece partialPiece;
+			qint32 pieceNumber;
+			quint32 numberOfBlocks;
+			stream >> pieceNumber >> numberOfBlocks;
+			partialPiece.pieceNumber = pieceNumber;
+			for (quint32 j = 0; j < numberOfBlocks && stream.status() == QDataStream::Ok; j++) {
+				qint32 begin, size;
+				stream >> begin >> size;
+				partialPiece.blocks.push_back(qMakePair(int(begin), int(size)));
+			}
+			partialPieces.push_back(partialPiece);
+		}
+	}
+	QVector<quint8> filePriorities;
+	if (version >= 3) {
+		stream >> filePriorities;
+	}
+	QMap<QByteArray, QByteArray> pieceLayers;
+	if (version >= 4) {
+		stream >> pieceLayers;
+	}
+	if (stream.status() != QDataStream::Ok) {
+		qDebug() << "Failed to load resume info: unexpected end of data";
 		return false;
 	}
+
+	m_downloadLocation = downloadLocation;
+	m_totalBytesDownloaded = totalBytesDownloaded;
+	m_totalBytesUploaded = totalBytesUploaded;
+	m_paused = paused;
+	m_aquiredPieces = toBitArray(aquiredPieces);
+	m_magnetLink = magnetLink;
+	m_fileInfos = fileInfos;
+	m_partialPieces = partialPieces;
+	m_filePriorities = filePriorities;
+	m_pieceLayers = pieceLayers;
 	return true;
 }
 
-void ResumeInfo::addToBencode(BencodeDictionary *mainResumeDictionary) const
+QByteArray ResumeInfo::toByteArray() const
 {
-	BencodeDictionary *dict = new BencodeDictionary;
-	dict->add("downloadLocation", new BencodeString(m_downloadLocation.toUtf8()));
-	dict->add("totalBytesDownloaded", new BencodeInteger(m_totalBytesDownloaded));
-	dict->add("totalBytesUploaded", new BencodeInteger(m_totalBytesUploaded));
-	dict->add("paused", new BencodeInteger(m_paused));
-	dict->add("aquiredPieces", new BencodeString(aquiredPiecesArray()));
+	QByteArray data;
+	QDataStream stream(&data, QIODevice::WriteOnly);
+	stream.setVersion(QDataStream::Qt_5_0);
 
-	mainResumeDictionary->add(m_torrentInfo->infoHash(), dict);
+	stream << RESUME_FILE_MAGIC << RESUME_FILE_VERSION;
+	stream << m_downloadLocation << m_totalBytesDownloaded << m_totalBytesUploaded
+		   << m_paused << aquiredPiecesArray();
+	if (!m_torrentInfo->hasMetadata()) {
+		// There is no .torrent file to resume from
+		stream << m_torrentInfo->magnetLink();
+	} else {
+		stream << QString();
+	}
+	stream << quint32(m_fileInfos.size());
+	for (const ResumeFileInfo &fileInfo : m_fileInfos) {
+		stream << fileInfo.size << fileInfo.lastModified;
+	}
+	stream << quint32(m_partialPieces.size());
+	for (const ResumePartialPiece &partialPiece : m_partialPieces) {
+		stream << qint32(partialPiece.pieceNumber) << quint32(partialPiece.blocks.size());
+		for (const QPair<int, int> &block : partialPiece.blocks) {
+			stream << qint32(block.first) << qint32(block.second);
+		}
+	}
+	stream << m_filePriorities;
+	stream << m_pieceLayers;
+	return data;
 }
 
 
@@ -133,6 +248,31 @@ const QVector<bool> &ResumeInfo::aquiredPieces() const
 	return m_aquiredPieces;
 }
 
+const QString &ResumeInfo::magnetLink() const
+{
+	return m_magnetLink;
+}
+
+const QVector<ResumeFileInfo> &ResumeInfo::fileInfos() const
+{
+	return m_fileInfos;
+}
+
+const QVector<ResumePartialPiece> &ResumeInfo::partialPieces() const
+{
+	return m_partialPieces;
+}
+
+const QVector<quint8> &ResumeInfo::filePriorities() const
+{
+	return m_filePriorities;
+}
+
+const QMap<QByteArray, QByteArray> &ResumeInfo::pieceLayers() const
+{
+	return m_pieceLayers;
+}
+
 /* Setters */
 
 void ResumeInfo::setDownloadLocation(const QString &downloadLocation)
@@ -159,3 +299,23 @@ void ResumeInfo::setAquiredPieces(const QVector<bool> &aquiredPieces)
 {
 	m_aquiredPieces = aquiredPieces;
 }
+
+void ResumeInfo::setFileInfos(const QVector<ResumeFileInfo> &fileInfos)
+{
+	m_fileInfos = fileInfos;
+}
+
+void ResumeInfo::setPartialPieces(const QVector<ResumePartialPiece> &partialPieces)
+{
+	m_partialPieces = partialPieces;
+}
+
+void ResumeInfo::setFilePriorities(const QVector<quint8> &filePriorities)
+{
+	m_filePriorities = filePriorities;
+}
+
+void ResumeInfo::setPieceLayers(const QMap<QByteArray, QByteArray> &pieceLayers)
+{
+	m_pieceLayers = pieceLayers;
+}
@@ -22,10 +22,29 @@
 
 #include <QtGlobal>
 #include <QVector>
+#include <QMap>
+#include <QPair>
 #include <QByteArray>
+#include <QString>
 
 class TorrentInfo;
-class BencodeDictionary;
+class BencodeView;
+
+/* Size and modification time of a downloaded file, as seen when the
+ * resume data was saved. Used for detecting changes made while we weren't running */
+struct ResumeFileInfo {
+	qint64 size;
+	// Milliseconds since epoch, -1 if the file didn't exist
+	qint64 lastModified;
+};
+
+/* A piece that wasn't complete when the resume data was saved.
+ * The listed blocks are already written to the files */
+struct ResumePartialPiece {
+	int pieceNumber;
+	// Begin and size of each downloaded block
+	QVector<QPair<int, int>> blocks;
+};
 
 /*
  * This class contains the information required to resume a
@@ -36,10 +55,12 @@ class ResumeInfo
 public:
 	ResumeInfo(TorrentInfo *torrentInfo);
 
-	bool loadFromBencode(BencodeDictionary *dict);
+	/* Loads an entry of the old, bencoded resume.dat file */
+	bool loadFromBencode(const BencodeView &dict);
 
-	/* Adds the resume data to the dictionary in the argument */
-	void addToBencode(BencodeDictionary *mainResumeDictionary) const;
+	/* The binary format of the per-torrent .resume files */
+	bool loadFromByteArray(const QByteArray &data);
+	QByteArray toByteArray() const;
 
 	/* Getters */
 	TorrentInfo *torrentInfo() const;
@@ -49,6 +70,14 @@ public:
 	bool paused() const;
 	const QVector<bool> &aquiredPieces() const;
 	QByteArray aquiredPiecesArray() const;
+	// Only set for magnet link torrents that don't have the metadata yet
+	const QString &magnetLink() const;
+	const QVector<ResumeFileInfo> &fileInfos() const;
+	const QVector<ResumePartialPiece> &partialPieces() const;
+	// Torrent::Priority of each file
+	const QVector<quint8> &filePriorities() const;
+	// The piece layers that were downloaded from peers, by pieces root
+	const QMap<QByteArray, QByteArray> &pieceLayers() const;
 
 	/* Setters */
 	void setDownloadLocation(const QString &downloadLocation);
@@ -56,6 +85,10 @@ public:
 	void setTotalBytesUploaded(qint64 totalBytesUploaded);
 	void setPaused(bool paused);
 	void setAquiredPieces(const QVector<bool> &aquiredPieces);
+	void setFileInfos(const QVector<ResumeFileInfo> &fileInfos);
+	void setPartialPieces(const QVector<ResumePartialPiece> &partialPieces);
+	void setFilePriorities(const QVector<quint8> &filePriorities);
+	void setPieceLayers(const QMap<QByteArray, QByteArray> &pieceLayers);
 
 private:
 	TorrentInfo *m_torrentInfo;
@@ -64,6 +97,11 @@ private:
 	qint64 m_totalBytesUploaded;
 	bool m_paused;
 	QVector<bool> m_aquiredPieces;
+	QString m_magnetLink;
+	QVector<ResumeFileInfo> m_fileInfos;
+	QVector<ResumePartialPiece> m_partialPieces;
+	QVector<quint8> m_filePriorities;
+	QMap<QByteArray, QByteArray> m_pieceLayers;
 
 	QVector<bool> toBitArray(const QByteArray &data);
 };
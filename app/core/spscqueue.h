@@ -0,0 +1,97 @@
+/* qTorrent - An open-source, cross-platform BitTorrent client
+ * Copyright (C) 2017 Petko Georgiev
+ *
+ * spscqueue.h
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SPSCQUEUE_H
+#define SPSCQUEUE_H
+
+#include <QAtomicPointer>
+
+/*
+ * An unbounded, lock-free, single-producer single-consumer queue.
+ * push() may only be called from one thread and pop() from one
+ * (possibly different) thread. Used to pass data between the
+ * network threads and the main thread without locking.
+ */
+template <typename T>
+class SpscQueue
+{
+	struct Node
+	{
+		T value;
+		QAtomicPointer<Node> next;
+
+		Node() : next(nullptr) {}
+	};
+
+	/* Owned by the consumer. Always points to a dummy node */
+	Node *m_head;
+	/* Owned by the producer */
+	Node *m_tail;
+
+public:
+	SpscQueue()
+	{
+		m_head = m_tail = new Node;
+	}
+
+	~SpscQueue()
+	{
+		while (m_head) {
+			Node *next = m_head->next.load();
+			delete m_head;
+			m_head = next;
+		}
+	}
+
+	/* Producer side */
+	void push(const T &value)
+	{
+		Node *node = new Node;
+		node->value = value;
+		// Publish the node only after it is fully constructed
+		m_tail->next.storeRelease(node);
+		m_tail = node;
+	}
+
+	/* Consumer side. Returns false if the queue is empty */
+	bool pop(T &value)
+	{
+		Node *next = m_head->next.loadAcquire();
+		if (next == nullptr) {
+			return false;
+		}
+		value = next->value;
+		// The popped node becomes the new dummy
+		next->value = T();
+		delete m_head;
+		m_head = next;
+		return true;
+	}
+
+	/* Consumer side */
+	bool isEmpty() const
+	{
+		return m_head->next.loadAcquire() == nullptr;
+	}
+
+private:
+	Q_DISABLE_COPY(SpscQueue)
+};
+
+#endif // SPSCQUEUE_H
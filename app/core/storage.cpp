@@ -0,0 +1,317 @@
+/* qTorrent - An open-source, cross-platform BitTorrent client
+ * Copyright (C) 2017 Petko Georgiev
+ *
+ * storage.cpp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "storage.h"
+#include <QFile>
+#include <QSettings>
+#include <QThreadStorage>
+#include <QDebug>
+#ifdef QTORRENT_IO_URING
+#include "uringstorage.h"
+#endif
+#ifdef Q_OS_UNIX
+#include <unistd.h>
+#endif
+#ifdef Q_OS_LINUX
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <climits>
+#include <cerrno>
+#include <cstring>
+#endif
+
+#ifdef Q_OS_LINUX
+// Offsets, sizes and buffers of O_DIRECT reads are multiples of this.
+// 4 KiB satisfies the block size of practically all file systems
+const qint64 DIRECT_IO_ALIGNMENT = 4096;
+
+// Reads size bytes at offset. Returns the number of bytes read,
+// which is less than size only at the end of the file, or -1
+static qint64 preadFully(int fd, char *data, qint64 size, qint64 offset)
+{
+	qint64 done = 0;
+	while (done < size) {
+		ssize_t result = pread(fd, data + done, size - done, offset + done);
+		if (result < 0 && errno == EINTR) {
+			continue;
+		}
+		if (result < 0) {
+			return -1;
+		}
+		if (result == 0) {
+			break;
+		}
+		done += result;
+	}
+	return done;
+}
+
+// Returns 1 on success, 0 if O_DIRECT isn't supported and -1 on error
+static int readDirect(const Storage::Read &read)
+{
+	int fd = ::open(QFile::encodeName(read.fileName).constData(), O_RDONLY | O_DIRECT | O_CLOEXEC);
+	if (fd < 0) {
+		return errno == EINVAL ? 0 : -1;
+	}
+
+	// Read the aligned range that contains the data
+	qint64 begin = read.offset & ~(DIRECT_IO_ALIGNMENT - 1);
+	qint64 end = (read.offset + read.size + DIRECT_IO_ALIGNMENT - 1) & ~(DIRECT_IO_ALIGNMENT - 1);
+	char *buffer = static_cast<char *>(qMallocAligned(end - begin, DIRECT_IO_ALIGNMENT));
+	int result = -1;
+	if (buffer) {
+		qint64 bytesRead = 0;
+		while (bytesRead < end - begin) {
+			ssize_t size = pread(fd, buffer + bytesRead, end - begin - bytesRead, begin + bytesRead);
+			if (size < 0 && errno == EINTR) {
+				continue;
+			}
+			if (size < 0) {
+				bytesRead = (errno == EINVAL) ? -2 : -1;
+				break;
+			}
+			bytesRead += size;
+			// A short read that isn't aligned ends at the end of the file
+			if (size == 0 || bytesRead % DIRECT_IO_ALIGNMENT != 0) {
+				break;
+			}
+		}
+		if (bytesRead == -2) {
+			result = 0;
+		} else if (bytesRead >= read.offset + read.size - begin) {
+			memcpy(read.data, buffer + (read.offset - begin), read.size);
+			result = 1;
+		}
+		qFreeAligned(buffer);
+	}
+	::close(fd);
+	return result;
+}
+
+// Reads normally and then tells the kernel to drop the pages
+static bool readAndDropPages(const Storage::Read &read)
+{
+	int fd = ::open(QFile::encodeName(read.fileName).constData(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return false;
+	}
+	bool ok = (preadFully(fd, read.data, read.size, read.offset) == read.size);
+	posix_fadvise(fd, read.offset, read.size, POSIX_FADV_DONTNEED);
+	::close(fd);
+	return ok;
+}
+#endif
+
+// Writes the segments one after another, starting at this offset in the file.
+// The file must be open
+static bool writeSegments(QFile *file, qint64 offset, const QVector<QPair<const char *, qint64>> &segments)
+{
+#ifdef Q_OS_LINUX
+	// Write as many segments as possible with a single system call
+	QVector<struct iovec> iov(segments.size());
+	for (int i = 0; i < segments.size(); i++) {
+		iov[i].iov_base = const_cast<char *>(segments[i].first);
+		iov[i].iov_len = segments[i].second;
+	}
+	int first = 0;
+	while (first < iov.size()) {
+		ssize_t written = pwritev(file->handle(), iov.data() + first, qMin(iov.size() - first, IOV_MAX), offset);
+		if (written < 0 && errno == EINTR) {
+			continue;
+		}
+		if (written <= 0) {
+			return false;
+		}
+		offset += written;
+		// Skip what was written, which can end in the middle of a segment
+		while (written > 0) {
+			if (size_t(written) >= iov[first].iov_len) {
+				written -= iov[first].iov_len;
+				first++;
+			} else {
+				iov[first].iov_base = static_cast<char *>(iov[first].iov_base) + written;
+				iov[first].iov_len -= written;
+				written = 0;
+			}
+		}
+	}
+	return true;
+#else
+	if (!file->seek(offset)) {
+		return false;
+	}
+	for (const auto &segment : segments) {
+		const char *data = segment.first;
+		qint64 bytesToWrite = segment.second;
+		while (bytesToWrite > 0) {
+			qint64 written = file->write(data, bytesToWrite);
+			if (written == -1) {
+				return false;
+			}
+			data += written;
+			bytesToWrite -= written;
+		}
+	}
+	return true;
+#endif
+}
+
+Storage::~Storage()
+{
+}
+
+bool Storage::readUncached(const QVector<Read> &reads)
+{
+#ifdef Q_OS_LINUX
+	for (const Read &read : reads) {
+		int result = readDirect(read);
+		if (result == 0) {
+			result = readAndDropPages(read) ? 1 : -1;
+		}
+		if (result < 0) {
+			qDebug() << "Failed to read" << read.size << "bytes from" << read.fileName;
+			return false;
+		}
+	}
+	return true;
+#else
+	return read(reads);
+#endif
+}
+
+bool Storage::sync(const QStringList &fileNames)
+{
+	for (const QString &fileName : fileNames) {
+		QFile file(fileName);
+		if (!file.exists()) {
+			continue;
+		}
+		if (!file.open(QIODevice::ReadOnly | QIODevice::Unbuffered)) {
+			qDebug() << "Failed to open file" << fileName << ":" << file.errorString();
+			return false;
+		}
+#if defined(Q_OS_LINUX)
+		int result = fdatasync(file.handle());
+#elif defined(Q_OS_UNIX)
+		int result = fsync(file.handle());
+#else
+		int result = 0;
+#endif
+		if (result != 0) {
+			qDebug() << "Failed to sync file" << fileName;
+			return false;
+		}
+	}
+	return true;
+}
+
+void Storage::writeAsync(const QVector<Write> &writes, const Callback &done)
+{
+	done(write(writes));
+}
+
+void Storage::readAsync(const QVector<Read> &reads, const Callback &done)
+{
+	done(read(reads));
+}
+
+void Storage::waitForAll()
+{
+}
+
+Storage *Storage::instance()
+{
+	static QThreadStorage<Storage *> storages;
+	if (!storages.hasLocalData()) {
+		QSettings settings;
+		QString backend = settings.value("StorageBackend", "qfile").toString();
+		settings.setValue("StorageBackend", backend);
+
+		Storage *storage = nullptr;
+#ifdef QTORRENT_IO_URING
+		if (backend == "io_uring") {
+			UringStorage *uringStorage = new UringStorage;
+			if (uringStorage->isValid()) {
+				storage = uringStorage;
+			} else {
+				qDebug() << "io_uring is not available:" << uringStorage->errorString();
+				delete uringStorage;
+			}
+		}
+#endif
+		if (!storage) {
+			if (backend != "qfile") {
+				qDebug() << "Storage backend" << backend << "is not available, using qfile";
+			}
+			storage = new QFileStorage;
+		}
+		storages.setLocalData(storage);
+	}
+	return storages.localData();
+}
+
+
+bool QFileStorage::write(const QVector<Write> &writes)
+{
+	for (const Write &write : writes) {
+		QFile file(write.fileName);
+		// Append causes bugs with seek
+		if (!file.open(QIODevice::ReadWrite | QIODevice::Unbuffered)) {
+			qDebug() << "Failed to open file" << write.fileName << ":" << file.errorString();
+			return false;
+		}
+		if (!writeSegments(&file, write.offset, write.segments)) {
+			qDebug() << "Failed to write to file" << write.fileName;
+			return false;
+		}
+	}
+	return true;
+}
+
+bool QFileStorage::read(const QVector<Read> &reads)
+{
+	for (const Read &read : reads) {
+		QFile file(read.fileName);
+		if (!file.open(QIODevice::ReadOnly | QIODevice::Unbuffered)) {
+			qDebug() << "Failed to open file" << read.fileName << ":" << file.errorString();
+			return false;
+		}
+		if (!file.seek(read.offset)) {
+			qDebug() << "Failed to seek" << read.offset << "bytes in file" << read.fileName << ":" << file.errorString();
+			return false;
+		}
+		char *data = read.data;
+		qint64 bytesToRead = read.size;
+		while (bytesToRead > 0) {
+			qint64 bytesRead = file.read(data, bytesToRead);
+			if (bytesRead <= 0) {
+				return false;
+			}
+			data += bytesRead;
+			bytesToRead -= bytesRead;
+		}
+	}
+	return true;
+}
+
+QString QFileStorage::name() const
+{
+	return "qfile";
+}
@@ -0,0 +1,97 @@
+/* qTorrent - An open-source, cross-platform BitTorrent client
+ * Copyright (C) 2017 Petko Georgiev
+ *
+ * storage.h
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include <QString>
+#include <QStringList>
+#include <QVector>
+#include <QPair>
+#include <functional>
+
+/*
+ * The file I/O of the torrents' data. Reads and writes are done in
+ * batches (usually the parts of a piece in each of its files), so a
+ * backend can have all of them in flight at the same time.
+ * Batches can also be asynchronous: the caller goes on and is called
+ * back from its thread's event loop when the batch is done.
+ * There is one backend per thread, see instance()
+ */
+class Storage
+{
+public:
+	/* Segments that are written one after another, starting at offset */
+	struct Write {
+		QString fileName;
+		qint64 offset;
+		QVector<QPair<const char *, qint64>> segments;
+	};
+	struct Read {
+		QString fileName;
+		qint64 offset;
+		char *data;
+		qint64 size;
+	};
+
+	/* Called with false if any of the operations of a batch failed */
+	typedef std::function<void(bool ok)> Callback;
+
+	virtual ~Storage();
+
+	/* Files that don't exist are created. Returns false if any of the writes failed */
+	virtual bool write(const QVector<Write> &writes) = 0;
+	/* Returns false unless all of the data was read */
+	virtual bool read(const QVector<Read> &reads) = 0;
+	/* Like read(), but keeps the data out of the page cache: O_DIRECT with
+	 * aligned buffers on Linux, or reading and then dropping the pages with
+	 * posix_fadvise(DONTNEED) where O_DIRECT isn't supported. Elsewhere
+	 * this is just read() */
+	virtual bool readUncached(const QVector<Read> &reads);
+	/* Waits until the written data of the files is on the disk (fdatasync).
+	 * Files that don't exist are skipped. Returns false if any sync failed.
+	 * Where there is no way to do that, the data is only in the OS's hands */
+	virtual bool sync(const QStringList &fileNames);
+
+	/* Asynchronous write() and read(). The data must stay valid until done
+	 * is called, which happens in this thread. The default implementation
+	 * does the work right away and calls done before returning */
+	virtual void writeAsync(const QVector<Write> &writes, const Callback &done);
+	virtual void readAsync(const QVector<Read> &reads, const Callback &done);
+	/* Blocks until all asynchronous batches are done and called back */
+	virtual void waitForAll();
+	virtual QString name() const = 0;
+
+	/* Returns the storage of the calling thread. It's created on first use.
+	 * The StorageBackend setting chooses the backend: "qfile", or "io_uring"
+	 * on Linux, when built with liburing. If a backend can't be used, it
+	 * falls back to "qfile" */
+	static Storage *instance();
+};
+
+/* Blocking I/O with QFile, works everywhere */
+class QFileStorage : public Storage
+{
+public:
+	bool write(const QVector<Write> &writes);
+	bool read(const QVector<Read> &reads);
+	QString name() const;
+};
+
+#endif // STORAGE_H
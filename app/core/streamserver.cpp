@@ -0,0 +1,267 @@
+/* qTorrent - An open-source, cross-platform BitTorrent client
+ * Copyright (C) 2017 Petko Georgiev
+ *
+ * streamserver.cpp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "streamserver.h"
+#include "torrentstream.h"
+#include "torrent.h"
+#include "torrentinfo.h"
+#include "qtorrent.h"
+#include <QTcpSocket>
+#include <QSettings>
+#include <QDebug>
+
+const int DEFAULT_STREAM_SERVER_PORT = 6880;
+const int MAX_REQUEST_SIZE = 8192;
+const qint64 SEND_CHUNK_SIZE = 64 * 1024;
+// Don't read from the files faster than the player takes the data
+const qint64 MAX_BYTES_TO_WRITE = 256 * 1024;
+
+StreamConnection::StreamConnection(QTcpSocket *socket, QObject *parent)
+	: QObject(parent)
+	, m_socket(socket)
+	, m_stream(nullptr)
+	, m_bytesLeft(0)
+{
+	m_socket->setParent(this);
+	connect(m_socket, &QTcpSocket::readyRead, this, &StreamConnection::readRequest);
+	connect(m_socket, &QTcpSocket::bytesWritten, this, &StreamConnection::sendData);
+	connect(m_socket, &QTcpSocket::disconnected, this, &StreamConnection::deleteLater);
+}
+
+StreamConnection::~StreamConnection()
+{
+	// Clears the deadlines of the stream
+	delete m_stream;
+}
+
+void StreamConnection::readRequest()
+{
+	if (m_stream) {
+		// One request per connection
+		m_socket->readAll();
+		return;
+	}
+	m_request.append(m_socket->readAll());
+	if (m_request.contains("\r\n\r\n")) {
+		handleRequest();
+	} else if (m_request.size() > MAX_REQUEST_SIZE) {
+		sendError(400, "Bad Request");
+	}
+}
+
+void StreamConnection::handleRequest()
+{
+	QList<QByteArray> lines = m_request.left(m_request.indexOf("\r\n\r\n")).split('\n');
+	QList<QByteArray> requestLine = lines.first().trimmed().split(' ');
+	if (requestLine.size() != 3) {
+		sendError(400, "Bad Request");
+		return;
+	}
+	const QByteArray &method = requestLine[0];
+	if (method != "GET" && method != "HEAD") {
+		sendError(405, "Method Not Allowed");
+		return;
+	}
+
+	// /<info hash>/<file index>
+	QList<QByteArray> path = requestLine[1].split('/');
+	Torrent *torrent = nullptr;
+	bool ok = false;
+	int fileIndex = -1;
+	if (path.size() == 3) {
+		torrent = findTorrent(QByteArray::fromHex(path[1]));
+		fileIndex = path[2].toInt(&ok);
+	}
+	if (torrent) {
+		m_stream = new TorrentStream(torrent, fileIndex, this);
+		if (!ok || !m_stream->open(QIODevice::ReadOnly)) {
+			delete m_stream;
+			m_stream = nullptr;
+		}
+	}
+	if (!m_stream) {
+		sendError(404, "Not Found");
+		return;
+	}
+
+	// Single byte ranges only: "bytes=first-last", "bytes=first-" or "bytes=-suffix"
+	qint64 size = m_stream->size();
+	qint64 first = 0;
+	qint64 last = size - 1;
+	bool isPartial = false;
+	for (int i = 1; i < lines.size(); i++) {
+		QByteArray line = lines[i].trimmed();
+		if (!line.toLower().startsWith("range:")) {
+			continue;
+		}
+		QByteArray range = line.mid(6).trimmed();
+		int dash = range.indexOf('-');
+		if (!range.startsWith("bytes=") || range.contains(',') || dash == -1) {
+			// Not supported, send everything
+			break;
+		}
+		QByteArray firstString = range.mid(6, dash - 6).trimmed();
+		QByteArray lastString = range.mid(dash + 1).trimmed();
+		bool firstOk = true;
+		bool lastOk = true;
+		if (firstString.isEmpty()) {
+			qint64 suffix = lastString.toLongLong(&lastOk);
+			first = qMax(size - suffix, qint64(0));
+			lastOk = lastOk && suffix > 0;
+		} else {
+			first = firstString.toLongLong(&firstOk);
+			if (!lastString.isEmpty()) {
+				last = qMin(lastString.toLongLong(&lastOk), size - 1);
+			}
+		}
+		if (!firstOk || !lastOk || first > last || first >= size) {
+			sendHeaders(416, "Range Not Satisfiable", QList<QByteArray>()
+						<< "Content-Range: bytes */" + QByteArray::number(size)
+						<< "Content-Length: 0" << "Connection: close");
+			m_socket->disconnectFromHost();
+			return;
+		}
+		isPartial = true;
+		break;
+	}
+
+	QList<QByteArray> headers;
+	headers << "Content-Type: application/octet-stream"
+			<< "Accept-Ranges: bytes"
+			<< "Content-Length: " + QByteArray::number(last - first + 1)
+			<< "Connection: close";
+	if (isPartial) {
+		headers << "Content-Range: bytes " + QByteArray::number(first) + "-"
+				   + QByteArray::number(last) + "/" + QByteArray::number(size);
+		sendHeaders(206, "Partial Content", headers);
+	} else {
+		sendHeaders(200, "OK", headers);
+	}
+	if (method == "HEAD") {
+		m_socket->disconnectFromHost();
+		return;
+	}
+
+	// The player is waiting for this part first
+	m_stream->seek(first);
+	m_bytesLeft = last - first + 1;
+	connect(m_stream, &TorrentStream::readyRead, this, &StreamConnection::sendData);
+	sendData();
+}
+
+void StreamConnection::sendData()
+{
+	if (!m_stream || !m_stream->isOpen()) {
+		return;
+	}
+	while (m_bytesLeft > 0 && m_socket->bytesToWrite() < MAX_BYTES_TO_WRITE) {
+		QByteArray data = m_stream->read(qMin(SEND_CHUNK_SIZE, m_bytesLeft));
+		if (data.isEmpty()) {
+			// Not downloaded yet
+			return;
+		}
+		m_socket->write(data);
+		m_bytesLeft -= data.size();
+	}
+	if (m_bytesLeft == 0) {
+		m_socket->disconnectFromHost();
+	}
+}
+
+void StreamConnection::sendError(int statusCode, const QByteArray &reason)
+{
+	sendHeaders(statusCode, reason, QList<QByteArray>() << "Content-Length: 0" << "Connection: close");
+	m_socket->disconnectFromHost();
+}
+
+void StreamConnection::sendHeaders(int statusCode, const QByteArray &reason, const QList<QByteArray> &headers)
+{
+	QByteArray response = "HTTP/1.1 " + QByteArray::number(statusCode) + " " + reason + "\r\n";
+	for (const QByteArray &header : headers) {
+		response += header + "\r\n";
+	}
+	response += "\r\n";
+	m_socket->write(response);
+}
+
+Torrent *StreamConnection::findTorrent(const QByteArray &infoHash) const
+{
+	for (Torrent *torrent : QTorrent::instance()->torrents()) {
+		if (torrent->torrentInfo()->infoHash() == infoHash) {
+			return torrent;
+		}
+	}
+	return nullptr;
+}
+
+
+StreamServer::StreamServer()
+{
+	connect(&m_server, &QTcpServer::newConnection, this, &StreamServer::newConnection);
+}
+
+StreamServer::~StreamServer()
+{
+	disconnect(&m_server, &QTcpServer::newConnection, this, &StreamServer::newConnection);
+}
+
+bool StreamServer::startServer()
+{
+	if (m_server.isListening()) {
+		m_server.close();
+	}
+
+	QSettings settings;
+	int port = settings.value("StreamServerPort", DEFAULT_STREAM_SERVER_PORT).toInt();
+	settings.setValue("StreamServerPort", port);
+	if (port == 0) {
+		return false;
+	}
+
+	// Only local players may connect
+	if (!m_server.listen(QHostAddress::LocalHost, port)) {
+		qDebug() << "Failed to start the stream server:" << m_server.errorString();
+		return false;
+	}
+	qDebug() << "Stream server started on port" << QString::number(port);
+	return true;
+}
+
+int StreamServer::port()
+{
+	return m_server.serverPort();
+}
+
+QUrl StreamServer::fileUrl(Torrent *torrent, int fileIndex)
+{
+	if (!m_server.isListening()) {
+		return QUrl();
+	}
+	return QUrl(QString("http://127.0.0.1:%1/%2/%3")
+				.arg(port())
+				.arg(QString(torrent->torrentInfo()->infoHash().toHex()))
+				.arg(fileIndex));
+}
+
+void StreamServer::newConnection()
+{
+	while (m_server.hasPendingConnections()) {
+		new StreamConnection(m_server.nextPendingConnection(), this);
+	}
+}
@@ -0,0 +1,86 @@
+/* qTorrent - An open-source, cross-platform BitTorrent client
+ * Copyright (C) 2017 Petko Georgiev
+ *
+ * streamserver.h
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STREAMSERVER_H
+#define STREAMSERVER_H
+
+#include <QObject>
+#include <QTcpServer>
+#include <QUrl>
+
+class QTcpSocket;
+class Torrent;
+class TorrentStream;
+
+/* Serves one HTTP request for a torrent file, with range support */
+class StreamConnection : public QObject
+{
+	Q_OBJECT
+
+public:
+	StreamConnection(QTcpSocket *socket, QObject *parent = nullptr);
+	~StreamConnection();
+
+private slots:
+	void readRequest();
+	void sendData();
+
+private:
+	QTcpSocket *m_socket;
+	QByteArray m_request;
+	TorrentStream *m_stream;
+	// The number of bytes of the requested range that aren't sent yet
+	qint64 m_bytesLeft;
+
+	void handleRequest();
+	void sendError(int statusCode, const QByteArray &reason);
+	void sendHeaders(int statusCode, const QByteArray &reason, const QList<QByteArray> &headers);
+	Torrent *findTorrent(const QByteArray &infoHash) const;
+};
+
+/*
+ * A local HTTP server that lets media players play files while they are
+ * being downloaded. http://127.0.0.1:<port>/<info hash>/<file index>
+ * serves a file of a torrent. Reading a part of it moves the torrent's
+ * playback cursor there
+ */
+class StreamServer : public QObject
+{
+	Q_OBJECT
+
+public:
+	StreamServer();
+	~StreamServer();
+
+	/* Start/restart the server using the port in the settings file.
+	 * Port 0 disables the server */
+	bool startServer();
+
+	int port();
+	// Returns the URL of the file, empty if the server isn't running
+	QUrl fileUrl(Torrent *torrent, int fileIndex);
+
+public slots:
+	void newConnection();
+
+private:
+	QTcpServer m_server;
+};
+
+#endif // STREAMSERVER_H
@@ -0,0 +1,210 @@
+/* qTorrent - An open-source, cross-platform BitTorrent client
+ * Copyright (C) 2017 Petko Georgiev
+ *
+ * timerwheel.cpp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "timerwheel.h"
+#include <QThreadStorage>
+
+TimerWheel::TimerWheel()
+	: m_currentTick(0)
+	, m_activeTimers(0)
+	, m_slots(NUMBER_OF_SLOTS, nullptr)
+	, m_expired(nullptr)
+{
+	m_clock.start();
+	m_timer.setInterval(TICK_MSEC);
+	connect(&m_timer, &QTimer::timeout, this, &TimerWheel::tick);
+}
+
+TimerWheel::~TimerWheel()
+{
+	// Detach the timers that are still running, so they
+	// don't try to remove themselves from a deleted wheel
+	for (int i = 0; i < m_slots.size(); i++) {
+		while (m_slots[i]) {
+			WheelTimer *timer = m_slots[i];
+			unlink(timer);
+			timer->m_wheel = nullptr;
+		}
+	}
+	while (m_expired) {
+		WheelTimer *timer = m_expired;
+		unlink(timer);
+		timer->m_wheel = nullptr;
+	}
+}
+
+TimerWheel *TimerWheel::instance()
+{
+	static QThreadStorage<TimerWheel *> wheels;
+	if (!wheels.hasLocalData()) {
+		wheels.setLocalData(new TimerWheel);
+	}
+	return wheels.localData();
+}
+
+int TimerWheel::activeTimers() const
+{
+	return m_activeTimers;
+}
+
+qint64 TimerWheel::elapsedTicks() const
+{
+	return m_clock.elapsed() / TICK_MSEC;
+}
+
+void TimerWheel::add(WheelTimer *timer, int msec)
+{
+	if (m_activeTimers == 0) {
+		// The wheel was idle. Don't replay the ticks we missed
+		m_currentTick = elapsedTicks();
+		m_timer.start();
+	}
+
+	// Round up, a timer must never fire early
+	qint64 ticks = qMax(1, (msec + TICK_MSEC - 1) / TICK_MSEC);
+	timer->m_wheel = this;
+	timer->m_expiryTick = elapsedTicks() + ticks;
+	link(m_slots.data() + timer->m_expiryTick % NUMBER_OF_SLOTS, timer);
+	m_activeTimers++;
+}
+
+void TimerWheel::remove(WheelTimer *timer)
+{
+	unlink(timer);
+	timer->m_wheel = nullptr;
+	m_activeTimers--;
+	if (m_activeTimers == 0) {
+		m_timer.stop();
+	}
+}
+
+void TimerWheel::link(WheelTimer **head, WheelTimer *timer)
+{
+	timer->m_head = head;
+	timer->m_prev = nullptr;
+	timer->m_next = *head;
+	if (*head) {
+		(*head)->m_prev = timer;
+	}
+	*head = timer;
+}
+
+void TimerWheel::unlink(WheelTimer *timer)
+{
+	if (timer->m_prev) {
+		timer->m_prev->m_next = timer->m_next;
+	} else {
+		*timer->m_head = timer->m_next;
+	}
+	if (timer->m_next) {
+		timer->m_next->m_prev = timer->m_prev;
+	}
+	timer->m_head = nullptr;
+	timer->m_prev = nullptr;
+	timer->m_next = nullptr;
+}
+
+void TimerWheel::tick()
+{
+	qint64 now = elapsedTicks();
+	while (m_currentTick < now) {
+		m_currentTick++;
+
+		// Move the expired timers out of the slot first.
+		// The callbacks are free to start, stop or delete any timer
+		WheelTimer *timer = m_slots[m_currentTick % NUMBER_OF_SLOTS];
+		while (timer) {
+			WheelTimer *next = timer->m_next;
+			if (timer->m_expiryTick <= m_currentTick) {
+				unlink(timer);
+				link(&m_expired, timer);
+			}
+			timer = next;
+		}
+
+		while (m_expired) {
+			timer = m_expired;
+			unlink(timer);
+			timer->m_wheel = nullptr;
+			m_activeTimers--;
+			if (timer->m_callback) {
+				timer->m_callback();
+			}
+		}
+	}
+
+	if (m_activeTimers == 0) {
+		m_timer.stop();
+	}
+}
+
+
+WheelTimer::WheelTimer()
+	: m_interval(0)
+	, m_wheel(nullptr)
+	, m_expiryTick(0)
+	, m_head(nullptr)
+	, m_prev(nullptr)
+	, m_next(nullptr)
+{
+}
+
+WheelTimer::~WheelTimer()
+{
+	stop();
+}
+
+void WheelTimer::setCallback(const std::function<void()> &callback)
+{
+	m_callback = callback;
+}
+
+void WheelTimer::setInterval(int msec)
+{
+	m_interval = msec;
+}
+
+int WheelTimer::interval() const
+{
+	return m_interval;
+}
+
+bool WheelTimer::isActive() const
+{
+	return m_wheel != nullptr;
+}
+
+void WheelTimer::start(int msec)
+{
+	m_interval = msec;
+	start();
+}
+
+void WheelTimer::start()
+{
+	stop();
+	TimerWheel::instance()->add(this, m_interval);
+}
+
+void WheelTimer::stop()
+{
+	if (m_wheel) {
+		m_wheel->remove(this);
+	}
+}
@@ -0,0 +1,123 @@
+/* qTorrent - An open-source, cross-platform BitTorrent client
+ * Copyright (C) 2017 Petko Georgiev
+ *
+ * timerwheel.h
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <QObject>
+#include <QTimer>
+#include <QVector>
+#include <QElapsedTimer>
+#include <functional>
+
+class WheelTimer;
+
+/*
+ * A hashed timing wheel. Drives the timeouts of many objects
+ * (keep-alives, request timeouts, reconnects...) with a single QTimer,
+ * instead of one QTimer per timeout.
+ * Timers are kept in intrusive lists, one per slot of the wheel, so
+ * starting and stopping a timer is O(1).
+ * There is one wheel per thread, see instance().
+ */
+class TimerWheel : public QObject
+{
+	Q_OBJECT
+
+public:
+	/* The resolution of the wheel */
+	static const int TICK_MSEC = 100;
+	/* One revolution of the wheel is NUMBER_OF_SLOTS * TICK_MSEC milliseconds.
+	 * Longer timers simply stay in their slot for several revolutions */
+	static const int NUMBER_OF_SLOTS = 512;
+
+	~TimerWheel();
+
+	/* Returns the wheel of the calling thread. It is created on first use */
+	static TimerWheel *instance();
+
+	/* Number of running timers */
+	int activeTimers() const;
+
+private:
+	friend class WheelTimer;
+
+	TimerWheel();
+
+	QTimer m_timer;
+	QElapsedTimer m_clock;
+	qint64 m_currentTick;
+	int m_activeTimers;
+
+	/* Heads of the intrusive timer lists */
+	QVector<WheelTimer *> m_slots;
+	/* Timers that expired on the current tick and wait for their callback */
+	WheelTimer *m_expired;
+
+	qint64 elapsedTicks() const;
+	void add(WheelTimer *timer, int msec);
+	void remove(WheelTimer *timer);
+
+	static void link(WheelTimer **head, WheelTimer *timer);
+	static void unlink(WheelTimer *timer);
+
+private slots:
+	void tick();
+};
+
+/*
+ * A single-shot timer, driven by the TimerWheel of the thread
+ * where it was started. It is not a QObject and is cheap to have
+ * thousands of. The callback is called from the wheel's thread.
+ */
+class WheelTimer
+{
+public:
+	WheelTimer();
+	~WheelTimer();
+
+	void setCallback(const std::function<void()> &callback);
+	void setInterval(int msec);
+	int interval() const;
+	bool isActive() const;
+
+	/* (Re)starts the timer with the given/current interval */
+	void start(int msec);
+	void start();
+	void stop();
+
+private:
+	friend class TimerWheel;
+
+	std::function<void()> m_callback;
+	int m_interval;
+
+	/* Set while the timer is running */
+	TimerWheel *m_wheel;
+	qint64 m_expiryTick;
+
+	/* Intrusive list links */
+	WheelTimer **m_head;
+	WheelTimer *m_prev;
+	WheelTimer *m_next;
+
+	Q_DISABLE_COPY(WheelTimer)
+};
+
+#endif // TIMERWHEEL_H
@@ -26,17 +26,62 @@
 #include "qtorrent.h"
 #include "filecontroller.h"
 #include "trafficmonitor.h"
-#include "ui/mainwindow.h"
+#include "metadatadownloader.h"
+#include "readcache.h"
+#include "networkengine.h"
+#include "storage.h"
+#include "diskmanager.h"
+#include "merkletree.h"
 #include <QDir>
 #include <QFile>
+#include <QFileInfo>
+#include <QSettings>
 #include <QUrlQuery>
+#include <QTimer>
+#include <algorithm>
+
+/* Streaming */
+// The pieces within this many bytes after the playback cursor get deadlines
+const qint64 STREAMING_WINDOW_BYTES = 16 * 1024 * 1024;
+// Deadline of the piece at the cursor, and the assumed playback rate
+const int STREAMING_FIRST_DEADLINE_MSEC = 1000;
+const qint64 STREAMING_BYTES_PER_SECOND = 1024 * 1024;
+// Blocks of pieces due sooner than this are requested from more than one peer
+const int DUPLICATE_REQUEST_DEADLINE_MSEC = 3000;
+
+// Verified pieces are kept in memory until this many MiB are cached
+const int DEFAULT_WRITE_CACHE_SIZE_MIB = 16;
+
+// Files that are moved to another file system are copied at this rate
+const int DEFAULT_STORAGE_MOVE_RATE_MIB = 50;
+// Appended to the name of a moved file until it's completely copied
+const char MOVED_FILE_SUFFIX[] = ".moving";
+
+// A peer has this long to send the hashes of the blocks of a corrupt piece
+const int HASH_REQUEST_TIMEOUT_MSEC = 30000;
+// The most hashes a peer has to send for one request (BEP 52)
+const int MAX_HASHES_PER_REQUEST = 512;
+
+// Returns the size and modification time of the file as stored in the resume info
+static ResumeFileInfo currentFileInfo(const QFile *file)
+{
+	QFileInfo info(*file);
+	ResumeFileInfo fileInfo;
+	fileInfo.size = info.exists() ? info.size() : 0;
+	fileInfo.lastModified = info.exists() ? info.lastModified().toMSecsSinceEpoch() : -1;
+	return fileInfo;
+}
 
 Torrent::Torrent()
 	: m_state(New)
 	, m_torrentInfo(nullptr)
 	, m_trackerClient(nullptr)
 	, m_fileController(nullptr)
+	, m_disk(nullptr)
+	, m_diskIo(nullptr)
 	, m_trafficMonitor(new TrafficMonitor(this))
+	, m_metadataDownloader(nullptr)
+	, m_partFile(nullptr)
 	, m_bytesDownloadedOnStartup(0)
 	, m_bytesUploadedOnStartup(0)
 	, m_totalBytesDownloaded(0)
@@ -46,16 +91,30 @@ Torrent::Torrent()
 	, m_isDownloaded(false)
 	, m_isPaused(true)
 	, m_startAfterChecking(false)
+	, m_wakePeersPending(false)
+	, m_allocationMode(AllocateSparse)
+	, m_allocationProgress(0)
+	, m_writeCacheSize(0)
+	, m_writeCacheBytes(0)
+	, m_zeroCopyUpload(false)
+	, m_storageMove(nullptr)
+	, m_lastHashRequestId(0)
+	, m_resumeInfoDirty(true)
 {
 }
 
 Torrent::~Torrent()
 {
+	flushWriteCache();
+	waitForWrites();
+	delete m_diskIo;
+	QTorrent::instance()->readCache()->removeTorrent(this);
+
 	for (auto peer : m_peers) {
 		delete peer;
 	}
 
-	for (Piece *piece : m_pieces) {
+	for (Piece *piece : m_activePieces) {
 		delete piece;
 	}
 
@@ -71,9 +130,25 @@ Torrent::~Torrent()
 		delete file;
 	}
 
+	if (m_partFile) {
+		delete m_partFile;
+	}
+
 	if (m_fileController) {
 		delete m_fileController;
 	}
+
+	if (m_storageMove) {
+		// The copy was aborted with the file controller
+		if (!m_storageMove->copyDestination.isEmpty()) {
+			QFile::remove(m_storageMove->copyDestination);
+		}
+		delete m_storageMove;
+	}
+
+	if (m_metadataDownloader) {
+		delete m_metadataDownloader;
+	}
 }
 
 bool Torrent::createNew(TorrentInfo *torrentInfo, const QString &downloadLocation)
@@ -84,27 +159,11 @@ bool Torrent::createNew(TorrentInfo *torrentInfo, const QString &downloadLocatio
 	m_torrentInfo = torrentInfo;
 	m_downloadLocation = downloadLocation;
 
-	// Create all pieces but the last
-	// The last piece could have a different size than the others
-	for (int i = 0; i < m_torrentInfo->numberOfPieces() - 1; i++) {
-		m_pieces.push_back(new Piece(this, i, m_torrentInfo->pieceLength()));
-	}
-	int lastPieceLength = m_torrentInfo->length() % m_torrentInfo->pieceLength();
-	if (lastPieceLength == 0) {
-		// The size of the last piece is the same as the others
-		lastPieceLength = m_torrentInfo->pieceLength();
-	}
-	// Create the last piece
-	m_pieces.push_back(new Piece(this, m_torrentInfo->numberOfPieces() - 1, lastPieceLength));
+	initPieceState();
 
 	// Create the tracker client
 	m_trackerClient = new TrackerClient(this);
 
-	// Create the file controller
-	m_fileController = new FileController(this);
-	connect(this, &Torrent::checkingStarted, m_fileController, &FileController::checkTorrent);
-	connect(m_fileController, &FileController::torrentChecked, this, &Torrent::onChecked);
-
 	m_state = Stopped;
 
 	// Creates QFile objects
@@ -120,38 +179,36 @@ bool Torrent::createFromResumeInfo(TorrentInfo *torrentInfo, ResumeInfo *resumeI
 
 	m_torrentInfo = torrentInfo;
 
-	// Create all pieces but the last
-	// The last piece could have a different size than the others
-	for (int i = 0; i < m_torrentInfo->numberOfPieces() - 1; i++) {
-		m_pieces.push_back(new Piece(this, i, m_torrentInfo->pieceLength()));
-	}
-	int lastPieceLength = m_torrentInfo->length() % m_torrentInfo->pieceLength();
-	if (lastPieceLength == 0) {
-		// The size of the last piece is the same as the others
-		lastPieceLength = m_torrentInfo->pieceLength();
-	}
-	// Create the last piece
-	m_pieces.push_back(new Piece(this, m_torrentInfo->numberOfPieces() - 1, lastPieceLength));
-
 	// Create the tracker client
 	m_trackerClient = new TrackerClient(this);
 
-	// Create the file controller
-	m_fileController = new FileController(this);
-	connect(this, &Torrent::checkingStarted, m_fileController, &FileController::checkTorrent);
-	connect(m_fileController, &FileController::torrentChecked, this, &Torrent::onChecked);
-
-	if (m_pieces.size() != resumeInfo->aquiredPieces().size()) {
+	const QVector<bool> &aquiredPieces = resumeInfo->aquiredPieces();
+	if (m_torrentInfo->numberOfPieces() != aquiredPieces.size()) {
 		setError("The number of pieces in the TorrentInfo does not match the one in the ResumeInfo");
 		return false;
 	}
 
-	// Set all aquired pieces
-	for (Piece *piece : m_pieces) {
-		if (resumeInfo->aquiredPieces().at(piece->pieceNumber())) {
-			setPieceAvailable(piece, true);
+	if (resumeInfo->filePriorities().size() == m_torrentInfo->fileInfos().size()) {
+		m_filePriorities = resumeInfo->filePriorities();
+	}
+	// The torrent file of a v2 torrent may lack the piece layers
+	const QMap<QByteArray, QByteArray> &pieceLayers = resumeInfo->pieceLayers();
+	for (auto it = pieceLayers.constBegin(); it != pieceLayers.constEnd(); ++it) {
+		int fileIndex = fileWithPiecesRoot(it.key());
+		if (fileIndex >= 0 && (!m_torrentInfo->pieceLayer(fileIndex).isEmpty()
+							   || m_torrentInfo->setPieceLayer(fileIndex, it.value()))) {
+			m_fetchedPieceLayers.insert(it.key());
+		}
+	}
+	initPieceState();
+	for (int i = 0; i < aquiredPieces.size(); i++) {
+		if (aquiredPieces[i]) {
+			m_havePieces.setBit(i);
+			m_downloadedPieces++;
+			m_bytesAvailable += pieceSize(i);
 		}
 	}
+	m_isDownloaded = (m_downloadedPieces == m_torrentInfo->numberOfPieces());
 
 	m_downloadLocation = resumeInfo->downloadLocation();
 
@@ -163,33 +220,327 @@ bool Torrent::createFromResumeInfo(TorrentInfo *torrentInfo, ResumeInfo *resumeI
 	// Creates QFile objects
 	loadFileDescriptors();
 
-	if (resumeInfo->paused()) {
-		pause();
-	} else {
-		start();
+	// Only verify the files that were modified while we weren't running
+	QVector<int> changedPieces = piecesInChangedFiles(resumeInfo->fileInfos());
+
+	// Continue the pieces that were partially downloaded. Their
+	// blocks are already in the files, unless those were modified
+	for (const ResumePartialPiece &partialPiece : resumeInfo->partialPieces()) {
+		int pieceNumber = partialPiece.pieceNumber;
+		if (pieceNumber < 0 || pieceNumber >= m_torrentInfo->numberOfPieces()
+				|| m_havePieces.testBit(pieceNumber) || m_activePieces.contains(pieceNumber)
+				|| changedPieces.contains(pieceNumber)) {
+			continue;
+		}
+		Piece *piece = new Piece(this, pieceNumber, pieceSize(pieceNumber));
+		if (piece->restoreBlocks(partialPiece.blocks)) {
+			m_activePieces.insert(pieceNumber, piece);
+		} else {
+			// The blocks may make up a complete piece
+			delete piece;
+			changedPieces.push_back(pieceNumber);
+		}
+	}
+
+	if (!changedPieces.isEmpty()) {
+		qDebug() << "Rechecking" << changedPieces.size() << "pieces of"
+				 << m_torrentInfo->torrentName() << "in modified files";
+		checkPieces(changedPieces);
+	}
+
+	// The torrent manager starts the torrent later, if it isn't paused
+	m_isPaused = resumeInfo->paused();
+
+	return true;
+}
+
+QVector<int> Torrent::piecesInChangedFiles(const QVector<ResumeFileInfo> &savedFileInfos) const
+{
+	QVector<int> pieces;
+	if (savedFileInfos.size() != m_files.size()) {
+		// Resume data of an older version without file information
+		return pieces;
+	}
+
+	const QList<FileInfo> &fileInfos = m_torrentInfo->fileInfos();
+	qint64 pieceLength = m_torrentInfo->pieceLength();
+	qint64 offset = 0;
+	for (int i = 0; i < m_files.size(); i++) {
+		qint64 length = fileInfos[i].length;
+		ResumeFileInfo current = currentFileInfo(m_files[i]);
+		const ResumeFileInfo &saved = savedFileInfos[i];
+		if (length > 0 && (current.size != saved.size || current.lastModified != saved.lastModified)) {
+			int firstPiece = offset / pieceLength;
+			int lastPiece = (offset + length - 1) / pieceLength;
+			// Files share their boundary pieces
+			if (!pieces.isEmpty() && pieces.last() >= firstPiece) {
+				firstPiece = pieces.last() + 1;
+			}
+			for (int piece = firstPiece; piece <= lastPiece; piece++) {
+				pieces.push_back(piece);
+			}
+		}
+		offset += length;
+	}
+	return pieces;
+}
+
+bool Torrent::createFromMagnetLink(TorrentInfo *torrentInfo, const QString &downloadLocation)
+{
+	clearError();
+	m_state = Loading;
+
+	m_torrentInfo = torrentInfo;
+	m_downloadLocation = downloadLocation;
+
+	// Create the tracker client
+	m_trackerClient = new TrackerClient(this);
+
+	// Pieces and files are created when the metadata arrives
+	m_metadataDownloader = new MetadataDownloader(this);
+	connect(m_metadataDownloader, &MetadataDownloader::metadataDownloaded,
+			this, &Torrent::onMetadataDownloaded, Qt::QueuedConnection);
+
+	return true;
+}
+
+bool Torrent::createFromMagnetLink(TorrentInfo *torrentInfo, ResumeInfo *resumeInfo)
+{
+	if (!createFromMagnetLink(torrentInfo, resumeInfo->downloadLocation())) {
+		return false;
 	}
 
+	// The torrent manager starts the torrent later, if it isn't paused
+	m_isPaused = resumeInfo->paused();
+
 	return true;
 }
 
+void Torrent::initPieceState()
+{
+	int numberOfPieces = m_torrentInfo->numberOfPieces();
+	m_havePieces = QBitArray(numberOfPieces);
+	m_pieceAvailability = QVector<quint16>(numberOfPieces, 0);
+	m_piecePriorities = QVector<quint8>(numberOfPieces, NormalPriority);
+
+	// Keep the file priorities that were set before the metadata was known
+	int numberOfFiles = m_torrentInfo->fileInfos().size();
+	if (m_filePriorities.size() != numberOfFiles) {
+		m_filePriorities = QVector<quint8>(numberOfFiles, NormalPriority);
+	}
+	updatePiecePriorities();
+}
+
+void Torrent::updatePiecePriorities()
+{
+	// A piece gets the highest priority of the files it belongs to
+	m_piecePriorities.fill(DontDownload);
+	const QList<FileInfo> &fileInfos = m_torrentInfo->fileInfos();
+	qint64 pieceLength = m_torrentInfo->pieceLength();
+	qint64 fileBegin = 0;
+	for (int i = 0; i < fileInfos.size(); i++) {
+		qint64 length = fileInfos[i].length;
+		if (length > 0) {
+			int firstPiece = fileBegin / pieceLength;
+			int lastPiece = (fileBegin + length - 1) / pieceLength;
+			for (int piece = firstPiece; piece <= lastPiece; piece++) {
+				m_piecePriorities[piece] = qMax(m_piecePriorities[piece], m_filePriorities[i]);
+			}
+		}
+		fileBegin += length;
+	}
+	// Pieces of files that were skipped may be wanted now
+	wakePeers();
+}
+
+bool Torrent::usesPartFile(int fileIndex) const
+{
+	// Skipped files aren't created. The pieces they share with
+	// wanted files are stored in the part file instead
+	return m_filePriorities[fileIndex] == DontDownload && !m_files[fileIndex]->exists();
+}
+
+bool Torrent::isPadFile(int fileIndex) const
+{
+	return m_torrentInfo->fileInfos()[fileIndex].isPadFile;
+}
+
+QString Torrent::partFilePath() const
+{
+	return partFilePath(m_downloadLocation);
+}
+
+QString Torrent::partFilePath(const QString &location) const
+{
+	QString path = location;
+	if (path[path.size() - 1] != '/') {
+		path.append('/');
+	}
+	return path + "." + m_torrentInfo->infoHash().toHex() + ".parts";
+}
+
+QString Torrent::filePath(const QString &location, int fileIndex) const
+{
+	const FileInfo &info = m_torrentInfo->fileInfos()[fileIndex];
+	QString path = location;
+	if (path[path.size() - 1] != '/') {
+		path.append('/');
+	}
+	for (int j = 0; j < info.path.size() - 1; j++) {
+		path.append(info.path[j]);
+		path.append('/');
+	}
+	return path + info.path.last();
+}
+
+void Torrent::moveFromPartFile(int fileIndex)
+{
+	if (!m_partFile->exists()) {
+		return;
+	}
+
+	// Only the first and the last piece of a skipped file can be shared
+	// with other files, so only they can have data in the part file
+	qint64 pieceLength = m_torrentInfo->pieceLength();
+	qint64 fileBegin = m_fileOffsets[fileIndex];
+	qint64 fileEnd = m_fileOffsets[fileIndex + 1];
+	if (fileEnd == fileBegin) {
+		return;
+	}
+	int firstPiece = fileBegin / pieceLength;
+	int lastPiece = (fileEnd - 1) / pieceLength;
+
+	if (!m_partFile->open(QIODevice::ReadOnly)) {
+		qDebug() << "Failed to open file" << m_partFile->fileName() << ":" << m_partFile->errorString();
+		return;
+	}
+	QList<int> pieces;
+	pieces << firstPiece;
+	if (lastPiece != firstPiece) {
+		pieces << lastPiece;
+	}
+	for (int pieceNumber : pieces) {
+		if (!m_havePieces.testBit(pieceNumber)) {
+			continue;
+		}
+		qint64 pieceBegin = pieceNumber * pieceLength;
+		qint64 begin = qMax(fileBegin, pieceBegin);
+		qint64 size = qMin(fileEnd, pieceBegin + pieceSize(pieceNumber)) - begin;
+		QByteArray blockData;
+		if (m_partFile->seek(begin)) {
+			blockData = m_partFile->read(size);
+		}
+		if (blockData.size() != size) {
+			qDebug() << "Failed to read piece" << pieceNumber << "from the part file";
+			continue;
+		}
+		// The file isn't skipped anymore, so this goes to the file itself
+		writeBlock(pieceNumber, begin - pieceBegin, blockData, [pieceNumber](bool ok) {
+			if (!ok) {
+				qDebug() << "Failed to move piece" << pieceNumber << "from the part file";
+			}
+		});
+	}
+	m_partFile->close();
+}
+
+int Torrent::firstFileAt(qint64 offset) const
+{
+	// The first file that begins at or after the offset,
+	// not counting the end of the last file
+	auto it = std::lower_bound(m_fileOffsets.constBegin(), m_fileOffsets.constEnd() - 1, offset);
+	int index = it - m_fileOffsets.constBegin();
+	// If it begins after the offset, the one before contains it
+	if (index > 0 && (index == m_files.size() || m_fileOffsets[index] > offset)) {
+		index--;
+	}
+	return index;
+}
+
+qint64 Torrent::fileOffset(int fileIndex) const
+{
+	return m_fileOffsets[fileIndex];
+}
+
+int Torrent::pieceSize(int pieceNumber) const
+{
+	return m_torrentInfo->pieceSize(pieceNumber);
+}
+
+void Torrent::createFileController()
+{
+	if (m_fileController) {
+		return;
+	}
+	m_disk = QTorrent::instance()->diskManager()->diskOf(m_downloadLocation);
+	m_fileController = new FileController(this, m_disk);
+	connect(this, &Torrent::checkingStarted, m_fileController, &FileController::checkTorrent);
+	connect(this, &Torrent::checkingPiecesStarted, m_fileController, &FileController::checkPieces);
+	connect(m_fileController, &FileController::torrentChecked, this, &Torrent::onChecked);
+	connect(this, &Torrent::allocationStarted, m_fileController, &FileController::allocateFiles);
+	connect(m_fileController, &FileController::allocationProgress, this, &Torrent::onAllocationProgress);
+	connect(m_fileController, &FileController::filesAllocated, this, &Torrent::onFilesAllocated);
+	connect(this, &Torrent::fileCopyStarted, m_fileController, &FileController::copyFile);
+	connect(m_fileController, &FileController::fileCopied, this, &Torrent::onFileCopied);
+}
+
 void Torrent::loadFileDescriptors()
 {
 	const QList<FileInfo> &fileInfos = m_torrentInfo->fileInfos();
+	qint64 offset = 0;
 	for (int i = 0; i < fileInfos.size(); i++) {
-		FileInfo info = fileInfos[i];
-		QString path = m_downloadLocation;
-		if (path[path.size() - 1] != '/') {
-			path.append('/');
-		}
-		for (int j = 0; j < info.path.size() - 1; j++) {
-			path.append(info.path[j]);
-			path.append('/');
-		}
-		QDir dir;
-		dir.mkpath(path);
-		path += info.path.last();
+		QString path = filePath(m_downloadLocation, i);
+		// The directories are created when the data is written
+		m_fileDirectories.append(path.left(path.lastIndexOf('/') + 1));
 		m_files.append(new QFile(path));
+
+		m_fileOffsets.push_back(offset);
+		offset += fileInfos[i].length;
 	}
+	// The end of the last file
+	m_fileOffsets.push_back(offset);
+	m_partFile = new QFile(partFilePath());
+
+	QSettings settings;
+	int allocationMode = settings.value("AllocationMode", AllocateSparse).toInt();
+	settings.setValue("AllocationMode", allocationMode);
+	if (allocationMode >= AllocateNone && allocationMode <= AllocateFull) {
+		m_allocationMode = AllocationMode(allocationMode);
+	}
+	int writeCacheSize = settings.value("WriteCacheSize", DEFAULT_WRITE_CACHE_SIZE_MIB).toInt();
+	settings.setValue("WriteCacheSize", writeCacheSize);
+	m_writeCacheSize = qMax(writeCacheSize, 0) * qint64(1024 * 1024);
+	m_zeroCopyUpload = settings.value("ZeroCopyUpload", true).toBool();
+	settings.setValue("ZeroCopyUpload", m_zeroCopyUpload);
+}
+
+void Torrent::allocateFiles()
+{
+	// The files are allocated at their new location after moving
+	if (m_allocationMode != AllocateFull || !hasMetadata() || m_storageMove) {
+		return;
+	}
+	QStringList filePaths;
+	QVector<qint64> fileSizes;
+	const QList<FileInfo> &fileInfos = m_torrentInfo->fileInfos();
+	for (int i = 0; i < m_files.size(); i++) {
+		if (m_filePriorities[i] != DontDownload && !isPadFile(i)) {
+			filePaths.push_back(m_files[i]->fileName());
+			fileSizes.push_back(fileInfos[i].length);
+		}
+	}
+	if (filePaths.isEmpty()) {
+		return;
+	}
+
+	// A running torrent keeps running. Reserving space doesn't touch the
+	// data, so it's safe to write pieces at the same time
+	if (m_state == Stopped) {
+		m_state = Allocating;
+	}
+	m_allocationProgress = 0;
+	createFileController();
+	emit allocationStarted(filePaths, fileSizes);
 }
 
 ResumeInfo Torrent::getResumeInfo() const
@@ -199,13 +550,55 @@ ResumeInfo Torrent::getResumeInfo() const
 	resumeInfo.setTotalBytesDownloaded(m_totalBytesDownloaded);
 	resumeInfo.setTotalBytesUploaded(m_totalBytesUploaded);
 	resumeInfo.setPaused(m_isPaused);
-	resumeInfo.setAquiredPieces(bitfield());
+	// The pieces that aren't written yet are downloaded again after a crash
+	QVector<bool> pieces = bitfield();
+	for (auto it = m_writeCache.constBegin(); it != m_writeCache.constEnd(); ++it) {
+		pieces[it.key()] = false;
+	}
+	for (auto it = m_writingPieces.constBegin(); it != m_writingPieces.constEnd(); ++it) {
+		pieces[it.key()] = false;
+	}
+	resumeInfo.setAquiredPieces(pieces);
+	QVector<ResumeFileInfo> fileInfos;
+	for (QFile *file : m_files) {
+		fileInfos.push_back(currentFileInfo(file));
+	}
+	resumeInfo.setFileInfos(fileInfos);
+	resumeInfo.setFilePriorities(m_filePriorities);
+	QMap<QByteArray, QByteArray> pieceLayers;
+	for (const QByteArray &piecesRoot : m_fetchedPieceLayers) {
+		int fileIndex = fileWithPiecesRoot(piecesRoot);
+		if (fileIndex >= 0) {
+			pieceLayers[piecesRoot] = m_torrentInfo->pieceLayer(fileIndex);
+		}
+	}
+	resumeInfo.setPieceLayers(pieceLayers);
+	QVector<ResumePartialPiece> partialPieces;
+	for (Piece *piece : m_activePieces) {
+		ResumePartialPiece partialPiece;
+		partialPiece.pieceNumber = piece->pieceNumber();
+		partialPiece.blocks = piece->savedBlocks();
+		if (!partialPiece.blocks.isEmpty()) {
+			partialPieces.push_back(partialPiece);
+		}
+	}
+	resumeInfo.setPartialPieces(partialPieces);
 	return resumeInfo;
 }
 
+bool Torrent::isResumeInfoDirty() const
+{
+	return m_resumeInfoDirty;
+}
+
+void Torrent::setResumeInfoDirty(bool dirty)
+{
+	m_resumeInfoDirty = dirty;
+}
+
 void Torrent::start()
 {
-	if (m_state == Checking) {
+	if (m_state == Checking || m_state == Allocating) {
 		m_startAfterChecking = true;
 		return;
 	}
@@ -218,10 +611,15 @@ void Torrent::start()
 	}
 
 	// Start all peers
+	m_isPaused = false;
+	m_resumeInfoDirty = true;
 	for (Peer *peer :  m_peers) {
 		peer->start();
 	}
-	m_isPaused = false;
+	if (m_state == Loading) {
+		// Keep fetching the metadata. onMetadataDownloaded() will start the torrent
+		return;
+	}
 	m_state = Started;
 }
 
@@ -232,10 +630,22 @@ void Torrent::pause()
 		peer->pause();
 	}
 	m_isPaused = true;
+	m_resumeInfoDirty = true;
 }
 
 void Torrent::stop()
 {
+	if (m_state == Loading && m_metadataDownloader) {
+		// Stop fetching the metadata
+		if (m_trackerClient->hasAnnouncedStarted()) {
+			m_trackerClient->announce(TrackerClient::Stopped);
+		}
+		m_isPaused = true;
+		for (Peer *peer : m_peers) {
+			peer->disconnect();
+		}
+		return;
+	}
 	if (m_state != Started) {
 		return;
 	}
@@ -246,192 +656,1086 @@ void Torrent::stop()
 		peer->disconnect();
 	}
 	m_state = Stopped;
+	flushWriteCache();
+}
+
+void Torrent::check()
+{
+	// The file names change while the files are moved
+	if (m_storageMove) {
+		return;
+	}
+	// The file controller checks after it's done allocating
+	if (m_state == Started) {
+		stop();
+		m_startAfterChecking = true;
+	} else if (m_state != Stopped && m_state != Allocating) {
+		return;
+	}
+	// The pieces being written are checked from the files
+	flushWriteCache();
+	waitForWrites();
+	m_state = Checking;
+	createFileController();
+	emit checkingStarted(checkLayout());
+}
+
+void Torrent::checkPieces(const QVector<int> &pieceNumbers)
+{
+	if (m_storageMove) {
+		return;
+	}
+	if (m_state == Started) {
+		stop();
+		m_startAfterChecking = true;
+	} else if (m_state != Stopped && m_state != Allocating) {
+		return;
+	}
+	flushWriteCache();
+	waitForWrites();
+	m_state = Checking;
+	createFileController();
+	emit checkingPiecesStarted(checkLayout(), pieceNumbers);
+}
+
+CheckLayout Torrent::checkLayout() const
+{
+	CheckLayout layout;
+	for (int i = 0; i < m_files.size(); i++) {
+		CheckedFile file;
+		file.fileName = m_files[i]->fileName();
+		file.begin = m_fileOffsets[i];
+		file.offset = 0;
+		file.size = m_fileOffsets[i + 1] - m_fileOffsets[i];
+		file.isPadFile = isPadFile(i);
+		if (!file.isPadFile && usesPartFile(i)) {
+			// The part file keeps the data at its offset in the torrent
+			file.fileName = m_partFile->fileName();
+			file.offset = file.begin;
+		}
+		layout.files.push_back(file);
+	}
+	layout.pieceLength = m_torrentInfo->pieceLength();
+	layout.totalSize = m_fileOffsets.last();
+	layout.numberOfPieces = m_torrentInfo->numberOfPieces();
+	layout.isV2Only = m_torrentInfo->isV2Only();
+	if (layout.isV2Only) {
+		// The piece layers that aren't known yet are zeros, those pieces fail
+		for (int i = 0; i < layout.numberOfPieces; i++) {
+			QByteArray root = m_torrentInfo->pieceRoot(i);
+			if (root.size() != MerkleTree::HASH_SIZE) {
+				root = QByteArray(MerkleTree::HASH_SIZE, '\0');
+			}
+			layout.pieceHashes.append(root);
+		}
+	} else {
+		layout.pieceHashes = m_torrentInfo->pieceHashes();
+	}
+	return layout;
+}
+
+Peer *Torrent::connectToPeer(QHostAddress address, int port)
+{
+	// Don't add the peer if he's already added
+	for (auto p : m_peers) {
+		if (p->port() == port && p->address() == address) {
+			return nullptr;
+		}
+	}
+
+	// Add the peer
+	Peer *peer = Peer::createServer(this, address, port);
+	m_trafficMonitor->addPeer(peer);
+	m_peers.push_back(peer);
+
+	if(isStarted() || isFetchingMetadata()) {
+		// Always start connecting
+		peer->startConnection();
+
+		// Pause the peer if needed
+		if (m_isPaused) {
+			peer->pause();
+		}
+	}
+
+	qDebug() << "Added peer" << peer->addressPort();
+	return peer;
+}
+
+void Torrent::addPeer(Peer *peer)
+{
+	// If there's another identical peer - replace it
+	for (Peer *&p : m_peers) {
+		if (p->port() == peer->port() && p->address() == peer->address()) {
+			p->deleteLater();
+			p = peer;
+			return;
+		}
+	}
+
+	// Else - add it to the list
+	m_peers.push_back(peer);
+	m_trafficMonitor->addPeer(peer);
+	qDebug() << "Added peer" << peer->addressPort();
+}
+
+void Torrent::wakePeers()
+{
+	// Many blocks are often released at once, e.g. when a peer disconnects
+	if (m_wakePeersPending) {
+		return;
+	}
+	m_wakePeersPending = true;
+	QTimer::singleShot(0, this, [this]() {
+		m_wakePeersPending = false;
+		for (Peer *peer : m_peers) {
+			peer->onRequestsAvailable();
+		}
+	});
+}
+
+Block *Torrent::requestBlock(Peer *peer, int size)
+{
+	Block *returnBlock = nullptr;
+
+	// Pieces with a deadline come first. Pieces without one are still
+	// picked rarest-first, so that streaming doesn't hurt the swarm
+	returnBlock = requestTimeCriticalBlock(peer, size);
+	if (returnBlock != nullptr) {
+		return returnBlock;
+	}
+
+	// Finish the pieces that are already being downloaded first
+	for (Piece *piece : m_activePieces) {
+		if (m_piecePriorities[piece->pieceNumber()] != DontDownload
+				&& peer->canRequestPiece(piece->pieceNumber())) {
+			returnBlock = piece->requestBlock(size);
+			if (returnBlock != nullptr) {
+				return returnBlock;
+			}
+		}
+	}
+
+	// Start downloading a new piece
+	int pieceNumber = pickPiece(peer);
+	if (pieceNumber != -1) {
+		Piece *piece = new Piece(this, pieceNumber, pieceSize(pieceNumber));
+		m_activePieces.insert(pieceNumber, piece);
+		returnBlock = piece->requestBlock(size);
+		if (returnBlock != nullptr) {
+			return returnBlock;
+		}
+	}
+
+	// No unrequested blocks, try to find some timed-out blocks
+	for (auto p : m_peers) {
+		if (p != peer && p->hasTimedOut()) {
+			for (auto block : p->blocksQueue()) {
+				if (peer->canRequestPiece(block->piece()->pieceNumber())) {
+					return block;
+				}
+			}
+		}
+	}
+
+	// No blocks
+	return nullptr;
+}
+
+Block *Torrent::requestTimeCriticalBlock(Peer *peer, int size)
+{
+	if (m_pieceDeadlines.isEmpty() || !isFastPeer(peer)) {
+		return nullptr;
+	}
+
+	// Earliest deadline first
+	QList<QPair<qint64, int>> pieces;
+	for (auto it = m_pieceDeadlines.begin(); it != m_pieceDeadlines.end(); ++it) {
+		pieces.push_back(qMakePair(it.value(), it.key()));
+	}
+	std::sort(pieces.begin(), pieces.end());
+
+	qint64 now = m_deadlineClock.elapsed();
+	for (const QPair<qint64, int> &deadline : pieces) {
+		int pieceNumber = deadline.second;
+		if (!peer->canRequestPiece(pieceNumber)) {
+			continue;
+		}
+		Piece *piece = m_activePieces.value(pieceNumber);
+		if (piece == nullptr) {
+			piece = new Piece(this, pieceNumber, pieceSize(pieceNumber));
+			m_activePieces.insert(pieceNumber, piece);
+		}
+		Block *block = piece->requestBlock(size);
+		if (block == nullptr && deadline.first - now < DUPLICATE_REQUEST_DEADLINE_MSEC) {
+			// Everything is requested, but the piece is due soon. Ask this
+			// peer too, the first one to send a block cancels the others
+			block = piece->requestDuplicateBlock(peer);
+		}
+		if (block != nullptr) {
+			return block;
+		}
+	}
+	return nullptr;
+}
+
+bool Torrent::isFastPeer(Peer *peer) const
+{
+	// At least half as fast as the average peer that sends us data
+	qint64 totalRate = 0;
+	int sendingPeers = 0;
+	for (Peer *p : m_peers) {
+		qint64 rate = p->downloadRate();
+		if (rate > 0) {
+			totalRate += rate;
+			sendingPeers++;
+		}
+	}
+	if (sendingPeers == 0) {
+		// No measurements yet
+		return true;
+	}
+	return peer->downloadRate() * 2 * sendingPeers >= totalRate;
+}
+
+void Torrent::setPieceDeadline(int pieceNumber, int msec)
+{
+	if (pieceNumber < 0 || pieceNumber >= m_havePieces.size() || m_havePieces.testBit(pieceNumber)) {
+		return;
+	}
+	if (!m_deadlineClock.isValid()) {
+		m_deadlineClock.start();
+	}
+	m_pieceDeadlines.insert(pieceNumber, m_deadlineClock.elapsed() + msec);
+}
+
+void Torrent::clearPieceDeadlines()
+{
+	m_pieceDeadlines.clear();
+}
+
+void Torrent::setPlaybackCursor(qint64 offset)
+{
+	if (!hasMetadata() || offset < 0 || offset >= m_fileOffsets.last()) {
+		return;
+	}
+	clearPieceDeadlines();
+
+	// The pieces are needed one after another, at the playback rate
+	qint64 pieceLength = m_torrentInfo->pieceLength();
+	int firstPiece = offset / pieceLength;
+	int lastPiece = qMin((offset + STREAMING_WINDOW_BYTES) / pieceLength,
+						 qint64(m_torrentInfo->numberOfPieces() - 1));
+	for (int i = firstPiece; i <= lastPiece; i++) {
+		qint64 bytesAhead = qMax(i * pieceLength - offset, qint64(0));
+		setPieceDeadline(i, STREAMING_FIRST_DEADLINE_MSEC + bytesAhead * 1000 / STREAMING_BYTES_PER_SECOND);
+	}
+}
+
+int Torrent::pickPiece(Peer *peer) const
+{
+	// The rarest of the most important pieces that the peer has
+	int best = -1;
+	for (int i = 0; i < m_havePieces.size(); i++) {
+		if (m_havePieces.testBit(i) || m_piecePriorities[i] == DontDownload
+				|| !peer->canRequestPiece(i) || m_activePieces.contains(i)) {
+			continue;
+		}
+		if (best == -1 || m_piecePriorities[i] > m_piecePriorities[best]
+				|| (m_piecePriorities[i] == m_piecePriorities[best]
+					&& m_pieceAvailability[i] < m_pieceAvailability[best])) {
+			best = i;
+		}
+	}
+	return best;
+}
+
+void Torrent::savePiece(Piece *piece)
+{
+	// Keep the piece until enough pieces are cached to write them in large runs
+	QByteArray &cached = m_writeCache[piece->pieceNumber()];
+	m_writeCacheBytes -= cached.size();
+	cached = QByteArray(piece->data(), piece->size());
+	m_writeCacheBytes += cached.size();
+	if (m_writeCacheBytes >= m_writeCacheSize) {
+		flushWriteCache();
+	}
+}
+
+void Torrent::flushWriteCache()
+{
+	if (m_writeCache.isEmpty()) {
+		return;
+	}
+
+	// The cache is sorted by piece number, so by offset in the torrent.
+	// Consecutive pieces are written together
+	auto it = m_writeCache.constBegin();
+	while (it != m_writeCache.constEnd()) {
+		int firstPiece = it.key();
+		int nextPiece = firstPiece;
+		QList<QByteArray> buffers;
+		for (; it != m_writeCache.constEnd() && it.key() == nextPiece; ++it, nextPiece++) {
+			// Shared, not copied
+			m_writingPieces.insert(it.key(), it.value());
+			buffers.append(it.value());
+		}
+		qint64 offset = m_torrentInfo->pieceLength();
+		offset *= firstPiece;
+		writeBuffers(offset, buffers, [this, firstPiece, nextPiece](bool ok) {
+			onPiecesWritten(firstPiece, nextPiece, ok);
+		});
+	}
+	m_writeCache.clear();
+	m_writeCacheBytes = 0;
+}
+
+void Torrent::onPiecesWritten(int firstPiece, int endPiece, bool ok)
+{
+	if (!ok) {
+		qDebug() << "Failed to write pieces" << firstPiece << "to" << endPiece - 1;
+	}
+
+	// The pieces stay in memory for uploading, they are shared, not copied.
+	// Most recently downloaded pieces are the ones other peers ask for
+	ReadCache *readCache = QTorrent::instance()->readCache();
+	for (int i = firstPiece; i < endPiece; i++) {
+		QByteArray pieceData = m_writingPieces.take(i);
+		if (ok) {
+			readCache->insert(this, i, pieceData);
+		} else {
+			// The piece didn't make it to the files, it has to be downloaded again
+			setPieceAvailable(i, false);
+		}
+	}
+	if (!ok) {
+		m_resumeInfoDirty = true;
+	}
+}
+
+void Torrent::waitForWrites()
+{
+	if (m_diskIo) {
+		m_diskIo->waitForJobs();
+	}
+}
+
+void Torrent::savePartialPieces()
+{
+	for (Piece *piece : m_activePieces) {
+		piece->saveDownloadedBlocks();
+	}
+}
+
+void Torrent::syncFiles(const DiskIo::Callback &done)
+{
+	// Queued even if there is nothing to sync, it's done after the writes before it
+	QStringList fileNames = m_unsyncedFiles.values();
+	m_unsyncedFiles.clear();
+	diskIo()->sync(fileNames, [this, fileNames, done](bool ok) {
+		if (!ok) {
+			for (const QString &fileName : fileNames) {
+				m_unsyncedFiles.insert(fileName);
+			}
+		}
+		done(ok);
+	});
+}
+
+bool Torrent::requestBlockHashes(Piece *piece)
+{
+	int pieceNumber = piece->pieceNumber();
+	HashRequest request;
+	if (!makeHashRequest(pieceNumber, request)) {
+		return false;
+	}
+	for (Peer *peer : m_peers) {
+		if (!peer->isConnected() || !peer->supportsV2() || !peer->hasPiece(pieceNumber)) {
+			continue;
+		}
+		request.id = ++m_lastHashRequestId;
+		m_hashRequests[pieceNumber] = request;
+		peer->sendHashRequest(request.piecesRoot, 0, request.index, request.length, request.proofLayers);
+
+		int id = request.id;
+		QTimer::singleShot(HASH_REQUEST_TIMEOUT_MSEC, this, [this, pieceNumber, id]() {
+			if (m_hashRequests.contains(pieceNumber) && m_hashRequests[pieceNumber].id == id) {
+				qDebug() << "Hash request for piece" << pieceNumber << "timed out";
+				finishHashRequest(pieceNumber, QByteArray());
+			}
+		});
+		return true;
+	}
+	return false;
+}
+
+void Torrent::onHashesReceived(const QByteArray &piecesRoot, int baseLayer, int index, int length,
+							   int proofLayers, const QByteArray &hashes)
+{
+	if (baseLayer != 0) {
+		onPieceLayerHashes(piecesRoot, baseLayer, index, length, proofLayers, hashes);
+		return;
+	}
+	for (auto it = m_hashRequests.constBegin(); it != m_hashRequests.constEnd(); ++it) {
+		const HashRequest &request = it.value();
+		if (request.piecesRoot != piecesRoot || request.index != index
+				|| request.length != length || request.proofLayers != proofLayers) {
+			continue;
+		}
+
+		// The hashes are followed by the proof. Both must lead to the known root
+		QByteArray blockHashes = hashes.left(length * MerkleTree::HASH_SIZE);
+		QByteArray uncles = hashes.mid(length * MerkleTree::HASH_SIZE);
+		bool valid = false;
+		if (blockHashes.size() == length * MerkleTree::HASH_SIZE
+				&& uncles.size() == proofLayers * MerkleTree::HASH_SIZE) {
+			QByteArray root = MerkleTree::root(blockHashes, length, QByteArray(MerkleTree::HASH_SIZE, '\0'));
+			root = MerkleTree::rootFromProof(root, index / length, uncles);
+			valid = MerkleTree::equal(root.constData(), request.expectedRoot.constData());
+		}
+		int pieceNumber = it.key();
+		if (!valid) {
+			qDebug() << "Received invalid hashes for piece" << pieceNumber;
+			blockHashes.clear();
+		}
+		finishHashRequest(pieceNumber, blockHashes);
+		return;
+	}
+}
+
+void Torrent::onHashesRejected(const QByteArray &piecesRoot, int baseLayer, int index, int length)
+{
+	if (baseLayer != 0) {
+		auto it = m_pieceLayerDownloads.find(piecesRoot);
+		if (it != m_pieceLayerDownloads.end() && it->chunkLength == length) {
+			it->requested.remove(index / length);
+		}
+		return;
+	}
+	for (auto it = m_hashRequests.constBegin(); it != m_hashRequests.constEnd(); ++it) {
+		const HashRequest &request = it.value();
+		if (request.piecesRoot == piecesRoot && baseLayer == 0
+				&& request.index == index && request.length == length) {
+			finishHashRequest(it.key(), QByteArray());
+			return;
+		}
+	}
+}
+
+bool Torrent::makeHashRequest(int pieceNumber, HashRequest &request) const
+{
+	if (!m_torrentInfo->isV2()) {
+		return false;
+	}
+
+	// The files of v2 and hybrid torrents start at piece boundaries, so
+	// the piece has the data of one file, maybe followed by padding
+	qint64 pieceLength = m_torrentInfo->pieceLength();
+	qint64 pieceBegin = pieceLength * pieceNumber;
+	int fileIndex = firstFileAt(pieceBegin);
+	while (fileIndex < m_files.size() && m_fileOffsets[fileIndex + 1] == m_fileOffsets[fileIndex]) {
+		fileIndex++;
+	}
+	if (fileIndex >= m_files.size() || isPadFile(fileIndex)) {
+		return false;
+	}
+	const FileInfo &fileInfo = m_torrentInfo->fileInfos()[fileIndex];
+	if (fileInfo.piecesRoot.isEmpty()) {
+		return false;
+	}
+
+	qint64 blocksPerPiece = pieceLength / MerkleTree::BLOCK_SIZE;
+	qint64 pieceInFile = (pieceBegin - m_fileOffsets[fileIndex]) / pieceLength;
+	qint64 dataSize = qMin(pieceLength, fileInfo.length - pieceInFile * pieceLength);
+	// Files larger than a piece have their tree padded to a power of two pieces
+	qint64 treeLeaves;
+	if (fileInfo.length > pieceLength) {
+		qint64 piecesInFile = (fileInfo.length + pieceLength - 1) / pieceLength;
+		request.index = pieceInFile * blocksPerPiece;
+		request.length = blocksPerPiece;
+		treeLeaves = MerkleTree::nextPowerOfTwo(piecesInFile) * blocksPerPiece;
+	} else {
+		request.index = 0;
+		request.length = MerkleTree::nextPowerOfTwo((dataSize + MerkleTree::BLOCK_SIZE - 1) / MerkleTree::BLOCK_SIZE);
+		treeLeaves = request.length;
+	}
+	// A piece of one block has nothing to narrow down
+	if (request.length < 2 || request.length > MAX_HASHES_PER_REQUEST) {
+		return false;
+	}
+
+	// With the piece layer, the hashes lead to the piece's hash. Without
+	// it, the peer adds the uncles on the way up to the pieces root
+	QByteArray pieceLayer = m_torrentInfo->pieceLayer(fileIndex);
+	if (!pieceLayer.isEmpty()) {
+		request.proofLayers = 0;
+		request.expectedRoot = pieceLayer.mid(pieceInFile * MerkleTree::HASH_SIZE, MerkleTree::HASH_SIZE);
+	} else {
+		request.proofLayers = MerkleTree::log2(treeLeaves) - MerkleTree::log2(request.length);
+		request.expectedRoot = fileInfo.piecesRoot;
+	}
+	request.piecesRoot = fileInfo.piecesRoot;
+	request.dataSize = dataSize;
+	return true;
+}
+
+void Torrent::finishHashRequest(int pieceNumber, const QByteArray &blockHashes)
+{
+	int dataSize = m_hashRequests[pieceNumber].dataSize;
+	m_hashRequests.remove(pieceNumber);
+	Piece *piece = m_activePieces.value(pieceNumber);
+	if (piece) {
+		piece->verifyBlocks(blockHashes, dataSize);
+	}
+}
+
+void Torrent::requestPieceLayers()
+{
+	if (!hasMetadata() || !m_torrentInfo->isV2()) {
+		return;
+	}
+	QList<Peer *> peers;
+	for (Peer *peer : m_peers) {
+		if (peer->isConnected() && peer->supportsV2()) {
+			peers.append(peer);
+		}
+	}
+	if (peers.isEmpty()) {
+		return;
+	}
+
+	qint64 pieceLength = m_torrentInfo->pieceLength();
+	int pieceLayerHeight = MerkleTree::log2(pieceLength / MerkleTree::BLOCK_SIZE);
+	const QList<FileInfo> &fileInfos = m_torrentInfo->fileInfos();
+	int nextPeer = 0;
+	for (int i = 0; i < fileInfos.size(); i++) {
+		const FileInfo &fileInfo = fileInfos[i];
+		if (isPadFile(i) || fileInfo.piecesRoot.isEmpty() || fileInfo.length <= pieceLength
+				|| !m_torrentInfo->pieceLayer(i).isEmpty()) {
+			continue;
+		}
+
+		// The layer is requested in chunks, each with the proof up to the pieces root
+		qint64 piecesInFile = (fileInfo.length + pieceLength - 1) / pieceLength;
+		qint64 leaves = MerkleTree::nextPowerOfTwo(piecesInFile);
+		if (!m_pieceLayerDownloads.contains(fileInfo.piecesRoot)) {
+			PieceLayerDownload download;
+			download.fileIndex = i;
+			download.hashes = QByteArray(leaves * MerkleTree::HASH_SIZE, '\0');
+			download.chunkLength = qMin<qint64>(leaves, MAX_HASHES_PER_REQUEST);
+			download.received = QBitArray(leaves / download.chunkLength);
+			m_pieceLayerDownloads[fileInfo.piecesRoot] = download;
+		}
+		PieceLayerDownload &download = m_pieceLayerDownloads[fileInfo.piecesRoot];
+		// A chunk of length hashes has the log2(length) layers below it
+		int proofLayers = MerkleTree::log2(leaves) - MerkleTree::log2(download.chunkLength);
+		for (int chunk = 0; chunk < download.received.size(); chunk++) {
+			if (download.received.testBit(chunk) || download.requested.contains(chunk)) {
+				continue;
+			}
+			download.requested.insert(chunk);
+			int index = chunk * download.chunkLength;
+			Peer *peer = peers[nextPeer++ % peers.size()];
+			peer->sendHashRequest(fileInfo.piecesRoot, pieceLayerHeight, index, download.chunkLength, proofLayers);
+
+			QByteArray piecesRoot = fileInfo.piecesRoot;
+			QTimer::singleShot(HASH_REQUEST_TIMEOUT_MSEC, this, [this, piecesRoot, chunk]() {
+				auto it = m_pieceLayerDownloads.find(piecesRoot);
+				if (it != m_pieceLayerDownloads.end() && it->requested.remove(chunk)) {
+					qDebug() << "Piece layer request" << chunk << "timed out";
+					requestPieceLayers();
+				}
+			});
+		}
+	}
+}
+
+void Torrent::onPieceLayerHashes(const QByteArray &piecesRoot, int baseLayer, int index, int length,
+								 int proofLayers, const QByteArray &hashes)
+{
+	auto it = m_pieceLayerDownloads.find(piecesRoot);
+	if (it == m_pieceLayerDownloads.end()) {
+		return;
+	}
+	PieceLayerDownload &download = it.value();
+	qint64 blocksPerPiece = m_torrentInfo->pieceLength() / MerkleTree::BLOCK_SIZE;
+	qint64 leaves = download.hashes.size() / MerkleTree::HASH_SIZE;
+	if (baseLayer != MerkleTree::log2(blocksPerPiece) || length != download.chunkLength
+			|| index % length != 0 || index < 0 || index + length > leaves
+			|| proofLayers != MerkleTree::log2(leaves) - MerkleTree::log2(length)) {
+		return;
+	}
+	int chunk = index / length;
+	if (!download.requested.remove(chunk) || download.received.testBit(chunk)) {
+		return;
+	}
+
+	// The chunk and its proof must lead to the pieces root
+	QByteArray layerHashes = hashes.left(length * MerkleTree::HASH_SIZE);
+	QByteArray uncles = hashes.mid(length * MerkleTree::HASH_SIZE);
+	bool valid = false;
+	if (layerHashes.size() == length * MerkleTree::HASH_SIZE
+			&& uncles.size() == proofLayers * MerkleTree::HASH_SIZE) {
+		QByteArray root = MerkleTree::root(layerHashes, length, MerkleTree::padHash(blocksPerPiece));
+		root = MerkleTree::rootFromProof(root, chunk, uncles);
+		valid = MerkleTree::equal(root.constData(), piecesRoot.constData());
+	}
+	if (!valid) {
+		// It is requested again when the next v2 peer connects
+		qDebug() << "Received an invalid piece layer chunk" << chunk;
+		return;
+	}
+	download.hashes.replace(index * MerkleTree::HASH_SIZE, layerHashes.size(), layerHashes);
+	download.received.setBit(chunk);
+	if (download.received.count(true) < download.received.size()) {
+		return;
+	}
+
+	// The hashes past the last piece are padding
+	int fileIndex = download.fileIndex;
+	qint64 pieceLength = m_torrentInfo->pieceLength();
+	qint64 piecesInFile = (m_torrentInfo->fileInfos()[fileIndex].length + pieceLength - 1) / pieceLength;
+	QByteArray pieceLayer = download.hashes.left(piecesInFile * MerkleTree::HASH_SIZE);
+	m_pieceLayerDownloads.erase(it);
+	if (m_torrentInfo->setPieceLayer(fileIndex, pieceLayer)) {
+		qDebug() << "Downloaded the piece layer of file" << fileIndex;
+		m_fetchedPieceLayers.insert(piecesRoot);
+		m_resumeInfoDirty = true;
+	}
+}
+
+void Torrent::serveHashRequest(const QByteArray &piecesRoot, int baseLayer, int index, int length, int proofLayers,
+							   const std::function<void(bool ok, const QByteArray &hashes)> &done)
+{
+	int fileIndex = hasMetadata() && m_torrentInfo->isV2() ? fileWithPiecesRoot(piecesRoot) : -1;
+	if (fileIndex < 0 || length < 2 || length > MAX_HASHES_PER_REQUEST || (length & (length - 1)) != 0
+			|| index < 0 || index % length != 0 || baseLayer < 0 || proofLayers < 0) {
+		done(false, QByteArray());
+		return;
+	}
+
+	const FileInfo &fileInfo = m_torrentInfo->fileInfos()[fileIndex];
+	qint64 pieceLength = m_torrentInfo->pieceLength();
+	qint64 blocksPerPiece = pieceLength / MerkleTree::BLOCK_SIZE;
+	int pieceLayerHeight = MerkleTree::log2(blocksPerPiece);
+	bool largeFile = fileInfo.length > pieceLength;
+	qint64 piecesInFile = largeFile ? (fileInfo.length + pieceLength - 1) / pieceLength : 1;
+	qint64 treeLeaves;
+	if (largeFile) {
+		treeLeaves = MerkleTree::nextPowerOfTwo(piecesInFile) * blocksPerPiece;
+	} else {
+		treeLeaves = MerkleTree::nextPowerOfTwo((fileInfo.length + MerkleTree::BLOCK_SIZE - 1) / MerkleTree::BLOCK_SIZE);
+	}
+	int treeHeight = MerkleTree::log2(treeLeaves);
+	if (baseLayer > treeHeight || proofLayers > treeHeight
+			|| baseLayer + MerkleTree::log2(length) + proofLayers > treeHeight
+			|| index + length > (treeLeaves >> baseLayer)) {
+		done(false, QByteArray());
+		return;
+	}
+
+	QByteArray hashes;
+	if (largeFile && baseLayer >= pieceLayerHeight) {
+		bool ok = merkleHashes(fileIndex, baseLayer, index, length, proofLayers, QByteArray(), 0, hashes);
+		done(ok, hashes);
+		return;
+	}
+
+	// Below the piece layer, the hashes come from the blocks of the piece
+	// they are in. Requests that span pieces aren't answered
+	qint64 pieceLeaves = largeFile ? blocksPerPiece : treeLeaves;
+	qint64 firstLeaf = qint64(index) << baseLayer;
+	qint64 lastLeaf = (qint64(index + length) << baseLayer) - 1;
+	qint64 pieceInFile = firstLeaf / pieceLeaves;
+	if (lastLeaf / pieceLeaves != pieceInFile || pieceInFile >= piecesInFile) {
+		done(false, QByteArray());
+		return;
+	}
+	int pieceNumber = m_fileOffsets[fileIndex] / pieceLength + pieceInFile;
+	if (!m_havePieces.testBit(pieceNumber)) {
+		done(false, QByteArray());
+		return;
+	}
+	qint64 dataSize = qMin(pieceLength, fileInfo.length - pieceInFile * pieceLength);
+	readCachedBlock(pieceNumber, 0, dataSize, [this, fileIndex, baseLayer, index, length, proofLayers,
+				pieceInFile, pieceLeaves, done](bool ok, const QByteArray &data) {
+		QByteArray hashes;
+		if (ok) {
+			QByteArray blockHashes = MerkleTree::blockHashes(data.constData(), data.size());
+			ok = merkleHashes(fileIndex, baseLayer, index, length, proofLayers,
+							  blockHashes, pieceInFile * pieceLeaves, hashes);
+		}
+		done(ok, hashes);
+	});
+}
+
+int Torrent::fileWithPiecesRoot(const QByteArray &piecesRoot) const
+{
+	const QList<FileInfo> &fileInfos = m_torrentInfo->fileInfos();
+	for (int i = 0; i < fileInfos.size(); i++) {
+		if (!isPadFile(i) && fileInfos[i].piecesRoot == piecesRoot) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+QByteArray Torrent::merkleNode(int fileIndex, int layer, qint64 position,
+							   const QByteArray &blockHashes, qint64 firstBlock) const
+{
+	qint64 pieceLength = m_torrentInfo->pieceLength();
+	qint64 blocksPerPiece = pieceLength / MerkleTree::BLOCK_SIZE;
+	int pieceLayerHeight = MerkleTree::log2(blocksPerPiece);
+	qint64 leaves = qint64(1) << layer;
+
+	// Above the piece layer, the nodes come from it, padded with the root of an empty piece
+	if (m_torrentInfo->fileInfos()[fileIndex].length > pieceLength && layer >= pieceLayerHeight) {
+		QByteArray pieceLayer = m_torrentInfo->pieceLayer(fileIndex);
+		if (pieceLayer.isEmpty()) {
+			return QByteArray();
+		}
+		qint64 pieces = leaves / blocksPerPiece;
+		QByteArray slice = pieceLayer.mid(position * pieces * MerkleTree::HASH_SIZE, pieces * MerkleTree::HASH_SIZE);
+		if (slice.isEmpty()) {
+			return MerkleTree::padHash(leaves);
+		}
+		return MerkleTree::root(slice, pieces, MerkleTree::padHash(blocksPerPiece));
+	}
+
+	// Below it, from the block hashes, padded with zero leaves
+	qint64 firstLeaf = position * leaves;
+	if (firstLeaf < firstBlock || blockHashes.isEmpty()) {
+		return QByteArray();
+	}
+	QByteArray slice = blockHashes.mid((firstLeaf - firstBlock) * MerkleTree::HASH_SIZE, leaves * MerkleTree::HASH_SIZE);
+	if (slice.isEmpty()) {
+		return MerkleTree::padHash(leaves);
+	}
+	return MerkleTree::root(slice, leaves, QByteArray(MerkleTree::HASH_SIZE, '\0'));
+}
+
+bool Torrent::merkleHashes(int fileIndex, int baseLayer, qint64 index, int length, int proofLayers,
+						   const QByteArray &blockHashes, qint64 firstBlock, QByteArray &hashes) const
+{
+	hashes.clear();
+	for (qint64 position = index; position < index + length; position++) {
+		QByteArray node = merkleNode(fileIndex, baseLayer, position, blockHashes, firstBlock);
+		if (node.isEmpty()) {
+			return false;
+		}
+		hashes.append(node);
+	}
+
+	// The uncles of the subtree of the hashes, from the bottom up
+	int layer = baseLayer + MerkleTree::log2(length);
+	qint64 position = index / length;
+	for (int i = 0; i < proofLayers; i++) {
+		QByteArray uncle = merkleNode(fileIndex, layer, position ^ 1, blockHashes, firstBlock);
+		if (uncle.isEmpty()) {
+			return false;
+		}
+		hashes.append(uncle);
+		position /= 2;
+		layer++;
+	}
+	return true;
 }
 
-void Torrent::check()
+void Torrent::writeBlock(int pieceNumber, int begin, const QByteArray &data, const DiskIo::Callback &done)
 {
-	if (m_state == Started) {
-		stop();
-		m_startAfterChecking = true;
-	} else if (m_state != Stopped) {
-		return;
-	}
-	m_state = Checking;
-	emit checkingStarted();
+	qint64 offset = m_torrentInfo->pieceLength();
+	offset *= pieceNumber;
+	offset += begin;
+	writeBuffers(offset, QList<QByteArray>() << data, done);
 }
 
-Peer *Torrent::connectToPeer(QHostAddress address, int port)
+void Torrent::writeBuffers(qint64 offset, const QList<QByteArray> &buffers, const DiskIo::Callback &done)
 {
-	// Don't add the peer if he's already added
-	for (auto p : m_peers) {
-		if (p->port() == port && p->address() == address) {
-			return nullptr;
-		}
+	// Find the absolute indexes of the data
+	qint64 blockBegin = offset;
+	qint64 blockEnd = blockBegin;
+	for (const QByteArray &buffer : buffers) {
+		blockEnd += buffer.size();
 	}
 
-	// Add the peer
-	Peer *peer = Peer::createServer(this, address, port);
-	m_trafficMonitor->addPeer(peer);
-	m_peers.push_back(peer);
+	// The part of the buffers that goes to the next file
+	int bufferIndex = 0;
+	qint64 bufferPos = 0;
+
+	// The writes to all files are done together
+	QVector<Storage::Write> writes;
+	QVector<DiskIo::FileSetup> setups;
+
+	// For each file with some of the data. Empty files are just created
+	for (int i = firstFileAt(blockBegin); i < m_files.size() && m_fileOffsets[i] < blockEnd; i++) {
+		qint64 fileBegin = m_fileOffsets[i];
+		qint64 fileEnd = m_fileOffsets[i + 1];
+		qint64 seek = qMax(blockBegin, fileBegin) - fileBegin;
+		qint64 bytesToWrite = qMin(blockEnd, fileEnd) - qMax(blockBegin, fileBegin);
+
+		// Split the file's data into the buffers' parts
+		QVector<QPair<const char *, qint64>> segments;
+		while (bytesToWrite > 0) {
+			qint64 size = qMin(bytesToWrite, buffers[bufferIndex].size() - bufferPos);
+			if (size > 0) {
+				segments.push_back(qMakePair(buffers[bufferIndex].constData() + bufferPos, size));
+			}
+			bytesToWrite -= size;
+			bufferPos += size;
+			if (bufferPos == buffers[bufferIndex].size()) {
+				bufferIndex++;
+				bufferPos = 0;
+			}
+		}
 
-	if(isStarted()) {
-		// Always start connecting
-		peer->startConnection();
+		QFile *file = m_files[i];
+		if (isPadFile(i)) {
+			continue;
+		} else if (usesPartFile(i)) {
+			// The part file keeps the data at its offset in the torrent
+			file = m_partFile;
+			seek += fileBegin;
+		} else {
+			// The directory is created and the file resized on the I/O thread
+			DiskIo::FileSetup setup;
+			setup.fileName = file->fileName();
+			setup.directory = m_fileDirectories[i];
+			setup.size = (m_allocationMode != AllocateNone) ? fileEnd - fileBegin : -1;
+			setups.push_back(setup);
+		}
 
-		// Pause the peer if needed
-		if (m_isPaused) {
-			peer->pause();
+		Storage::Write write;
+		write.fileName = file->fileName();
+		write.offset = seek;
+		write.segments = segments;
+		writes.push_back(write);
+		m_unsyncedFiles.insert(write.fileName);
+
+		// The copy of the file being moved misses this data
+		if (m_storageMove && !m_storageMove->filesToCopy.isEmpty()
+				&& file == movedFile(m_storageMove->filesToCopy.first())) {
+			qint64 size = qMin(blockEnd, fileEnd) - qMax(blockBegin, fileBegin);
+			m_storageMove->writtenRanges.push_back(qMakePair(seek, size));
 		}
 	}
-
-	qDebug() << "Added peer" << peer->addressPort();
-	return peer;
+	if (m_disk) {
+		m_disk->addBytesWritten(blockEnd - blockBegin);
+	}
+	diskIo()->write(writes, setups, buffers, done);
 }
 
-void Torrent::addPeer(Peer *peer)
+DiskIo *Torrent::diskIo()
 {
-	// If there's another identical peer - replace it
-	for (Peer *&p : m_peers) {
-		if (p->port() == peer->port() && p->address() == peer->address()) {
-			p->deleteLater();
-			p = peer;
-			return;
+	if (!m_diskIo) {
+		if (!m_disk) {
+			m_disk = QTorrent::instance()->diskManager()->diskOf(m_downloadLocation);
 		}
+		m_diskIo = new DiskIo(m_disk);
+	}
+	return m_diskIo;
+}
+
+bool Torrent::readBlock(int pieceNumber, int begin, int size, QByteArray &blockData)
+{
+	// Verified pieces may not be written to the files yet
+	if (readUnwrittenBlock(pieceNumber, begin, size, blockData)) {
+		return true;
 	}
 
-	// Else - add it to the list
-	m_peers.push_back(peer);
-	m_trafficMonitor->addPeer(peer);
-	qDebug() << "Added peer" << peer->addressPort();
+	blockData.resize(size);
+	QVector<Storage::Read> reads = blockReads(pieceNumber, begin, size, blockData.data());
+	if (m_disk) {
+		m_disk->addBytesRead(size);
+	}
+	if (!Storage::instance()->read(reads)) {
+		blockData.clear();
+		return false;
+	}
+	return true;
 }
 
-Block *Torrent::requestBlock(Peer *peer, int size)
+QVector<Storage::Read> Torrent::blockReads(int pieceNumber, int begin, int size, char *data) const
 {
-	Block *returnBlock = nullptr;
-	for (auto piece : m_pieces) {
-		if (!piece->isDownloaded() && peer->hasPiece(piece)) {
-			returnBlock = piece->requestBlock(size);
-			if (returnBlock != nullptr) {
-				return returnBlock;
-			}
+	// Find this block's absolute indexes
+	qint64 blockBegin = m_torrentInfo->pieceLength();
+	blockBegin *= pieceNumber;
+	blockBegin += begin;
+	qint64 blockEnd = blockBegin + size;
+
+	// The reads from all files are done together
+	QVector<Storage::Read> reads;
+
+	// For each file with some of the data
+	for (int i = firstFileAt(blockBegin); i < m_files.size() && m_fileOffsets[i] < blockEnd; i++) {
+		qint64 fileBegin = m_fileOffsets[i];
+		qint64 fileEnd = m_fileOffsets[i + 1];
+		if (fileEnd == fileBegin) {
+			continue;
+		}
+		Storage::Read read;
+		read.fileName = m_files[i]->fileName();
+		read.offset = qMax(blockBegin, fileBegin) - fileBegin;
+		read.data = data + (qMax(blockBegin, fileBegin) - blockBegin);
+		read.size = qMin(blockEnd, fileEnd) - qMax(blockBegin, fileBegin);
+		if (isPadFile(i)) {
+			memset(read.data, 0, read.size);
+			continue;
 		}
+		if (usesPartFile(i)) {
+			read.fileName = m_partFile->fileName();
+			read.offset += fileBegin;
+		}
+		reads.push_back(read);
 	}
+	return reads;
+}
 
-	// No unrequested blocks, try to find some timed-out blocks
-	for (auto peer : m_peers) {
-		if (peer->hasTimedOut()) {
-			for (auto block : peer->blocksQueue()) {
-				if (peer->hasPiece(block->piece())) {
-					return block;
-				}
-			}
+void Torrent::readCachedBlock(int pieceNumber, int begin, int size, const DiskIo::ReadCallback &done)
+{
+	QByteArray blockData;
+	if (readBlockFromMemory(pieceNumber, begin, size, blockData)) {
+		done(true, blockData);
+		return;
+	}
+	ReadCache *cache = QTorrent::instance()->readCache();
+	int fullSize = pieceSize(pieceNumber);
+	if (fullSize > cache->capacity()) {
+		QByteArray data(size, Qt::Uninitialized);
+		QVector<Storage::Read> reads = blockReads(pieceNumber, begin, size, data.data());
+		if (m_disk) {
+			m_disk->addBytesRead(size);
 		}
+		diskIo()->read(reads, data, done);
+		return;
 	}
 
-	// No blocks
-	return nullptr;
+	// Read the whole piece, the other blocks are likely to be requested soon.
+	// The requests for blocks of a piece that is being read wait for it
+	PendingRead pending;
+	pending.begin = begin;
+	pending.size = size;
+	pending.done = done;
+	bool reading = m_pendingReads.contains(pieceNumber);
+	m_pendingReads[pieceNumber].append(pending);
+	if (reading) {
+		return;
+	}
+	QByteArray pieceData(fullSize, Qt::Uninitialized);
+	QVector<Storage::Read> reads = blockReads(pieceNumber, 0, fullSize, pieceData.data());
+	if (m_disk) {
+		m_disk->addBytesRead(fullSize);
+	}
+	diskIo()->read(reads, pieceData, [this, pieceNumber](bool ok, const QByteArray &data) {
+		if (ok) {
+			QTorrent::instance()->readCache()->insert(this, pieceNumber, data);
+		}
+		for (const PendingRead &pending : m_pendingReads.take(pieceNumber)) {
+			pending.done(ok, ok ? data.mid(pending.begin, pending.size) : QByteArray());
+		}
+	});
 }
 
-bool Torrent::savePiece(Piece *piece)
+void Torrent::readSavedBlocks(int pieceNumber, const QVector<QPair<int, int>> &blocks, const DiskIo::ReadCallback &done)
 {
-	int pieceLength = m_torrentInfo->pieceLength();
-	int thisPieceLength = piece->size();
-	const QList<FileInfo> &fileInfos = m_torrentInfo->fileInfos();
-
-	qint64 dataBegin = piece->pieceNumber();
-	dataBegin *= pieceLength;
+	QByteArray pieceData(pieceSize(pieceNumber), Qt::Uninitialized);
+	QVector<Storage::Read> reads;
+	qint64 bytesRead = 0;
+	for (const QPair<int, int> &block : blocks) {
+		reads += blockReads(pieceNumber, block.first, block.second, pieceData.data() + block.first);
+		bytesRead += block.second;
+	}
+	if (m_disk) {
+		m_disk->addBytesRead(bytesRead);
+	}
+	diskIo()->read(reads, pieceData, done);
+}
 
-	int firstFileNumber = 0;
-	qint64 startingPos = 0;
-	qint64 pos = 0;
-	for (int i = 0; i < fileInfos.size(); i++) {
-		pos += fileInfos[i].length;
-		firstFileNumber = i;
-		if (pos > dataBegin) {
-			pos -= fileInfos[i].length;
-			startingPos = dataBegin - pos;
-			break;
+bool Torrent::readUnwrittenBlock(int pieceNumber, int begin, int size, QByteArray &blockData) const
+{
+	auto cached = m_writeCache.constFind(pieceNumber);
+	if (cached == m_writeCache.constEnd()) {
+		cached = m_writingPieces.constFind(pieceNumber);
+		if (cached == m_writingPieces.constEnd()) {
+			return false;
 		}
 	}
+	blockData = cached.value().mid(begin, size);
+	return blockData.size() == size;
+}
 
-	char *dataPtr = piece->data();
+bool Torrent::readBlockFromMemory(int pieceNumber, int begin, int size, QByteArray &blockData)
+{
+	if (readUnwrittenBlock(pieceNumber, begin, size, blockData)) {
+		return true;
+	}
+	// A disabled cache doesn't count misses
+	ReadCache *cache = QTorrent::instance()->readCache();
+	if (pieceSize(pieceNumber) > cache->capacity()) {
+		return false;
+	}
+	return cache->read(this, pieceNumber, begin, size, blockData);
+}
 
-	int bytesToWrite = thisPieceLength;
-	for (int i = firstFileNumber;; i++) {
-		FileInfo info = fileInfos[i];
-		if (info.path.size() > 1) {
-			QString path = m_downloadLocation;
-			if (path[path.size()-1] == '/') {
-				path.remove(path.size()-1, 1);
-			}
-			for (int j = 0; j < info.path.size() - 1; j++) {
-				path += '/';
-				path += info.path[j];
-			}
-			QDir dir;
-			dir.mkpath(path);
-		}
+bool Torrent::fileRegions(int pieceNumber, int begin, int size, QVector<FileRegion> &regions) const
+{
+	regions.clear();
+	if (!m_zeroCopyUpload || m_writeCache.contains(pieceNumber) || m_writingPieces.contains(pieceNumber)) {
+		return false;
+	}
 
-		QFile *file = m_files[i];
-		if (!file->exists() || file->size() != info.length) {
-			file->resize(info.length);
-		}
-		if (!file->open(QIODevice::ReadWrite)) { // Append causes bugs with seek
-			qDebug() << "Failed to open file" << i << file->fileName() << ":" << file->errorString();
-			return false;
-		}
-		qint64 pos = 0;
-		if (i == firstFileNumber) {
-			pos = startingPos;
+	// Find this block's absolute indexes
+	qint64 blockBegin = m_torrentInfo->pieceLength();
+	blockBegin *= pieceNumber;
+	blockBegin += begin;
+	qint64 blockEnd = blockBegin + size;
+
+	for (int i = firstFileAt(blockBegin); i < m_files.size() && m_fileOffsets[i] < blockEnd; i++) {
+		qint64 fileBegin = m_fileOffsets[i];
+		qint64 fileEnd = m_fileOffsets[i + 1];
+		if (fileEnd == fileBegin) {
+			continue;
 		}
-		if (!file->seek(pos)) {
-			qDebug() << "Failed to seek in file" << i << file->fileName() << ":" << file->errorString();
+		// There is nothing to send the zeros of pad files from
+		if (isPadFile(i)) {
 			return false;
 		}
-		int toWrite = bytesToWrite;
-		qint64 bytesToEnd = fileInfos[i].length - pos;
-		if (toWrite > bytesToEnd) {
-			toWrite = bytesToEnd;
-		}
-		for (int written = 0;;) {
-			dataPtr += written;
-			toWrite -= written;
-			bytesToWrite -= written;
-			if (toWrite == 0) {
-				break;
-			}
-			written = file->write(dataPtr, toWrite);
-			if (written == -1) {
-				qDebug() << "Failed to write to file" << i << file->fileName() << ":" << file->errorString();
-				file->close();
-				return false;
-			}
-		}
-		file->close();
-		if (bytesToWrite == 0) {
-			break;
+		FileRegion region;
+		region.fileName = m_files[i]->fileName();
+		region.offset = qMax(blockBegin, fileBegin) - fileBegin;
+		region.length = qMin(blockEnd, fileEnd) - qMax(blockBegin, fileBegin);
+		if (usesPartFile(i)) {
+			region.fileName = m_partFile->fileName();
+			region.offset += fileBegin;
 		}
+		regions.push_back(region);
 	}
 	return true;
 }
 
-void Torrent::setPieceAvailable(Piece *piece, bool available)
+void Torrent::setPieceAvailable(int pieceNumber, bool available)
 {
-	if (piece->isDownloaded() == available) {
+	if (m_havePieces.testBit(pieceNumber) == available) {
 		return;
 	}
 
+	// The piece is no longer being downloaded
+	Piece *piece = m_activePieces.take(pieceNumber);
+	if (piece) {
+		piece->deleteLater();
+	}
+
+	int size = pieceSize(pieceNumber);
 	if (available) {
 		// Increment some counters
 		m_downloadedPieces++;
-		m_bytesAvailable += piece->size();
+		m_bytesAvailable += size;
 
 		if (m_state == Started) {
-			m_totalBytesDownloaded += piece->size();
+			m_totalBytesDownloaded += size;
 
 			// Send 'have' messages to all peers
 			for (auto peer : m_peers) {
-				peer->sendHave(piece->pieceNumber());
+				peer->sendHave(pieceNumber);
 			}
 		}
 
@@ -441,11 +1745,92 @@ void Torrent::setPieceAvailable(Piece *piece, bool available)
 		}
 	} else {
 		m_downloadedPieces--;
-		m_bytesAvailable -= piece->size();
+		m_bytesAvailable -= size;
 		m_isDownloaded = false;
+		QTorrent::instance()->readCache()->remove(this, pieceNumber);
+	}
+
+	m_havePieces.setBit(pieceNumber, available);
+	m_resumeInfoDirty = true;
+	if (available) {
+		m_pieceDeadlines.remove(pieceNumber);
+		emit pieceDownloaded(pieceNumber);
+	}
+}
+
+void Torrent::changePieceAvailability(int pieceNumber, int change)
+{
+	m_pieceAvailability[pieceNumber] += change;
+}
+
+void Torrent::setPiecePriority(int pieceNumber, Priority priority)
+{
+	m_piecePriorities[pieceNumber] = priority;
+}
+
+void Torrent::setFilePriority(int fileIndex, Priority priority)
+{
+	if (fileIndex < 0 || fileIndex >= m_filePriorities.size()
+			|| m_filePriorities[fileIndex] == priority) {
+		return;
+	}
+	bool wasSkipped = usesPartFile(fileIndex);
+	if (wasSkipped && priority != DontDownload) {
+		// The cached pieces go to the part file before it's copied from
+		flushWriteCache();
+		waitForWrites();
+	}
+	m_filePriorities[fileIndex] = priority;
+	if (wasSkipped && priority != DontDownload) {
+		moveFromPartFile(fileIndex);
+		allocateFiles();
+	}
+	updatePiecePriorities();
+	m_resumeInfoDirty = true;
+}
+
+void Torrent::setFilePriorities(const QVector<quint8> &priorities)
+{
+	if (priorities.size() != m_filePriorities.size()) {
+		return;
+	}
+	for (int i = 0; i < priorities.size(); i++) {
+		setFilePriority(i, Priority(qMin(priorities[i], quint8(HighPriority))));
+	}
+}
+
+void Torrent::onMetadataDownloaded(const QByteArray &infoDictionary)
+{
+	if (!m_metadataDownloader) {
+		return;
+	}
+	if (!m_torrentInfo->loadFromInfoDictionary(infoDictionary)) {
+		qDebug() << "Failed to load the downloaded metadata:" << m_torrentInfo->errorString();
+		m_metadataDownloader->reset();
+		return;
+	}
+	m_metadataDownloader->deleteLater();
+	m_metadataDownloader = nullptr;
+
+	initPieceState();
+	loadFileDescriptors();
+
+	// The peers can now make sense of their bitfields
+	for (Peer *peer : m_peers) {
+		peer->onMetadataLoaded();
 	}
+	// Including the ones that connected to us, which start() doesn't reach
+	wakePeers();
+	// v2 torrents from magnet links have no piece layers
+	requestPieceLayers();
+
+	m_state = Stopped;
+	emit metadataLoaded(this);
 
-	piece->setDownloaded(available);
+	// Switch to normal downloading
+	if (!m_isPaused) {
+		start();
+	}
 }
 
 void Torrent::onSuccessfullyAnnounced(TrackerClient::Event event)
@@ -464,9 +1849,14 @@ QList<Peer *> &Torrent::peers()
 	return m_peers;
 }
 
-QList<Piece *> &Torrent::pieces()
+const QMap<int, Piece *> &Torrent::activePieces() const
+{
+	return m_activePieces;
+}
+
+Piece *Torrent::activePiece(int pieceNumber) const
 {
-	return m_pieces;
+	return m_activePieces.value(pieceNumber, nullptr);
 }
 
 TorrentInfo *Torrent::torrentInfo()
@@ -484,6 +1874,16 @@ TrafficMonitor *Torrent::trafficMonitor()
 	return m_trafficMonitor;
 }
 
+Disk *Torrent::disk() const
+{
+	return m_disk;
+}
+
+MetadataDownloader *Torrent::metadataDownloader()
+{
+	return m_metadataDownloader;
+}
+
 QList<QFile *> &Torrent::files()
 {
 	return m_files;
@@ -532,6 +1932,36 @@ int Torrent::downloadedPieces()
 	return m_downloadedPieces;
 }
 
+bool Torrent::hasPiece(int pieceNumber) const
+{
+	return m_havePieces.testBit(pieceNumber);
+}
+
+int Torrent::pieceAvailability(int pieceNumber) const
+{
+	return m_pieceAvailability[pieceNumber];
+}
+
+Torrent::Priority Torrent::piecePriority(int pieceNumber) const
+{
+	return Priority(m_piecePriorities[pieceNumber]);
+}
+
+Torrent::Priority Torrent::filePriority(int fileIndex) const
+{
+	return Priority(m_filePriorities[fileIndex]);
+}
+
+const QVector<quint8> &Torrent::filePriorities() const
+{
+	return m_filePriorities;
+}
+
+int Torrent::allocationProgress() const
+{
+	return m_allocationProgress;
+}
+
 bool Torrent::isDownloaded()
 {
 	return m_isDownloaded;
@@ -547,6 +1977,16 @@ bool Torrent::isStarted() const
 	return !m_isPaused && m_state == Started;
 }
 
+bool Torrent::hasMetadata() const
+{
+	return m_torrentInfo->hasMetadata();
+}
+
+bool Torrent::isFetchingMetadata() const
+{
+	return !m_isPaused && m_state == Loading && m_metadataDownloader != nullptr;
+}
+
 int Torrent::connectedPeersCount() const
 {
 	int count = 0;
@@ -574,12 +2014,23 @@ QString Torrent::stateString() const
 	case New:
 		return "Created";
 	case Loading:
+		if (m_metadataDownloader) {
+			return "Fetching metadata";
+		}
 		return "Loading";
 	case Checking:
 		return "Checking";
+	case Allocating:
+		return "Allocating (" + QString::number(m_allocationProgress) + "%)";
 	case Stopped:
+		if (m_storageMove) {
+			return "Moving files";
+		}
 		return "Stopped";
 	default:
+		if (m_storageMove) {
+			return "Moving files";
+		}
 		if (m_isPaused) {
 			return "Paused";
 		} else if (m_isDownloaded) {
@@ -598,6 +2049,9 @@ const QString &Torrent::downloadLocation() const
 
 float Torrent::percentDownloaded()
 {
+	if (m_torrentInfo->length() == 0) {
+		return 0.0f;
+	}
 	double percent = m_bytesAvailable;
 	percent /= m_torrentInfo->length();
 	percent *= 100.0f;
@@ -606,14 +2060,198 @@ float Torrent::percentDownloaded()
 
 QVector<bool> Torrent::bitfield() const
 {
-	QVector<bool> bf;
-	for (auto p : m_pieces) {
-		bf.push_back(p->isDownloaded());
+	QVector<bool> bf(m_havePieces.size());
+	for (int i = 0; i < m_havePieces.size(); i++) {
+		bf[i] = m_havePieces.testBit(i);
 	}
 	return bf;
 }
 
 
+bool Torrent::moveStorage(const QString &location)
+{
+	if (!hasMetadata() || m_storageMove || m_state == Checking || m_state == Allocating) {
+		return false;
+	}
+	if (QDir(location) == QDir(m_downloadLocation)) {
+		return true;
+	}
+
+	// The cached pieces go to the old files, which are moved with them
+	flushWriteCache();
+	waitForWrites();
+
+	m_storageMove = new StorageMove;
+	m_storageMove->location = location;
+	m_storageMove->failed = false;
+	for (const QString &directory : m_fileDirectories) {
+		if (!m_storageMove->oldDirectories.contains(directory)) {
+			m_storageMove->oldDirectories.append(directory);
+		}
+	}
+
+	// Renaming is instant, and is all that's needed on the same file system.
+	// The other files are copied in the background, while the torrent
+	// keeps using the old ones
+	for (int i = PART_FILE_INDEX; i < m_files.size(); i++) {
+		QFile *file = movedFile(i);
+		QString newPath = movedFilePath(i);
+		if (!file->exists()) {
+			setFilePath(i, newPath);
+			continue;
+		}
+		QDir().mkpath(QFileInfo(newPath).path());
+		if (QFile::exists(newPath)) {
+			QFile::remove(newPath);
+		}
+		if (QDir().rename(file->fileName(), newPath)) {
+			setFilePath(i, newPath);
+		} else {
+			m_storageMove->filesToCopy.append(i);
+		}
+	}
+	copyNextFile();
+	return true;
+}
+
+bool Torrent::isMovingStorage() const
+{
+	return m_storageMove != nullptr;
+}
+
+void Torrent::onFileCopied(bool ok)
+{
+	if (!m_storageMove || m_storageMove->filesToCopy.isEmpty()) {
+		return;
+	}
+	int fileIndex = m_storageMove->filesToCopy.takeFirst();
+	QFile *file = movedFile(fileIndex);
+	QString newPath = movedFilePath(fileIndex);
+	QString copyPath = m_storageMove->copyDestination;
+	m_storageMove->copyDestination.clear();
+
+	// Copy what was written to the old file during the copy
+	waitForWrites();
+	if (ok && !m_storageMove->writtenRanges.isEmpty()) {
+		QFile copy(copyPath);
+		ok = file->open(QIODevice::ReadOnly) && copy.open(QIODevice::ReadWrite);
+		for (const auto &range : m_storageMove->writtenRanges) {
+			if (!ok) {
+				break;
+			}
+			QByteArray data;
+			if (file->seek(range.first)) {
+				data = file->read(range.second);
+			}
+			ok = (data.size() == range.second && copy.seek(range.first) && copy.write(data) == data.size());
+		}
+		file->close();
+		copy.close();
+		// The copy itself was synced by the file controller
+		ok = ok && Storage::instance()->sync(QStringList() << copyPath);
+	}
+	m_storageMove->writtenRanges.clear();
+
+	// Switch to the copy
+	if (ok) {
+		QFile::remove(newPath);
+		ok = QDir().rename(copyPath, newPath);
+	}
+	if (ok) {
+		QString oldPath = file->fileName();
+		setFilePath(fileIndex, newPath);
+		QFile::remove(oldPath);
+	} else {
+		qDebug() << "Failed to move" << file->fileName() << "to" << newPath;
+		QFile::remove(copyPath);
+		m_storageMove->failed = true;
+	}
+	copyNextFile();
+}
+
+QFile *Torrent::movedFile(int fileIndex) const
+{
+	return (fileIndex == PART_FILE_INDEX) ? m_partFile : m_files[fileIndex];
+}
+
+QString Torrent::movedFilePath(int fileIndex) const
+{
+	if (fileIndex == PART_FILE_INDEX) {
+		return partFilePath(m_storageMove->location);
+	}
+	return filePath(m_storageMove->location, fileIndex);
+}
+
+void Torrent::setFilePath(int fileIndex, const QString &path)
+{
+	if (fileIndex == PART_FILE_INDEX) {
+		m_partFile->setFileName(path);
+	} else {
+		m_files[fileIndex]->setFileName(path);
+		m_fileDirectories[fileIndex] = path.left(path.lastIndexOf('/') + 1);
+	}
+}
+
+void Torrent::copyNextFile()
+{
+	if (m_storageMove->filesToCopy.isEmpty()) {
+		finishStorageMove();
+		return;
+	}
+	int fileIndex = m_storageMove->filesToCopy.first();
+	m_storageMove->copyDestination = movedFilePath(fileIndex) + MOVED_FILE_SUFFIX;
+
+	QSettings settings;
+	int rate = settings.value("StorageMoveRate", DEFAULT_STORAGE_MOVE_RATE_MIB).toInt();
+	settings.setValue("StorageMoveRate", rate);
+
+	createFileController();
+	emit fileCopyStarted(movedFile(fileIndex)->fileName(), m_storageMove->copyDestination,
+						 qMax(rate, 0) * qint64(1024 * 1024));
+}
+
+void Torrent::finishStorageMove()
+{
+	bool ok = !m_storageMove->failed;
+	if (ok) {
+		// Remove the directories that are left empty, the deepest first
+		QString oldLocation = QDir(m_downloadLocation).absolutePath();
+		QStringList directories = m_storageMove->oldDirectories;
+		std::sort(directories.begin(), directories.end(), [](const QString &a, const QString &b) {
+			return a.size() > b.size();
+		});
+		for (const QString &directory : directories) {
+			QDir dir(directory);
+			while (dir.absolutePath().startsWith(oldLocation + '/') && dir.rmdir(dir.absolutePath())) {
+				dir.cdUp();
+			}
+		}
+		m_downloadLocation = m_storageMove->location;
+		m_resumeInfoDirty = true;
+
+		// The next jobs go to the queue of the new disk. This may be
+		// called by the file controller's signal, so it's deleted later
+		Disk *disk = QTorrent::instance()->diskManager()->diskOf(m_downloadLocation);
+		if (m_fileController && disk != m_disk) {
+			m_fileController->disconnect();
+			disconnect(m_fileController);
+			m_fileController->deleteLater();
+			m_fileController = nullptr;
+		}
+		m_disk = disk;
+		if (m_diskIo) {
+			m_diskIo->setDisk(disk);
+		}
+	} else {
+		// The files that were moved are used from their new location,
+		// but the torrent is resumed from the old one
+		setError("Failed to move some of the files to " + m_storageMove->location);
+	}
+	delete m_storageMove;
+	m_storageMove = nullptr;
+	emit storageMoved(ok);
+}
+
 QString Torrent::errorString() const
 {
 	return m_errorString;
@@ -624,10 +2262,17 @@ QString Torrent::errorString() const
 
 void Torrent::onPieceDownloaded(Piece *piece)
 {
+	m_havePieces.setBit(piece->pieceNumber());
+	m_activePieces.remove(piece->pieceNumber());
+	m_pieceDeadlines.remove(piece->pieceNumber());
+	piece->deleteLater();
+	emit pieceDownloaded(piece->pieceNumber());
+
 	// Increment some counters
 	m_downloadedPieces++;
 	m_bytesAvailable += piece->size();
 	m_totalBytesDownloaded += piece->size();
+	m_resumeInfoDirty = true;
 
 	qDebug() << "Downloaded pieces"
 			 << m_downloadedPieces << "/" << m_torrentInfo->numberOfPieces()
@@ -647,12 +2292,14 @@ void Torrent::onPieceDownloaded(Piece *piece)
 void Torrent::onBlockUploaded(int bytes)
 {
 	m_totalBytesUploaded += bytes;
+	m_resumeInfoDirty = true;
 }
 
 void Torrent::onFullyDownloaded()
 {
 	if (m_state == Started) {
-		QTorrent::instance()->mainWindow()->torrentFullyDownloaded(this);
+		// The torrent was downloaded just now, not found on disk by a check
+		emit downloadCompleted(this);
 		// Send announce
 		m_trackerClient->announce(TrackerClient::Completed);
 	}
@@ -686,3 +2333,25 @@ void Torrent::onChecked()
 	}
 	emit checked();
 }
+
+void Torrent::onAllocationProgress(int percent)
+{
+	m_allocationProgress = percent;
+	emit allocationProgressChanged(percent);
+}
+
+void Torrent::onFilesAllocated(bool ok)
+{
+	if (!ok) {
+		// The files are still allocated sparsely as they are written
+		qDebug() << "Failed to allocate the files of" << m_torrentInfo->torrentName();
+	}
+	m_allocationProgress = 100;
+	// Unless a check was queued after the allocation
+	if (m_state == Allocating) {
+		m_state = Stopped;
+		if (m_startAfterChecking) {
+			start();
+		}
+	}
+}
@@ -21,10 +21,20 @@
 #define TORRENT_H
 
 #include "resumeinfo.h"
+#include "diskio.h"
 #include "trackerclient.h"
+#include "filecontroller.h"
 #include <QHostAddress>
 #include <QString>
+#include <QStringList>
 #include <QList>
+#include <QVector>
+#include <QMap>
+#include <QSet>
+#include <QPair>
+#include <QByteArray>
+#include <QBitArray>
+#include <QElapsedTimer>
 #include <QUrl>
 
 class Peer;
@@ -32,9 +42,12 @@ class TorrentInfo;
 class TrackerClient;
 class FileController;
 class TrafficMonitor;
+class MetadataDownloader;
+class Disk;
 class Piece;
 class Block;
 class QFile;
+struct FileRegion;
 
 /*
  * This class represents a torrent
@@ -52,11 +65,31 @@ public:
 	 * New - Just created
 	 * Loading - Loading torrent / Fetching torrent metainfo
 	 * Checking - Verifying downloaded pieces
+	 * Allocating - Reserving disk space for the files
 	 * Stopped - Downloading/Uploading is stopped.
 	 * Started - Downloading/Uploading is allowed.
 	 */
 	enum State {
-		New, Loading, Checking, Stopped, Started
+		New, Loading, Checking, Allocating, Stopped, Started
+	};
+
+	/*
+	 * How disk space is reserved for the files (the AllocationMode setting):
+	 * AllocateNone - Files grow as the data is written
+	 * AllocateSparse - Files get their full size on the first write,
+	 *                  without reserving the space (the default)
+	 * AllocateFull - All space is reserved when the torrent is added
+	 */
+	enum AllocationMode {
+		AllocateNone, AllocateSparse, AllocateFull
+	};
+
+	/*
+	 * Download priority of a piece.
+	 * Higher priority pieces are requested first
+	 */
+	enum Priority {
+		DontDownload, LowPriority, NormalPriority, HighPriority
 	};
 
 	/* Constructor and destructor */
@@ -67,20 +100,103 @@ public:
 
 	bool createNew(TorrentInfo *torrentInfo, const QString &downloadLocation);
 	bool createFromResumeInfo(TorrentInfo *torrentInfo, ResumeInfo *resumeInfo);
+	// Creates a torrent from a magnet link. The torrent stays in the
+	// Loading state until the metadata is downloaded from the peers
+	bool createFromMagnetLink(TorrentInfo *torrentInfo, const QString &downloadLocation);
+	// The same, for a magnet link that was still loading when the client was closed
+	bool createFromMagnetLink(TorrentInfo *torrentInfo, ResumeInfo *resumeInfo);
 	void loadFileDescriptors();
+	// Reserves the space of the wanted files in the background, if the
+	// allocation mode is AllocateFull. The torrent starts when it's done
+	void allocateFiles();
+	// Moves the files to another download location. Files are renamed when
+	// possible, and the others are copied in the background, one at a time,
+	// while the torrent keeps using the old file until its copy is complete.
+	// The copy rate is the StorageMoveRate setting, in MiB/s (0 for no limit)
+	bool moveStorage(const QString &location);
+	bool isMovingStorage() const;
 
 	Block *requestBlock(Peer *client, int size);
-
-	bool savePiece(Piece *piece);
+	// Called when something that peers may request became free: blocks,
+	// pieces that are wanted again or metadata pieces. The peers that
+	// couldn't fill their request pipeline try again, once per event loop pass
+	void wakePeers();
+
+	// Verified pieces are cached and written later, see flushWriteCache()
+	void savePiece(Piece *piece);
+	// Starts writing the cached pieces to the files in the order of their
+	// offsets. Consecutive pieces are written together. Pieces that fail
+	// to be written become unavailable
+	void flushWriteCache();
+	// Waits until the queued reads and writes are done and called back
+	void waitForWrites();
+	// The reads and writes run on the I/O thread of the torrent's disk.
+	// The callbacks are called on this thread
+	void writeBlock(int pieceNumber, int begin, const QByteArray &data, const DiskIo::Callback &done);
+	// Starts writing the downloaded blocks of incomplete pieces to the
+	// files, so that they can be recorded in the resume data
+	void savePartialPieces();
+	// Calls done when everything that was written to the files is on the
+	// disk, so that the resume data doesn't list pieces that would be lost
+	// in a crash
+	void syncFiles(const DiskIo::Callback &done);
+	// v2 and hybrid torrents: when a piece fails its check, or its hash
+	// isn't known yet, the hashes of its blocks are requested from a v2 peer
+	// (BEP 52), so that only the corrupt blocks are downloaded again.
+	// Returns false if that isn't possible
+	bool requestBlockHashes(Piece *piece);
+	// The answers of the peers to the hash requests
+	void onHashesReceived(const QByteArray &piecesRoot, int baseLayer, int index, int length,
+						  int proofLayers, const QByteArray &hashes);
+	void onHashesRejected(const QByteArray &piecesRoot, int baseLayer, int index, int length);
+	// Requests the piece layers that the torrent file doesn't have from the
+	// connected v2 peers. They are verified against the pieces roots and
+	// saved with the resume data
+	void requestPieceLayers();
+	// Answers a hash request of a peer, now or after the piece is read.
+	// Nodes at and above the piece layers come from them, the ones below
+	// from the hashes of the piece's blocks, if we have the piece
+	void serveHashRequest(const QByteArray &piecesRoot, int baseLayer, int index, int length, int proofLayers,
+						  const std::function<void(bool ok, const QByteArray &hashes)> &done);
+	// Reads a part of a piece from the files
+	bool readBlock(int pieceNumber, int begin, int size, QByteArray &blockData);
+	// Like readBlock(), but through the read cache and without waiting
+	// for the disk. Used for uploading
+	void readCachedBlock(int pieceNumber, int begin, int size, const DiskIo::ReadCallback &done);
+	// Reads the saved blocks (begin and size) of a piece that isn't complete
+	// yet on the I/O thread. The data has the size of the piece, with the
+	// blocks at their offsets. It bypasses the read cache
+	void readSavedBlocks(int pieceNumber, const QVector<QPair<int, int>> &blocks, const DiskIo::ReadCallback &done);
+	// Copies the block from the write or read cache, without touching
+	// the files. Returns false if the piece is in neither
+	bool readBlockFromMemory(int pieceNumber, int begin, int size, QByteArray &blockData);
+	// Returns the parts of the files, where a block is stored, for sending
+	// it without reading it first. False if the block has to be read
+	// (the ZeroCopyUpload setting is off or the piece isn't written yet)
+	bool fileRegions(int pieceNumber, int begin, int size, QVector<FileRegion> &regions) const;
+
+	/* Streaming. Pieces with a deadline are requested before all others,
+	 * from the fast peers and, when they are due soon, from several peers */
+	void setPieceDeadline(int pieceNumber, int msec);
+	void clearPieceDeadlines();
+	// Sets deadlines for the pieces after this offset in the torrent
+	void setPlaybackCursor(qint64 offset);
 
 	/* Getters */
 
 	QList<Peer *> &peers();
-	QList<Piece *> &pieces();
+	// The pieces that are being downloaded right now
+	const QMap<int, Piece *> &activePieces() const;
+	// nullptr if the piece isn't being downloaded
+	Piece *activePiece(int pieceNumber) const;
 	QList<QFile *> &files();
 	TorrentInfo *torrentInfo();
 	TrackerClient *trackerClient();
 	TrafficMonitor *trafficMonitor();
+	// The disk with the files. nullptr until they're first used
+	Disk *disk() const;
+	// nullptr if the metadata is already available
+	MetadataDownloader *metadataDownloader();
 
 	// The number of bytes since startup
 	qint64 bytesDownloaded() const;
@@ -94,9 +210,26 @@ public:
 	qint64 bytesLeft() const;
 
 	int downloadedPieces();
+	bool hasPiece(int pieceNumber) const;
+	int pieceSize(int pieceNumber) const;
+	// The offset of the file's data in the torrent
+	qint64 fileOffset(int fileIndex) const;
+	// The number of peers that have the piece
+	int pieceAvailability(int pieceNumber) const;
+	Priority piecePriority(int pieceNumber) const;
+	Priority filePriority(int fileIndex) const;
+	const QVector<quint8> &filePriorities() const;
+	// Skipped files keep the pieces they share with other files here
+	QString partFilePath() const;
 	bool isDownloaded();
+	// Percentage of the current file allocation
+	int allocationProgress() const;
 	bool isPaused() const;
 	bool isStarted() const;
+	// Returns true if the torrent info dictionary is available
+	bool hasMetadata() const;
+	// Returns true if we're currently downloading the metadata from peers
+	bool isFetchingMetadata() const;
 	int connectedPeersCount() const;
 	int allPeersCount() const;
 
@@ -113,19 +246,36 @@ public:
 	QVector<bool> bitfield() const;
 
 	ResumeInfo getResumeInfo() const;
+	// True if the resume info changed since it was last saved
+	bool isResumeInfoDirty() const;
+	void setResumeInfoDirty(bool dirty);
 
 	// Returns m_torrentInfo->errorString();
 	QString errorString() const;
 
 signals:
-	void checkingStarted();
+	void checkingStarted(const CheckLayout &layout);
+	void allocationStarted(const QStringList &filePaths, const QVector<qint64> &fileSizes);
+	void allocationProgressChanged(int percent);
+	void checkingPiecesStarted(const CheckLayout &layout, const QVector<int> &pieceNumbers);
 	void checked();
 	void fullyDownloaded();
+	void downloadCompleted(Torrent *torrent);
+	void metadataLoaded(Torrent *torrent);
+	void pieceDownloaded(int pieceNumber);
+	void fileCopyStarted(const QString &source, const QString &destination, qint64 bytesPerSecond);
+	void storageMoved(bool ok);
 
 public slots:
 	// Called when torrent is checked
 	void onChecked();
 
+	// Called by the file controller while the files are being allocated
+	void onAllocationProgress(int percent);
+	void onFilesAllocated(bool ok);
+	// Called by the file controller when a moved file is copied
+	void onFileCopied(bool ok);
+
 	// Called when a piece is successfully downloaded
 	void onPieceDownloaded(Piece *piece);
 
@@ -139,6 +289,9 @@ public slots:
 	// Called when announce is successful
 	void onSuccessfullyAnnounced(TrackerClient::Event event);
 
+	// Called when the info dictionary was downloaded from the peers
+	void onMetadataDownloaded(const QByteArray &infoDictionary);
+
 
 	// Creates a peer and connects to him
 	Peer *connectToPeer(QHostAddress address, int port);
@@ -146,7 +299,13 @@ public slots:
 	void addPeer(Peer *peer);
 	// Sets a piece's downloaded/available state.
 	// if state is Started, it will increment m_bytesDownloaded
-	void setPieceAvailable(Piece *piece, bool available);
+	void setPieceAvailable(int pieceNumber, bool available);
+	// Called by the peers when they get or lose a piece
+	void changePieceAvailability(int pieceNumber, int change);
+	void setPiecePriority(int pieceNumber, Priority priority);
+	// The pieces get the highest priority of their files
+	void setFilePriority(int fileIndex, Priority priority);
+	void setFilePriorities(const QVector<quint8> &priorities);
 
 	// Start downloading/uploading
 	void start();
@@ -156,16 +315,37 @@ public slots:
 	void stop();
 	// Check the torrent
 	void check();
+	// Check only some of the pieces
+	void checkPieces(const QVector<int> &pieceNumbers);
 
 private:
 	State m_state;
 	QList<Peer *> m_peers;
-	QList<Piece *> m_pieces;
+
+	/* The state of all pieces, indexed by piece number.
+	 * Piece objects only exist for the pieces in m_activePieces */
+	QBitArray m_havePieces;
+	QVector<quint16> m_pieceAvailability;
+	QVector<quint8> m_piecePriorities;
+	QMap<int, Piece *> m_activePieces;
+	QVector<quint8> m_filePriorities;
+	// Milliseconds on m_deadlineClock
+	QMap<int, qint64> m_pieceDeadlines;
+	QElapsedTimer m_deadlineClock;
 	TorrentInfo *m_torrentInfo;
 	TrackerClient *m_trackerClient;
 	QList<QFile *> m_files;
+	/* The offset of each file in the torrent, followed by the size of the
+	 * torrent, for finding the files of a piece with a binary search */
+	QVector<qint64> m_fileOffsets;
+	/* The directories of the files, created before the first write */
+	QStringList m_fileDirectories;
 	FileController *m_fileController;
+	Disk *m_disk;
+	DiskIo *m_diskIo;
 	TrafficMonitor *m_trafficMonitor;
+	MetadataDownloader *m_metadataDownloader;
+	QFile *m_partFile;
 
 	// The number of bytes on startup
 	qint64 m_bytesDownloadedOnStartup;
@@ -188,9 +368,156 @@ private:
 	/* Start torrent after checking? */
 	bool m_startAfterChecking;
 
+	/* The files written to since the last syncFiles() */
+	QSet<QString> m_unsyncedFiles;
+
+	/* Set while wakePeers() is scheduled */
+	bool m_wakePeersPending;
+
+	/* Read from the settings when the files are loaded */
+	AllocationMode m_allocationMode;
+	int m_allocationProgress;
+
+	/* Verified pieces that aren't written yet, by piece number.
+	 * Flushed when m_writeCacheSize bytes are cached (the WriteCacheSize
+	 * setting, 0 disables the cache), when the torrent stops,
+	 * and periodically by the torrent manager */
+	QMap<int, QByteArray> m_writeCache;
+	qint64 m_writeCacheSize;
+	qint64 m_writeCacheBytes;
+	/* Flushed pieces that are still being written */
+	QMap<int, QByteArray> m_writingPieces;
+
+	/* Uploads that wait for a piece to be read into the read cache */
+	struct PendingRead {
+		int begin;
+		int size;
+		DiskIo::ReadCallback done;
+	};
+	QMap<int, QList<PendingRead>> m_pendingReads;
+
+	/* Send uploaded blocks straight from the files */
+	bool m_zeroCopyUpload;
+
+	/* Files are numbered by their index; the part file is PART_FILE_INDEX */
+	static const int PART_FILE_INDEX = -1;
+	/* A running moveStorage() */
+	struct StorageMove {
+		QString location;
+		QStringList oldDirectories;
+		// The first one is being copied to copyDestination
+		QList<int> filesToCopy;
+		QString copyDestination;
+		// Offset and size of the data written to the file during the copy
+		QVector<QPair<qint64, qint64>> writtenRanges;
+		bool failed;
+	};
+	StorageMove *m_storageMove;
+
+	/* A request for the merkle tree leaves of a piece (v2 and hybrid torrents) */
+	struct HashRequest {
+		int id;
+		QByteArray piecesRoot;
+		int index;
+		int length;
+		int proofLayers;
+		// What the requested hashes and the proof must hash up to
+		QByteArray expectedRoot;
+		// The size of the file's data in the piece, the rest is padding
+		int dataSize;
+	};
+	// By piece number
+	QMap<int, HashRequest> m_hashRequests;
+	int m_lastHashRequestId;
+
+	/* A piece layer that is being requested from the peers */
+	struct PieceLayerDownload {
+		int fileIndex;
+		// The layer, padded to a power of two hashes
+		QByteArray hashes;
+		// The hashes in each request
+		int chunkLength;
+		// The chunks that are verified, and the ones that are requested
+		QBitArray received;
+		QSet<int> requested;
+	};
+	// By pieces root
+	QMap<QByteArray, PieceLayerDownload> m_pieceLayerDownloads;
+	// The pieces roots of the layers that came from peers, not from the
+	// torrent file. They are saved with the resume data
+	QSet<QByteArray> m_fetchedPieceLayers;
+
+	/* Has the resume info changed since it was saved? */
+	bool m_resumeInfoDirty;
+
 	/* The torrent's download location */
 	QString m_downloadLocation;
 
+	/* Allocates the piece state arrays. Nothing is downloaded yet */
+	void initPieceState();
+	/* Recalculates the piece priorities from the file priorities */
+	void updatePiecePriorities();
+	/* Where the data is stored, for the file controller's checks */
+	CheckLayout checkLayout() const;
+	/* The reads of a part of a piece from the files, into data. Pad files are zeroed here */
+	QVector<Storage::Read> blockReads(int pieceNumber, int begin, int size, char *data) const;
+	/* Reads a part of a piece that is cached or being written */
+	bool readUnwrittenBlock(int pieceNumber, int begin, int size, QByteArray &blockData) const;
+	/* Writes the buffers one after another, starting at this offset in the torrent */
+	void writeBuffers(qint64 offset, const QList<QByteArray> &buffers, const DiskIo::Callback &done);
+	/* The I/O of the torrent's disk, created on first use */
+	DiskIo *diskIo();
+	/* Called when the pieces from firstPiece to endPiece (excluded) are written */
+	void onPiecesWritten(int firstPiece, int endPiece, bool ok);
+	/* The paths of the files in a download location */
+	QString filePath(const QString &location, int fileIndex) const;
+	QString partFilePath(const QString &location) const;
+	/* Storage moves */
+	QFile *movedFile(int fileIndex) const;
+	// The path of the file in the new location
+	QString movedFilePath(int fileIndex) const;
+	void setFilePath(int fileIndex, const QString &path);
+	void copyNextFile();
+	void finishStorageMove();
+	/* Hash requests */
+	bool makeHashRequest(int pieceNumber, HashRequest &request) const;
+	// Passes the verified hashes to the piece, or discards it if they are empty
+	void finishHashRequest(int pieceNumber, const QByteArray &blockHashes);
+	void onPieceLayerHashes(const QByteArray &piecesRoot, int baseLayer, int index, int length,
+							int proofLayers, const QByteArray &hashes);
+	// The index of the file with this pieces root, or -1
+	int fileWithPiecesRoot(const QByteArray &piecesRoot) const;
+	// A node of the file's merkle tree, counting the layers from the blocks up.
+	// Below the piece layer, it's computed from the block hashes of the piece
+	// that begins at block firstBlock. Empty if the hashes aren't known
+	QByteArray merkleNode(int fileIndex, int layer, qint64 position,
+						  const QByteArray &blockHashes, qint64 firstBlock) const;
+	// The nodes of a hash request, followed by the proof
+	bool merkleHashes(int fileIndex, int baseLayer, qint64 index, int length, int proofLayers,
+					  const QByteArray &blockHashes, qint64 firstBlock, QByteArray &hashes) const;
+	/* Returns the first file that has data at or after this offset in the torrent.
+	 * Empty files at the offset come before the file that contains it */
+	int firstFileAt(qint64 offset) const;
+	/* True if the file's data is written to the part file */
+	bool usesPartFile(int fileIndex) const;
+	/* Pad files are zeros that only exist in the pieces of hybrid torrents,
+	 * and between the files of v2 torrents */
+	bool isPadFile(int fileIndex) const;
+	/* Copies the data of a file that is no longer skipped out of the part file */
+	void moveFromPartFile(int fileIndex);
+	/* Returns a block of the piece with the earliest deadline, if any */
+	Block *requestTimeCriticalBlock(Peer *peer, int size);
+	/* Only the fast peers get the blocks with deadlines */
+	bool isFastPeer(Peer *peer) const;
+	/* Returns the piece a peer should start downloading next, or -1 */
+	int pickPiece(Peer *peer) const;
+	/* Creates the file controller (and its thread) and connects it.
+	 * Not done until the first check */
+	void createFileController();
+	/* Returns the pieces of all files whose size or modification time
+	 * differs from the one in the resume info */
+	QVector<int> piecesInChangedFiles(const QVector<ResumeFileInfo> &savedFileInfos) const;
+
 	/* Contains last error */
 	QString m_errorString;
 	void clearError();
@@ -0,0 +1,354 @@
+/* qTorrent - An open-source, cross-platform BitTorrent client
+ * Copyright (C) 2017 Petko Georgiev
+ *
+ * torrentcreator.cpp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "torrentcreator.h"
+#include "bencodevalue.h"
+#include <QtConcurrent>
+#include <QCryptographicHash>
+#include <QDir>
+#include <QDirIterator>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <QThread>
+#include <QDebug>
+#include <algorithm>
+
+const qint64 MIN_PIECE_LENGTH = 16 * 1024;
+const qint64 MAX_PIECE_LENGTH = 16 * 1024 * 1024;
+const qint64 TARGET_NUMBER_OF_PIECES = 1500;
+// The data read while the previous batch is hashed
+const qint64 BATCH_SIZE = 64 * 1024 * 1024;
+const int SHA1_SIZE = 20;
+
+TorrentCreator::TorrentCreator(QObject *parent)
+	: QObject(parent)
+	, m_pieceLength(0)
+	, m_private(false)
+	, m_totalSize(0)
+	, m_elapsedMsecs(0)
+	, m_aborted(0)
+	, m_fileIndex(0)
+{
+}
+
+void TorrentCreator::setSourcePath(const QString &sourcePath)
+{
+	m_sourcePath = sourcePath;
+}
+
+void TorrentCreator::setTrackers(const QStringList &trackers)
+{
+	m_trackers = trackers;
+}
+
+void TorrentCreator::setComment(const QString &comment)
+{
+	m_comment = comment;
+}
+
+void TorrentCreator::setPieceLength(qint64 pieceLength)
+{
+	m_pieceLength = pieceLength;
+}
+
+void TorrentCreator::setPrivate(bool isPrivate)
+{
+	m_private = isPrivate;
+}
+
+bool TorrentCreator::create()
+{
+	QElapsedTimer timer;
+	timer.start();
+	m_errorString.clear();
+	m_torrentData.clear();
+
+	if (!findFiles()) {
+		return false;
+	}
+	if (m_pieceLength == 0) {
+		m_pieceLength = pickPieceLength(m_totalSize);
+	}
+	if (m_pieceLength < MIN_PIECE_LENGTH || (m_pieceLength & (m_pieceLength - 1)) != 0) {
+		setError(QString("Invalid piece length %1, must be a power of two of at least %2")
+				 .arg(m_pieceLength).arg(MIN_PIECE_LENGTH));
+		return false;
+	}
+
+	int numberOfPieces = this->numberOfPieces();
+	m_pieces.fill('\0', numberOfPieces * SHA1_SIZE);
+	m_fileIndex = 0;
+	m_file.close();
+
+	// Enough pieces per batch for every thread, read into one buffer while the other is hashed
+	int batchPieces = qMax<qint64>(QThread::idealThreadCount(), BATCH_SIZE / m_pieceLength);
+	QVector<PieceJob> batches[2];
+	QFuture<void> hashing;
+	int current = 0;
+	int lastPercent = -1;
+	bool ok = true;
+	for (int firstPiece = 0; firstPiece < numberOfPieces; firstPiece += batchPieces) {
+		QVector<PieceJob> &batch = batches[current];
+		batch.clear();
+		for (int i = firstPiece; i < qMin(firstPiece + batchPieces, numberOfPieces); i++) {
+			PieceJob job;
+			job.hash = m_pieces.data() + i * SHA1_SIZE;
+			if (!readPiece(job.data, qMin(m_pieceLength, m_totalSize - i * m_pieceLength))) {
+				ok = false;
+				break;
+			}
+			batch.push_back(job);
+		}
+		hashing.waitForFinished();
+		if (!ok || m_aborted.loadAcquire()) {
+			break;
+		}
+
+		int percent = firstPiece * 100LL / numberOfPieces;
+		if (percent != lastPercent) {
+			lastPercent = percent;
+			emit progress(percent);
+		}
+		hashing = QtConcurrent::map(batch, hashPiece);
+		current = 1 - current;
+	}
+	hashing.waitForFinished();
+	m_file.close();
+
+	if (m_aborted.loadAcquire()) {
+		setError("Aborted");
+		return false;
+	}
+	if (!ok) {
+		return false;
+	}
+	emit progress(100);
+
+	makeTorrentData();
+	m_elapsedMsecs = timer.elapsed();
+	qDebug() << "Created a torrent of" << m_totalSize << "bytes in" << numberOfPieces << "pieces,"
+			 << "hashed at" << throughput() / (1024 * 1024) << "MiB/s";
+	return true;
+}
+
+void TorrentCreator::abort()
+{
+	m_aborted.storeRelease(1);
+}
+
+const QByteArray &TorrentCreator::torrentData() const
+{
+	return m_torrentData;
+}
+
+bool TorrentCreator::saveTorrentFile(const QString &fileName)
+{
+	QFile file(fileName);
+	if (!file.open(QIODevice::WriteOnly)) {
+		setError("Failed to open " + fileName + ": " + file.errorString());
+		return false;
+	}
+	if (file.write(m_torrentData) != m_torrentData.size()) {
+		setError("Failed to write " + fileName + ": " + file.errorString());
+		return false;
+	}
+	return true;
+}
+
+qint64 TorrentCreator::totalSize() const
+{
+	return m_totalSize;
+}
+
+qint64 TorrentCreator::pieceLength() const
+{
+	return m_pieceLength;
+}
+
+int TorrentCreator::numberOfPieces() const
+{
+	if (m_pieceLength == 0) {
+		return 0;
+	}
+	return (m_totalSize + m_pieceLength - 1) / m_pieceLength;
+}
+
+qint64 TorrentCreator::elapsedMsecs() const
+{
+	return m_elapsedMsecs;
+}
+
+qint64 TorrentCreator::throughput() const
+{
+	return m_totalSize * 1000 / qMax<qint64>(m_elapsedMsecs, 1);
+}
+
+QString TorrentCreator::errorString() const
+{
+	return m_errorString;
+}
+
+qint64 TorrentCreator::pickPieceLength(qint64 totalSize)
+{
+	qint64 pieceLength = MIN_PIECE_LENGTH;
+	while (pieceLength < MAX_PIECE_LENGTH && totalSize / pieceLength > TARGET_NUMBER_OF_PIECES) {
+		pieceLength *= 2;
+	}
+	return pieceLength;
+}
+
+
+bool TorrentCreator::findFiles()
+{
+	m_files.clear();
+	m_totalSize = 0;
+
+	QFileInfo source(m_sourcePath);
+	if (!source.exists()) {
+		setError("No such file or directory: " + m_sourcePath);
+		return false;
+	}
+	if (source.isFile()) {
+		File file;
+		file.path = source.absoluteFilePath();
+		file.size = source.size();
+		m_files.push_back(file);
+	} else {
+		QDir root(source.absoluteFilePath());
+		QDirIterator it(root.absolutePath(), QDir::Files | QDir::NoDotAndDotDot, QDirIterator::Subdirectories);
+		while (it.hasNext()) {
+			it.next();
+			File file;
+			file.path = it.filePath();
+			file.components = root.relativeFilePath(file.path).split('/');
+			file.size = it.fileInfo().size();
+			m_files.push_back(file);
+		}
+		// The order of the iterator depends on the file system
+		std::sort(m_files.begin(), m_files.end(), [](const File &a, const File &b) {
+			return a.components < b.components;
+		});
+	}
+	if (m_files.isEmpty()) {
+		setError("There are no files in " + m_sourcePath);
+		return false;
+	}
+	for (const File &file : m_files) {
+		m_totalSize += file.size;
+	}
+	if (m_totalSize == 0) {
+		setError("The files in " + m_sourcePath + " are empty");
+		return false;
+	}
+	return true;
+}
+
+bool TorrentCreator::readPiece(QByteArray &data, qint64 size)
+{
+	data.resize(size);
+	qint64 position = 0;
+	while (position < size) {
+		if (!m_file.isOpen()) {
+			// Skip the empty files, the torrent has enough data for the piece
+			while (m_files[m_fileIndex].size == 0) {
+				m_fileIndex++;
+			}
+			m_file.setFileName(m_files[m_fileIndex].path);
+			if (!m_file.open(QIODevice::ReadOnly)) {
+				setError("Failed to open " + m_file.fileName() + ": " + m_file.errorString());
+				return false;
+			}
+		}
+		qint64 fileLeft = m_files[m_fileIndex].size - m_file.pos();
+		qint64 bytesToRead = qMin(fileLeft, size - position);
+		if (m_file.read(data.data() + position, bytesToRead) != bytesToRead) {
+			setError("Failed to read " + m_file.fileName() + ", it may have changed");
+			return false;
+		}
+		position += bytesToRead;
+		if (bytesToRead == fileLeft) {
+			m_file.close();
+			m_fileIndex++;
+		}
+	}
+	return true;
+}
+
+void TorrentCreator::makeTorrentData()
+{
+	BencodeDictionary torrent;
+	if (!m_trackers.isEmpty()) {
+		BencodeList *announceList = new BencodeList;
+		for (const QString &tracker : m_trackers) {
+			BencodeList *tier = new BencodeList;
+			tier->add(new BencodeString(tracker.toUtf8()));
+			announceList->add(tier);
+		}
+		torrent.add("announce", new BencodeString(m_trackers.first().toUtf8()));
+		torrent.add("announce-list", announceList);
+	}
+	if (!m_comment.isEmpty()) {
+		torrent.add("comment", new BencodeString(m_comment.toUtf8()));
+	}
+	torrent.add("created by", new BencodeString("qTorrent " VERSION));
+	torrent.add("creation date", new BencodeInteger(QDateTime::currentMSecsSinceEpoch() / 1000));
+
+	BencodeDictionary *info = new BencodeDictionary;
+	QFileInfo source(m_sourcePath);
+	QString name = source.isFile() ? source.fileName() : QDir(source.absoluteFilePath()).dirName();
+	info->add("name", new BencodeString(name.toUtf8()));
+	info->add("piece length", new BencodeInteger(m_pieceLength));
+	info->add("pieces", new BencodeString(m_pieces));
+	if (m_private) {
+		info->add("private", new BencodeInteger(1));
+	}
+	if (source.isFile()) {
+		info->add("length", new BencodeInteger(m_totalSize));
+	} else {
+		BencodeList *files = new BencodeList;
+		for (const File &file : m_files) {
+			BencodeDictionary *fileDict = new BencodeDictionary;
+			BencodeList *path = new BencodeList;
+			for (const QString &component : file.components) {
+				path->add(new BencodeString(component.toUtf8()));
+			}
+			fileDict->add("length", new BencodeInteger(file.size));
+			fileDict->add("path", path);
+			files->add(fileDict);
+		}
+		info->add("files", files);
+	}
+	torrent.add("info", info);
+
+	m_torrentData = torrent.bencode();
+}
+
+void TorrentCreator::setError(const QString &errorString)
+{
+	m_errorString = errorString;
+	qDebug() << "Failed to create torrent:" << errorString;
+}
+
+void TorrentCreator::hashPiece(PieceJob &job)
+{
+	QByteArray hash = QCryptographicHash::hash(job.data, QCryptographicHash::Sha1);
+	memcpy(job.hash, hash.constData(), SHA1_SIZE);
+	// Only two batches are kept in memory, free this one early
+	job.data.clear();
+}
@@ -0,0 +1,118 @@
+/* qTorrent - An open-source, cross-platform BitTorrent client
+ * Copyright (C) 2017 Petko Georgiev
+ *
+ * torrentcreator.h
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef TORRENTCREATOR_H
+#define TORRENTCREATOR_H
+
+#include <QObject>
+#include <QByteArray>
+#include <QString>
+#include <QStringList>
+#include <QVector>
+#include <QAtomicInt>
+#include <QFile>
+
+/*
+ * Creates a .torrent file from a file or a directory.
+ * The pieces are read in batches, one after another. While a batch is
+ * read, the previous one is hashed by the threads of the global thread
+ * pool, so the disk and the CPUs are busy at the same time.
+ */
+class TorrentCreator : public QObject
+{
+	Q_OBJECT
+
+public:
+	TorrentCreator(QObject *parent = nullptr);
+
+	/* A file, or a directory, whose files are added in the order of their
+	 * paths. Hidden files are left out */
+	void setSourcePath(const QString &sourcePath);
+	/* Each tracker is a tier of its own */
+	void setTrackers(const QStringList &trackers);
+	void setComment(const QString &comment);
+	/* A power of two. 0 picks one from the size, see pickPieceLength() */
+	void setPieceLength(qint64 pieceLength);
+	void setPrivate(bool isPrivate);
+
+	/* Hashes the files and makes the metafile. Blocks until it's done,
+	 * the user interface runs it in another thread. Returns false on error */
+	bool create();
+	/* Makes a running create() fail as soon as possible. Thread-safe */
+	void abort();
+
+	/* The bencoded metafile */
+	const QByteArray &torrentData() const;
+	bool saveTorrentFile(const QString &fileName);
+
+	qint64 totalSize() const;
+	qint64 pieceLength() const;
+	int numberOfPieces() const;
+	/* The time create() took, and the bytes it hashed per second */
+	qint64 elapsedMsecs() const;
+	qint64 throughput() const;
+
+	QString errorString() const;
+
+	/* About 1500 pieces, between 16 KiB and 16 MiB */
+	static qint64 pickPieceLength(qint64 totalSize);
+
+signals:
+	/* The percentage of the data that is hashed. Emitted from create()'s thread */
+	void progress(int percent);
+
+private:
+	struct File {
+		QString path;
+		// The path in the torrent
+		QStringList components;
+		qint64 size;
+	};
+	// A piece in a batch and where its hash goes
+	struct PieceJob {
+		QByteArray data;
+		char *hash;
+	};
+
+	QString m_sourcePath;
+	QStringList m_trackers;
+	QString m_comment;
+	qint64 m_pieceLength;
+	bool m_private;
+
+	QVector<File> m_files;
+	qint64 m_totalSize;
+	QByteArray m_pieces;
+	QByteArray m_torrentData;
+	qint64 m_elapsedMsecs;
+	QAtomicInt m_aborted;
+	QString m_errorString;
+
+	// The file that the next piece starts in
+	int m_fileIndex;
+	QFile m_file;
+
+	bool findFiles();
+	bool readPiece(QByteArray &data, qint64 size);
+	void makeTorrentData();
+	void setError(const QString &errorString);
+
+	static void hashPiece(PieceJob &job);
+};
+
+#endif // TORRENTCREATOR_H
@@ -18,11 +18,44 @@
  */
 
 #include "torrentinfo.h"
-#include "bencodeparser.h"
+#include "bencodereader.h"
+#include "bencodevalue.h"
+#include "merkletree.h"
 #include <QFile>
 #include <QString>
+#include <QStringList>
 #include <QCryptographicHash>
+#include <QUrl>
+#include <QUrlQuery>
 #include <QDebug>
+#include <algorithm>
+
+// Decodes a base32 (RFC 4648) string. Returns an empty array on error
+static QByteArray fromBase32(const QByteArray &data)
+{
+	QByteArray decoded;
+	quint32 buffer = 0;
+	int bits = 0;
+	for (char c : data) {
+		int value;
+		if (c >= 'A' && c <= 'Z') {
+			value = c - 'A';
+		} else if (c >= 'a' && c <= 'z') {
+			value = c - 'a';
+		} else if (c >= '2' && c <= '7') {
+			value = c - '2' + 26;
+		} else {
+			return QByteArray();
+		}
+		buffer = (buffer << 5) | value;
+		bits += 5;
+		if (bits >= 8) {
+			bits -= 8;
+			decoded.push_back(char((buffer >> bits) & 0xFF));
+		}
+	}
+	return decoded;
+}
 
 void TorrentInfo::clearError()
 {
@@ -46,6 +79,8 @@ TorrentInfo::TorrentInfo()
 	, m_comment(nullptr)
 	, m_createdBy(nullptr)
 	, m_encoding(nullptr)
+	, m_isHybrid(false)
+	, m_isV2Only(false)
 	, m_numberOfPieces(0)
 {
 }
@@ -58,20 +93,33 @@ TorrentInfo::~TorrentInfo()
 	if (m_encoding != nullptr) delete m_encoding;
 }
 
+// Returns the value of a required key. Throws BencodeException if it is missing or has the wrong type
+static BencodeView requiredValue(const BencodeView &dict, const char *key, BencodeView::Type type)
+{
+	BencodeView value = dict.value(key);
+	if (!value.isValid()) {
+		throw BencodeException("No such key: '") << key << "'";
+	}
+	if (value.type() != type) {
+		throw BencodeException("Value of '") << key << "' has the wrong type";
+	}
+	return value;
+}
+
 bool TorrentInfo::loadFromTorrentFile(QString filename)
 {
 	m_creationFileName = filename;
-	BencodeParser bencodeParser;
+	BencodeReader bencodeReader;
 
 	/* Read torrent file */
-	if (!bencodeParser.readFile(filename)) {
-		setError("Failed to read file " + filename + ": " + bencodeParser.errorString());
+	if (!bencodeReader.readFile(filename)) {
+		setError("Failed to read file " + filename + ": " + bencodeReader.errorString());
 		return false;
 	}
 
 	/* Parse torrent file */
-	if (!bencodeParser.parse()) {
-		setError("Failed to parse file " + filename + ": " + bencodeParser.errorString());
+	if (!bencodeReader.parse()) {
+		setError("Failed to parse file " + filename + ": " + bencodeReader.errorString());
 		return false;
 	}
 
@@ -81,146 +129,547 @@ bool TorrentInfo::loadFromTorrentFile(QString filename)
 
 		/* Required parameters */
 
-		// Main list
-		QList<BencodeValue *> mainList = bencodeParser.list();
-
-		// The main list must have only one element - the main dictionary
-		if (mainList.isEmpty()) {
-			throw ex << "Torrent file is empty";
-		} else if (mainList.size() > 1) {
-			throw ex << "Main list size is " << mainList.size() << ". Expected 1";
-		}
-
 		// Main dictionary
-		BencodeDictionary *mainDict = mainList.first()->toBencodeDictionary();
+		BencodeView mainDict = bencodeReader.root();
+		if (!mainDict.isDictionary()) {
+			throw ex << "Torrent file does not contain a dictionary";
+		}
 
 		// The Info dictionary
-		BencodeDictionary *infoDict = mainDict->value("info")->toBencodeDictionary();
+		BencodeView infoDict = requiredValue(mainDict, "info", BencodeView::Type::Dictionary);
 
 		// Announce URL
-		try {
-			QList<QByteArray> announceUrlsList;
-			QList<BencodeValue*> announceList = mainDict->value("announce-list")->toList();
-			for (BencodeValue *announceListValue : announceList) {
-				QList<BencodeValue *> announceSubList = announceListValue->toList();
-				for (BencodeValue *announceUrl : announceSubList) {
-					// [TODO] Support shuffling
-					// http://bittorrent.org/beps/bep_0012.html
-					announceUrlsList.push_back(announceUrl->toByteArray());
+		m_announceUrlsList.clear();
+		BencodeView announceList = mainDict.value("announce-list");
+		for (BencodeView::Iterator tiers(announceList); tiers.hasNext();) {
+			for (BencodeView::Iterator urls(tiers.next()); urls.hasNext();) {
+				// [TODO] Support shuffling
+				// http://bittorrent.org/beps/bep_0012.html
+				BencodeView url = urls.next();
+				if (url.isString()) {
+					m_announceUrlsList.push_back(url.toByteArray());
 				}
 			}
-			m_announceUrlsList = announceUrlsList;
-		} catch (BencodeException &ex) {
-			m_announceUrlsList.clear();
-			// Try to find 'announce' key
-			try {
-				QByteArray url = mainDict->value("announce")->toByteArray();
-				m_announceUrlsList.push_back(url);
-			} catch(BencodeException &ex) {
-				m_announceUrlsList.clear();
-			}
-		}
-
-		// Torrent name
-		m_torrentName = infoDict->value("name")->toByteArray();
-
-		// Piece length
-		m_pieceLength = infoDict->value("piece length")->toInt();
-
-		// SHA-1 hash sums of the pieces
-		QByteArray pieceData = infoDict->value("pieces")->toByteArray();
-		if (pieceData.size() % 20 != 0) {
-			throw ex << "Piece data length is not a multiple of 20";
 		}
-		for (int i = 0; i < pieceData.size();) {
-			QByteArray piece;
-			for (int j = 0; j < 20; j++) {
-				piece.append(pieceData[i++]);
+		if (m_announceUrlsList.isEmpty()) {
+			// Try to find 'announce' key
+			BencodeView url = mainDict.value("announce");
+			if (url.isString()) {
+				m_announceUrlsList.push_back(url.toByteArray());
 			}
-			m_pieces.append(piece);
 		}
 
-		// Information about all files in the torrent
-		if (infoDict->keyExists("length")) {
-			// Single file torrent
-			m_length = infoDict->value("length")->toInt();
-			FileInfo fileInfo;
-			fileInfo.length = m_length;
-			fileInfo.path = QList<QString>({m_torrentName});
-			m_fileInfos.push_back(fileInfo);
-		} else {
-			// Multi file torrent
-			m_length = 0;
-			QList<BencodeValue *> filesList = infoDict->value("files")->toList();
-			for (BencodeValue *file : filesList) {
-				BencodeDictionary *fileDict = file->toBencodeDictionary();
-				FileInfo fileInfo;
-				fileInfo.length = fileDict->value("length")->toInt();
-				QList<BencodeValue *> pathList = fileDict->value("path")->toList();
-				fileInfo.path = QList<QString>({m_torrentName});
-				for (auto path : pathList) {
-					fileInfo.path.push_back(path->toByteArray());
+		// Everything in the info dictionary
+		loadInfoDictionary(infoDict);
+
+		// The piece layers of v2 torrents. Invalid ones are ignored,
+		// the hashes can be requested from the peers
+		BencodeView pieceLayers = mainDict.value("piece layers");
+		if (isV2() && pieceLayers.isDictionary()) {
+			for (BencodeView::Iterator layers(pieceLayers); layers.hasNext();) {
+				BencodeView layer = layers.next();
+				QByteArray piecesRoot = layers.key().toByteArray();
+				for (int i = 0; i < m_fileInfos.size(); i++) {
+					if (m_fileInfos[i].piecesRoot == piecesRoot && layer.isString()) {
+						setPieceLayer(i, layer.toByteArray());
+						break;
+					}
 				}
-				m_length += fileInfo.length;
-				m_fileInfos.push_back(fileInfo);
 			}
 		}
 
 		/* Optional parameters */
 
 		// Creation date
-		try {
-			m_creationDate = new QDateTime;
-			qint64 creation = mainDict->value("creation date")->toInt();
-			*m_creationDate = QDateTime::fromMSecsSinceEpoch(1000*creation);
-		} catch (BencodeException &ex) {
-			delete m_creationDate;
-			m_creationDate = nullptr;
+		BencodeView creation = mainDict.value("creation date");
+		if (creation.isInteger()) {
+			m_creationDate = new QDateTime(QDateTime::fromMSecsSinceEpoch(1000*creation.toInt()));
 		}
 
 		// Comment
-		try {
-			m_comment = new QString;
-			*m_comment = mainDict->value("comment")->toByteArray();
-		} catch (BencodeException &ex) {
-			delete m_comment;
-			m_comment = nullptr;
+		BencodeView comment = mainDict.value("comment");
+		if (comment.isString()) {
+			m_comment = new QString(comment.toByteArray());
 		}
 
 		// Created by
-		try {
-			m_createdBy = new QString;
-			*m_createdBy = mainDict->value("created by")->toByteArray();
-		} catch (BencodeException &ex) {
-			delete m_createdBy;
-			m_createdBy = nullptr;
+		BencodeView createdBy = mainDict.value("created by");
+		if (createdBy.isString()) {
+			m_createdBy = new QString(createdBy.toByteArray());
 		}
 
 		// Encoding
-		try {
-			m_encoding = new QString;
-			*m_encoding = mainDict->value("encoding")->toByteArray();
-		} catch (BencodeException &ex) {
+		BencodeView encoding = mainDict.value("encoding");
+		if (encoding.isString()) {
+			m_encoding = new QString(encoding.toByteArray());
+		} else {
 			// Default to UTF-8 encoding
-			delete m_encoding;
 			m_encoding = new QString("UTF-8");
 		}
 
 		/* Calculate torrent file info hash */
-		m_infoHash = QCryptographicHash::hash(infoDict->getRawBencodeData(), QCryptographicHash::Sha1);
+		if (m_isV2Only) {
+			m_infoHash = m_infoHashV2.left(PIECE_HASH_SIZE);
+		} else {
+			m_infoHash = QCryptographicHash::hash(m_infoDictionary, QCryptographicHash::Sha1);
+		}
+	} catch (BencodeException &ex) {
+		setError(ex.what());
+		return false;
+	}
+	return true;
+}
+
+void TorrentInfo::loadInfoDictionary(const BencodeView &infoDict)
+{
+	BencodeException ex("TorrentInfo::loadInfoDictionary(): ");
+
+	// Torrent name
+	m_torrentName = requiredValue(infoDict, "name", BencodeView::Type::String).toByteArray();
+
+	// Piece length
+	m_pieceLength = requiredValue(infoDict, "piece length", BencodeView::Type::Integer).toInt();
+	if (m_pieceLength <= 0) {
+		throw ex << "Invalid piece length " << m_pieceLength;
+	}
+
+	// v2 torrents have a merkle tree for each file. Hybrid ones also have
+	// everything of v1 torrents
+	BencodeView metaVersion = infoDict.value("meta version");
+	bool isV2 = metaVersion.isInteger() && metaVersion.toInt() == 2;
+	m_isHybrid = false;
+	m_isV2Only = false;
+	m_pieceLayers.clear();
+	if (isV2 && (m_pieceLength < MerkleTree::BLOCK_SIZE || (m_pieceLength & (m_pieceLength - 1)) != 0)) {
+		throw ex << "Invalid piece length " << m_pieceLength << " for a v2 torrent";
+	}
+	if (isV2 && !infoDict.keyExists("pieces")) {
+		m_isV2Only = true;
+		m_pieceHashes.clear();
+		loadV2Files(requiredValue(infoDict, "file tree", BencodeView::Type::Dictionary));
+		loadPieceLayout();
+		m_infoDictionary = infoDict.getRawBencodeData();
+		m_infoHashV2 = QCryptographicHash::hash(m_infoDictionary, QCryptographicHash::Sha256);
+		return;
+	}
+
+	// SHA-1 hash sums of the pieces
+	BencodeView pieceData = requiredValue(infoDict, "pieces", BencodeView::Type::String);
+	if (pieceData.stringLength() % PIECE_HASH_SIZE != 0) {
+		throw ex << "Piece data length is not a multiple of " << PIECE_HASH_SIZE;
+	}
+	m_pieceHashes = QByteArray(pieceData.stringData(), pieceData.stringLength());
+
+	// Information about all files in the torrent
+	m_fileInfos.clear();
+	BencodeView length = infoDict.value("length");
+	if (length.isValid()) {
+		// Single file torrent
+		if (!length.isInteger()) {
+			throw ex << "Value of 'length' has the wrong type";
+		}
+		m_length = length.toInt();
+		FileInfo fileInfo;
+		fileInfo.length = m_length;
+		fileInfo.path = QList<QString>({m_torrentName});
+		fileInfo.isPadFile = false;
+		m_fileInfos.push_back(fileInfo);
+	} else {
+		// Multi file torrent
+		m_length = 0;
+		BencodeView filesList = requiredValue(infoDict, "files", BencodeView::Type::List);
+		for (BencodeView::Iterator files(filesList); files.hasNext();) {
+			BencodeView fileDict = files.next();
+			if (!fileDict.isDictionary()) {
+				throw ex << "File entry is not a dictionary";
+			}
+			FileInfo fileInfo;
+			fileInfo.length = requiredValue(fileDict, "length", BencodeView::Type::Integer).toInt();
+			BencodeView attributes = fileDict.value("attr");
+			fileInfo.isPadFile = attributes.isString() && attributes.toByteArray().contains('p');
+			BencodeView pathList = requiredValue(fileDict, "path", BencodeView::Type::List);
+			fileInfo.path = QList<QString>({m_torrentName});
+			for (BencodeView::Iterator paths(pathList); paths.hasNext();) {
+				BencodeView path = paths.next();
+				if (!path.isString()) {
+					throw ex << "File path element is not a string";
+				}
+				fileInfo.path.push_back(path.toByteArray());
+			}
+			m_length += fileInfo.length;
+			m_fileInfos.push_back(fileInfo);
+		}
+	}
+
+	/* Calculate total number of pieces */
+	loadPieceLayout();
+	int numberOfHashes = m_pieceHashes.size() / PIECE_HASH_SIZE;
+	if (m_numberOfPieces != numberOfHashes) {
+		throw ex << "Expected " << m_numberOfPieces << " piece hashes, found " << numberOfHashes;
+	}
+
+	if (isV2) {
+		loadFileTree(requiredValue(infoDict, "file tree", BencodeView::Type::Dictionary));
+		m_isHybrid = true;
+	}
+
+	m_infoDictionary = infoDict.getRawBencodeData();
+	if (m_isHybrid) {
+		m_infoHashV2 = QCryptographicHash::hash(m_infoDictionary, QCryptographicHash::Sha256);
+	} else {
+		m_infoHashV2.clear();
+	}
+}
+
+// Adds the files in the tree to files, in the order of the tree. The
+// paths don't have the torrent's name. The length is -1 if it's missing,
+// the pieces root is only set if it's valid
+static void findFiles(const BencodeView &tree, QStringList &path, QList<FileInfo> &files)
+{
+	// Deeper trees are not valid paths anyway
+	if (path.size() > 64) {
+		throw BencodeException("File tree is too deep");
+	}
+	for (BencodeView::Iterator nodes(tree); nodes.hasNext();) {
+		BencodeView node = nodes.next();
+		if (!node.isDictionary()) {
+			throw BencodeException("File tree entry is not a dictionary");
+		}
+		// A file is a dictionary with an empty key
+		if (nodes.key().stringLength() == 0) {
+			FileInfo fileInfo;
+			fileInfo.path = path;
+			BencodeView length = node.value("length");
+			fileInfo.length = length.isInteger() ? length.toInt() : -1;
+			fileInfo.isPadFile = false;
+			BencodeView piecesRoot = node.value("pieces root");
+			if (piecesRoot.isString() && piecesRoot.stringLength() == MerkleTree::HASH_SIZE) {
+				fileInfo.piecesRoot = piecesRoot.toByteArray();
+			}
+			files.push_back(fileInfo);
+			continue;
+		}
+		path.push_back(QString::fromUtf8(nodes.key().toByteArray()));
+		findFiles(node, path, files);
+		path.pop_back();
+	}
+}
+
+void TorrentInfo::loadFileTree(const BencodeView &fileTree)
+{
+	BencodeException ex("TorrentInfo::loadFileTree(): ");
+
+	QStringList path;
+	QList<FileInfo> files;
+	findFiles(fileTree, path, files);
+	QMap<QString, QByteArray> roots;
+	for (const FileInfo &file : files) {
+		if (!file.piecesRoot.isEmpty()) {
+			roots[QStringList(file.path).join('/')] = file.piecesRoot;
+		}
+	}
+
+	// Each file of the v1 part must be in the tree and start at a piece
+	// boundary, so that every piece is in one file and its merkle tree
+	qint64 offset = 0;
+	for (FileInfo &fileInfo : m_fileInfos) {
+		if (!fileInfo.isPadFile && fileInfo.length > 0) {
+			// Multi-file torrents have the files in a directory named after the torrent
+			QString filePath = fileInfo.path.size() == 1 ? fileInfo.path.first()
+														 : QStringList(fileInfo.path.mid(1)).join('/');
+			if (!roots.contains(filePath)) {
+				throw ex << "File " << filePath << " of the hybrid torrent is not in the file tree";
+			}
+			if (offset % m_pieceLength != 0) {
+				throw ex << "File " << filePath << " of the hybrid torrent is not aligned to a piece";
+			}
+			fileInfo.piecesRoot = roots.value(filePath);
+		}
+		offset += fileInfo.length;
+	}
+}
+
+void TorrentInfo::loadV2Files(const BencodeView &fileTree)
+{
+	BencodeException ex("TorrentInfo::loadV2Files(): ");
+
+	QStringList path;
+	QList<FileInfo> files;
+	findFiles(fileTree, path, files);
+	if (files.isEmpty()) {
+		throw ex << "The file tree has no files";
+	}
+
+	// A single file is named after the torrent, like in v1 torrents
+	bool singleFile = files.size() == 1 && files.first().path.size() == 1;
+	m_fileInfos.clear();
+	m_length = 0;
+	qint64 offset = 0;
+	for (FileInfo fileInfo : files) {
+		if (fileInfo.length < 0) {
+			throw ex << "Invalid length " << fileInfo.length << " of " << QStringList(fileInfo.path).join('/');
+		}
+		if (fileInfo.length > 0 && fileInfo.piecesRoot.isEmpty()) {
+			throw ex << "File " << QStringList(fileInfo.path).join('/') << " has no valid pieces root";
+		}
+		if (fileInfo.length > 0 && offset % m_pieceLength != 0) {
+			// Fills the rest of the last piece of the previous file (BEP 47)
+			FileInfo padFile;
+			padFile.length = m_pieceLength - offset % m_pieceLength;
+			padFile.path = QList<QString>({m_torrentName, ".pad", QString::number(padFile.length)});
+			padFile.isPadFile = true;
+			m_fileInfos.push_back(padFile);
+			offset += padFile.length;
+		}
+		if (singleFile) {
+			fileInfo.path = QList<QString>({m_torrentName});
+		} else {
+			fileInfo.path.prepend(m_torrentName);
+		}
+		m_fileInfos.push_back(fileInfo);
+		offset += fileInfo.length;
+		// The pad files have no data, the size is what's downloaded
+		m_length += fileInfo.length;
+	}
+}
 
-		/* Calculate total number of pieces */
-		m_numberOfPieces = m_length / m_pieceLength;
-		if (m_length % m_pieceLength != 0) {
-			m_numberOfPieces++;
+void TorrentInfo::loadPieceLayout()
+{
+	m_fileOffsets.clear();
+	qint64 offset = 0;
+	for (const FileInfo &fileInfo : m_fileInfos) {
+		m_fileOffsets.push_back(offset);
+		offset += fileInfo.length;
+	}
+	m_fileOffsets.push_back(offset);
+
+	m_numberOfPieces = offset / m_pieceLength;
+	if (offset % m_pieceLength != 0) {
+		m_numberOfPieces++;
+	}
+
+	// In v1 torrents the pad files are part of the pieces, in v2
+	// torrents the last piece of each file ends with it
+	m_shortPieces.clear();
+	if (m_isV2Only) {
+		for (int i = 0; i < m_fileInfos.size(); i++) {
+			const FileInfo &fileInfo = m_fileInfos[i];
+			if (fileInfo.isPadFile || fileInfo.length == 0) {
+				continue;
+			}
+			qint64 fileEnd = m_fileOffsets[i + 1];
+			int lastPiece = (fileEnd - 1) / m_pieceLength;
+			int lastPieceLength = fileEnd - lastPiece * m_pieceLength;
+			if (lastPieceLength != m_pieceLength) {
+				m_shortPieces[lastPiece] = lastPieceLength;
+			}
 		}
+	} else if (offset % m_pieceLength != 0) {
+		m_shortPieces[m_numberOfPieces - 1] = offset % m_pieceLength;
+	}
+}
+
+int TorrentInfo::fileOfPiece(int pieceIndex) const
+{
+	qint64 pieceBegin = m_pieceLength * pieceIndex;
+	// The last file that begins at or before the piece
+	auto it = std::upper_bound(m_fileOffsets.constBegin(), m_fileOffsets.constEnd() - 1, pieceBegin);
+	int fileIndex = it - m_fileOffsets.constBegin() - 1;
+	if (fileIndex < 0 || fileIndex >= m_fileInfos.size() || m_fileInfos[fileIndex].isPadFile
+			|| m_fileOffsets[fileIndex + 1] <= pieceBegin) {
+		return -1;
+	}
+	return fileIndex;
+}
+
+bool TorrentInfo::loadFromMagnetLink(const QString &magnetLink)
+{
+	clearError();
+
+	QUrl url(magnetLink);
+	if (url.scheme() != "magnet") {
+		setError("Not a magnet link: " + magnetLink);
+		return false;
+	}
+
+	QUrlQuery query(url);
+	m_infoHash.clear();
+	m_infoHashV2.clear();
+	for (const auto &item : query.queryItems(QUrl::FullyDecoded)) {
+		// 'xt' may be numbered (xt.1, xt.2, ...) if there are several of them
+		if (item.first != "xt" && !item.first.startsWith("xt.")) {
+			continue;
+		}
+		if (item.second.startsWith("urn:btih:", Qt::CaseInsensitive) && m_infoHash.isEmpty()) {
+			QByteArray hash = item.second.mid(9).toLatin1();
+			if (hash.size() == 40) {
+				m_infoHash = QByteArray::fromHex(hash);
+			} else if (hash.size() == 32) {
+				m_infoHash = fromBase32(hash);
+			}
+			if (m_infoHash.size() != PIECE_HASH_SIZE) {
+				m_infoHash.clear();
+			}
+		} else if (item.second.startsWith("urn:btmh:", Qt::CaseInsensitive) && m_infoHashV2.isEmpty()) {
+			// A hex multihash. Only SHA-256 (0x12) of 32 bytes (0x20) is used
+			QByteArray hash = item.second.mid(9).toLatin1();
+			if (hash.size() == 4 + 2 * MerkleTree::HASH_SIZE && hash.startsWith("1220")) {
+				m_infoHashV2 = QByteArray::fromHex(hash.mid(4));
+			}
+			if (m_infoHashV2.size() != MerkleTree::HASH_SIZE) {
+				m_infoHashV2.clear();
+			}
+		}
+	}
+	// Without the v1 info hash, the swarm is found by the truncated v2 one
+	if (m_infoHash.isEmpty()) {
+		m_infoHash = m_infoHashV2.left(PIECE_HASH_SIZE);
+	}
+	if (m_infoHash.isEmpty()) {
+		setError("Magnet link does not contain a valid BitTorrent info hash");
+		return false;
+	}
+
+	// Display name. Use the info hash if there's none
+	QString displayName = query.queryItemValue("dn", QUrl::FullyDecoded).replace('+', ' ');
+	if (displayName.isEmpty()) {
+		m_torrentName = m_infoHash.toHex();
+	} else {
+		m_torrentName = displayName.toUtf8();
+	}
+
+	// Trackers
+	m_announceUrlsList.clear();
+	for (const QString &tracker : query.allQueryItemValues("tr", QUrl::FullyDecoded)) {
+		m_announceUrlsList.push_back(tracker.toUtf8());
+	}
+
+	m_creationFileName.clear();
+	m_infoDictionary.clear();
+	return true;
+}
+
+bool TorrentInfo::loadFromInfoDictionary(const QByteArray &infoDictionary)
+{
+	clearError();
+
+	if (!matchesInfoDictionary(infoDictionary)) {
+		QByteArray infoHash = QCryptographicHash::hash(infoDictionary, QCryptographicHash::Sha1);
+		setError("Info dictionary hash " + infoHash.toHex() + " does not match " + m_infoHash.toHex());
+		return false;
+	}
+
+	BencodeReader bencodeReader;
+	if (!bencodeReader.parse(infoDictionary)) {
+		setError("Failed to parse info dictionary: " + bencodeReader.errorString());
+		return false;
+	}
+
+	try {
+		BencodeException ex("TorrentInfo::loadFromInfoDictionary(): ");
+		if (!bencodeReader.root().isDictionary()) {
+			throw ex << "Info dictionary is not a dictionary";
+		}
+		loadInfoDictionary(bencodeReader.root());
 	} catch (BencodeException &ex) {
+		m_infoDictionary.clear();
 		setError(ex.what());
 		return false;
 	}
+
+	// A magnet link's info hash stays, the peers and trackers know the torrent by it
+	if (m_infoHash.isEmpty()) {
+		if (m_isV2Only) {
+			m_infoHash = m_infoHashV2.left(PIECE_HASH_SIZE);
+		} else {
+			m_infoHash = QCryptographicHash::hash(infoDictionary, QCryptographicHash::Sha1);
+		}
+	}
+	if (m_encoding == nullptr) {
+		m_encoding = new QString("UTF-8");
+	}
+	return true;
+}
+
+bool TorrentInfo::saveToTorrentFile(const QString &filename)
+{
+	clearError();
+
+	if (!hasMetadata()) {
+		setError("Can't save a torrent file without metadata");
+		return false;
+	}
+
+	// Keys must be sorted
+	QByteArray data;
+	data.append('d');
+	if (!m_announceUrlsList.isEmpty()) {
+		BencodeString announce(m_announceUrlsList.first());
+		BencodeList announceList;
+		for (const QByteArray &url : m_announceUrlsList) {
+			BencodeList *tier = new BencodeList;
+			tier->add(new BencodeString(url));
+			announceList.add(tier);
+		}
+		data.append(BencodeString("announce").bencode()).append(announce.bencode());
+		data.append(BencodeString("announce-list").bencode()).append(announceList.bencode());
+	}
+	data.append(BencodeString("info").bencode()).append(m_infoDictionary);
+	if (!m_pieceLayers.isEmpty()) {
+		BencodeDictionary pieceLayers;
+		for (auto it = m_pieceLayers.constBegin(); it != m_pieceLayers.constEnd(); ++it) {
+			pieceLayers.add(it.key(), new BencodeString(it.value()));
+		}
+		data.append(BencodeString("piece layers").bencode()).append(pieceLayers.bencode());
+	}
+	data.append('e');
+
+	QFile file(filename);
+	if (!file.open(QIODevice::WriteOnly)) {
+		setError("Failed to open " + filename + ": " + file.errorString());
+		return false;
+	}
+	if (file.write(data) != data.size()) {
+		setError("Failed to write " + filename + ": " + file.errorString());
+		return false;
+	}
+	m_creationFileName = filename;
 	return true;
 }
 
+bool TorrentInfo::hasMetadata() const
+{
+	return !m_infoDictionary.isEmpty();
+}
+
+const QByteArray &TorrentInfo::infoDictionary() const
+{
+	return m_infoDictionary;
+}
+
+QString TorrentInfo::magnetLink() const
+{
+	QUrlQuery query;
+	// The info hash of a v2 torrent is the truncated v2 one, which isn't a btih
+	if (hasMetadata() && !m_isV2Only) {
+		query.addQueryItem("xt", "urn:btih:" + QCryptographicHash::hash(m_infoDictionary, QCryptographicHash::Sha1).toHex());
+	} else if (!hasMetadata() && m_infoHash != m_infoHashV2.left(PIECE_HASH_SIZE)) {
+		query.addQueryItem("xt", "urn:btih:" + m_infoHash.toHex());
+	}
+	if (!m_infoHashV2.isEmpty()) {
+		// A multihash: SHA-256 (0x12), 32 bytes (0x20)
+		query.addQueryItem("xt", "urn:btmh:1220" + m_infoHashV2.toHex());
+	}
+	query.addQueryItem("dn", QString::fromUtf8(m_torrentName));
+	for (const QByteArray &url : m_announceUrlsList) {
+		query.addQueryItem("tr", QString::fromUtf8(url));
+	}
+	QUrl url;
+	url.setScheme("magnet");
+	url.setQuery(query);
+	return url.toString(QUrl::FullyEncoded);
+}
+
 
 const QList<QByteArray> &TorrentInfo::announceUrlsList() const
 {
@@ -242,14 +691,48 @@ qint64 TorrentInfo::pieceLength() const
 	return m_pieceLength;
 }
 
-const QList<QByteArray> &TorrentInfo::pieces() const
+const QByteArray &TorrentInfo::pieceHashes() const
+{
+	return m_pieceHashes;
+}
+
+const char *TorrentInfo::pieceHash(int pieceIndex) const
 {
-	return m_pieces;
+	Q_ASSERT(pieceIndex >= 0 && pieceIndex < m_numberOfPieces);
+	return m_pieceHashes.constData() + pieceIndex * PIECE_HASH_SIZE;
 }
 
-const QByteArray &TorrentInfo::piece(int pieceIndex) const
+bool TorrentInfo::checkPieceHash(int pieceIndex, const QByteArray &hash) const
 {
-	return m_pieces[pieceIndex];
+	if (pieceIndex < 0 || pieceIndex >= m_numberOfPieces || hash.size() != PIECE_HASH_SIZE) {
+		return false;
+	}
+	const char *expected = pieceHash(pieceIndex);
+	const char *actual = hash.constData();
+	unsigned char difference = 0;
+	for (int i = 0; i < PIECE_HASH_SIZE; i++) {
+		difference |= expected[i] ^ actual[i];
+	}
+	return difference == 0;
+}
+
+bool TorrentInfo::checkPiece(int pieceIndex, const char *data, qint64 size) const
+{
+	if (!m_isV2Only) {
+		return checkPieceHash(pieceIndex, QCryptographicHash::hash(QByteArray::fromRawData(data, size), QCryptographicHash::Sha1));
+	}
+	QByteArray expected = pieceRoot(pieceIndex);
+	if (expected.size() != MerkleTree::HASH_SIZE || size != pieceSize(pieceIndex)) {
+		return false;
+	}
+	int fileIndex = fileOfPiece(pieceIndex);
+	QByteArray actual = MerkleTree::pieceRoot(data, size, m_fileInfos[fileIndex].length, m_pieceLength);
+	return actual.size() == MerkleTree::HASH_SIZE && MerkleTree::equal(actual.constData(), expected.constData());
+}
+
+int TorrentInfo::pieceSize(int pieceIndex) const
+{
+	return m_shortPieces.value(pieceIndex, int(m_pieceLength));
 }
 
 const QList<FileInfo> &TorrentInfo::fileInfos() const
@@ -267,6 +750,89 @@ const QByteArray &TorrentInfo::infoHash() const
 	return m_infoHash;
 }
 
+bool TorrentInfo::isHybrid() const
+{
+	return m_isHybrid;
+}
+
+const QByteArray &TorrentInfo::infoHashV2() const
+{
+	return m_infoHashV2;
+}
+
+bool TorrentInfo::isV2Only() const
+{
+	return m_isV2Only;
+}
+
+bool TorrentInfo::isV2() const
+{
+	return m_isHybrid || m_isV2Only;
+}
+
+bool TorrentInfo::matchesInfoHash(const QByteArray &infoHash) const
+{
+	if (infoHash == m_infoHash) {
+		return true;
+	}
+	return !m_infoHashV2.isEmpty() && infoHash == m_infoHashV2.left(PIECE_HASH_SIZE);
+}
+
+bool TorrentInfo::matchesInfoDictionary(const QByteArray &infoDictionary) const
+{
+	if (m_infoHash.isEmpty() && m_infoHashV2.isEmpty()) {
+		return true;
+	}
+	QByteArray infoHash = QCryptographicHash::hash(infoDictionary, QCryptographicHash::Sha1);
+	if (!m_infoHash.isEmpty() && infoHash == m_infoHash) {
+		return true;
+	}
+	QByteArray infoHashV2 = QCryptographicHash::hash(infoDictionary, QCryptographicHash::Sha256);
+	if (!m_infoHashV2.isEmpty()) {
+		return infoHashV2 == m_infoHashV2;
+	}
+	return infoHashV2.left(PIECE_HASH_SIZE) == m_infoHash;
+}
+
+QByteArray TorrentInfo::pieceRoot(int pieceIndex) const
+{
+	int fileIndex = fileOfPiece(pieceIndex);
+	if (fileIndex < 0) {
+		return QByteArray();
+	}
+	const FileInfo &fileInfo = m_fileInfos[fileIndex];
+	if (fileInfo.length <= m_pieceLength) {
+		return fileInfo.piecesRoot;
+	}
+	qint64 pieceInFile = (m_pieceLength * pieceIndex - m_fileOffsets[fileIndex]) / m_pieceLength;
+	return m_pieceLayers.value(fileInfo.piecesRoot).mid(pieceInFile * MerkleTree::HASH_SIZE, MerkleTree::HASH_SIZE);
+}
+
+QByteArray TorrentInfo::pieceLayer(int fileIndex) const
+{
+	return m_pieceLayers.value(m_fileInfos[fileIndex].piecesRoot);
+}
+
+bool TorrentInfo::setPieceLayer(int fileIndex, const QByteArray &pieceLayer)
+{
+	const FileInfo &fileInfo = m_fileInfos[fileIndex];
+	if (fileInfo.piecesRoot.isEmpty() || fileInfo.length <= m_pieceLength) {
+		return false;
+	}
+	qint64 numberOfPieces = (fileInfo.length + m_pieceLength - 1) / m_pieceLength;
+	if (pieceLayer.size() != numberOfPieces * MerkleTree::HASH_SIZE) {
+		return false;
+	}
+	QByteArray padHash = MerkleTree::padHash(m_pieceLength / MerkleTree::BLOCK_SIZE);
+	QByteArray root = MerkleTree::root(pieceLayer, MerkleTree::nextPowerOfTwo(numberOfPieces), padHash);
+	if (root != fileInfo.piecesRoot) {
+		qDebug() << "Piece layer of" << fileInfo.path.join('/') << "does not match its pieces root";
+		return false;
+	}
+	m_pieceLayers[fileInfo.piecesRoot] = pieceLayer;
+	return true;
+}
+
 const QString &TorrentInfo::creationFileName() const
 {
 	return m_creationFileName;
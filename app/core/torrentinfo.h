@@ -21,12 +21,25 @@
 #define TORRENTINFO_H
 
 #include <QList>
+#include <QMap>
+#include <QVector>
 #include <QString>
 #include <QDateTime>
 
+class BencodeView;
+
+/* Size of a SHA-1 piece hash */
+const int PIECE_HASH_SIZE = 20;
+
 struct FileInfo {
 	QList<QString> path;
 	qint64 length;
+	/* Fills the space up to the next piece boundary (BEP 47). It's all
+	 * zeros and is never written to the disk */
+	bool isPadFile;
+	/* The root of the file's SHA-256 merkle tree (BEP 52), in v2 and
+	 * hybrid torrents. Empty otherwise, and for empty files */
+	QByteArray piecesRoot;
 };
 
 class TorrentInfo
@@ -40,7 +53,9 @@ class TorrentInfo
 	qint64 m_length;
 	QByteArray m_torrentName;
 	qint64 m_pieceLength;
-	QList<QByteArray> m_pieces;
+
+	/* SHA-1 hashes of all pieces, PIECE_HASH_SIZE bytes each, back to back */
+	QByteArray m_pieceHashes;
 
 	QDateTime *m_creationDate;
 	QString *m_comment;
@@ -51,20 +66,79 @@ class TorrentInfo
 
 	QByteArray m_infoHash;
 
+	/* v2 and hybrid v1/v2 torrents (BEP 52) */
+	bool m_isHybrid;
+	bool m_isV2Only;
+	// SHA-256 of the info dictionary
+	QByteArray m_infoHashV2;
+	// The hashes of the pieces of each file larger than a piece, by pieces root
+	QMap<QByteArray, QByteArray> m_pieceLayers;
+
 	QString m_creationFileName;
 
 	int m_numberOfPieces;
+	// Where each file begins, followed by the end of the last one
+	QVector<qint64> m_fileOffsets;
+	// The pieces that are shorter than the piece length, by index: the
+	// last one, and in v2 torrents the last one of each file
+	QMap<int, int> m_shortPieces;
+
+	/* The raw bencoded info dictionary. Empty until the metadata is known */
+	QByteArray m_infoDictionary;
+
+	/* Loads all values from the info dictionary.
+	 * Throws BencodeException on error */
+	void loadInfoDictionary(const BencodeView &infoDict);
+	/* Finds the pieces root of each file in the v2 file tree of a hybrid torrent.
+	 * Throws BencodeException on error */
+	void loadFileTree(const BencodeView &fileTree);
+	/* Loads the files of a v2 torrent from its file tree. Each file starts
+	 * at a piece boundary, the gaps are filled with pad files.
+	 * Throws BencodeException on error */
+	void loadV2Files(const BencodeView &fileTree);
+	/* Computes the file offsets, the number of pieces and their sizes */
+	void loadPieceLayout();
+	/* The index of the file with the data of a v2 piece, or -1 */
+	int fileOfPiece(int pieceIndex) const;
+
 public:
 	QString errorString() const;
 	bool loadFromTorrentFile(QString filename);
 
+	/* Loads the info hash, name and trackers from a magnet URI.
+	 * The rest of the metadata has to be loaded later with loadFromInfoDictionary() */
+	bool loadFromMagnetLink(const QString &magnetLink);
+
+	/* Loads the metadata from a raw bencoded info dictionary
+	 * Fails if its hash does not match the already known info hash */
+	bool loadFromInfoDictionary(const QByteArray &infoDictionary);
+
+	/* Writes a .torrent file with the announce list and the info dictionary */
+	bool saveToTorrentFile(const QString &filename);
+
+	/* Returns true if the info dictionary is loaded */
+	bool hasMetadata() const;
+	const QByteArray &infoDictionary() const;
+	QString magnetLink() const;
+
 	const QList<QByteArray> &announceUrlsList() const;
 
 	qint64 length() const;
 	const QByteArray &torrentName() const;
 	qint64 pieceLength() const;
-	const QList<QByteArray> &pieces() const;
-	const QByteArray &piece(int pieceIndex) const;
+	const QByteArray &pieceHashes() const;
+
+	/* Points to the PIECE_HASH_SIZE bytes long hash of the piece */
+	const char *pieceHash(int pieceIndex) const;
+
+	/* Compares hash with the expected hash of the piece.
+	 * Takes the same time no matter where they differ */
+	bool checkPieceHash(int pieceIndex, const QByteArray &hash) const;
+	/* Checks the data of a piece: by its SHA-1 hash, or by its merkle
+	 * root in v2 torrents. False if the root is not known yet */
+	bool checkPiece(int pieceIndex, const char *data, qint64 size) const;
+	/* The size of a piece. The last piece of a file may be shorter in v2 torrents */
+	int pieceSize(int pieceIndex) const;
 
 	const QDateTime *creationDate() const;
 	const QString *comment() const;
@@ -76,6 +150,30 @@ public:
 
 	const QByteArray &infoHash() const;
 
+	/* Hybrid torrents have the v1 piece hashes and a merkle tree for
+	 * each file. v2 torrents only have the merkle trees */
+	bool isHybrid() const;
+	bool isV2Only() const;
+	/* True for both, which have the merkle trees and talk to v2 peers */
+	bool isV2() const;
+	/* SHA-256 of the info dictionary. The info hash of v2 torrents is
+	 * this, truncated to 20 bytes */
+	const QByteArray &infoHashV2() const;
+	/* True for the info hash, or the v2 info hash truncated to 20 bytes,
+	 * which v2 peers may use in their handshake */
+	bool matchesInfoHash(const QByteArray &infoHash) const;
+	/* True if the info dictionary has the known v1 or v2 info hash,
+	 * or if none is known */
+	bool matchesInfoDictionary(const QByteArray &infoDictionary) const;
+	/* The hash of a v2 piece: from the piece layer of its file, or the
+	 * pieces root of a file of up to one piece. Empty if not known */
+	QByteArray pieceRoot(int pieceIndex) const;
+	/* The hashes of the pieces of a file from the "piece layers" of the
+	 * .torrent file, or an empty array. Files of up to one piece have none */
+	QByteArray pieceLayer(int fileIndex) const;
+	/* Checks a file's piece layer against its pieces root and keeps it if it's valid */
+	bool setPieceLayer(int fileIndex, const QByteArray &pieceLayer);
+
 	const QString &creationFileName() const;
 
 	int numberOfPieces() const;
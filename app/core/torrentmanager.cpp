@@ -21,23 +21,142 @@
 #include "torrentinfo.h"
 #include "torrent.h"
 #include "resumeinfo.h"
-#include "bencodeparser.h"
-#include "ui/mainwindow.h"
+#include "bencodereader.h"
 #include "qtorrent.h"
 #include <QDir>
+#include <QFile>
+#include <QSaveFile>
+#include <QSettings>
 #include <QStandardPaths>
+#include <QTimer>
+#include <QtConcurrent>
+#include <QDebug>
+#include <cstring>
+
+// Extension of the per-torrent resume files, next to the saved .torrent files
+#define RESUME_FILE_SUFFIX ".resume"
+
+const int DEFAULT_CHECKPOINT_INTERVAL_SEC = 30;
+const int DEFAULT_WRITE_CACHE_FLUSH_INTERVAL_SEC = 5;
+
+// Resumed torrents are started in batches of this size
+const int ACTIVATION_BATCH_SIZE = 10;
+const int ACTIVATION_INTERVAL_MSEC = 250;
 
 TorrentManager *TorrentManager::m_torrentManager = nullptr;
 
+// Returns the directory with the saved .torrent and .resume files and creates it if needed.
+// Returns an empty string on error
+static QString resumeDirectoryPath()
+{
+	QString path = QStandardPaths::writableLocation(QStandardPaths::AppDataLocation) + "/resume";
+	if (!QDir().mkpath(path)) {
+		return QString();
+	}
+	return path;
+}
+
+// Atomically replaces fileName with data
+static bool writeResumeFile(const QString &fileName, const QByteArray &data, QString &errorString)
+{
+	QSaveFile file(fileName);
+	if (!file.open(QIODevice::WriteOnly)) {
+		errorString = "Failed to open " + fileName + ": " + file.errorString();
+		return false;
+	}
+	if (file.write(data) != data.size() || !file.commit()) {
+		errorString = "Failed to write " + fileName + ": " + file.errorString();
+		return false;
+	}
+	return true;
+}
+
+// Loads a .resume file and the .torrent file next to it. Runs in a worker thread
+static LoadedTorrent loadSavedTorrent(const QString &resumeFileName)
+{
+	LoadedTorrent loaded = { nullptr, nullptr, QString() };
+
+	QFile resumeFile(resumeFileName);
+	if (!resumeFile.open(QIODevice::ReadOnly)) {
+		loaded.errorString = "Failed to open " + resumeFileName + ": " + resumeFile.errorString();
+		return loaded;
+	}
+	QByteArray resumeData = resumeFile.readAll();
+
+	QString torrentFileName = resumeFileName;
+	torrentFileName.chop(strlen(RESUME_FILE_SUFFIX));
+	torrentFileName += ".torrent";
+
+	TorrentInfo *torrentInfo = new TorrentInfo;
+	ResumeInfo *resumeInfo = new ResumeInfo(torrentInfo);
+	if (QFile::exists(torrentFileName)) {
+		if (!torrentInfo->loadFromTorrentFile(torrentFileName)) {
+			loaded.errorString = "Failed to parse " + torrentFileName + ": " + torrentInfo->errorString();
+		} else if (!resumeInfo->loadFromByteArray(resumeData)) {
+			loaded.errorString = "Failed to load resume info for " + torrentFileName;
+		}
+	} else if (!resumeInfo->loadFromByteArray(resumeData) || resumeInfo->magnetLink().isEmpty()) {
+		loaded.errorString = "File " + torrentFileName + " not found";
+	} else if (!torrentInfo->loadFromMagnetLink(resumeInfo->magnetLink())) {
+		// A magnet link torrent, which hasn't downloaded its metadata yet
+		loaded.errorString = "Failed to parse magnet link " + resumeInfo->magnetLink() + ": " + torrentInfo->errorString();
+	}
+
+	if (!loaded.errorString.isEmpty()) {
+		delete resumeInfo;
+		delete torrentInfo;
+		return loaded;
+	}
+	loaded.torrentInfo = torrentInfo;
+	loaded.resumeInfo = resumeInfo;
+	return loaded;
+}
+
+
 
 TorrentManager::TorrentManager()
+	: m_checkpointTimer(new QTimer(this))
+	, m_writeCacheTimer(new QTimer(this))
+	, m_activationTimer(new QTimer(this))
+	, m_resumeWatcher(nullptr)
+	, m_nextResumedTorrent(0)
 {
 	Q_ASSERT(m_torrentManager == nullptr);
 	m_torrentManager = this;
+
+	// Periodically save the resume data of the torrents that changed,
+	// so that a crash doesn't lose all progress since startup
+	QSettings settings;
+	int checkpointInterval = settings.value("ResumeCheckpointInterval", DEFAULT_CHECKPOINT_INTERVAL_SEC).toInt();
+	settings.setValue("ResumeCheckpointInterval", checkpointInterval);
+	if (checkpointInterval > 0) {
+		connect(m_checkpointTimer, &QTimer::timeout, this, &TorrentManager::saveDirtyTorrentsResumeInfo);
+		m_checkpointTimer->start(checkpointInterval * 1000);
+	}
+
+	// Cached pieces don't stay in memory for longer than this
+	int flushInterval = settings.value("WriteCacheFlushInterval", DEFAULT_WRITE_CACHE_FLUSH_INTERVAL_SEC).toInt();
+	settings.setValue("WriteCacheFlushInterval", flushInterval);
+	if (flushInterval > 0) {
+		connect(m_writeCacheTimer, &QTimer::timeout, this, &TorrentManager::flushWriteCaches);
+		m_writeCacheTimer->start(flushInterval * 1000);
+	}
+
+	m_activationTimer->setInterval(ACTIVATION_INTERVAL_MSEC);
+	connect(m_activationTimer, &QTimer::timeout, this, &TorrentManager::activateTorrents);
 }
 
 TorrentManager::~TorrentManager()
 {
+	if (m_resumeWatcher) {
+		// Free the loaded torrents that weren't added yet
+		m_resumeWatcher->waitForFinished();
+		QFuture<LoadedTorrent> future = m_resumeWatcher->future();
+		for (int i = m_nextResumedTorrent; i < future.resultCount(); i++) {
+			delete future.resultAt(i).resumeInfo;
+			delete future.resultAt(i).torrentInfo;
+		}
+	}
 	for (Torrent *torrent : m_torrents) {
 		delete torrent;
 	}
@@ -60,23 +179,39 @@ void TorrentManager::addTorrentFromInfo(TorrentInfo *torrentInfo, const TorrentS
 		}
 	}
 
-	// Create the torrent
 	Torrent *torrent = new Torrent();
-	if (!torrent->createNew(torrentInfo, settings.downloadLocation())) {
-		emit failedToAddTorrent("Failed to add torrent: " + torrent->errorString());
-		torrent->deleteLater();
-		return;
-	}
+	if (torrentInfo->hasMetadata()) {
+		// Create the torrent
+		if (!torrent->createNew(torrentInfo, settings.downloadLocation())) {
+			emit failedToAddTorrent("Failed to add torrent: " + torrent->errorString());
+			torrent->deleteLater();
+			return;
+		}
 
-	// Save the torrent
-	if (!saveTorrentFile(torrentInfo->creationFileName(), torrentInfo)) {
-		emit failedToAddTorrent("Failed to save the torrent");
-		torrent->deleteLater();
-		return;
+		// Save the torrent
+		if (!saveTorrentFile(torrentInfo->creationFileName(), torrentInfo)) {
+			emit failedToAddTorrent("Failed to save the torrent");
+			torrent->deleteLater();
+			return;
+		}
+	} else {
+		// Magnet link. The .torrent file is saved when the metadata arrives
+		if (!torrent->createFromMagnetLink(torrentInfo, settings.downloadLocation())) {
+			emit failedToAddTorrent("Failed to add torrent: " + torrent->errorString());
+			torrent->deleteLater();
+			return;
+		}
+		connect(torrent, &Torrent::metadataLoaded, this, &TorrentManager::onTorrentMetadataLoaded);
 	}
 
 	m_torrents.push_back(torrent);
 
+	// Only known if the metadata is available
+	if (!settings.filePriorities().isEmpty()) {
+		torrent->setFilePriorities(settings.filePriorities());
+	}
+	torrent->allocateFiles();
+
 	if (!settings.skipHashCheck()) {
 		torrent->check();
 	}
@@ -89,132 +224,249 @@ void TorrentManager::addTorrentFromInfo(TorrentInfo *torrentInfo, const TorrentS
 
 	emit torrentAdded(torrent);
 
-	saveTorrentsResumeInfo();
+	saveResumeInfo(torrent);
 }
 
 void TorrentManager::resumeTorrents()
 {
-	QString dataPath = QStandardPaths::writableLocation(QStandardPaths::AppDataLocation);
-	QDir dir(dataPath);
-	if (!dir.exists()) {
-		if (!dir.mkpath(dataPath)) {
-			emit failedToResumeTorrents("Failed to create directory " + dataPath);
+	QString resumePath = resumeDirectoryPath();
+	if (resumePath.isEmpty()) {
+		emit failedToResumeTorrents("Failed to create the resume directory");
+		return;
+	}
+	QDir dir(resumePath);
+
+	migrateLegacyResumeFile(dir);
+
+	// Read the .torrent and .resume files in parallel.
+	// The torrents are added one by one as they are loaded
+	QStringList resumeFiles = dir.entryList(QStringList("*" RESUME_FILE_SUFFIX), QDir::Files, QDir::Name);
+	if (resumeFiles.isEmpty()) {
+		emit torrentsResumed();
+		return;
+	}
+	for (QString &fileName : resumeFiles) {
+		fileName = dir.absoluteFilePath(fileName);
+	}
+	m_nextResumedTorrent = 0;
+	m_resumeWatcher = new QFutureWatcher<LoadedTorrent>(this);
+	connect(m_resumeWatcher, &QFutureWatcher<LoadedTorrent>::resultReadyAt, this, &TorrentManager::addResumedTorrents);
+	connect(m_resumeWatcher, &QFutureWatcher<LoadedTorrent>::finished, this, &TorrentManager::onTorrentsLoaded);
+	m_resumeWatcher->setFuture(QtConcurrent::mapped(resumeFiles, loadSavedTorrent));
+}
+
+void TorrentManager::addResumedTorrents()
+{
+	// Keep the order of the files, even if they're loaded out of order
+	QFuture<LoadedTorrent> future = m_resumeWatcher->future();
+	while (m_nextResumedTorrent < future.resultCount() && future.isResultReadyAt(m_nextResumedTorrent)) {
+		addResumedTorrent(future.resultAt(m_nextResumedTorrent++));
+	}
+}
+
+void TorrentManager::onTorrentsLoaded()
+{
+	addResumedTorrents();
+	m_resumeWatcher->deleteLater();
+	m_resumeWatcher = nullptr;
+	emit torrentsResumed();
+}
+
+void TorrentManager::addResumedTorrent(const LoadedTorrent &loaded)
+{
+	if (!loaded.errorString.isEmpty()) {
+		qDebug() << "TorrentManager::resumeTorrents():" << loaded.errorString;
+		return;
+	}
+	TorrentInfo *torrentInfo = loaded.torrentInfo;
+	ResumeInfo *resumeInfo = loaded.resumeInfo;
+
+	// The same torrent could have been added while we were loading
+	for (Torrent *t : m_torrents) {
+		if (t->torrentInfo()->infoHash() == torrentInfo->infoHash()) {
+			delete resumeInfo;
+			delete torrentInfo;
 			return;
 		}
 	}
-	if (!dir.exists("resume")) {
-		if (!dir.mkdir("resume")) {
-			emit failedToResumeTorrents("Failed to create directory " + dataPath + "/resume");
+
+	Torrent *torrent = new Torrent();
+	if (!torrentInfo->hasMetadata()) {
+		if (!torrent->createFromMagnetLink(torrentInfo, resumeInfo)) {
+			qDebug() << "TorrentManager::resumeTorrents(): Failed to create torrent from magnet link"
+					 << torrentInfo->magnetLink() << torrent->errorString();
+			delete resumeInfo;
+			torrent->deleteLater();
 			return;
 		}
+		connect(torrent, &Torrent::metadataLoaded, this, &TorrentManager::onTorrentMetadataLoaded);
+	} else if (!torrent->createFromResumeInfo(torrentInfo, resumeInfo)) {
+		qDebug() << "TorrentManager::resumeTorrents(): Failed to create torrent from resume data for"
+				 << torrentInfo->creationFileName() << torrent->errorString();
+		delete resumeInfo;
+		torrent->deleteLater();
+		return;
 	}
-	dir.cd("resume");
-	QFile resumeFile(dir.path() + "/resume.dat");
-	if (!resumeFile.exists()) {
-		// No resume file => Nothing to do.
+
+	// Don't start all torrents at once
+	if (resumeInfo->paused()) {
+		torrent->pause();
+	} else {
+		m_activationQueue.push_back(torrent);
+		if (!m_activationTimer->isActive()) {
+			m_activationTimer->start();
+		}
+	}
+	delete resumeInfo;
+
+	// Nothing changed since the resume data was saved
+	torrent->setResumeInfoDirty(false);
+
+	m_torrents.push_back(torrent);
+	emit torrentAdded(torrent);
+}
+
+void TorrentManager::activateTorrents()
+{
+	for (int i = 0; i < ACTIVATION_BATCH_SIZE && !m_activationQueue.isEmpty(); i++) {
+		Torrent *torrent = m_activationQueue.takeFirst();
+		// It could have been paused or started by the user in the meantime
+		if (!torrent->isPaused() && !torrent->isStarted()) {
+			torrent->start();
+			Q_ASSERT_X(torrent->hasMetadata() || torrent->isFetchingMetadata(),
+					   "TorrentManager::activateTorrents()", "Magnet link isn't fetching the metadata");
+		}
+	}
+	if (m_activationQueue.isEmpty()) {
+		m_activationTimer->stop();
+	}
+}
+
+void TorrentManager::migrateLegacyResumeFile(const QDir &dir)
+{
+	QFile legacyFile(dir.absoluteFilePath("resume.dat"));
+	if (!legacyFile.exists()) {
 		return;
 	}
-	if (!resumeFile.open(QIODevice::ReadOnly)) {
-		QFileInfo info(resumeFile);
-		emit failedToResumeTorrents("Failed to open file " + info.absoluteFilePath() + ": " + resumeFile.errorString());
+	if (!legacyFile.open(QIODevice::ReadOnly)) {
+		emit failedToResumeTorrents("Failed to open file " + legacyFile.fileName() + ": " + legacyFile.errorString());
 		return;
 	}
-	QByteArray resumeData = resumeFile.readAll();
-	BencodeParser parser;
-	try {
-		if (!parser.parse(resumeData)) {
-			throw BencodeException(parser.errorString());
-		}
-		if (parser.list().isEmpty()) {
-			throw BencodeException("Main bencode list is empty");
-		}
-		if (parser.list().size() != 1) {
-			throw BencodeException("Main bencode list has size of "
-								   + QString::number(parser.list().size()) + ", expected 1");
+	BencodeReader reader;
+	if (!reader.parse(legacyFile.readAll())) {
+		emit failedToResumeTorrents("Failed to read resume file: " + reader.errorString());
+		return;
+	}
+	if (!reader.root().isDictionary()) {
+		emit failedToResumeTorrents("Failed to read resume file: not a dictionary");
+		return;
+	}
+	legacyFile.close();
+
+	for (BencodeView::Iterator it(reader.root()); it.hasNext();) {
+		BencodeView value = it.next();
+		QString hash = it.key().toByteArray().toHex();
+		QString resumeFileName = dir.absoluteFilePath(hash + RESUME_FILE_SUFFIX);
+		if (QFile::exists(resumeFileName)) {
+			// Already migrated
+			continue;
 		}
 
-		BencodeDictionary *mainDict = parser.list().first()->toBencodeDictionary();
-		for (QByteArray infoHash : mainDict->keys()) {
-			QFile file(dir.path() + "/" + infoHash.toHex() + ".torrent");
-			if (!file.exists()) {
-				QFileInfo info(file);
-				qDebug() << "TorrentManager::resumeTorrents(): file" << info.absoluteFilePath() << "Not found";
+		TorrentInfo torrentInfo;
+		QString torrentFileName = dir.absoluteFilePath(hash + ".torrent");
+		if (QFile::exists(torrentFileName)) {
+			if (!torrentInfo.loadFromTorrentFile(torrentFileName)) {
+				qDebug() << "TorrentManager::migrateLegacyResumeFile(): Failed to parse" << torrentFileName
+						 << torrentInfo.errorString();
 				continue;
 			}
-
-			TorrentInfo *torrentInfo = new TorrentInfo;
-			if (!torrentInfo->loadFromTorrentFile(file.fileName())) {
-				qDebug() << "TorrentManager::resumeTorrents(): Failed to parse" << file.fileName()
-						 << torrentInfo->errorString();
-				delete torrentInfo;
+		} else {
+			// A magnet link torrent, which hasn't downloaded its metadata yet
+			BencodeView magnetLink = value.value("magnetLink");
+			if (!magnetLink.isString() || !torrentInfo.loadFromMagnetLink(QString::fromUtf8(magnetLink.toByteArray()))) {
+				qDebug() << "TorrentManager::migrateLegacyResumeFile(): file" << torrentFileName << "Not found";
 				continue;
 			}
+		}
 
-			ResumeInfo resumeInfo(torrentInfo);
-
-			BencodeValue *value = mainDict->value(infoHash);
-			if (!value->isDictionary()) {
-				qDebug() << "TorrentManager::resumeTorrents(): Failed to parse" << file.fileName()
-						 << ": value for infohash is not a dictionary";
-				delete torrentInfo;
-				continue;
-			}
-			if (!resumeInfo.loadFromBencode(value->toBencodeDictionary())) {
-				qDebug() << "TorrentManager::resumeTorrents(): Failed to load resume info for" << file.fileName();
-				delete torrentInfo;
-				continue;
-			}
+		ResumeInfo resumeInfo(&torrentInfo);
+		if (!value.isDictionary() || !resumeInfo.loadFromBencode(value)) {
+			qDebug() << "TorrentManager::migrateLegacyResumeFile(): Failed to load resume info for" << hash;
+			continue;
+		}
+		QString errorString;
+		if (!writeResumeFile(resumeFileName, resumeInfo.toByteArray(), errorString)) {
+			emit failedToResumeTorrents(errorString);
+			return;
+		}
+	}
 
-			Torrent *torrent = new Torrent();
-			if (!torrent->createFromResumeInfo(torrentInfo, &resumeInfo)) {
-				qDebug() << "TorrentManager::resumeTorrents(): Failed to create torrent from resume data for"
-						 << file.fileName() << torrent->errorString();
-				torrent->deleteLater();
-				continue;
-			}
+	// Keep the old file around, but never read it again
+	QFile::remove(legacyFile.fileName() + ".old");
+	legacyFile.rename(legacyFile.fileName() + ".old");
+}
 
-			m_torrents.push_back(torrent);
-			emit torrentAdded(torrent);
+bool TorrentManager::saveResumeInfo(Torrent *torrent)
+{
+	QString resumePath = resumeDirectoryPath();
+	if (resumePath.isEmpty()) {
+		emit error("Failed to create the resume directory");
+		return false;
+	}
 
+	QString fileName = resumePath + "/" + torrent->torrentInfo()->infoHash().toHex() + RESUME_FILE_SUFFIX;
+	// Only the pieces and blocks that made it to the files are recorded
+	torrent->flushWriteCache();
+	torrent->savePartialPieces();
+	// Otherwise, after a crash, the resume data could list pieces that never
+	// reached the disk in files with the recorded modification times.
+	// The sync runs after the writes, on the disk's I/O thread
+	torrent->syncFiles([this, torrent, fileName](bool ok) {
+		// Removed in the meantime
+		if (!m_torrents.contains(torrent)) {
+			return;
 		}
-
-	} catch (BencodeException &ex) {
-		emit failedToResumeTorrents("Failed to read resume file: " + ex.what());
-		return;
-	}
+		if (!ok) {
+			emit error("Failed to sync the files of " + QString::fromUtf8(torrent->torrentInfo()->torrentName()));
+			return;
+		}
+		QString errorString;
+		if (!writeResumeFile(fileName, torrent->getResumeInfo().toByteArray(), errorString)) {
+			emit error(errorString);
+			return;
+		}
+		torrent->setResumeInfoDirty(false);
+	});
+	return true;
 }
 
 void TorrentManager::saveTorrentsResumeInfo()
 {
-	QString dataPath = QStandardPaths::writableLocation(QStandardPaths::AppDataLocation);
-	QDir dir(dataPath);
-	if (!dir.exists()) {
-		if (!dir.mkpath(dataPath)) {
-			emit error("Failed to create directory " + dataPath);
+	for (Torrent *torrent : m_torrents) {
+		if (!saveResumeInfo(torrent)) {
 			return;
 		}
 	}
-	if (!dir.exists("resume")) {
-		if (!dir.mkdir("resume")) {
-			emit error("Failed to create directory " + dataPath + "/resume");
-			return;
-		}
+	// Called on shutdown, the resume files are written when the syncs are done
+	for (Torrent *torrent : m_torrents) {
+		torrent->waitForWrites();
 	}
-	dir.cd("resume");
-	QFile resumeFile(dir.path() + "/resume.dat");
-	if (!resumeFile.open(QIODevice::WriteOnly)) {
-		QFileInfo info(resumeFile);
-		emit error("Failed to open " + info.absoluteFilePath() + ": " + resumeFile.errorString());
-		return;
+}
+
+void TorrentManager::flushWriteCaches()
+{
+	for (Torrent *torrent : m_torrents) {
+		torrent->flushWriteCache();
 	}
-	BencodeDictionary *mainDict = new BencodeDictionary;
+}
+
+void TorrentManager::saveDirtyTorrentsResumeInfo()
+{
 	for (Torrent *torrent : m_torrents) {
-		torrent->getResumeInfo().addToBencode(mainDict);
+		if (torrent->isResumeInfoDirty() && !saveResumeInfo(torrent)) {
+			return;
+		}
 	}
-	QByteArray bencodedData = mainDict->bencode(true);
-	resumeFile.write(bencodedData);
-	resumeFile.close();
-	delete mainDict;
 }
 
 bool TorrentManager::saveTorrentFile(const QString &filename, TorrentInfo *torrentInfo)
@@ -247,6 +499,28 @@ bool TorrentManager::saveTorrentFile(const QString &filename, TorrentInfo *torre
 	return true;
 }
 
+void TorrentManager::onTorrentMetadataLoaded(Torrent *torrent)
+{
+	QString dataPath = QStandardPaths::writableLocation(QStandardPaths::AppDataLocation);
+	QDir dir(dataPath);
+	if (!dir.exists("resume")) {
+		if (!dir.mkpath("resume")) {
+			emit error("Failed to create directory " + dataPath + "/resume");
+			return;
+		}
+	}
+	dir.cd("resume");
+
+	TorrentInfo *torrentInfo = torrent->torrentInfo();
+	QString torrentPath = dir.absoluteFilePath(torrentInfo->infoHash().toHex() + ".torrent");
+	if (!torrentInfo->saveToTorrentFile(torrentPath)) {
+		emit error("Failed to save " + torrentPath + ": " + torrentInfo->errorString());
+		return;
+	}
+
+	saveResumeInfo(torrent);
+}
+
 bool TorrentManager::removeTorrent(Torrent *torrent, bool deleteData)
 {
 	QString dataPath = QStandardPaths::writableLocation(QStandardPaths::AppDataLocation);
@@ -254,7 +528,14 @@ bool TorrentManager::removeTorrent(Torrent *torrent, bool deleteData)
 	if (savedTorrentFile.exists()) {
 		savedTorrentFile.remove();
 	}
+	QFile::remove(dataPath + "/resume/" + torrent->torrentInfo()->infoHash().toHex() + RESUME_FILE_SUFFIX);
 	m_torrents.removeAll(torrent);
+	m_activationQueue.removeAll(torrent);
+	// Stopping writes the cached pieces, so it's done before removing the files
+	torrent->stop();
+	torrent->waitForWrites();
+	// Only useful to this torrent
+	QFile::remove(torrent->partFilePath());
 	if (deleteData) {
 		for (QFile *file : torrent->files()) {
 			if (file->exists()) {
@@ -262,7 +543,6 @@ bool TorrentManager::removeTorrent(Torrent *torrent, bool deleteData)
 			}
 		}
 	}
-	torrent->stop();
 	emit torrentRemoved(torrent);
 	torrent->deleteLater();
 	return true;
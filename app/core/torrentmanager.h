@@ -24,9 +24,20 @@
 #include <QObject>
 #include <QList>
 #include <QUrl>
+#include <QFutureWatcher>
 
 class Torrent;
 class TorrentInfo;
+class ResumeInfo;
+class QTimer;
+class QDir;
+
+// A saved torrent, loaded by one of the threads in resumeTorrents()
+struct LoadedTorrent {
+	TorrentInfo *torrentInfo;
+	ResumeInfo *resumeInfo;
+	QString errorString;
+};
 
 class TorrentManager : public QObject
 {
@@ -44,27 +55,59 @@ public:
 signals:
 	void torrentAdded(Torrent *torrent);
 	void torrentRemoved(Torrent *torrent);
+	// All saved torrents were loaded by resumeTorrents()
+	void torrentsResumed();
 	// errors
 	void failedToAddTorrent(QString errorString);
 	void failedToResumeTorrents(QString errorString);
 	void error(QString errorString);
 
 public slots:
-	// Loads all saved for resuming torrents
+	// Starts loading all saved for resuming torrents in the background.
+	// Emits torrentAdded() for each of them and torrentsResumed() at the end
 	void resumeTorrents();
 
 	void addTorrentFromInfo(TorrentInfo *torrentInfo, const TorrentSettings &settings);
 
-	// Saves resume info for all torrents
+	// Saves resume info for all torrents and waits until it's written
 	void saveTorrentsResumeInfo();
+	// Writes the cached pieces of all torrents to the files
+	void flushWriteCaches();
+	// Saves resume info for the torrents that changed since the last save
+	void saveDirtyTorrentsResumeInfo();
+	// Atomically writes the torrent's .resume file, once its data is
+	// on the disk. Returns false if it can't be saved at all
+	bool saveResumeInfo(Torrent *torrent);
 	// Permanently saves the torrent file to the app data directory
 	bool saveTorrentFile(const QString &filename, TorrentInfo *torrentInfo);
 
 	bool removeTorrent(Torrent *torrent, bool deleteData);
 
+private slots:
+	// Saves the downloaded metadata of a magnet link torrent as a .torrent file
+	void onTorrentMetadataLoaded(Torrent *torrent);
+	// Adds the loaded torrents in the order of their files
+	void addResumedTorrents();
+	void onTorrentsLoaded();
+	// Starts the next batch of resumed torrents
+	void activateTorrents();
+
 
 private:
 	QList<Torrent *> m_torrents;
+	QTimer *m_checkpointTimer;
+	QTimer *m_writeCacheTimer;
+
+	QTimer *m_activationTimer;
+	QList<Torrent *> m_activationQueue;
+
+	QFutureWatcher<LoadedTorrent> *m_resumeWatcher;
+	int m_nextResumedTorrent;
+
+	void addResumedTorrent(const LoadedTorrent &loaded);
+
+	// Converts the resume.dat file of older versions to .resume files
+	void migrateLegacyResumeFile(const QDir &dir);
 
 	static TorrentManager *m_torrentManager;
 };
@@ -18,7 +18,7 @@
  */
 
 #include "torrentmessage.h"
-#include <QAbstractSocket>
+#include <QIODevice>
 
 TorrentMessage::TorrentMessage(Type type)
 {
@@ -61,7 +61,7 @@ void TorrentMessage::addByteArray(QByteArray value)
 }
 
 
-void TorrentMessage::keepAlive(QAbstractSocket *socket)
+void TorrentMessage::keepAlive(QIODevice *socket)
 {
 	QByteArray arr;
 	for (int i = 0; i < 4; i++) {
@@ -70,38 +70,38 @@ void TorrentMessage::keepAlive(QAbstractSocket *socket)
 	socket->write(arr);
 }
 
-void TorrentMessage::choke(QAbstractSocket *socket)
+void TorrentMessage::choke(QIODevice *socket)
 {
 	TorrentMessage msg(Choke);
 	socket->write(msg.getMessage());
 }
 
-void TorrentMessage::unchoke(QAbstractSocket *socket)
+void TorrentMessage::unchoke(QIODevice *socket)
 {
 	TorrentMessage msg(Unchoke);
 	socket->write(msg.getMessage());
 }
 
-void TorrentMessage::interested(QAbstractSocket *socket)
+void TorrentMessage::interested(QIODevice *socket)
 {
 	TorrentMessage msg(Interested);
 	socket->write(msg.getMessage());
 }
 
-void TorrentMessage::notInterested(QAbstractSocket *socket)
+void TorrentMessage::notInterested(QIODevice *socket)
 {
 	TorrentMessage msg(NotInterested);
 	socket->write(msg.getMessage());
 }
 
-void TorrentMessage::have(QAbstractSocket *socket, int pieceIndex)
+void TorrentMessage::have(QIODevice *socket, int pieceIndex)
 {
 	TorrentMessage msg(Have);
 	msg.addInt32(pieceIndex);
 	socket->write(msg.getMessage());
 }
 
-void TorrentMessage::bitfield(QAbstractSocket *socket, const QVector<bool> &bitfield)
+void TorrentMessage::bitfield(QIODevice *socket, const QVector<bool> &bitfield)
 {
 	TorrentMessage msg(Bitfield);
 	unsigned char byte = 0;
@@ -123,7 +123,7 @@ void TorrentMessage::bitfield(QAbstractSocket *socket, const QVector<bool> &bitf
 	socket->write(msg.getMessage());
 }
 
-void TorrentMessage::request(QAbstractSocket *socket, int index, int begin, int length)
+void TorrentMessage::request(QIODevice *socket, int index, int begin, int length)
 {
 	TorrentMessage msg(Request);
 	msg.addInt32(index);
@@ -132,7 +132,7 @@ void TorrentMessage::request(QAbstractSocket *socket, int index, int begin, int
 	socket->write(msg.getMessage());
 }
 
-void TorrentMessage::piece(QAbstractSocket *socket, int index, int begin, const QByteArray &block)
+void TorrentMessage::piece(QIODevice *socket, int index, int begin, const QByteArray &block)
 {
 	TorrentMessage msg(Piece);
 	msg.addInt32(index);
@@ -141,7 +141,22 @@ void TorrentMessage::piece(QAbstractSocket *socket, int index, int begin, const
 	socket->write(msg.getMessage());
 }
 
-void TorrentMessage::cancel(QAbstractSocket *socket, int index, int begin, int length)
+QByteArray TorrentMessage::pieceHeader(int index, int begin, int length)
+{
+	TorrentMessage msg(Piece);
+	msg.addInt32(index);
+	msg.addInt32(begin);
+	QByteArray header = msg.getMessage();
+	// The length includes the block that follows
+	int len = header.size() - 4 + length;
+	for (int i = 3; i >= 0; i--) {
+		header[i] = (unsigned char)(len % 256);
+		len /= 256;
+	}
+	return header;
+}
+
+void TorrentMessage::cancel(QIODevice *socket, int index, int begin, int length)
 {
 	TorrentMessage msg(Cancel);
 	msg.addInt32(index);
@@ -150,9 +165,83 @@ void TorrentMessage::cancel(QAbstractSocket *socket, int index, int begin, int l
 	socket->write(msg.getMessage());
 }
 
-void TorrentMessage::port(QAbstractSocket *socket, int listenPort)
+void TorrentMessage::port(QIODevice *socket, int listenPort)
 {
 	TorrentMessage msg(Port);
 	msg.addInt32(listenPort);
 	socket->write(msg.getMessage());
 }
+
+
+void TorrentMessage::haveAll(QIODevice *socket)
+{
+	TorrentMessage msg(HaveAll);
+	socket->write(msg.getMessage());
+}
+
+void TorrentMessage::haveNone(QIODevice *socket)
+{
+	TorrentMessage msg(HaveNone);
+	socket->write(msg.getMessage());
+}
+
+void TorrentMessage::rejectRequest(QIODevice *socket, int index, int begin, int length)
+{
+	TorrentMessage msg(RejectRequest);
+	msg.addInt32(index);
+	msg.addInt32(begin);
+	msg.addInt32(length);
+	socket->write(msg.getMessage());
+}
+
+void TorrentMessage::allowedFast(QIODevice *socket, int pieceIndex)
+{
+	TorrentMessage msg(AllowedFast);
+	msg.addInt32(pieceIndex);
+	socket->write(msg.getMessage());
+}
+
+void TorrentMessage::extended(QIODevice *socket, int extendedId, const QByteArray &payload)
+{
+	TorrentMessage msg(Extended);
+	msg.addByte(extendedId);
+	msg.addByteArray(payload);
+	socket->write(msg.getMessage());
+}
+
+void TorrentMessage::hashRequest(QIODevice *socket, const QByteArray &piecesRoot, int baseLayer,
+								 int index, int length, int proofLayers)
+{
+	TorrentMessage msg(HashRequest);
+	msg.addByteArray(piecesRoot);
+	msg.addInt32(baseLayer);
+	msg.addInt32(index);
+	msg.addInt32(length);
+	msg.addInt32(proofLayers);
+	socket->write(msg.getMessage());
+}
+
+void TorrentMessage::hashes(QIODevice *socket, const QByteArray &piecesRoot, int baseLayer,
+							int index, int length, int proofLayers, const QByteArray &hashes)
+{
+	TorrentMessage msg(Hashes);
+	msg.addByteArray(piecesRoot);
+	msg.addInt32(baseLayer);
+	msg.addInt32(index);
+	msg.addInt32(length);
+	msg.addInt32(proofLayers);
+	msg.addByteArray(hashes);
+	socket->write(msg.getMessage());
+}
+
+void TorrentMessage::hashReject(QIODevice *socket, const QByteArray &piecesRoot, int baseLayer,
+								int index, int length, int proofLayers)
+{
+	TorrentMessage msg(HashReject);
+	msg.addByteArray(piecesRoot);
+	msg.addInt32(baseLayer);
+	msg.addInt32(index);
+	msg.addInt32(length);
+	msg.addInt32(proofLayers);
+	socket->write(msg.getMessage());
+}
@@ -23,7 +23,7 @@
 #include <QByteArray>
 #include <QVector>
 
-class QAbstractSocket;
+class QIODevice;
 
 /* A class, used to generate BitTorrent messages */
 
@@ -36,7 +36,14 @@ public:
 		Choke = 0, Unchoke = 1,
 		Interested = 2, NotInterested = 3,
 		Have = 4, Bitfield = 5, Request = 6,
-		Piece = 7, Cancel = 8, Port = 9
+		Piece = 7, Cancel = 8, Port = 9,
+		/* Fast extension (BEP 6) */
+		SuggestPiece = 13, HaveAll = 14, HaveNone = 15,
+		RejectRequest = 16, AllowedFast = 17,
+		/* Extension protocol (BEP 10) */
+		Extended = 20,
+		/* BitTorrent v2 (BEP 52) */
+		HashRequest = 21, Hashes = 22, HashReject = 23
 	};
 
 	TorrentMessage(Type type);
@@ -46,17 +53,37 @@ public:
 	void addByteArray(QByteArray value);
 
 	/* Ready-to-use functions for generating messages */
-	static void keepAlive(QAbstractSocket *socket);
-	static void choke(QAbstractSocket *socket);
-	static void unchoke(QAbstractSocket *socket);
-	static void interested(QAbstractSocket *socket);
-	static void notInterested(QAbstractSocket *socket);
-	static void have(QAbstractSocket *socket, int pieceIndex);
-	static void bitfield(QAbstractSocket *socket, const QVector<bool> &bitfield);
-	static void request(QAbstractSocket *socket, int index, int begin, int length);
-	static void piece(QAbstractSocket *socket, int index, int begin, const QByteArray &block);
-	static void cancel(QAbstractSocket *socket, int index, int begin, int length);
-	static void port(QAbstractSocket *socket, int listenPort);
+	static void keepAlive(QIODevice *socket);
+	static void choke(QIODevice *socket);
+	static void unchoke(QIODevice *socket);
+	static void interested(QIODevice *socket);
+	static void notInterested(QIODevice *socket);
+	static void have(QIODevice *socket, int pieceIndex);
+	static void bitfield(QIODevice *socket, const QVector<bool> &bitfield);
+	static void request(QIODevice *socket, int index, int begin, int length);
+	static void piece(QIODevice *socket, int index, int begin, const QByteArray &block);
+	// The beginning of a piece message, without the block of this length
+	static QByteArray pieceHeader(int index, int begin, int length);
+	static void cancel(QIODevice *socket, int index, int begin, int length);
+	static void port(QIODevice *socket, int listenPort);
+
+	/* Fast extension messages */
+	static void haveAll(QIODevice *socket);
+	static void haveNone(QIODevice *socket);
+	static void rejectRequest(QIODevice *socket, int index, int begin, int length);
+	static void allowedFast(QIODevice *socket, int pieceIndex);
+
+	/* Extension protocol message. extendedId 0 is the extended handshake */
+	static void extended(QIODevice *socket, int extendedId, const QByteArray &payload);
+
+	/* BitTorrent v2 messages */
+	static void hashRequest(QIODevice *socket, const QByteArray &piecesRoot, int baseLayer,
+							int index, int length, int proofLayers);
+	// The hashes of the base layer, followed by the proof
+	static void hashes(QIODevice *socket, const QByteArray &piecesRoot, int baseLayer,
+					   int index, int length, int proofLayers, const QByteArray &hashes);
+	static void hashReject(QIODevice *socket, const QByteArray &piecesRoot, int baseLayer,
+						   int index, int length, int proofLayers);
 };
 
 #endif // TORRENTMESSAGE_H
@@ -19,17 +19,24 @@
 
 #include "torrentserver.h"
 #include "peer.h"
+#include "peersocket.h"
 #include <QSettings>
 #include <QDebug>
 
+void PeerServer::incomingConnection(qintptr socketDescriptor)
+{
+	emit newSocketDescriptor(socketDescriptor);
+}
+
+
 TorrentServer::TorrentServer()
 {
-	connect(&m_server, SIGNAL(newConnection()), this, SLOT(newConnection()));
+	connect(&m_server, SIGNAL(newSocketDescriptor(qintptr)), this, SLOT(newConnection(qintptr)));
 }
 
 TorrentServer::~TorrentServer()
 {
-	disconnect(&m_server, SIGNAL(newConnection()), this, SLOT(newConnection()));
+	disconnect(&m_server, SIGNAL(newSocketDescriptor(qintptr)), this, SLOT(newConnection(qintptr)));
 }
 
 bool TorrentServer::startServer()
@@ -66,11 +73,20 @@ bool TorrentServer::startServer()
 	return true;
 }
 
-void TorrentServer::newConnection()
+void TorrentServer::newConnection(qintptr socketDescriptor)
 {
-	QTcpSocket *socket = m_server.nextPendingConnection();
-	Peer *peer = Peer::createClient(socket);
-	m_peers.push_back(peer);
+	// The peer is created when the network thread takes over the socket,
+	// because it needs the address of the peer
+	PeerSocket *socket = new PeerSocket;
+	connect(socket, &PeerSocket::connected, this, [this, socket]() {
+		QObject::disconnect(socket, nullptr, this, nullptr);
+		Peer *peer = Peer::createClient(socket);
+		m_peers.push_back(peer);
+	});
+	connect(socket, &PeerSocket::error, this, [socket]() {
+		socket->deleteLater();
+	});
+	socket->setSocketDescriptor(socketDescriptor);
 }
 
 QTcpServer &TorrentServer::server()
@@ -26,6 +26,19 @@
 
 class Peer;
 
+/* Hands the accepted sockets over to the NetworkEngine
+ * instead of creating QTcpSocket objects in this thread */
+class PeerServer : public QTcpServer
+{
+	Q_OBJECT
+
+signals:
+	void newSocketDescriptor(qintptr socketDescriptor);
+
+protected:
+	void incomingConnection(qintptr socketDescriptor);
+};
+
 /* This class is used to receive and handle incoming peer connections */
 class TorrentServer : public QObject
 {
@@ -44,10 +57,10 @@ public:
 	QList<Peer *> &peers();
 
 public slots:
-	void newConnection();
+	void newConnection(qintptr socketDescriptor);
 
 private:
-	QTcpServer m_server;
+	PeerServer m_server;
 	QList<Peer *> m_peers;
 };
 
@@ -39,6 +39,11 @@ void TorrentSettings::setSkipHashCheck(bool skipHashCheck)
 	m_skipHashCheck = skipHashCheck;
 }
 
+void TorrentSettings::setFilePriorities(const QVector<quint8> &filePriorities)
+{
+	m_filePriorities = filePriorities;
+}
+
 
 const QString &TorrentSettings::downloadLocation() const
 {
@@ -54,3 +59,8 @@ bool TorrentSettings::skipHashCheck() const
 {
 	return m_skipHashCheck;
 }
+
+const QVector<quint8> &TorrentSettings::filePriorities() const
+{
+	return m_filePriorities;
+}
@@ -21,6 +21,7 @@
 #define TORRENTSETTINGS_H
 
 #include <QString>
+#include <QVector>
 
 class TorrentSettings
 {
@@ -31,16 +32,20 @@ public:
 	void setDownloadLocation(const QString &downloadLocation);
 	void setStartImmediately(bool startImmediately);
 	void setSkipHashCheck(bool skipHashCheck);
+	void setFilePriorities(const QVector<quint8> &filePriorities);
 
 	/* Getters */
 	const QString &downloadLocation() const;
 	bool startImmediately() const;
 	bool skipHashCheck() const;
+	// Torrent::Priority of each file. Empty if all files are downloaded normally
+	const QVector<quint8> &filePriorities() const;
 
 private:
 	QString m_downloadLocation;
 	bool m_startImmediately;
 	bool m_skipHashCheck;
+	QVector<quint8> m_filePriorities;
 };
 
 #endif // TORRENTSETTINGS_H
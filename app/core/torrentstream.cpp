@@ -0,0 +1,183 @@
+/* qTorrent - An open-source, cross-platform BitTorrent client
+ * Copyright (C) 2017 Petko Georgiev
+ *
+ * torrentstream.cpp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "torrentstream.h"
+#include "torrent.h"
+#include "torrentinfo.h"
+
+TorrentStream::TorrentStream(Torrent *torrent, int fileIndex, QObject *parent)
+	: QIODevice(parent)
+	, m_torrent(torrent)
+	, m_fileIndex(fileIndex)
+	, m_fileBegin(0)
+	, m_fileSize(0)
+	, m_cursorPiece(-1)
+{
+	connect(m_torrent, &Torrent::pieceDownloaded, this, &TorrentStream::onPieceDownloaded);
+	connect(m_torrent, &QObject::destroyed, this, &TorrentStream::onTorrentDestroyed);
+}
+
+TorrentStream::~TorrentStream()
+{
+	close();
+}
+
+bool TorrentStream::open(OpenMode mode)
+{
+	if ((mode & WriteOnly) || !m_torrent || !m_torrent->hasMetadata()) {
+		setErrorString("The stream can only be read and only when the metadata is available");
+		return false;
+	}
+	const QList<FileInfo> &fileInfos = m_torrent->torrentInfo()->fileInfos();
+	if (m_fileIndex < 0 || m_fileIndex >= fileInfos.size()) {
+		setErrorString("No such file in the torrent");
+		return false;
+	}
+	m_fileBegin = m_torrent->fileOffset(m_fileIndex);
+	m_fileSize = fileInfos[m_fileIndex].length;
+
+	// A skipped file has to be downloaded after all
+	if (m_torrent->filePriority(m_fileIndex) == Torrent::DontDownload) {
+		m_torrent->setFilePriority(m_fileIndex, Torrent::NormalPriority);
+	}
+
+	// Our position is the playback cursor, QIODevice mustn't read ahead
+	if (!QIODevice::open(mode | Unbuffered)) {
+		return false;
+	}
+	m_cursorPiece = -1;
+	updatePlaybackCursor(pos());
+	return true;
+}
+
+void TorrentStream::close()
+{
+	if (!isOpen()) {
+		return;
+	}
+	if (m_torrent) {
+		m_torrent->clearPieceDeadlines();
+	}
+	QIODevice::close();
+}
+
+bool TorrentStream::isSequential() const
+{
+	return false;
+}
+
+qint64 TorrentStream::size() const
+{
+	return m_fileSize;
+}
+
+bool TorrentStream::seek(qint64 pos)
+{
+	if (!QIODevice::seek(pos)) {
+		return false;
+	}
+	updatePlaybackCursor(pos);
+	return true;
+}
+
+qint64 TorrentStream::bytesAvailable() const
+{
+	return downloadedBytesAfter(pos()) + QIODevice::bytesAvailable();
+}
+
+qint64 TorrentStream::readData(char *data, qint64 maxSize)
+{
+	if (!m_torrent) {
+		return -1;
+	}
+	qint64 pos = this->pos();
+	qint64 toRead = qMin(maxSize, downloadedBytesAfter(pos));
+
+	qint64 pieceLength = m_torrent->torrentInfo()->pieceLength();
+	qint64 bytesRead = 0;
+	while (bytesRead < toRead) {
+		qint64 offset = m_fileBegin + pos + bytesRead;
+		int pieceNumber = offset / pieceLength;
+		int begin = offset - pieceNumber * pieceLength;
+		int size = qMin(toRead - bytesRead, qint64(m_torrent->pieceSize(pieceNumber) - begin));
+		QByteArray blockData;
+		if (!m_torrent->readBlock(pieceNumber, begin, size, blockData) || blockData.size() != size) {
+			setErrorString("Failed to read piece " + QString::number(pieceNumber));
+			return bytesRead > 0 ? bytesRead : -1;
+		}
+		memcpy(data + bytesRead, blockData.constData(), size);
+		bytesRead += size;
+	}
+
+	// The cursor follows the reading position
+	if (pos + bytesRead < m_fileSize && pieceAt(pos + bytesRead) != m_cursorPiece) {
+		updatePlaybackCursor(pos + bytesRead);
+	}
+	return bytesRead;
+}
+
+qint64 TorrentStream::writeData(const char *data, qint64 maxSize)
+{
+	Q_UNUSED(data);
+	Q_UNUSED(maxSize);
+	return -1;
+}
+
+void TorrentStream::onPieceDownloaded(int pieceNumber)
+{
+	if (isOpen() && pos() < m_fileSize && pieceNumber == pieceAt(pos())) {
+		emit readyRead();
+	}
+}
+
+void TorrentStream::onTorrentDestroyed()
+{
+	m_torrent = nullptr;
+	close();
+}
+
+int TorrentStream::pieceAt(qint64 pos) const
+{
+	return (m_fileBegin + pos) / m_torrent->torrentInfo()->pieceLength();
+}
+
+qint64 TorrentStream::downloadedBytesAfter(qint64 pos) const
+{
+	if (!m_torrent || !isOpen() || pos >= m_fileSize) {
+		return 0;
+	}
+	qint64 pieceLength = m_torrent->torrentInfo()->pieceLength();
+	qint64 fileEnd = m_fileBegin + m_fileSize;
+	qint64 offset = m_fileBegin + pos;
+	int pieceNumber = offset / pieceLength;
+	while (offset < fileEnd && m_torrent->hasPiece(pieceNumber)) {
+		pieceNumber++;
+		offset = pieceNumber * pieceLength;
+	}
+	return qMin(offset, fileEnd) - (m_fileBegin + pos);
+}
+
+void TorrentStream::updatePlaybackCursor(qint64 pos)
+{
+	if (!m_torrent || pos >= m_fileSize) {
+		return;
+	}
+	m_cursorPiece = pieceAt(pos);
+	m_torrent->setPlaybackCursor(m_fileBegin + pos);
+}
@@ -0,0 +1,72 @@
+/* qTorrent - An open-source, cross-platform BitTorrent client
+ * Copyright (C) 2017 Petko Georgiev
+ *
+ * torrentstream.h
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TORRENTSTREAM_H
+#define TORRENTSTREAM_H
+
+#include <QIODevice>
+
+class Torrent;
+
+/*
+ * Reads a file of a torrent while it is being downloaded.
+ * The reading position is the torrent's playback cursor, so the pieces
+ * right after it are downloaded first. Reading never blocks: if the data
+ * isn't downloaded yet, nothing is read and readyRead() is emitted once
+ * it arrives.
+ */
+class TorrentStream : public QIODevice
+{
+	Q_OBJECT
+
+public:
+	TorrentStream(Torrent *torrent, int fileIndex, QObject *parent = nullptr);
+	~TorrentStream();
+
+	bool open(OpenMode mode);
+	void close();
+	bool isSequential() const;
+	qint64 size() const;
+	bool seek(qint64 pos);
+	qint64 bytesAvailable() const;
+
+protected:
+	qint64 readData(char *data, qint64 maxSize);
+	qint64 writeData(const char *data, qint64 maxSize);
+
+private slots:
+	void onPieceDownloaded(int pieceNumber);
+	void onTorrentDestroyed();
+
+private:
+	Torrent *m_torrent;
+	int m_fileIndex;
+	// The position of the file in the torrent
+	qint64 m_fileBegin;
+	qint64 m_fileSize;
+	// The piece the playback cursor was last set to
+	int m_cursorPiece;
+
+	int pieceAt(qint64 pos) const;
+	// Returns the number of downloaded bytes after pos, without gaps
+	qint64 downloadedBytesAfter(qint64 pos) const;
+	void updatePlaybackCursor(qint64 pos);
+};
+
+#endif // TORRENTSTREAM_H
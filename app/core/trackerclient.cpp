@@ -66,6 +66,11 @@ void TrackerClient::announce(Event event)
 	qint64 bytesDownloaded = m_torrent->bytesDownloaded();
 	qint64 bytesUploaded = m_torrent->bytesUploaded();
 	qint64 bytesLeft = m_torrent->bytesLeft();
+	if (!m_torrent->hasMetadata()) {
+		// The size is unknown. Trackers treat left=0 as a seeder and
+		// don't return other seeders, so report something non-zero
+		bytesLeft = 16384;
+	}
 	int port = QTorrent::instance()->server()->port();
 
 	QString bytesDownloadedString = QString::number(bytesDownloaded);
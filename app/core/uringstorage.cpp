@@ -0,0 +1,593 @@
+/* qTorrent - An open-source, cross-platform BitTorrent client
+ * Copyright (C) 2017 Petko Georgiev
+ *
+ * uringstorage.cpp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "uringstorage.h"
+#include <QFile>
+#include <QSocketNotifier>
+#include <QDebug>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <climits>
+#include <cerrno>
+#include <cstring>
+
+UringStorage::UringStorage()
+	: m_isValid(false)
+	, m_eventFd(-1)
+	, m_notifier(nullptr)
+	, m_filesRegistered(false)
+	, m_useCounter(0)
+	, m_buffersRegistered(false)
+	, m_bufferMemory(nullptr)
+	, m_inFlight(0)
+{
+	// Completions are signalled through the eventfd, so that the
+	// event loop of this thread calls back the asynchronous batches
+	m_eventFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (m_eventFd < 0) {
+		m_errorString = strerror(errno);
+		return;
+	}
+	m_notifier = new QSocketNotifier(m_eventFd, QSocketNotifier::Read);
+	QObject::connect(m_notifier, &QSocketNotifier::activated, [this]() { onEventFd(); });
+
+	m_bufferMemory = static_cast<char *>(qMallocAligned(FIXED_BUFFER_COUNT * FIXED_BUFFER_SIZE, 4096));
+	m_isValid = setUpRing();
+}
+
+UringStorage::~UringStorage()
+{
+	waitForAll();
+	for (OpenFile *file : m_files) {
+		closeFile(file);
+	}
+	for (OpenFile *file : m_retiredFiles) {
+		closeFile(file);
+	}
+	if (m_isValid) {
+		io_uring_queue_exit(&m_ring);
+	}
+	delete m_notifier;
+	if (m_eventFd >= 0) {
+		::close(m_eventFd);
+	}
+	qFreeAligned(m_bufferMemory);
+}
+
+bool UringStorage::setUpRing()
+{
+	int ret = io_uring_queue_init(QUEUE_DEPTH, &m_ring, 0);
+	if (ret < 0) {
+		m_errorString = strerror(-ret);
+		return false;
+	}
+	ret = io_uring_register_eventfd(&m_ring, m_eventFd);
+	if (ret < 0) {
+		m_errorString = strerror(-ret);
+		io_uring_queue_exit(&m_ring);
+		return false;
+	}
+
+	// A table of empty slots, filled as files are opened
+	QVector<int> fds(MAX_OPEN_FILES, -1);
+	m_filesRegistered = (io_uring_register_files(&m_ring, fds.constData(), fds.size()) == 0);
+	m_freeSlots.clear();
+	if (m_filesRegistered) {
+		for (int i = MAX_OPEN_FILES - 1; i >= 0; i--) {
+			m_freeSlots.push_back(i);
+		}
+	}
+	for (OpenFile *file : m_files) {
+		if (!m_freeSlots.isEmpty() && io_uring_register_files_update(&m_ring, m_freeSlots.last(), &file->fd, 1) == 1) {
+			file->slot = m_freeSlots.takeLast();
+		}
+	}
+
+	// Pinned once. The kernel counts them against RLIMIT_MEMLOCK, which may be too low
+	m_buffersRegistered = false;
+	m_freeBuffers.clear();
+	if (m_bufferMemory) {
+		QVector<struct iovec> buffers(FIXED_BUFFER_COUNT);
+		for (int i = 0; i < FIXED_BUFFER_COUNT; i++) {
+			buffers[i].iov_base = m_bufferMemory + i * FIXED_BUFFER_SIZE;
+			buffers[i].iov_len = FIXED_BUFFER_SIZE;
+		}
+		m_buffersRegistered = (io_uring_register_buffers(&m_ring, buffers.constData(), buffers.size()) == 0);
+	}
+	if (m_buffersRegistered) {
+		for (int i = FIXED_BUFFER_COUNT - 1; i >= 0; i--) {
+			m_freeBuffers.push_back(i);
+		}
+	} else {
+		qDebug() << "io_uring: Failed to register buffers, using unregistered ones";
+	}
+	return true;
+}
+
+void UringStorage::resetRing()
+{
+	// Let the kernel finish what it has, the rest is done here
+	QList<Operation *> operations = m_unsubmitted;
+	m_unsubmitted.clear();
+	QList<Batch *> finished;
+	while (m_inFlight > 0) {
+		struct io_uring_cqe *cqe = nullptr;
+		int ret = io_uring_wait_cqe(&m_ring, &cqe);
+		if (ret == -EINTR) {
+			continue;
+		}
+		if (ret < 0) {
+			qDebug() << "io_uring_wait_cqe failed:" << strerror(-ret);
+			break;
+		}
+		Operation *operation = static_cast<Operation *>(io_uring_cqe_get_data(cqe));
+		int result = cqe->res;
+		io_uring_cqe_seen(&m_ring, cqe);
+		m_inFlight--;
+		complete(operation, result, finished);
+	}
+
+	// The registered files go with the ring
+	for (OpenFile *file : m_files) {
+		file->slot = -1;
+	}
+	for (OpenFile *file : m_retiredFiles) {
+		file->slot = -1;
+	}
+	io_uring_queue_exit(&m_ring);
+	m_filesRegistered = false;
+	m_buffersRegistered = false;
+	m_isValid = setUpRing();
+	for (Operation *operation : operations) {
+		if (operation->buffer != -1) {
+			// Not used, the data is still in the caller's memory
+			operation->buffer = -1;
+		}
+		complete(operation, 0, finished);
+	}
+	m_inFlight = 0;
+	callBack(finished);
+}
+
+bool UringStorage::isValid() const
+{
+	return m_isValid;
+}
+
+QString UringStorage::errorString() const
+{
+	return m_errorString;
+}
+
+UringStorage::OpenFile *UringStorage::openFile(const QString &fileName, bool write)
+{
+	QByteArray path = QFile::encodeName(fileName);
+	struct stat info;
+	bool exists = (::stat(path.constData(), &info) == 0);
+
+	OpenFile *file = m_files.value(fileName);
+	if (file) {
+		if (exists && file->device == info.st_dev && file->inode == info.st_ino && (file->writable || !write)) {
+			file->lastUse = ++m_useCounter;
+			return file;
+		}
+		// Renamed, deleted or replaced since, or only open for reading
+		m_files.remove(fileName);
+		retireFile(file);
+	}
+
+	int fd = ::open(path.constData(), O_RDWR | O_CLOEXEC | (write ? O_CREAT : 0), 0666);
+	bool writable = true;
+	if (fd < 0 && !write && (errno == EACCES || errno == EROFS)) {
+		// Seeding from read-only files
+		fd = ::open(path.constData(), O_RDONLY | O_CLOEXEC);
+		writable = false;
+	}
+	if (fd < 0 || fstat(fd, &info) != 0) {
+		qDebug() << "Failed to open file" << fileName << ":" << strerror(errno);
+		if (fd >= 0) {
+			::close(fd);
+		}
+		return nullptr;
+	}
+
+	// Make room by closing the least recently used file
+	if (m_files.size() >= MAX_OPEN_FILES) {
+		auto oldest = m_files.begin();
+		for (auto it = m_files.begin(); it != m_files.end(); ++it) {
+			if (it.value()->lastUse < oldest.value()->lastUse) {
+				oldest = it;
+			}
+		}
+		retireFile(oldest.value());
+		m_files.erase(oldest);
+	}
+
+	file = new OpenFile;
+	file->fd = fd;
+	file->slot = -1;
+	file->writable = writable;
+	file->device = info.st_dev;
+	file->inode = info.st_ino;
+	file->users = 0;
+	file->lastUse = ++m_useCounter;
+	if (m_filesRegistered && !m_freeSlots.isEmpty()
+			&& io_uring_register_files_update(&m_ring, m_freeSlots.last(), &fd, 1) == 1) {
+		file->slot = m_freeSlots.takeLast();
+	}
+	m_files.insert(fileName, file);
+	return file;
+}
+
+void UringStorage::retireFile(OpenFile *file)
+{
+	if (file->users == 0) {
+		closeFile(file);
+	} else {
+		m_retiredFiles.append(file);
+	}
+}
+
+void UringStorage::releaseFile(OpenFile *file)
+{
+	file->users--;
+	if (file->users == 0 && m_retiredFiles.removeOne(file)) {
+		closeFile(file);
+	}
+}
+
+void UringStorage::closeFile(OpenFile *file)
+{
+	if (file->slot != -1) {
+		int empty = -1;
+		io_uring_register_files_update(&m_ring, file->slot, &empty, 1);
+		m_freeSlots.push_back(file->slot);
+	}
+	::close(file->fd);
+	delete file;
+}
+
+bool UringStorage::write(const QVector<Write> &writes)
+{
+	bool finished = false;
+	bool ok = false;
+	writeAsync(writes, [&finished, &ok](bool result) {
+		finished = true;
+		ok = result;
+	});
+	while (!finished && (m_inFlight > 0 || !m_queued.isEmpty() || !m_unsubmitted.isEmpty())) {
+		reap(true);
+	}
+	return ok;
+}
+
+bool UringStorage::read(const QVector<Read> &reads)
+{
+	bool finished = false;
+	bool ok = false;
+	readAsync(reads, [&finished, &ok](bool result) {
+		finished = true;
+		ok = result;
+	});
+	while (!finished && (m_inFlight > 0 || !m_queued.isEmpty() || !m_unsubmitted.isEmpty())) {
+		reap(true);
+	}
+	return ok;
+}
+
+void UringStorage::writeAsync(const QVector<Write> &writes, const Callback &done)
+{
+	Batch *batch = new Batch;
+	batch->done = done;
+	batch->pending = 0;
+	batch->ok = true;
+
+	QVector<Operation *> operations;
+	for (const Write &write : writes) {
+		OpenFile *file = openFile(write.fileName, true);
+		if (!file) {
+			batch->ok = false;
+			continue;
+		}
+		if (write.segments.isEmpty()) {
+			// Just creating the file
+			continue;
+		}
+		Operation *operation = new Operation;
+		operation->batch = batch;
+		operation->file = file;
+		operation->isWrite = true;
+		operation->offset = write.offset;
+		operation->buffer = -1;
+		for (const auto &segment : write.segments) {
+			struct iovec iov;
+			iov.iov_base = const_cast<char *>(segment.first);
+			iov.iov_len = segment.second;
+			operation->iov.push_back(iov);
+		}
+		file->users++;
+		operations.push_back(operation);
+	}
+	run(batch, operations);
+}
+
+void UringStorage::readAsync(const QVector<Read> &reads, const Callback &done)
+{
+	Batch *batch = new Batch;
+	batch->done = done;
+	batch->pending = 0;
+	batch->ok = true;
+
+	QVector<Operation *> operations;
+	for (const Read &read : reads) {
+		OpenFile *file = openFile(read.fileName, false);
+		if (!file) {
+			batch->ok = false;
+			continue;
+		}
+		Operation *operation = new Operation;
+		operation->batch = batch;
+		operation->file = file;
+		operation->isWrite = false;
+		operation->offset = read.offset;
+		operation->buffer = -1;
+		struct iovec iov;
+		iov.iov_base = read.data;
+		iov.iov_len = read.size;
+		operation->iov.push_back(iov);
+		file->users++;
+		operations.push_back(operation);
+	}
+	run(batch, operations);
+}
+
+void UringStorage::waitForAll()
+{
+	while (m_inFlight > 0 || !m_queued.isEmpty() || !m_unsubmitted.isEmpty()) {
+		reap(true);
+	}
+}
+
+QString UringStorage::name() const
+{
+	return "io_uring";
+}
+
+void UringStorage::run(Batch *batch, const QVector<Operation *> &operations)
+{
+	batch->pending = operations.size();
+	if (operations.isEmpty()) {
+		callBack(QList<Batch *>() << batch);
+		return;
+	}
+	for (Operation *operation : operations) {
+		m_queued.append(operation);
+	}
+	submitQueued();
+}
+
+void UringStorage::submitQueued()
+{
+	if (!m_isValid) {
+		// Without a ring, everything is done with blocking calls
+		QList<Batch *> finished;
+		while (!m_queued.isEmpty()) {
+			complete(m_queued.takeFirst(), 0, finished);
+		}
+		callBack(finished);
+		return;
+	}
+
+	while (!m_queued.isEmpty() && m_inFlight + m_unsubmitted.size() < int(QUEUE_DEPTH)) {
+		struct io_uring_sqe *sqe = io_uring_get_sqe(&m_ring);
+		if (!sqe) {
+			break;
+		}
+		Operation *operation = m_queued.takeFirst();
+		prepare(sqe, operation);
+		m_unsubmitted.append(operation);
+	}
+	if (m_unsubmitted.isEmpty()) {
+		return;
+	}
+
+	int submitted;
+	do {
+		submitted = io_uring_submit(&m_ring);
+	} while (submitted == -EINTR);
+	for (int i = 0; i < submitted && !m_unsubmitted.isEmpty(); i++) {
+		m_unsubmitted.removeFirst();
+		m_inFlight++;
+	}
+
+	// The ring is busy until some operations complete. If nothing is
+	// in flight, or it's another error, the ring is of no use
+	bool retryLater = (submitted >= 0 || submitted == -EAGAIN || submitted == -EBUSY) && m_inFlight > 0;
+	if (!m_unsubmitted.isEmpty() && !retryLater) {
+		qDebug() << "io_uring_submit failed, submitted" << qMax(submitted, 0) << "operations";
+		resetRing();
+	}
+}
+
+void UringStorage::prepare(struct io_uring_sqe *sqe, Operation *operation)
+{
+	int fd = (operation->file->slot != -1) ? operation->file->slot : operation->file->fd;
+	qint64 size = 0;
+	for (const struct iovec &iov : operation->iov) {
+		size += iov.iov_len;
+	}
+
+	if (m_buffersRegistered && size <= FIXED_BUFFER_SIZE && !m_freeBuffers.isEmpty()) {
+		operation->buffer = m_freeBuffers.takeLast();
+		char *buffer = m_bufferMemory + operation->buffer * FIXED_BUFFER_SIZE;
+		if (operation->isWrite) {
+			char *pos = buffer;
+			for (const struct iovec &iov : operation->iov) {
+				memcpy(pos, iov.iov_base, iov.iov_len);
+				pos += iov.iov_len;
+			}
+			io_uring_prep_write_fixed(sqe, fd, buffer, size, operation->offset, operation->buffer);
+		} else {
+			io_uring_prep_read_fixed(sqe, fd, buffer, size, operation->offset, operation->buffer);
+		}
+	} else {
+		// What doesn't fit in IOV_MAX segments is finished by complete()
+		int count = qMin(operation->iov.size(), IOV_MAX);
+		if (operation->isWrite) {
+			io_uring_prep_writev(sqe, fd, operation->iov.constData(), count, operation->offset);
+		} else {
+			io_uring_prep_readv(sqe, fd, operation->iov.constData(), count, operation->offset);
+		}
+	}
+	if (operation->file->slot != -1) {
+		io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+	}
+	io_uring_sqe_set_data(sqe, operation);
+}
+
+void UringStorage::complete(Operation *operation, int result, QList<Batch *> &finished)
+{
+	if (operation->buffer != -1) {
+		if (!operation->isWrite && result > 0) {
+			const char *pos = m_bufferMemory + operation->buffer * FIXED_BUFFER_SIZE;
+			qint64 left = result;
+			for (const struct iovec &iov : operation->iov) {
+				qint64 size = qMin<qint64>(left, iov.iov_len);
+				memcpy(iov.iov_base, pos, size);
+				pos += size;
+				left -= size;
+			}
+		}
+		m_freeBuffers.push_back(operation->buffer);
+	}
+
+	bool ok;
+	if (result < 0 && result != -EINTR && result != -EAGAIN) {
+		qDebug() << (operation->isWrite ? "Write" : "Read") << "failed:" << strerror(-result);
+		ok = false;
+	} else {
+		ok = finish(*operation, qMax(result, 0));
+	}
+	releaseFile(operation->file);
+
+	Batch *batch = operation->batch;
+	batch->ok = batch->ok && ok;
+	batch->pending--;
+	if (batch->pending == 0) {
+		finished.append(batch);
+	}
+	delete operation;
+}
+
+void UringStorage::reap(bool wait)
+{
+	QList<Batch *> finished;
+	bool block = wait;
+	while (m_inFlight > 0) {
+		struct io_uring_cqe *cqe = nullptr;
+		int ret = block ? io_uring_wait_cqe(&m_ring, &cqe) : io_uring_peek_cqe(&m_ring, &cqe);
+		if (ret == -EINTR) {
+			continue;
+		}
+		if (ret < 0) {
+			// -EAGAIN: nothing else is done yet
+			if (ret != -EAGAIN) {
+				qDebug() << "io_uring_wait_cqe failed:" << strerror(-ret);
+			}
+			break;
+		}
+		block = false;
+		Operation *operation = static_cast<Operation *>(io_uring_cqe_get_data(cqe));
+		int result = cqe->res;
+		io_uring_cqe_seen(&m_ring, cqe);
+		m_inFlight--;
+		complete(operation, result, finished);
+	}
+
+	// There is room in the ring now
+	submitQueued();
+	callBack(finished);
+}
+
+void UringStorage::onEventFd()
+{
+	eventfd_t value;
+	eventfd_read(m_eventFd, &value);
+	reap(false);
+}
+
+void UringStorage::callBack(const QList<Batch *> &finished)
+{
+	// The callbacks may start new batches
+	for (Batch *batch : finished) {
+		Callback done = batch->done;
+		bool ok = batch->ok;
+		delete batch;
+		done(ok);
+	}
+}
+
+bool UringStorage::finish(Operation &operation, qint64 done)
+{
+	int fd = operation.file->fd;
+
+	// Skip what was done
+	int first = 0;
+	operation.offset += done;
+	while (first < operation.iov.size() && done >= qint64(operation.iov[first].iov_len)) {
+		done -= operation.iov[first].iov_len;
+		first++;
+	}
+	if (first < operation.iov.size()) {
+		operation.iov[first].iov_base = static_cast<char *>(operation.iov[first].iov_base) + done;
+		operation.iov[first].iov_len -= done;
+	}
+
+	while (first < operation.iov.size()) {
+		ssize_t result;
+		int count = qMin(operation.iov.size() - first, IOV_MAX);
+		if (operation.isWrite) {
+			result = pwritev(fd, operation.iov.constData() + first, count, operation.offset);
+		} else {
+			result = preadv(fd, operation.iov.constData() + first, count, operation.offset);
+		}
+		if (result < 0 && errno == EINTR) {
+			continue;
+		}
+		if (result <= 0) {
+			// Also the end of the file when reading
+			return false;
+		}
+		operation.offset += result;
+		while (result > 0) {
+			if (size_t(result) >= operation.iov[first].iov_len) {
+				result -= operation.iov[first].iov_len;
+				first++;
+			} else {
+				operation.iov[first].iov_base = static_cast<char *>(operation.iov[first].iov_base) + result;
+				operation.iov[first].iov_len -= result;
+				result = 0;
+			}
+		}
+	}
+	return true;
+}
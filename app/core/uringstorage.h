@@ -0,0 +1,148 @@
+/* qTorrent - An open-source, cross-platform BitTorrent client
+ * Copyright (C) 2017 Petko Georgiev
+ *
+ * uringstorage.h
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef URINGSTORAGE_H
+#define URINGSTORAGE_H
+
+#include "storage.h"
+#include <QHash>
+#include <QList>
+#include <liburing.h>
+#include <sys/types.h>
+
+class QSocketNotifier;
+
+/*
+ * Storage backend that uses io_uring (Linux 5.1 and later).
+ * Asynchronous batches are submitted and the caller goes on. The ring
+ * signals completions through an eventfd, which is watched by the event
+ * loop of the thread that owns the storage. The synchronous calls are
+ * submitted the same way and wait for their batch.
+ * Files stay open between batches and are registered with the ring. A
+ * file that was renamed, deleted or replaced since is opened again.
+ * Operations that fit go through registered buffers, which are pinned
+ * once instead of for every operation.
+ * Short transfers and submission errors are finished with blocking calls.
+ * Only built when liburing is available
+ */
+class UringStorage : public Storage
+{
+public:
+	/* The number of operations in flight */
+	static const unsigned QUEUE_DEPTH = 64;
+	/* Files that are kept open and registered */
+	static const int MAX_OPEN_FILES = 64;
+	/* The registered buffers. Larger operations use the caller's memory */
+	static const int FIXED_BUFFER_COUNT = 16;
+	static const int FIXED_BUFFER_SIZE = 256 * 1024;
+
+	UringStorage();
+	~UringStorage();
+
+	/* False if the ring couldn't be created, e.g. on older kernels */
+	bool isValid() const;
+	QString errorString() const;
+
+	bool write(const QVector<Write> &writes);
+	bool read(const QVector<Read> &reads);
+	void writeAsync(const QVector<Write> &writes, const Callback &done);
+	void readAsync(const QVector<Read> &reads, const Callback &done);
+	void waitForAll();
+	QString name() const;
+
+private:
+	struct Batch {
+		Callback done;
+		int pending;
+		bool ok;
+	};
+	struct OpenFile {
+		int fd;
+		// The index among the registered files, or -1
+		int slot;
+		bool writable;
+		dev_t device;
+		ino_t inode;
+		// Operations in flight that use it
+		int users;
+		qint64 lastUse;
+	};
+	struct Operation {
+		Batch *batch;
+		OpenFile *file;
+		bool isWrite;
+		qint64 offset;
+		QVector<struct iovec> iov;
+		// The registered buffer it goes through, or -1
+		int buffer;
+	};
+
+	struct io_uring m_ring;
+	bool m_isValid;
+	QString m_errorString;
+	int m_eventFd;
+	QSocketNotifier *m_notifier;
+
+	bool m_filesRegistered;
+	QVector<int> m_freeSlots;
+	// By file name
+	QHash<QString, OpenFile *> m_files;
+	// Replaced or evicted while in use, closed when the last operation is done
+	QList<OpenFile *> m_retiredFiles;
+	qint64 m_useCounter;
+
+	bool m_buffersRegistered;
+	char *m_bufferMemory;
+	QVector<int> m_freeBuffers;
+
+	// Waiting for room in the ring
+	QList<Operation *> m_queued;
+	// In the submission queue, but not taken by the kernel yet
+	QList<Operation *> m_unsubmitted;
+	int m_inFlight;
+
+	/* Creates the ring and registers the eventfd, files and buffers */
+	bool setUpRing();
+	/* Recreates the ring after an error. The unsubmitted operations are
+	 * finished with blocking calls */
+	void resetRing();
+
+	OpenFile *openFile(const QString &fileName, bool write);
+	void retireFile(OpenFile *file);
+	void releaseFile(OpenFile *file);
+	void closeFile(OpenFile *file);
+
+	/* Queues the operations of the batch and submits what fits */
+	void run(Batch *batch, const QVector<Operation *> &operations);
+	void submitQueued();
+	void prepare(struct io_uring_sqe *sqe, Operation *operation);
+	/* Handles the completion of an operation. Done batches are added to finished */
+	void complete(Operation *operation, int result, QList<Batch *> &finished);
+	/* Handles the completions, waiting for at least one if wait is set,
+	 * and calls back the finished batches */
+	void reap(bool wait);
+	void onEventFd();
+	static void callBack(const QList<Batch *> &finished);
+	/* Does the rest of a partially done operation with blocking calls */
+	static bool finish(Operation &operation, qint64 done);
+
+	Q_DISABLE_COPY(UringStorage)
+};
+
+#endif // URINGSTORAGE_H
@@ -19,11 +19,18 @@
 
 #include "qtorrent.h"
 #include "core/remote.h"
+#include "core/torrentmanager.h"
+#include "ui/mainwindow.h"
 #include <QApplication>
+#include <QElapsedTimer>
+#include <QTextStream>
 #include <QDebug>
 
 int main(int argc, char *argv[])
 {
+	QElapsedTimer startupTimer;
+	startupTimer.start();
+
 	QApplication app(argc, argv);
 	app.setOrganizationName("qTorrent");
 	app.setOrganizationDomain("qtorrent.com");
@@ -36,6 +43,20 @@ int main(int argc, char *argv[])
 	}
 
 	QTorrent qTorrent;
+	MainWindow mainWindow;
+	QObject::connect(&remote, &Remote::showWindowRequested, &mainWindow, &MainWindow::show);
+
+	// Used by tools/compare-startup.sh
+	if (qEnvironmentVariableIsSet("QTORRENT_STARTUP_BENCHMARK")) {
+		QObject::connect(qTorrent.torrentManager(), &TorrentManager::torrentsResumed, &app, [&startupTimer]() {
+			QTextStream(stdout) << "startup_ms " << startupTimer.elapsed() << endl
+								<< "torrents " << TorrentManager::instance()->torrents().size() << endl;
+			QCoreApplication::quit();
+		}, Qt::QueuedConnection);
+	}
+
+	qTorrent.start();
+	mainWindow.show();
 
 	app.exec();
 	qTorrent.shutDown();
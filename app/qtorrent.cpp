@@ -22,11 +22,12 @@
 #include "core/torrentinfo.h"
 #include "core/torrentmanager.h"
 #include "core/torrentserver.h"
+#include "core/streamserver.h"
+#include "core/readcache.h"
+#include "core/diskmanager.h"
+#include "core/networkengine.h"
 #include "core/localservicediscoveryclient.h"
 #include "core/trackerclient.h"
-#include "ui/mainwindow.h"
-#include <QGuiApplication>
-#include <QMessageBox>
 #include <QUrlQuery>
 
 QTorrent *QTorrent::m_instance;
@@ -38,10 +39,13 @@ QTorrent::QTorrent()
 
 	m_instance = this;
 
+	m_networkEngine = new NetworkEngine;
+	m_readCache = new ReadCache;
+	m_diskManager = new DiskManager;
 	m_torrentManager = new TorrentManager;
 	m_server = new TorrentServer;
+	m_streamServer = new StreamServer;
 	m_LSDClient = new LocalServiceDiscoveryClient;
-	m_mainWindow = new MainWindow;
 
 	// Generate random peer id that starts with 'qT'
 	m_peerId.push_back("qT");
@@ -50,22 +54,32 @@ QTorrent::QTorrent()
 	}
 
 	connect(m_LSDClient, &LocalServiceDiscoveryClient::foundPeer, this, &QTorrent::LSDPeerFound);
-
-	startServer();
-	m_torrentManager->resumeTorrents();
-	startLSDClient();
-	showMainWindow();
 }
 
 QTorrent::~QTorrent()
 {
 	delete m_torrentManager;
 	delete m_server;
+	delete m_streamServer;
 	delete m_LSDClient;
-	delete m_mainWindow;
+	// The torrents are deleted with the torrent manager
+	delete m_readCache;
+	// Waits for the disks' threads, the torrents' jobs are already aborted
+	delete m_diskManager;
+	// The peer sockets must be gone by now
+	delete m_networkEngine;
 }
 
 
+void QTorrent::start()
+{
+	startServer();
+	m_streamServer->startServer();
+	// Announce the torrents over LSD once they're all loaded
+	connect(m_torrentManager, &TorrentManager::torrentsResumed, this, &QTorrent::startLSDClient);
+	m_torrentManager->resumeTorrents();
+}
+
 bool QTorrent::startServer()
 {
 	return m_server->startServer();
@@ -85,37 +99,6 @@ void QTorrent::shutDown()
 	m_torrentManager->saveTorrentsResumeInfo();
 }
 
-void QTorrent::showMainWindow()
-{
-	m_mainWindow->show();
-}
-
-
-/* Message Boxes */
-
-void QTorrent::critical(const QString &text)
-{
-	QMessageBox::critical(m_mainWindow, QGuiApplication::applicationDisplayName(), text);
-}
-
-void QTorrent::information(const QString &text)
-{
-	QMessageBox::information(m_mainWindow, QGuiApplication::applicationDisplayName(), text);
-}
-
-bool QTorrent::question(const QString &text)
-{
-	QMessageBox::StandardButton ans;
-	ans = QMessageBox::question(m_mainWindow, QGuiApplication::applicationDisplayName(), text);
-	return ans == QMessageBox::Yes;
-}
-
-void QTorrent::warning(const QString &text)
-{
-	QMessageBox::warning(m_mainWindow, QGuiApplication::applicationDisplayName(), text);
-}
-
-
 const QByteArray &QTorrent::peerId() const
 {
 	return m_peerId;
@@ -137,12 +120,22 @@ TorrentServer *QTorrent::server()
 	return m_server;
 }
 
+StreamServer *QTorrent::streamServer()
+{
+	return m_streamServer;
+}
+
+ReadCache *QTorrent::readCache()
+{
+	return m_readCache;
+}
 
-MainWindow *QTorrent::mainWindow()
+DiskManager *QTorrent::diskManager()
 {
-	return m_mainWindow;
+	return m_diskManager;
 }
 
+
 QTorrent *QTorrent::instance()
 {
 	return m_instance;
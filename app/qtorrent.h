@@ -30,7 +30,10 @@
 class Torrent;
 class TorrentManager;
 class TorrentServer;
-class MainWindow;
+class StreamServer;
+class ReadCache;
+class DiskManager;
+class NetworkEngine;
 class LocalServiceDiscoveryClient;
 
 class QTorrent : public QObject
@@ -41,42 +44,39 @@ public:
 	QTorrent();
 	~QTorrent();
 
+	/* Starts the server, resumes the saved torrents and starts LSD.
+	 * Called after the user interface (if any) is connected */
+	void start();
+
 	bool startServer();
-	void startLSDClient();
 
 	void shutDown();
 
-	void showMainWindow();
-
-	/* Opens a critical MessageBox */
-	void critical(const QString &text);
-	/* Opens an information MessageBox */
-	void information(const QString &text);
-	/* Opens question MessageBox. Returns true on 'yes' */
-	bool question(const QString &text);
-	/* Opens a warning MessageBox */
-	void warning(const QString &text);
-
 	const QByteArray &peerId() const;
 	const QList<Torrent *> &torrents() const;
 	TorrentManager *torrentManager();
 	TorrentServer *server();
-	MainWindow *mainWindow();
+	StreamServer *streamServer();
+	ReadCache *readCache();
+	DiskManager *diskManager();
 
 	static QTorrent *instance();
 
 public slots:
+	void startLSDClient();
 	void LSDPeerFound(QHostAddress address, int port, Torrent *torrent);
 
 private:
 	QByteArray m_peerId;
 
+	NetworkEngine *m_networkEngine;
 	TorrentManager *m_torrentManager;
 	TorrentServer *m_server;
+	StreamServer *m_streamServer;
+	ReadCache *m_readCache;
+	DiskManager *m_diskManager;
 	LocalServiceDiscoveryClient *m_LSDClient;
 
-	MainWindow *m_mainWindow;
-
 	static QTorrent *m_instance;
 };
 
@@ -20,6 +20,7 @@
 #include "addtorrentdialog.h"
 #include "qtorrent.h"
 #include "core/torrentinfo.h"
+#include "core/torrent.h"
 #include "core/torrentmanager.h"
 #include "global.h"
 #include <QVBoxLayout>
@@ -35,6 +36,28 @@
 #include <QMessageBox>
 #include <QGuiApplication>
 #include <QScreen>
+#include <QTreeWidget>
+#include <QHeaderView>
+#include <QMenu>
+
+enum FilesColumn {
+	FileName, FileSize, FilePriority
+};
+
+static QString priorityString(int priority)
+{
+	switch (priority) {
+	case Torrent::DontDownload:
+		return QObject::tr("Skip");
+	case Torrent::LowPriority:
+		return QObject::tr("Low");
+	case Torrent::NormalPriority:
+		return QObject::tr("Normal");
+	case Torrent::HighPriority:
+		return QObject::tr("High");
+	}
+	return QString();
+}
 
 AddTorrentDialog::AddTorrentDialog(QWidget *parent)
 	: QDialog(parent)
@@ -77,6 +100,18 @@ AddTorrentDialog::AddTorrentDialog(QWidget *parent)
 	infoBox->setLayout(infoLayout);
 	layout->addWidget(infoBox);
 
+	QGroupBox *filesBox = new QGroupBox("Files");
+	QVBoxLayout *filesLayout = new QVBoxLayout;
+	filesLayout->addWidget(m_files = new QTreeWidget);
+	m_files->setHeaderLabels(QStringList() << tr("Name") << tr("Size") << tr("Priority"));
+	m_files->setRootIsDecorated(false);
+	m_files->setSelectionMode(QAbstractItemView::ExtendedSelection);
+	m_files->setContextMenuPolicy(Qt::CustomContextMenu);
+	m_files->header()->setSectionResizeMode(FileName, QHeaderView::Stretch);
+	m_files->header()->setStretchLastSection(false);
+	filesBox->setLayout(filesLayout);
+	layout->addWidget(filesBox);
+
 	QHBoxLayout *bottomLayout = new QHBoxLayout;
 	bottomLayout->addWidget(m_ok = new QPushButton("Ok"), 0, Qt::AlignRight);
 	bottomLayout->addWidget(m_cancel = new QPushButton("Cancel"), Qt::AlignRight);
@@ -107,6 +142,8 @@ void AddTorrentDialog::connectAll()
 	connect(m_browseDownloadLocation, SIGNAL(clicked()), this, SLOT(browseDownloadLocation()));
 	connect(m_ok, SIGNAL(clicked()), this, SLOT(ok()));
 	connect(m_cancel, SIGNAL(clicked()), this, SLOT(cancel()));
+	connect(m_files, SIGNAL(customContextMenuRequested(QPoint)), this, SLOT(openFilesContextMenu(QPoint)));
+	connect(m_files, SIGNAL(itemChanged(QTreeWidgetItem*,int)), this, SLOT(onFileItemChanged(QTreeWidgetItem*,int)));
 }
 
 bool AddTorrentDialog::setTorrentUrl(QUrl url)
@@ -129,6 +166,29 @@ bool AddTorrentDialog::setTorrentUrl(QUrl url)
 	return false;
 }
 
+bool AddTorrentDialog::setMagnetLink(const QString &magnetLink)
+{
+	// Delete existing TorrentInfo object
+	if (m_torrentInfo) {
+		delete m_torrentInfo;
+	}
+
+	m_torrentInfo = new TorrentInfo;
+	if (!m_torrentInfo->loadFromMagnetLink(magnetLink)) {
+		QMessageBox::warning(this, tr("Add torrent"),
+							 tr("Failed to add magnet link\n\nReason: %1")
+							 .arg(m_torrentInfo->errorString()));
+		delete m_torrentInfo;
+		m_torrentInfo = nullptr;
+		return false;
+	}
+
+	setWindowTitle(m_torrentInfo->torrentName());
+	updateInfo();
+	show();
+	return true;
+}
+
 bool AddTorrentDialog::browseFilePath(QWidget *parent)
 {
 	QString filePath;
@@ -229,6 +289,18 @@ void AddTorrentDialog::ok()
 	settings.setStartImmediately(m_startImmediately->isChecked());
 	settings.setSkipHashCheck(m_skipHashCheck->isChecked());
 
+	// Only pass the priorities if they were changed
+	QVector<quint8> filePriorities;
+	bool allNormal = true;
+	for (int i = 0; i < m_files->topLevelItemCount(); i++) {
+		int priority = m_files->topLevelItem(i)->data(FilePriority, Qt::UserRole).toInt();
+		filePriorities.push_back(priority);
+		allNormal = allNormal && (priority == Torrent::NormalPriority);
+	}
+	if (!allNormal) {
+		settings.setFilePriorities(filePriorities);
+	}
+
 	emit torrentAdded(m_torrentInfo, settings);
 
 	// Don't destroy the TorrentInfo object in the destructor
@@ -249,13 +321,34 @@ void AddTorrentDialog::updateInfo()
 {
 	if (m_torrentInfo) {
 		m_name->setText(m_torrentInfo->torrentName());
-		m_size->setText(tr("%1 (%2 bytes)")
-						.arg(formatSize(m_torrentInfo->length()))
-						.arg(QString::number(m_torrentInfo->length())));
+		if (m_torrentInfo->hasMetadata()) {
+			m_size->setText(tr("%1 (%2 bytes)")
+							.arg(formatSize(m_torrentInfo->length()))
+							.arg(QString::number(m_torrentInfo->length())));
+		} else {
+			// Known only after the metadata is downloaded
+			m_size->setText(tr("Unknown"));
+		}
 		m_infoHash->setText(m_torrentInfo->infoHash().toHex());
 		m_creationDate->setText(m_torrentInfo->creationDate() ? m_torrentInfo->creationDate()->toString() : "N/A");
 		m_createdBy->setText(m_torrentInfo->createdBy() ? *m_torrentInfo->createdBy() : "N/A");
 		m_comment->setText(m_torrentInfo->comment() ? *m_torrentInfo->comment() : "N/A");
+
+		// Magnet links get their file list with the metadata
+		m_files->clear();
+		if (m_torrentInfo->hasMetadata()) {
+			m_files->blockSignals(true);
+			for (const FileInfo &fileInfo : m_torrentInfo->fileInfos()) {
+				QTreeWidgetItem *item = new QTreeWidgetItem(m_files);
+				item->setText(FileName, QStringList(fileInfo.path).join('/'));
+				item->setText(FileSize, formatSize(fileInfo.length));
+				item->setTextAlignment(FileSize, Qt::AlignRight | Qt::AlignVCenter);
+				setFilePriority(item, Torrent::NormalPriority);
+			}
+			m_files->blockSignals(false);
+			m_files->resizeColumnToContents(FileSize);
+			m_files->resizeColumnToContents(FilePriority);
+		}
 	} else {
 		m_name->clear();
 		m_size->clear();
@@ -263,5 +356,50 @@ void AddTorrentDialog::updateInfo()
 		m_creationDate->clear();
 		m_createdBy->clear();
 		m_comment->clear();
+		m_files->clear();
+	}
+}
+
+void AddTorrentDialog::setFilePriority(QTreeWidgetItem *item, int priority)
+{
+	item->setData(FilePriority, Qt::UserRole, priority);
+	item->setText(FilePriority, priorityString(priority));
+	item->setCheckState(FileName, priority == Torrent::DontDownload ? Qt::Unchecked : Qt::Checked);
+}
+
+void AddTorrentDialog::openFilesContextMenu(const QPoint &pos)
+{
+	QList<QTreeWidgetItem *> items = m_files->selectedItems();
+	if (items.isEmpty()) {
+		return;
+	}
+
+	QMenu menu(this);
+	QMenu *priorityMenu = menu.addMenu(tr("Priority"));
+	for (int priority = Torrent::HighPriority; priority >= Torrent::DontDownload; priority--) {
+		QAction *action = priorityMenu->addAction(priorityString(priority));
+		connect(action, &QAction::triggered, [this, items, priority]() {
+			m_files->blockSignals(true);
+			for (QTreeWidgetItem *item : items) {
+				setFilePriority(item, priority);
+			}
+			m_files->blockSignals(false);
+		});
+	}
+	menu.exec(m_files->viewport()->mapToGlobal(pos));
+}
+
+void AddTorrentDialog::onFileItemChanged(QTreeWidgetItem *item, int column)
+{
+	if (column != FileName) {
+		return;
+	}
+	// Unchecking skips the file, checking downloads it normally
+	bool checked = (item->checkState(FileName) == Qt::Checked);
+	bool skipped = (item->data(FilePriority, Qt::UserRole).toInt() == Torrent::DontDownload);
+	if (checked == skipped) {
+		m_files->blockSignals(true);
+		setFilePriority(item, checked ? Torrent::NormalPriority : Torrent::DontDownload);
+		m_files->blockSignals(false);
 	}
 }
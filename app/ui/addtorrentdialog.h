@@ -28,6 +28,8 @@ class QLineEdit;
 class QPushButton;
 class QCheckBox;
 class QLabel;
+class QTreeWidget;
+class QTreeWidgetItem;
 class TorrentInfo;
 
 class AddTorrentDialog : public QDialog
@@ -39,6 +41,7 @@ public:
 	~AddTorrentDialog();
 
 	bool setTorrentUrl(QUrl url);
+	bool setMagnetLink(const QString &magnetLink);
 	bool browseFilePath(QWidget *parent);
 
 	void updateInfo();
@@ -48,6 +51,10 @@ public slots:
 	void ok();
 	void cancel();
 
+	/* File priorities */
+	void openFilesContextMenu(const QPoint &pos);
+	void onFileItemChanged(QTreeWidgetItem *item, int column);
+
 signals:
 	void torrentAdded(TorrentInfo* torrentInfo, TorrentSettings settings);
 
@@ -66,10 +73,14 @@ private:
 	QLabel *m_createdBy;
 	QLabel *m_comment;
 
+	// One item per file. The Torrent::Priority is stored as item data
+	QTreeWidget *m_files;
+
 	TorrentInfo *m_torrentInfo;
 
 	void connectAll();
 	bool loadTorrent(const QString &filePath);
+	void setFilePriority(QTreeWidgetItem *item, int priority);
 };
 
 #endif // ADDTORRENTDIALOG_H
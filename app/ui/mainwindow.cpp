@@ -27,6 +27,8 @@
 #include "core/torrent.h"
 #include "core/torrentinfo.h"
 #include "core/torrentmanager.h"
+#include "core/torrentcreator.h"
+#include "global.h"
 #include <QGuiApplication>
 #include <QScreen>
 #include <QStackedLayout>
@@ -38,6 +40,11 @@
 #include <QCloseEvent>
 #include <QApplication>
 #include <QVBoxLayout>
+#include <QInputDialog>
+#include <QProgressDialog>
+#include <QFutureWatcher>
+#include <QEventLoop>
+#include <QtConcurrent>
 
 const int UI_REFRESH_INTERVAL = 300;
 
@@ -55,6 +62,8 @@ MainWindow::MainWindow()
 
 	connect(TorrentManager::instance(), &TorrentManager::torrentAdded,
 			m_torrentsList, &TorrentsList::addTorrent);
+	connect(TorrentManager::instance(), &TorrentManager::torrentAdded,
+			this, &MainWindow::torrentAdded);
 	connect(TorrentManager::instance(), &TorrentManager::torrentRemoved,
 			m_torrentsList, &TorrentsList::removeTorrent);
 	connect(TorrentManager::instance(), &TorrentManager::failedToAddTorrent,
@@ -132,6 +141,31 @@ MainWindow* MainWindow::instance()
 	return m_mainWindow;
 }
 
+
+/* Message Boxes */
+
+void MainWindow::critical(const QString &text)
+{
+	QMessageBox::critical(this, QGuiApplication::applicationDisplayName(), text);
+}
+
+void MainWindow::information(const QString &text)
+{
+	QMessageBox::information(this, QGuiApplication::applicationDisplayName(), text);
+}
+
+bool MainWindow::question(const QString &text)
+{
+	QMessageBox::StandardButton ans;
+	ans = QMessageBox::question(this, QGuiApplication::applicationDisplayName(), text);
+	return ans == QMessageBox::Yes;
+}
+
+void MainWindow::warning(const QString &text)
+{
+	QMessageBox::warning(this, QGuiApplication::applicationDisplayName(), text);
+}
+
 Panel *MainWindow::panel()
 {
 	return m_panel;
@@ -163,6 +197,8 @@ void MainWindow::createMenus()
 
 	// Actions
 	QAction *addTorrentAction = new QAction(tr("&Add torrent"), this);
+	QAction *addMagnetLinkAction = new QAction(tr("Add &magnet link"), this);
+	QAction *createTorrentAction = new QAction(tr("&Create torrent"), this);
 	QAction *exitAction = new QAction(tr("&Exit"), this);
 	QAction *hideClientAction = new QAction(tr("Hide qTorrent"), this);
 	m_viewTorrentsFilterPanel = new QAction(tr("Torrents filter panel"), this);
@@ -171,6 +207,8 @@ void MainWindow::createMenus()
 
 	// Connect actions
 	connect(addTorrentAction, &QAction::triggered, this, &MainWindow::addTorrentAction);
+	connect(addMagnetLinkAction, &QAction::triggered, this, &MainWindow::addMagnetLinkAction);
+	connect(createTorrentAction, &QAction::triggered, this, &MainWindow::createTorrentAction);
 	connect(exitAction, &QAction::triggered, this, &MainWindow::exitAction);
 	connect(hideClientAction, &QAction::triggered, this, &MainWindow::hide);
 	connect(m_viewTorrentsFilterPanel, &QAction::triggered, this, &MainWindow::toggleHideShowTorrentsFilterPanel);
@@ -179,10 +217,13 @@ void MainWindow::createMenus()
 
 	// Action shortcuts
 	addTorrentAction->setShortcut(QKeySequence(Qt::CTRL + Qt::Key_O));
+	addMagnetLinkAction->setShortcut(QKeySequence(Qt::CTRL + Qt::Key_M));
 	exitAction->setShortcut(QKeySequence(Qt::CTRL + Qt::Key_E));
 
 	// Add actions to menus
 	fileMenu->addAction(addTorrentAction);
+	fileMenu->addAction(addMagnetLinkAction);
+	fileMenu->addAction(createTorrentAction);
 	fileMenu->addAction(exitAction);
 
 	viewMenu->addAction(hideClientAction);
@@ -237,9 +278,82 @@ void MainWindow::addTorrentAction()
 	}
 }
 
+void MainWindow::addMagnetLinkAction()
+{
+	bool ok;
+	QString magnetLink = QInputDialog::getText(this, tr("Add magnet link"), tr("Magnet link:"),
+											   QLineEdit::Normal, QString(), &ok);
+	if (!ok || magnetLink.isEmpty()) {
+		return;
+	}
+	AddTorrentDialog dialog(this);
+	connect(&dialog, &AddTorrentDialog::torrentAdded,
+			TorrentManager::instance(), &TorrentManager::addTorrentFromInfo);
+	if (dialog.setMagnetLink(magnetLink.trimmed())) {
+		dialog.exec();
+	}
+}
+
+void MainWindow::createTorrentAction()
+{
+	QString sourcePath = QFileDialog::getExistingDirectory(this, tr("Create torrent from"));
+	if (sourcePath.isEmpty()) {
+		return;
+	}
+	bool ok;
+	QString trackers = QInputDialog::getMultiLineText(this, tr("Create torrent"), tr("Trackers, one per line:"),
+													  QString(), &ok);
+	if (!ok) {
+		return;
+	}
+	QString fileName = QFileDialog::getSaveFileName(this, tr("Save torrent"), sourcePath + ".torrent",
+													tr("Torrent files (*.torrent)"));
+	if (fileName.isEmpty()) {
+		return;
+	}
+
+	TorrentCreator creator;
+	creator.setSourcePath(sourcePath);
+	QStringList trackerList;
+	for (const QString &tracker : trackers.split('\n', QString::SkipEmptyParts)) {
+		if (!tracker.trimmed().isEmpty()) {
+			trackerList << tracker.trimmed();
+		}
+	}
+	creator.setTrackers(trackerList);
+
+	// Hash in another thread, the progress dialog keeps the window responsive
+	QProgressDialog progress(tr("Hashing %1").arg(sourcePath), tr("Cancel"), 0, 100, this);
+	progress.setWindowModality(Qt::WindowModal);
+	progress.setMinimumDuration(0);
+	connect(&creator, &TorrentCreator::progress, &progress, &QProgressDialog::setValue);
+	connect(&progress, &QProgressDialog::canceled, [&creator]() {
+		creator.abort();
+	});
+	QEventLoop loop;
+	QFutureWatcher<bool> watcher;
+	connect(&watcher, &QFutureWatcher<bool>::finished, &loop, &QEventLoop::quit);
+	watcher.setFuture(QtConcurrent::run(&creator, &TorrentCreator::create));
+	loop.exec();
+	progress.reset();
+
+	if (progress.wasCanceled()) {
+		return;
+	}
+	if (!watcher.result() || !creator.saveTorrentFile(fileName)) {
+		critical(tr("Failed to create the torrent: %1").arg(creator.errorString()));
+		return;
+	}
+	information(tr("Created %1\n%2 pieces of %3, hashed at %4/s")
+				.arg(fileName)
+				.arg(creator.numberOfPieces())
+				.arg(formatSize(creator.pieceLength()))
+				.arg(formatSize(creator.throughput())));
+}
+
 void MainWindow::exitAction()
 {
-	if (QTorrent::instance()->question("Are you sure you want to exit "
+	if (question("Are you sure you want to exit "
 									   + QGuiApplication::applicationDisplayName() + "?")) {
 		QApplication::quit();
 	}
@@ -247,7 +361,14 @@ void MainWindow::exitAction()
 
 void MainWindow::addTorrentFromUrl(QUrl url)
 {
-	if (url.isLocalFile()) {
+	if (url.scheme() == "magnet") {
+		AddTorrentDialog dialog(this);
+		connect(&dialog, &AddTorrentDialog::torrentAdded,
+				TorrentManager::instance(), &TorrentManager::addTorrentFromInfo);
+		if (dialog.setMagnetLink(url.toString())) {
+			dialog.exec();
+		}
+	} else if (url.isLocalFile()) {
 		AddTorrentDialog dialog(this);
 		connect(&dialog, &AddTorrentDialog::torrentAdded,
 				TorrentManager::instance(), &TorrentManager::addTorrentFromInfo);
@@ -307,6 +428,11 @@ void MainWindow::trayIconActivated(QSystemTrayIcon::ActivationReason reason)
 	}
 }
 
+void MainWindow::torrentAdded(Torrent *torrent)
+{
+	connect(torrent, &Torrent::downloadCompleted, this, &MainWindow::torrentFullyDownloaded);
+}
+
 void MainWindow::torrentFullyDownloaded(Torrent *torrent)
 {
 	m_trayIcon->showMessage(tr("Torrent downloaded successfully"),
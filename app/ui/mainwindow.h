@@ -48,6 +48,15 @@ public:
 
 	QString getDownloadLocation();
 
+	/* Opens a critical MessageBox */
+	void critical(const QString &text);
+	/* Opens an information MessageBox */
+	void information(const QString &text);
+	/* Opens question MessageBox. Returns true on 'yes' */
+	bool question(const QString &text);
+	/* Opens a warning MessageBox */
+	void warning(const QString &text);
+
 private:
 	Panel *m_panel;
 	QStackedWidget *m_stackedWidget;
@@ -77,6 +86,8 @@ public slots:
 	void closeSettings();
 
 	void addTorrentAction();
+	void addMagnetLinkAction();
+	void createTorrentAction();
 	void exitAction();
 
 	void toggleHideShowTorrentsFilterPanel();
@@ -87,6 +98,7 @@ public slots:
 	void toggleHideShow();
 	void trayIconActivated(QSystemTrayIcon::ActivationReason reason);
 
+	void torrentAdded(Torrent *torrent);
 	void torrentFullyDownloaded(Torrent *torrent);
 
 	// Add torrent from url
@@ -20,8 +20,10 @@
 #include "settingswindow.h"
 #include "qtorrent.h"
 #include "core/torrentserver.h"
+#include "core/torrent.h"
 #include <QPushButton>
 #include <QLineEdit>
+#include <QComboBox>
 #include <QLabel>
 #include <QHBoxLayout>
 #include <QVBoxLayout>
@@ -52,6 +54,19 @@ SettingsWindow::SettingsWindow(QWidget *parent)
 
 	mainLayout->addLayout(serverPortLayout);
 
+	// In the order of Torrent::AllocationMode
+	m_allocationMode = new QComboBox;
+	m_allocationMode->addItem(tr("None - files grow as they are downloaded"));
+	m_allocationMode->addItem(tr("Sparse - files get their size on the first write"));
+	m_allocationMode->addItem(tr("Full - reserve the disk space when adding a torrent"));
+
+	QHBoxLayout *allocationModeLayout = new QHBoxLayout;
+	allocationModeLayout->addWidget(new QLabel(tr("File allocation: ")));
+	allocationModeLayout->addWidget(m_allocationMode);
+	allocationModeLayout->addStretch();
+
+	mainLayout->addLayout(allocationModeLayout);
+
 	QPushButton *applyButton = new QPushButton(tr("Apply"));
 	QPushButton *cancelButton = new QPushButton(tr("Cancel"));
 	applyButton->setMaximumWidth(200);
@@ -91,6 +106,8 @@ void SettingsWindow::apply()
 	QSettings settings;
 	settings.setValue("ServerStartPort", serverStartPort);
 	settings.setValue("ServerEndPort", serverEndPort);
+	// Used for the torrents that are added from now on
+	settings.setValue("AllocationMode", m_allocationMode->currentIndex());
 
 	// Restart the server
 	QTorrent::instance()->server()->startServer();
@@ -101,4 +118,5 @@ void SettingsWindow::reset()
 	QSettings settings;
 	m_serverStartPort->setText(settings.value("ServerStartPort").toString());
 	m_serverEndPort->setText(settings.value("ServerEndPort").toString());
+	m_allocationMode->setCurrentIndex(settings.value("AllocationMode", Torrent::AllocateSparse).toInt());
 }
@@ -23,6 +23,7 @@
 #include <QWidget>
 
 class QLineEdit;
+class QComboBox;
 
 class SettingsWindow : public QWidget
 {
@@ -38,6 +39,7 @@ private slots:
 private:
 	QLineEdit *m_serverStartPort;
 	QLineEdit *m_serverEndPort;
+	QComboBox *m_allocationMode;
 };
 
 #endif // SETTINGSWINDOW_H
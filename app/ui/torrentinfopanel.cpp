@@ -23,12 +23,14 @@
 #include "torrentslist.h"
 #include "core/torrent.h"
 #include "core/torrentinfo.h"
+#include "core/diskmanager.h"
 #include "global.h"
 #include <QTabWidget>
 #include <QLabel>
 #include <QVBoxLayout>
 #include <QContextMenuEvent>
 #include <QMenu>
+#include <QStringList>
 
 TorrentInfoPanel::TorrentInfoPanel(QWidget *parent)
 	: QTabWidget(parent)
@@ -47,11 +49,19 @@ TorrentInfoPanel::TorrentInfoPanel(QWidget *parent)
 	infoTab->setLayout(infoLayout);
 
 	addTab(infoTab, "Info");
+
+	QWidget* disksTab = new QWidget;
+	QVBoxLayout* disksLayout = new QVBoxLayout;
+	disksLayout->addWidget(m_disks = new QLabel);
+	disksLayout->addStretch();
+	disksTab->setLayout(disksLayout);
+
+	addTab(disksTab, "Disks");
 }
 
 void TorrentInfoPanel::refreshInfoTab()
 {
-	Torrent *torrent = QTorrent::instance()->mainWindow()->
+	Torrent *torrent = MainWindow::instance()->
 					   torrentsList()->currentTorrent();
 	if (!torrent) {
 		m_torrentName->clear();
@@ -89,9 +99,24 @@ void TorrentInfoPanel::refreshInfoTab()
 							: tr("Not available")));
 }
 
+void TorrentInfoPanel::refreshDisksTab()
+{
+	QStringList lines;
+	for (Disk *disk : QTorrent::instance()->diskManager()->disks()) {
+		lines << tr("%1 (%2): reading %3/s, writing %4/s, %5 queued jobs")
+				 .arg(disk->name())
+				 .arg(disk->rootPath())
+				 .arg(formatSize(disk->readSpeed()))
+				 .arg(formatSize(disk->writeSpeed()))
+				 .arg(disk->queueDepth());
+	}
+	m_disks->setText(lines.join('\n'));
+}
+
 void TorrentInfoPanel::refresh()
 {
 	refreshInfoTab();
+	refreshDisksTab();
 }
 
 void TorrentInfoPanel::contextMenuEvent(QContextMenuEvent *event)
@@ -32,6 +32,7 @@ public:
 	TorrentInfoPanel(QWidget *parent = nullptr);
 
 	void refreshInfoTab();
+	void refreshDisksTab();
 
 public slots:
 	void refresh();
@@ -51,6 +52,7 @@ private:
 	QLabel *m_creationDate;
 	QLabel *m_createdBy;
 	QLabel *m_comment;
+	QLabel *m_disks;
 };
 
 #endif // TORRENTSTATUSBAR_H
@@ -20,6 +20,7 @@
 #include "qtorrent.h"
 #include "core/torrent.h"
 #include "core/torrentinfo.h"
+#include "core/streamserver.h"
 #include "mainwindow.h"
 #include "torrentslist.h"
 #include "torrentslistitem.h"
@@ -135,16 +136,21 @@ void TorrentsList::openContextMenu(const QPoint &pos)
 
 	QAction *openAct = new QAction(tr("Open"), this);
 	QAction *openLocationAct = new QAction(tr("Open containing folder"), this);
+	QAction *copyStreamUrlAct = new QAction(tr("Copy stream URL"), this);
 	QAction *pauseAct = new QAction(tr("Pause"), this);
 	QAction *startAct = new QAction(tr("Start"), this);
 	QAction *stopAct = new QAction(tr("Stop"), this);
 	QAction *recheckAct = new QAction(tr("Recheck"), this);
+	QAction *moveAct = new QAction(tr("Move..."), this);
 	QAction *removeAct = new QAction(tr("Remove"), this);
 
 	Torrent *torrent = item->torrent();
 	if (!torrent->torrentInfo()->isSingleFile() || !torrent->isDownloaded()) {
 		openAct->setEnabled(false);
 	}
+	if (!torrent->hasMetadata() || QTorrent::instance()->streamServer()->fileUrl(torrent, 0).isEmpty()) {
+		copyStreamUrlAct->setEnabled(false);
+	}
 	if (torrent->isPaused()) {
 		pauseAct->setEnabled(false);
 	}
@@ -155,24 +161,31 @@ void TorrentsList::openContextMenu(const QPoint &pos)
 		pauseAct->setEnabled(false);
 		stopAct->setEnabled(false);
 	}
+	if (!torrent->hasMetadata() || torrent->isMovingStorage()) {
+		moveAct->setEnabled(false);
+	}
 
 	QMenu menu(this);
 
 	menu.addAction(openAct);
 	menu.addAction(openLocationAct);
+	menu.addAction(copyStreamUrlAct);
 	menu.addSeparator();
 	menu.addAction(pauseAct);
 	menu.addAction(startAct);
 	menu.addAction(stopAct);
 	menu.addAction(recheckAct);
+	menu.addAction(moveAct);
 	menu.addAction(removeAct);
 
 	connect(openAct, SIGNAL(triggered()), item, SLOT(onOpenAction()));
 	connect(openLocationAct, SIGNAL(triggered()), item, SLOT(onOpenLocationAction()));
+	connect(copyStreamUrlAct, SIGNAL(triggered()), item, SLOT(onCopyStreamUrlAction()));
 	connect(pauseAct, SIGNAL(triggered()), item, SLOT(onPauseAction()));
 	connect(startAct, SIGNAL(triggered()), item, SLOT(onStartAction()));
 	connect(stopAct, SIGNAL(triggered()), item, SLOT(onStopAction()));
 	connect(recheckAct, SIGNAL(triggered()), item, SLOT(onRecheckAction()));
+	connect(moveAct, SIGNAL(triggered()), item, SLOT(onMoveAction()));
 	connect(removeAct, SIGNAL(triggered()), item, SLOT(onRemoveAction()));
 
 	menu.exec(mapToGlobal(pos));
@@ -24,6 +24,7 @@
 #include "core/torrent.h"
 #include "core/torrentinfo.h"
 #include "core/trafficmonitor.h"
+#include "core/streamserver.h"
 #include "global.h"
 #include <QDialog>
 #include <QVBoxLayout>
@@ -34,6 +35,9 @@
 #include <QFileInfo>
 #include <QFile>
 #include <QDesktopServices>
+#include <QGuiApplication>
+#include <QClipboard>
+#include <QFileDialog>
 
 TorrentsListItem::TorrentsListItem(QTreeWidget *view, Torrent *torrent)
 	: QTreeWidgetItem(view)
@@ -85,7 +89,7 @@ void TorrentsListItem::refresh()
 
 bool TorrentsListItem::belongsToSection()
 {
-	Panel::Section section = QTorrent::instance()->mainWindow()->panel()->getCurrentSection();
+	Panel::Section section = MainWindow::instance()->panel()->getCurrentSection();
 	switch (section) {
 	case Panel::All:
 		return true;
@@ -204,6 +208,20 @@ void TorrentsListItem::onOpenLocationAction()
 	QDesktopServices::openUrl(url);
 }
 
+void TorrentsListItem::onCopyStreamUrlAction()
+{
+	// The largest file is most likely the one to be played
+	const QList<FileInfo> &fileInfos = m_torrent->torrentInfo()->fileInfos();
+	int largestFile = 0;
+	for (int i = 1; i < fileInfos.size(); i++) {
+		if (fileInfos[i].length > fileInfos[largestFile].length) {
+			largestFile = i;
+		}
+	}
+	QUrl url = QTorrent::instance()->streamServer()->fileUrl(m_torrent, largestFile);
+	QGuiApplication::clipboard()->setText(url.toString());
+}
+
 void TorrentsListItem::onPauseAction()
 {
 	m_torrent->pause();
@@ -224,9 +242,19 @@ void TorrentsListItem::onRecheckAction()
 	m_torrent->check();
 }
 
+void TorrentsListItem::onMoveAction()
+{
+	QString location = QFileDialog::getExistingDirectory(MainWindow::instance(), tr("Move to"),
+														 m_torrent->downloadLocation());
+	if (location.isEmpty()) {
+		return;
+	}
+	m_torrent->moveStorage(location);
+}
+
 void TorrentsListItem::onRemoveAction()
 {
-	QDialog dialog(QTorrent::instance()->mainWindow());
+	QDialog dialog(MainWindow::instance());
 	QVBoxLayout *layout = new QVBoxLayout;
 	layout->addWidget(new QLabel(tr("Are you sure you want to remove this\ntorrent from the list of torrents?")));
 	QCheckBox *deleteData = new QCheckBox("Delete downloaded data");
@@ -64,10 +64,12 @@ public:
 public slots:
 	void onOpenAction();
 	void onOpenLocationAction();
+	void onCopyStreamUrlAction();
 	void onPauseAction();
 	void onStartAction();
 	void onStopAction();
 	void onRecheckAction();
+	void onMoveAction();
 	void onRemoveAction();
 
 signals:
@@ -0,0 +1,24 @@
+QT = core network
+
+CONFIG += c++11 console
+CONFIG -= app_bundle
+
+TARGET = qtorrentd
+
+TEMPLATE = app
+
+CONFIG(release, debug|release):DEFINES += QT_NO_DEBUG_OUTPUT
+
+# Everything but the user interface
+include(../app/core.pri)
+
+SOURCES += main.cpp
+
+# Version definition
+include(../version.pri)
+
+# Install binary
+unix:!macx {
+	target.path = /usr/bin
+	INSTALLS += target
+}
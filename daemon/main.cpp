@@ -0,0 +1,221 @@
+/* qTorrent - An open-source, cross-platform BitTorrent client
+ * Copyright (C) 2017 Petko Georgiev
+ *
+ * main.cpp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qtorrent.h"
+#include "core/remote.h"
+#include "core/torrentinfo.h"
+#include "core/torrentmanager.h"
+#include "core/torrentsettings.h"
+#include "core/torrentcreator.h"
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QStandardPaths>
+#include <QFileInfo>
+#include <QTextStream>
+#include <QDebug>
+
+#ifdef Q_OS_UNIX
+#include <QSocketNotifier>
+#include <csignal>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* SIGINT and SIGTERM are turned into a write on this socket pair,
+ * so the shutdown happens in the event loop and resume data is saved */
+static int signalFd[2];
+
+static void signalHandler(int)
+{
+	char c = 1;
+	ssize_t ret = ::write(signalFd[0], &c, sizeof(c));
+	Q_UNUSED(ret);
+}
+
+static void setupSignalHandlers(QCoreApplication *app)
+{
+	if (::socketpair(AF_UNIX, SOCK_STREAM, 0, signalFd) != 0) {
+		qDebug() << "Failed to create the signal socket pair";
+		return;
+	}
+	QSocketNotifier *notifier = new QSocketNotifier(signalFd[1], QSocketNotifier::Read, app);
+	QObject::connect(notifier, &QSocketNotifier::activated, app, &QCoreApplication::quit);
+
+	struct sigaction action;
+	action.sa_handler = signalHandler;
+	sigemptyset(&action.sa_mask);
+	action.sa_flags = SA_RESTART;
+	sigaction(SIGINT, &action, nullptr);
+	sigaction(SIGTERM, &action, nullptr);
+}
+#endif
+
+/* Adds the torrent files and magnet links given on the command line */
+static void addTorrents(const QStringList &torrents, const QString &downloadLocation)
+{
+	QTextStream err(stderr);
+	for (const QString &torrent : torrents) {
+		TorrentInfo *torrentInfo = new TorrentInfo;
+		bool ok;
+		if (torrent.startsWith("magnet:", Qt::CaseInsensitive)) {
+			ok = torrentInfo->loadFromMagnetLink(torrent);
+		} else {
+			ok = torrentInfo->loadFromTorrentFile(QFileInfo(torrent).absoluteFilePath());
+		}
+		if (!ok) {
+			err << "Failed to load " << torrent << ": " << torrentInfo->errorString() << endl;
+			delete torrentInfo;
+			continue;
+		}
+
+		TorrentSettings settings;
+		settings.setDownloadLocation(downloadLocation);
+		settings.setStartImmediately(true);
+		settings.setSkipHashCheck(false);
+		TorrentManager::instance()->addTorrentFromInfo(torrentInfo, settings);
+	}
+}
+
+/* Creates a torrent file and returns the exit code */
+static int createTorrent(const QString &sourcePath, const QString &output, const QStringList &trackers,
+						 const QString &pieceSize, const QString &comment, bool isPrivate)
+{
+	QTextStream out(stdout);
+	QTextStream err(stderr);
+
+	TorrentCreator creator;
+	creator.setSourcePath(sourcePath);
+	creator.setTrackers(trackers);
+	creator.setComment(comment);
+	creator.setPrivate(isPrivate);
+	if (!pieceSize.isEmpty()) {
+		bool ok;
+		qint64 kib = pieceSize.toLongLong(&ok);
+		if (!ok || kib <= 0) {
+			err << "Invalid piece size " << pieceSize << endl;
+			return 1;
+		}
+		creator.setPieceLength(kib * 1024);
+	}
+	QObject::connect(&creator, &TorrentCreator::progress, [&err](int percent) {
+		err << "\rHashing " << percent << "%" << flush;
+	});
+
+	if (!creator.create()) {
+		err << endl << "Failed to create the torrent: " << creator.errorString() << endl;
+		return 1;
+	}
+	err << endl;
+
+	QString fileName = output;
+	if (fileName.isEmpty()) {
+		fileName = QFileInfo(QFileInfo(sourcePath).absoluteFilePath()).fileName() + ".torrent";
+	}
+	if (!creator.saveTorrentFile(fileName)) {
+		err << creator.errorString() << endl;
+		return 1;
+	}
+	out << "Created " << fileName << ": " << creator.numberOfPieces() << " pieces of "
+		<< creator.pieceLength() / 1024 << " KiB, " << creator.totalSize() << " bytes hashed in "
+		<< creator.elapsedMsecs() << " ms (" << creator.throughput() / (1024 * 1024) << " MiB/s)" << endl;
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	QElapsedTimer startupTimer;
+	startupTimer.start();
+
+	QCoreApplication app(argc, argv);
+	// Same as the GUI, so that both use the same settings and resume data
+	app.setOrganizationName("qTorrent");
+	app.setOrganizationDomain("qtorrent.com");
+	app.setApplicationName("qTorrent");
+	app.setApplicationVersion(VERSION);
+
+	QCommandLineParser parser;
+	parser.setApplicationDescription("qTorrent daemon - a BitTorrent client without a user interface");
+	parser.addHelpOption();
+	parser.addVersionOption();
+	QCommandLineOption downloadLocationOption(QStringList() << "d" << "download-location",
+											  "Download the added torrents to <directory>.", "directory",
+											  QStandardPaths::writableLocation(QStandardPaths::DownloadLocation));
+	parser.addOption(downloadLocationOption);
+	QCommandLineOption createOption(QStringList() << "c" << "create",
+									"Create a torrent file from <path> and exit.", "path");
+	parser.addOption(createOption);
+	QCommandLineOption outputOption(QStringList() << "o" << "output",
+									"Write the created torrent file to <file>. The default is the name of the path with .torrent appended.", "file");
+	parser.addOption(outputOption);
+	QCommandLineOption trackerOption(QStringList() << "t" << "tracker",
+									 "Add <url> to the created torrent. Can be given more than once.", "url");
+	parser.addOption(trackerOption);
+	QCommandLineOption pieceSizeOption("piece-size",
+									   "The piece size of the created torrent in KiB. By default, it's picked from the size.", "kib");
+	parser.addOption(pieceSizeOption);
+	QCommandLineOption commentOption("comment", "The comment of the created torrent.", "text");
+	parser.addOption(commentOption);
+	QCommandLineOption privateOption("private", "Make the created torrent private.");
+	parser.addOption(privateOption);
+	parser.addPositionalArgument("torrents", "Torrent files or magnet links to add.", "[torrents...]");
+	parser.process(app);
+
+	// Runs without the client, so it works while the daemon is running
+	if (parser.isSet(createOption)) {
+		return createTorrent(parser.value(createOption), parser.value(outputOption),
+							 parser.values(trackerOption), parser.value(pieceSizeOption),
+							 parser.value(commentOption), parser.isSet(privateOption));
+	}
+
+	Remote remote;
+	if (!remote.start()) {
+		qDebug() << "Already running";
+		return 0;
+	}
+
+#ifdef Q_OS_UNIX
+	setupSignalHandlers(&app);
+#endif
+
+	QTorrent qTorrent;
+
+	// There is nobody to show the errors to, so log them
+	auto logError = [](QString errorString) {
+		QTextStream(stderr) << errorString << endl;
+	};
+	QObject::connect(TorrentManager::instance(), &TorrentManager::failedToAddTorrent, logError);
+	QObject::connect(TorrentManager::instance(), &TorrentManager::failedToResumeTorrents, logError);
+	QObject::connect(TorrentManager::instance(), &TorrentManager::error, logError);
+
+	// Used by tools/compare-startup.sh
+	if (qEnvironmentVariableIsSet("QTORRENT_STARTUP_BENCHMARK")) {
+		QObject::connect(TorrentManager::instance(), &TorrentManager::torrentsResumed, &app, [&startupTimer]() {
+			QTextStream(stdout) << "startup_ms " << startupTimer.elapsed() << endl
+								<< "torrents " << TorrentManager::instance()->torrents().size() << endl;
+			QCoreApplication::quit();
+		}, Qt::QueuedConnection);
+	}
+
+	qTorrent.start();
+	addTorrents(parser.positionalArguments(), parser.value(downloadLocationOption));
+
+	app.exec();
+	qTorrent.shutDown();
+	return 0;
+}
@@ -0,0 +1,24 @@
+# Parse benchmark for the bencode tree parser and the view based reader.
+# Not part of the main build: qmake tools/bencode-benchmark && make
+
+QT = core
+
+CONFIG += c++11 console release
+CONFIG -= app_bundle
+
+TARGET = bencode-benchmark
+
+TEMPLATE = app
+
+INCLUDEPATH += ../../app
+
+SOURCES += \
+    main.cpp \
+    ../../app/core/bencodeparser.cpp \
+    ../../app/core/bencodevalue.cpp \
+    ../../app/core/bencodereader.cpp
+
+HEADERS += \
+    ../../app/core/bencodeparser.h \
+    ../../app/core/bencodevalue.h \
+    ../../app/core/bencodereader.h
@@ -0,0 +1,152 @@
+/* qTorrent - An open-source, cross-platform BitTorrent client
+ * Copyright (C) 2017 Petko Georgiev
+ *
+ * main.cpp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* Compares BencodeParser (heap tree) with BencodeReader (views).
+ *
+ * usage: bencode-benchmark [-n iterations] [file.torrent | resume.dat]...
+ *
+ * Without files, a torrent with 300000 pieces and 1000 files is generated.
+ * For each input, prints the average time of a full parse followed by
+ * looking up info/pieces, which is what loading a torrent needs */
+
+#include "core/bencodeparser.h"
+#include "core/bencodereader.h"
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QPair>
+#include <QStringList>
+#include <QTextStream>
+
+static QByteArray bencodeString(const QByteArray &string)
+{
+	return QByteArray::number(string.size()) + ':' + string;
+}
+
+// Builds a multi file torrent with the given number of pieces and files
+static QByteArray generateTorrent(int numberOfPieces, int numberOfFiles)
+{
+	const qint64 pieceLength = 16384;
+	qint64 totalLength = pieceLength * numberOfPieces;
+
+	QByteArray files;
+	qint64 fileLength = totalLength / numberOfFiles;
+	for (int i = 0; i < numberOfFiles; i++) {
+		qint64 length = fileLength;
+		if (i == numberOfFiles - 1) {
+			length = totalLength - fileLength * (numberOfFiles - 1);
+		}
+		files += "d6:lengthi" + QByteArray::number(length) + "e4:pathl"
+				+ bencodeString("directory") + bencodeString("file" + QByteArray::number(i)) + "ee";
+	}
+
+	QByteArray pieces(numberOfPieces * 20, '\0');
+	for (int i = 0; i < pieces.size(); i++) {
+		pieces[i] = char(i * 31 + 7);
+	}
+
+	QByteArray info = "d5:filesl" + files + "e"
+			+ bencodeString("name") + bencodeString("benchmark")
+			+ bencodeString("piece length") + "i" + QByteArray::number(pieceLength) + "e"
+			+ bencodeString("pieces") + bencodeString(pieces) + "e";
+
+	return "d" + bencodeString("announce") + bencodeString("http://localhost/announce")
+			+ bencodeString("info") + info + "e";
+}
+
+static double benchmarkTree(const QByteArray &data, int iterations, qint64 &checksum)
+{
+	QElapsedTimer timer;
+	timer.start();
+	for (int i = 0; i < iterations; i++) {
+		BencodeParser parser;
+		if (!parser.parse(data)) {
+			return -1;
+		}
+		try {
+			BencodeDictionary *mainDict = parser.list().first()->toBencodeDictionary();
+			if (mainDict->keyExists("info")) {
+				checksum += mainDict->value("info")->toBencodeDictionary()->value("pieces")->toByteArray().size();
+			}
+		} catch (BencodeException &ex) {
+		}
+	}
+	return double(timer.nsecsElapsed()) / iterations / 1000000.0;
+}
+
+static double benchmarkView(const QByteArray &data, int iterations, qint64 &checksum)
+{
+	QElapsedTimer timer;
+	timer.start();
+	for (int i = 0; i < iterations; i++) {
+		BencodeReader reader;
+		if (!reader.parse(data)) {
+			return -1;
+		}
+		checksum += reader.root().value("info").value("pieces").stringLength();
+	}
+	return double(timer.nsecsElapsed()) / iterations / 1000000.0;
+}
+
+int main(int argc, char *argv[])
+{
+	QCoreApplication app(argc, argv);
+	QTextStream out(stdout);
+	QTextStream err(stderr);
+
+	QStringList arguments = app.arguments().mid(1);
+	int iterations = 20;
+	if (arguments.size() >= 2 && arguments.first() == "-n") {
+		iterations = qMax(1, arguments.at(1).toInt());
+		arguments = arguments.mid(2);
+	}
+
+	QList<QPair<QString, QByteArray>> inputs;
+	if (arguments.isEmpty()) {
+		inputs.append(qMakePair(QString("generated (300000 pieces, 1000 files)"), generateTorrent(300000, 1000)));
+	}
+	for (const QString &fileName : arguments) {
+		QFile file(fileName);
+		if (!file.open(QIODevice::ReadOnly)) {
+			err << "Failed to open " << fileName << ": " << file.errorString() << endl;
+			return 1;
+		}
+		inputs.append(qMakePair(fileName, file.readAll()));
+	}
+
+	qint64 checksum = 0;
+	for (const auto &input : inputs) {
+		double treeMs = benchmarkTree(input.second, iterations, checksum);
+		double viewMs = benchmarkView(input.second, iterations, checksum);
+		out << input.first << " (" << input.second.size() << " bytes)" << endl;
+		if (treeMs < 0 || viewMs < 0) {
+			out << "  parse error" << endl;
+			continue;
+		}
+		out << "  tree_parse_ms " << treeMs << endl;
+		out << "  view_parse_ms " << viewMs << endl;
+		if (viewMs > 0) {
+			out << "  speedup " << treeMs / viewMs << "x" << endl;
+		}
+	}
+	// Keeps the lookups from being optimized away
+	if (checksum == 42) {
+		out << endl;
+	}
+	return 0;
+}
@@ -0,0 +1,56 @@
+#!/bin/sh
+# Compares the startup time and the peak memory usage (RSS) of the
+# GUI application and the qtorrentd daemon.
+#
+# usage: compare-startup.sh <build directory> [runs]
+#
+# Both binaries quit right after startup when QTORRENT_STARTUP_BENCHMARK
+# is set and print "startup_ms <milliseconds>". The GUI is run with the
+# offscreen platform plugin, so no display is needed.
+# Note that the saved torrents are resumed, so run both with the same data.
+
+BUILD_DIR=${1:-.}
+RUNS=${2:-10}
+
+GUI="$BUILD_DIR/app/qTorrent"
+DAEMON="$BUILD_DIR/daemon/qtorrentd"
+
+for binary in "$GUI" "$DAEMON"; do
+	if [ ! -x "$binary" ]; then
+		echo "$binary not found. Build the project first." >&2
+		exit 1
+	fi
+done
+
+if ! [ -x /usr/bin/time ]; then
+	echo "/usr/bin/time is required to measure the memory usage" >&2
+	exit 1
+fi
+
+# Runs the binary $RUNS times and prints the averages
+measure() {
+	name=$1
+	shift
+	total_ms=0
+	total_kb=0
+	i=0
+	while [ $i -lt $RUNS ]; do
+		out=$(QTORRENT_STARTUP_BENCHMARK=1 /usr/bin/time -f "maxrss_kb %M" "$@" 2>&1)
+		ms=$(echo "$out" | sed -n 's/^startup_ms \([0-9]*\)$/\1/p')
+		kb=$(echo "$out" | sed -n 's/^maxrss_kb \([0-9]*\)$/\1/p')
+		if [ -z "$ms" ] || [ -z "$kb" ]; then
+			echo "$name: unexpected output:" >&2
+			echo "$out" >&2
+			exit 1
+		fi
+		total_ms=$((total_ms + ms))
+		total_kb=$((total_kb + kb))
+		i=$((i + 1))
+	done
+	printf "%-10s startup: %6d ms   peak RSS: %8d KiB\n" "$name" \
+		$((total_ms / RUNS)) $((total_kb / RUNS))
+}
+
+echo "Average of $RUNS runs:"
+measure qTorrent env QT_QPA_PLATFORM=offscreen "$GUI"
+measure qtorrentd "$DAEMON"
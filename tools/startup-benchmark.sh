@@ -0,0 +1,90 @@
+#!/bin/sh
+# Measures how long it takes to resume a large number of saved torrents.
+#
+# usage: startup-benchmark.sh <qtorrentd or qTorrent binary> [torrents] [pieces] [runs]
+#
+# Generates <torrents> paused torrents with <pieces> pieces each in a
+# temporary data directory, in the old resume.dat format. The first run
+# converts them to .resume files and is reported separately; the other
+# runs show the normal startup time. Needs sha1sum and xxd.
+
+BINARY=$1
+TORRENTS=${2:-2000}
+PIECES=${3:-4000}
+RUNS=${4:-5}
+
+if [ ! -x "$BINARY" ]; then
+	echo "usage: $0 <qtorrentd or qTorrent binary> [torrents] [pieces] [runs]" >&2
+	exit 1
+fi
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+# Keep the settings and the resume data away from the real ones
+export XDG_DATA_HOME="$TMP/data"
+export XDG_CONFIG_HOME="$TMP/config"
+export QT_QPA_PLATFORM=offscreen
+RESUME_DIR="$XDG_DATA_HOME/qTorrent/qTorrent/resume"
+mkdir -p "$RESUME_DIR" "$TMP/downloads"
+
+PIECE_LENGTH=262144
+PIECES_SIZE=$((PIECES * 20))
+BITFIELD_SIZE=$(((PIECES + 7) / 8))
+
+echo "Generating $TORRENTS torrents with $PIECES pieces each..."
+printf 'd' > "$RESUME_DIR/resume.dat"
+i=0
+while [ $i -lt "$TORRENTS" ]; do
+	name="benchmark$i"
+	info="$TMP/info"
+	{
+		printf 'd6:lengthi%de4:name%d:%s12:piece lengthi%de6:pieces%d:' \
+			$((PIECES * PIECE_LENGTH)) ${#name} "$name" $PIECE_LENGTH $PIECES_SIZE
+		# Any bytes will do as piece hashes, as long as the torrents differ
+		head -c $PIECES_SIZE /dev/zero | tr '\0' "$(printf '\\%03o' $((i % 200 + 32)))"
+		printf 'e'
+	} > "$info"
+	hash=$(sha1sum "$info" | cut -d ' ' -f 1)
+	{
+		printf 'd8:announce25:http://localhost/announce4:info'
+		cat "$info"
+		printf 'e'
+	} > "$RESUME_DIR/$hash.torrent"
+	{
+		printf '20:'
+		echo "$hash" | xxd -r -p
+		printf 'd13:aquiredPieces%d:' $BITFIELD_SIZE
+		head -c $BITFIELD_SIZE /dev/zero
+		printf '16:downloadLocation%d:%s6:pausedi1e20:totalBytesDownloadedi0e18:totalBytesUploadedi0ee' \
+			${#TMP} "$TMP"
+	} >> "$RESUME_DIR/resume.dat"
+	i=$((i + 1))
+done
+printf 'e' >> "$RESUME_DIR/resume.dat"
+
+run() {
+	out=$(QTORRENT_STARTUP_BENCHMARK=1 "$BINARY" 2>&1)
+	ms=$(echo "$out" | sed -n 's/^startup_ms \([0-9]*\)$/\1/p')
+	count=$(echo "$out" | sed -n 's/^torrents \([0-9]*\)$/\1/p')
+	if [ -z "$ms" ]; then
+		echo "unexpected output:" >&2
+		echo "$out" >&2
+		exit 1
+	fi
+	if [ "$count" != "$TORRENTS" ]; then
+		echo "warning: resumed $count of $TORRENTS torrents" >&2
+	fi
+}
+
+run
+echo "first run (converts resume.dat): $ms ms"
+
+total_ms=0
+i=0
+while [ $i -lt "$RUNS" ]; do
+	run
+	total_ms=$((total_ms + ms))
+	i=$((i + 1))
+done
+echo "startup with $TORRENTS torrents, average of $RUNS runs: $((total_ms / RUNS)) ms"